@@ -2,6 +2,7 @@
 #include <QStringList>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <string>
 #include "image/image.hpp"
 #include "tracking/region/Regions.h"
@@ -215,7 +216,29 @@ int ana(void)
             std::cout << file_name << " does not exist. terminating..." << std::endl;
             return 0;
         }
-        if (!tract_model.load_from_file(file_name.c_str()))
+        bool loaded;
+        // a bundle or a box of a *.tti file, without decoding the other tracts
+        if(po.has("tract_cluster") || po.has("tract_box"))
+        {
+            image::vector<3,float> from,to;
+            std::fill(from.begin(),from.end(),-std::numeric_limits<float>::max());
+            std::fill(to.begin(),to.end(),std::numeric_limits<float>::max());
+            if(po.has("tract_box"))
+            {
+                std::string box = po.get("tract_box");
+                std::replace(box.begin(),box.end(),',',' ');
+                std::istringstream in(box);
+                if(!(in >> from[0] >> from[1] >> from[2] >> to[0] >> to[1] >> to[2]))
+                {
+                    std::cout << "Invalid tract_box. Use x1,y1,z1,x2,y2,z2 in voxels" << std::endl;
+                    return 1;
+                }
+            }
+            loaded = tract_model.load_from_tract_file(file_name.c_str(),po.get("tract_cluster",int(-1)),from,to);
+        }
+        else
+            loaded = tract_model.load_from_file(file_name.c_str());
+        if (!loaded)
         {
             std::cout << "Cannot open file " << file_name << std::endl;
             return 0;
@@ -1,130 +1,233 @@
-#include <QApplication>
-#include <QFileInfo>
-#include "tracking/vbc_dialog.hpp"
-#include "ui_vbc_dialog.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iterator>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include "vbc/vbc_database.h"
 #include "program_option.hpp"
 
+static void output_fdr_json(std::ostream& out,const char* name,const std::vector<float>& fdr)
+{
+    out << "\"" << name << "\":[";
+    for(unsigned int index = 0;index < fdr.size();++index)
+    {
+        if(index)
+            out << ",";
+        out << fdr[index];
+    }
+    out << "]";
+}
+
 int cnt(void)
 {
-    std::auto_ptr<vbc_database> database(new vbc_database);
-    database.reset(new vbc_database);
+    std::auto_ptr<vbc_database> vbc(new vbc_database);
     std::cout << "reading connectometry db" <<std::endl;
-    if(!database->load_database(po.get("source").c_str()))
+    if(!vbc->load_database(po.get("source").c_str()))
     {
         std::cout << "invalid database format" << std::endl;
         return 0;
     }
-    std::auto_ptr<vbc_dialog> vbc(new vbc_dialog(0,database.release(),po.get("source").c_str(),false));
-    vbc->setAttribute(Qt::WA_DeleteOnClose);
-    vbc->show();
-    vbc->hide();
-
     if(!po.has("demo"))
     {
         std::cout << "please assign demographic file" << std::endl;
         return 0;
     }
+    int model_type = po.get("model",int(0));
+    if(model_type == 3)
+    {
+        std::cout << "Individual connectometry has not yet been implemented in command line. Please email frank to request this function" <<std::endl;
+        return 0;
+    }
+    std::vector<std::string> feature_names;
+    if(!vbc->load_demographic_file(po.get("demo").c_str(),model_type,feature_names))
+    {
+        std::cout << vbc->error_msg << std::endl;
+        return 0;
+    }
+    std::cout << "demographic file loaded" << std::endl;
 
-    switch(po.get("model",int(0)))
+    // several features of interest can be analyzed in one run, e.g. --foi=0,2
+    std::vector<int> foi_list;
+    if(model_type == 0)
     {
-    case 0:
-        vbc->ui->rb_multiple_regression->setChecked(true);
-        if(!vbc->load_demographic_file(po.get("demo").c_str()))
-            return 0;
-        std::cout << "demographic file loaded" << std::endl;
         if(!po.has("foi"))
         {
             std::cout << "please assign feature of interest using --foi" << std::endl;
             return 0;
         }
-        vbc->ui->foi->setCurrentIndex(po.get("foi",int(0)));
-        std::cout << "feature of interest=" << vbc->ui->foi->currentText().toLocal8Bit().begin() << std::endl;
-        break;
-    case 1:
-        vbc->ui->rb_group_difference->setChecked(true);
-        if(!vbc->load_demographic_file(po.get("demo").c_str()))
-            return 0;
-        std::cout << "demographic file loaded" << std::endl;
-        break;
-    case 2:
-        vbc->ui->rb_paired_difference->setChecked(true);
-        if(!vbc->load_demographic_file(po.get("demo").c_str()))
-            return 0;
-        std::cout << "demographic file loaded" << std::endl;
-        break;
-    case 3:
-        //vbc->ui->rb_individual_analysis->setChecked(true);
-        std::cout << "Individual connectometry has not yet been implemented in command line. Please email frank to request this function" <<std::endl;
-        return 0;
+        std::string foi_str = po.get("foi");
+        std::replace(foi_str.begin(),foi_str.end(),',',' ');
+        std::istringstream in(foi_str);
+        std::copy(std::istream_iterator<int>(in),std::istream_iterator<int>(),std::back_inserter(foi_list));
+        for(unsigned int i = 0;i < foi_list.size();++i)
+            if(foi_list[i] < 0 || foi_list[i] >= feature_names.size())
+            {
+                std::cout << "invalid feature of interest:" << foi_list[i] << std::endl;
+                return -1;
+            }
     }
+    else
+        foi_list.push_back(0);
+
     int threshold_type = po.get("threshold_type",int(0));
     // percentage = 0,t = 1,beta = 2,percentile = 3,mean_dif = 4
-    switch(threshold_type)
+    const char threshold_type_name[5][11] = {"percentage","t","beta","percentile","mean_dif"};
+    if(threshold_type < 0 || threshold_type > 4)
     {
-    case 0:
-        vbc->ui->rb_percentage->setChecked(true);
-        std::cout << "threshold_type=percentage change" << std::endl;
-        break;
-    case 1:
-        vbc->ui->rb_t_stat->setChecked(true);
-        std::cout << "threshold_type=t statistics" << std::endl;
-        break;
-    case 2:
-        vbc->ui->rb_beta->setChecked(true);
-        std::cout << "threshold_type=beta coefficient" << std::endl;
-        break;
-    case 3:
-        vbc->ui->rb_percentile->setChecked(true);
-        std::cout << "threshold_type=percentile rank" << std::endl;
-        break;
-    case 4:
-        vbc->ui->rb_mean_dif->setChecked(true);
-        std::cout << "threshold_type=mean difference" << std::endl;
-        break;
-    default:
         std::cout << "unknown threshold type:" << threshold_type << std::endl;
         return -1;
     }
+    std::cout << "threshold_type=" << threshold_type_name[threshold_type] << std::endl;
 
-    if(po.has("missing_value"))
+    unsigned int thread_count = std::max<int>(1,po.get("thread_count",int(std::thread::hardware_concurrency())));
+    unsigned int permutation_count = po.get("permutation",int(5000));
+    vbc->seeding_density = po.get("seeding_density",float(10));
+    vbc->normalize_qa = po.get("normalized_qa",int(0));
+    vbc->output_resampling = po.get("output_resampling",int(0));
+    int track_length = po.get("track_length",int(40));
+    if(track_length < 0 || track_length >= 200)// the range of the fdr tables
     {
-        vbc->ui->missing_data_checked->setChecked(true);
-        vbc->ui->missing_value->setValue(po.get("missing_value",float(0)));
-        std::cout << "missing value=" << vbc->ui->missing_value->value() << std::endl;
+        std::cout << "invalid track_length:" << track_length << ". The value should be between 0 and 199." << std::endl;
+        return -1;
     }
+    vbc->length_threshold = track_length;
+    vbc->track_trimming = po.get("track_trimming",int(0));
+    vbc->individual_data.clear();
+    vbc->roi_list.clear();
+    vbc->roi_type.clear();
+    std::cout << "seeding_density=" << vbc->seeding_density << std::endl;
+    std::cout << "permutation=" << permutation_count << std::endl;
+    std::cout << "thread=" << thread_count << std::endl;
+    std::cout << "track_length=" << vbc->length_threshold << std::endl;
 
-    if(vbc->ui->rb_individual_analysis->isChecked())
-        vbc->ui->threshold->setValue(5);
-    else
-        vbc->on_suggest_threshold_clicked();
-    vbc->ui->threshold->setValue(po.get("threshold",float(vbc->ui->threshold->value())));
-
-    std::cout << "threshold=" << vbc->ui->threshold->value() << std::endl;
+    std::auto_ptr<stat_model> model(vbc->model.release());
+    for(unsigned int foi_index = 0;foi_index < foi_list.size();++foi_index)
+    {
+        vbc->model.reset(new stat_model);
+        *vbc->model.get() = *model.get();
+        if(model_type == 0)
+        {
+            vbc->model->study_feature = foi_list[foi_index]+1; // skip the intercept
+            std::cout << "feature of interest=" << feature_names[foi_list[foi_index]] << std::endl;
+        }
+        vbc->model->threshold_type = (decltype(vbc->model->threshold_type))threshold_type;
+        if(po.has("missing_value"))
+        {
+            vbc->model->remove_missing_data(po.get("missing_value",float(0)));
+            std::cout << "missing value=" << po.get("missing_value",float(0)) << std::endl;
+        }
 
-    vbc->ui->seeding_density->setValue(po.get("seeding_density",float(10)));
-    std::cout << "seeding_density=" << vbc->ui->seeding_density->value() << std::endl;
+        float threshold = po.get("threshold",float(0));
+        if(!po.has("threshold"))
+        {
+            stat_model info;
+            info.resample(*vbc->model.get(),false,false);
+            threshold = vbc->suggest_threshold(info,thread_count);
+            if(threshold_type == 0 || threshold_type == 3)
+                threshold *= 100.0;
+        }
+        std::cout << "threshold=" << threshold << std::endl;
+        vbc->tracking_threshold = (threshold_type == 0 || threshold_type == 3) ? threshold*0.01 : threshold;
 
-    vbc->ui->mr_permutation->setValue(po.get("permutation",int(5000)));
-    std::cout << "permutation=" << vbc->ui->mr_permutation->value() << std::endl;
+        std::ostringstream param_out;
+        if(vbc->normalize_qa)
+            param_out << ".nqa";
+        param_out << ".length" << vbc->length_threshold;
+        param_out << ".s" << vbc->seeding_density;
+        param_out << ".p" << permutation_count;
+        param_out << "." << threshold_type_name[threshold_type];
+        param_out << "." << threshold;
+        vbc->trk_file_names.clear();
+        vbc->trk_file_names.push_back(po.get("demo") + param_out.str());
+        std::ostringstream out;
+        switch(model_type)
+        {
+        case 0:
+            {
+                // lower case, as in the GUI naming
+                std::string foi_name = feature_names[foi_list[foi_index]];
+                std::transform(foi_name.begin(),foi_name.end(),foi_name.begin(),
+                               [](char c){return (char)std::tolower((unsigned char)c);});
+                vbc->trk_file_names[0] += ".mr.";
+                vbc->trk_file_names[0] += foi_name;
+            }
+            out << "\nDiffusion MRI connectometry (Yeh et al. NeuroImage 125 (2016): 162-171) was used to study the effect of "
+                << feature_names[foi_list[foi_index]]
+                << ". A multiple regression model was used in a total of "
+                << vbc->model->subject_index.size() << " subjects.";
+            break;
+        case 1:
+            vbc->trk_file_names[0] += ".group";
+            out << "\nDiffusion MRI connectometry (Yeh et al. NeuroImage 125 (2016): 162-171) was conducted to compare group differences in a total of "
+                << vbc->model->subject_index.size() << " subjects.";
+            break;
+        case 2:
+            vbc->trk_file_names[0] += ".paired";
+            out << "\nDiffusion MRI connectometry (Yeh et al. NeuroImage 125 (2016): 162-171) was conducted to compare paired group differences in a total of "
+                << vbc->model->subject_index.size() << " pairs.";
+            break;
+        }
+        if(vbc->normalize_qa)
+            out << " The SDF was normalized.";
+        out << " A " << threshold_type_name[threshold_type] << " threshold of " << threshold
+            << " was assigned to select local connectomes, and the local connectomes were tracked using a deterministic fiber tracking algorithm (Yeh et al. PLoS ONE 8(11): e80713, 2013).";
+        out << " A length threshold of " << vbc->length_threshold << " mm was used to select tracks.";
+        out << " The seeding density was " << vbc->seeding_density << " seed(s) per mm3.";
+        out << " To estimate the false discovery rate, a total of " << permutation_count
+            << " randomized permutations were applied to the group label to obtain the null distribution of the track length.";
+        vbc->report = out.str();
 
-    vbc->ui->multithread->setValue(po.get("thread_count",int(std::thread::hardware_concurrency())));
-    std::cout << "thread=" << vbc->ui->multithread->value() << std::endl;
+        std::cout << "running connectometry" << std::endl;
+        vbc->run_permutation(thread_count,permutation_count);
+        unsigned int last_progress = 0;
+        while(vbc->progress < 100 && !vbc->terminated)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            if(vbc->progress != last_progress)
+            {
+                last_progress = vbc->progress;
+                vbc->calculate_FDR();
+                std::cout << "{\"progress\":" << last_progress
+                          << ",\"fdr_greater\":" << vbc->fdr_greater[vbc->length_threshold]
+                          << ",\"fdr_lesser\":" << vbc->fdr_lesser[vbc->length_threshold] << "}" << std::endl;
+            }
+        }
+        vbc->wait();
+        vbc->calculate_FDR();
+        std::cout << "output results" << std::endl;
+        std::vector<std::string> saved_file_name;
+        vbc->save_tracks_files(saved_file_name);
 
-    if(po.get("normalized_qa",int(0)))
-    {
-        std::cout << "normalized qa" << std::endl;
-        vbc->ui->normalize_qa->setChecked(true);
-    }    
-    vbc->ui->length_threshold->setValue(po.get("track_length",int(40)));
-    std::cout << "track_length=" << vbc->ui->length_threshold->value() << std::endl;
-    std::cout << "running connectometry" << std::endl;
-    vbc->on_run_clicked();
-    for(int i = 0;i < vbc->vbc->threads.size();++i)
-        vbc->vbc->threads[i]->wait();
-    std::cout << "output results" << std::endl;
-    vbc->calculate_FDR();
-    std::cout << "close GUI" << std::endl;
-    vbc->close();
-    vbc.reset(0);
+        {
+            std::ostringstream out;
+            out << " The connectometry analysis identified "
+                << (vbc->fdr_greater[vbc->length_threshold]>0.5 || !vbc->has_greater_result ? "no track": vbc->greater_tracks_result.c_str())
+                << " with increased connectivity (FDR="
+                << vbc->fdr_greater[vbc->length_threshold] << ") "
+                << "and "
+                << (vbc->fdr_lesser[vbc->length_threshold]>0.5 || !vbc->has_lesser_result ? "no track": vbc->lesser_tracks_result.c_str())
+                << " with decreased connectivity (FDR="
+                << vbc->fdr_lesser[vbc->length_threshold] << ").";
+            out << " The analysis was conducted using DSI Studio (http://dsi-studio.labsolver.org).";
+            std::ofstream report_file((vbc->trk_file_names[0]+".report.txt").c_str());
+            report_file << vbc->handle->report << vbc->report << out.str() << std::endl;
+        }
+        {
+            std::ostringstream json;
+            json << "{\"progress\":100,\"length_threshold\":" << vbc->length_threshold << ",";
+            output_fdr_json(json,"fdr_greater",vbc->fdr_greater);
+            json << ",";
+            output_fdr_json(json,"fdr_lesser",vbc->fdr_lesser);
+            json << "}";
+            std::cout << json.str() << std::endl;
+            std::ofstream((vbc->trk_file_names[0]+".fdr.json").c_str()) << json.str() << std::endl;
+        }
+        if(vbc->has_greater_result || vbc->has_lesser_result)
+            std::cout << "trk files saved" << std::endl;
+        else
+            std::cout << "no significant finding" << std::endl;
+    }
     return 0;
 }
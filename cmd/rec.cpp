@@ -4,6 +4,7 @@
 #include <string>
 #include "image/image.hpp"
 #include "libs/dsi/image_model.hpp"
+#include "libs/dsi/motion_correction.hpp"
 #include "dsi_interface_static_link.h"
 #include "mapping/fa_template.hpp"
 #include "libs/gzip_interface.hpp"
@@ -12,10 +13,6 @@
 #include "program_option.hpp"
 
 extern fa_template fa_template_imp;
-void rec_motion_correction(ImageModel* handle,unsigned int total_thread,
-                           std::vector<image::affine_transform<double> >& args,
-                           unsigned int& progress,
-                           bool& terminated);
 void calculate_shell(const std::vector<float>& bvalues,std::vector<unsigned int>& shell);
 
 /**
@@ -38,7 +35,7 @@ int rec(void)
         for(unsigned int index = 0;index < flip_seq.length();++index)
             if(flip_seq[index] >= '0' && flip_seq[index] <= '5')
             {
-                handle->flip(flip_seq[index]-'0');
+                handle->add_flip(flip_seq[index]-'0');
                 std::cout << "Flip image volume:" << (int)flip_seq[index]-'0' << std::endl;
             }
     }
@@ -57,8 +54,10 @@ int rec(void)
         image::transformation_matrix<double> affine;
         affine.load_from_transform(T.begin());
         std::cout << "rotating images" << std::endl;
-        handle->rotate(handle->voxel.dim,affine);
+        handle->add_rotation(handle->transformed_dim(),affine);
     }
+    // flips and rotation are applied together in one resampling
+    handle->apply_transform();
 
     float param[4] = {0,0,0,0};
     int method_index = 0;
@@ -146,6 +145,7 @@ int rec(void)
     handle->voxel.output_mapping = po.get("output_map",int(0));
     handle->voxel.output_diffusivity = po.get("output_dif",int(1));
     handle->voxel.output_tensor = po.get("output_tensor",int(0));
+    handle->voxel.dti_fit = po.get("dti_fit",int(0));
     handle->voxel.output_rdi = po.get("output_rdi",int(1));
     handle->voxel.odf_deconvolusion = po.get("deconvolution",int(0));
     handle->voxel.odf_decomposition = po.get("decomposition",int(0));
@@ -217,6 +217,21 @@ int rec(void)
         rec_motion_correction(handle.get(),po.get("thread_count",int(std::thread::hardware_concurrency())),
                 arg,progress,terminated);
         std::cout << "Done." <<std::endl;
+        // --save_nii: output the corrected DWI with its rotated b-table
+        if(po.has("save_nii"))
+        {
+            std::string nii_name = po.get("save_nii");
+            std::cout << "saving corrected DWI to " << nii_name << std::endl;
+            if(!handle->save_to_nii(nii_name.c_str()) ||
+               !handle->save_bval((nii_name+".bval").c_str()) ||
+               !handle->save_bvec((nii_name+".bvec").c_str()))
+            {
+                std::cout << "failed to save the corrected DWI" << std::endl;
+                return 1;
+            }
+            if(!po.has("method"))
+                return 0;
+        }
     }
     std::cout << "start reconstruction..." <<std::endl;
     const char* msg = reconstruction(handle.get(),method_index,
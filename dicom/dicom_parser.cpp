@@ -2,6 +2,9 @@
 #include <QProgressDialog>
 #include <QFileDialog>
 #include <QSettings>
+#include <atomic>
+#include <future>
+#include <thread>
 #include "dicom_parser.h"
 #include "ui_dicom_parser.h"
 #include "image/image.hpp"
@@ -128,7 +131,9 @@ void load_bval(const char* file_name,std::vector<double>& bval)
               std::back_inserter(bval));
 }
 
-bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
+// max_in_flight: number of volumes handed to the conversion threads at a time
+// (0 uses the number of hardware threads)
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,unsigned int max_in_flight = 0)
 {
     gz_nifti analyze_header;
     if(!analyze_header.load_from_file(file_name))
@@ -189,31 +194,82 @@ bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >&
             std::cout << "mask used" << std::endl;
         }
     }
-    // check data range
-    float max_value = 0.0;
-    for(unsigned int index = 0;index < analyze_header.dim(4);++index)
-    {
-        std::auto_ptr<DwiHeader> new_file(new DwiHeader);
-        image::basic_image<float,3> data;
-        if(!analyze_header.toLPS(data,false))
+    // decompress each volume once. Reoriented volumes are handed in batches to
+    // the conversion threads so that reading overlaps with the conversion, and
+    // at most two batches are held at a time.
+    if(!max_in_flight)
+        max_in_flight = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    // floating point data are scaled by the global maximum, known only after
+    // the last volume. Each volume is kept on the full range of its own
+    // maximum until then, and rescaled in place (within one unit of scaling
+    // the float values directly).
+    bool is_float = analyze_header.nif_header.datatype == 16 || analyze_header.nif_header.datatype == 64;
+    unsigned int dwi_count = analyze_header.dim(4);
+    std::vector<image::basic_image<float,3> > volumes(dwi_count);
+    std::vector<float> volume_max(dwi_count);
+    std::vector<std::shared_ptr<DwiHeader> > new_files(dwi_count);
+    std::future<void> pending;
+    unsigned int loaded_count = 0;
+    bool truncated = false;
+    while(loaded_count < dwi_count && !truncated)
+    {
+        unsigned int batch_begin = loaded_count;
+        for(;loaded_count < dwi_count && loaded_count-batch_begin < max_in_flight;++loaded_count)
+            if(!analyze_header.toLPS(volumes[loaded_count],false))
+            {
+                truncated = true;
+                break;
+            }
+        if(pending.valid())
+            pending.wait();
+        if(batch_begin == loaded_count)
             break;
-        max_value = std::max<float>(max_value,*std::max_element(data.begin(),data.end()));
+        unsigned int batch_end = loaded_count;
+        pending = std::async(std::launch::async,[&,batch_begin,batch_end]()
+        {
+            image::par_for(batch_end-batch_begin,[&](int i)
+            {
+                unsigned int index = batch_begin+i;
+                image::basic_image<float,3>& data = volumes[index];
+                image::lower_threshold(data,0.0);
+                if(is_float && !data.empty())
+                {
+                    volume_max[index] = *std::max_element(data.begin(),data.end());
+                    if(volume_max[index] > 0.0f)
+                    {
+                        data *= 65535.0/volume_max[index];
+                        image::upper_threshold(data,65535.0f);
+                    }
+                }
+                new_files[index].reset(new DwiHeader);
+                new_files[index]->image = data;
+                image::basic_image<float,3>().swap(data);
+            });
+        });
+    }
+    if(pending.valid())
+        pending.wait();
+    if(is_float)
+    {
+        float max_value = 0.0f;
+        for(unsigned int index = 0;index < loaded_count;++index)
+            max_value = std::max<float>(max_value,volume_max[index]);
+        if(max_value > 0.0f)
+            image::par_for(loaded_count,[&](int index)
+            {
+                float scale = 32767.0f/65535.0f*(volume_max[index]/max_value);
+                image::basic_image<unsigned short,3>& I = new_files[index]->image;
+                for(unsigned int i = 0;i < I.size();++i)
+                    I[i] = I[i]*scale+0.5f;
+            });
     }
-    if(!analyze_header.load_from_file(file_name))
-        return false;
+
     {
         float vs[4];
         analyze_header.get_voxel_size(vs);
-        for(unsigned int index = 0;index < analyze_header.dim(4);++index)
+        for(unsigned int index = 0;index < loaded_count;++index)
         {
-            std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-            image::basic_image<float,3> data;
-            if(!analyze_header.toLPS(data,false))
-                break;
-            image::lower_threshold(data,0.0);
-            if(analyze_header.nif_header.datatype == 16 || analyze_header.nif_header.datatype == 64) // if floating point, scale and convert to interger
-                data *= 32767.0/max_value;
-            new_file->image = data;
+            std::shared_ptr<DwiHeader> new_file = new_files[index];
             new_file->file_name = file_name;
             std::ostringstream out;
             out << index;
@@ -320,123 +376,134 @@ bool load_multiple_slice_dicom(QStringList file_list,std::vector<std::shared_ptr
     if(geo[2] != 1)
         return false;
 
-    image::io::dicom dicom_header2;
-    if(!dicom_header2.load_from_file(file_list[1].toLocal8Bit().begin()))
+    unsigned int file_count = file_list.size();
+    std::vector<std::string> file_names(file_count);
+    for(unsigned int index = 0;index < file_count;++index)
+        file_names[index] = file_list[index].toLocal8Bit().begin();
+
+    // first pass: read only the tags needed to group and sort the slices
+    std::vector<float> slice_location(file_count);
+    std::vector<DwiHeader> slice_info(file_count);
+    std::vector<unsigned char> valid(file_count);
+    std::atomic<bool> terminated(false);
+    begin_prog("reading headers");
+    image::par_for2(file_count,[&](int index,int thread_index)
+    {
+        if(terminated)
+            return;
+        if(thread_index == 0)
+        {
+            if(prog_aborted())
+            {
+                terminated = true;
+                return;
+            }
+            check_prog(index,file_count);
+        }
+        image::io::dicom header;
+        if(!header.load_from_file(file_names[index].c_str()))
+            return;
+        slice_location[index] = header.get_slice_location();
+        slice_info[index].read_dicom_diffusion(header);
+        valid[index] = 1;
+    });
+    check_prog(file_count,file_count);
+    if(terminated || std::find(valid.begin(),valid.end(),0) != valid.end())
         return false;
-    float s1 = dicom_header.get_slice_location();
+
+    float s1 = slice_location[0];
     bool iterate_slice_first = true;
     unsigned int slice_num = 2;
     unsigned int b_num = 2;
     if(s1 == 0.0) // no slice locaton information
     {
-        DwiHeader dwi1,dwi2;
-        dwi1.open(file_list[0].toLocal8Bit().begin());
-        dwi2.open(file_list[1].toLocal8Bit().begin());
-        if(dwi1.bvec == dwi2.bvec && dwi1.bvalue == dwi2.bvalue) // iterater slice first
+        if(slice_info[0] == slice_info[1]) // iterater slice first
         {
-            for (;slice_num < file_list.size();++slice_num)
-            {
-                DwiHeader dwi;
-                if(!dwi.open(file_list[slice_num].toLocal8Bit().begin()))
-                    return false;
-                if(dwi1.bvec != dwi.bvec || dwi1.bvalue != dwi.bvalue)
-                    break;
-            }
+            for (;slice_num < file_count && slice_info[0] == slice_info[slice_num];++slice_num)
+                ;
             geo[2] = slice_num;
             iterate_slice_first = true;
         }
         else
         // iterate b first
         {
-            for (;b_num < file_list.size();++b_num)
-            {
-                DwiHeader dwi;
-                if(!dwi.open(file_list[b_num].toLocal8Bit().begin()))
-                    return false;
-                if(dwi1.bvec == dwi.bvec && dwi1.bvalue == dwi.bvalue)
-                    break;
-            }
-            geo[2] = file_list.size()/b_num;
+            for (;b_num < file_count && !(slice_info[0] == slice_info[b_num]);++b_num)
+                ;
+            geo[2] = file_count/b_num;
             iterate_slice_first = false;
         }
     }
     else
     {
-        if(s1 == dicom_header2.get_slice_location()) // iterater b-value first
+        if(s1 == slice_location[1]) // iterater b-value first
         {
-            for (;b_num < file_list.size();++b_num)
-            {
-                if(!dicom_header2.load_from_file(file_list[b_num].toLocal8Bit().begin()))
-                    return false;
-                if(dicom_header2.get_slice_location() != s1)
-                    break;
-            }
-            geo[2] = file_list.size()/b_num;
+            for (;b_num < file_count && slice_location[b_num] == s1;++b_num)
+                ;
+            geo[2] = file_count/b_num;
             iterate_slice_first = false;
         }
         else
         // iterater slice first
         {
-            for (;slice_num < file_list.size();++slice_num)
-            {
-                if(!dicom_header2.load_from_file(file_list[slice_num].toLocal8Bit().begin()))
-                    return false;
-                if(dicom_header2.get_slice_location() == s1)
-                    break;
-            }
+            for (;slice_num < file_count && slice_location[slice_num] != s1;++slice_num)
+                ;
             geo[2] = slice_num;
             iterate_slice_first = true;
         }
     }
 
-    if(iterate_slice_first)
+    // allocate all DWI volumes, each taking its b-table from its first slice
+    unsigned int dwi_count = iterate_slice_first ? (file_count+slice_num-1)/slice_num : b_num;
+    unsigned int dwi_offset = dwi_files.size();
+    for(unsigned int b_index = 0;b_index < dwi_count;++b_index)
     {
-        for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
-        {
-            if(!dicom_header2.load_from_file(file_list[index].toLocal8Bit().begin()))
-                return false;
-            if(slice_index == 0)
-            {
-                dwi_files.push_back(std::make_shared<DwiHeader>());
-                dwi_files.back()->open(file_list[index].toLocal8Bit().begin());
-                dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-                dwi_files.back()->image.resize(geo);
-                dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-            }
-            dicom_header2.save_to_buffer(
-                    dwi_files[b_index]->image.begin() + slice_index*geo.plane_size(),geo.plane_size());
-            ++slice_index;
-            if(slice_index >= slice_num)
-            {
-                slice_index = 0;
-                ++b_index;
-            }
-        }
+        unsigned int first_file = iterate_slice_first ? b_index*slice_num : b_index;
+        dwi_files.push_back(std::make_shared<DwiHeader>());
+        DwiHeader& dwi = *dwi_files.back();
+        dwi.image.resize(geo);
+        dwi.file_name = file_names[first_file];
+        dwi.bvalue = slice_info[first_file].bvalue;
+        dwi.bvec = slice_info[first_file].bvec;
+        dwi.te = slice_info[first_file].te;
+        dicom_header.get_voxel_size(dwi.voxel_size);
     }
-    else
+
+    // second pass: decode the pixels straight into their slice positions
+    std::atomic<bool> failed(false);
+    begin_prog("loading images");
+    image::par_for2(file_count,[&](int index,int thread_index)
     {
-        begin_prog("loading images");
-        for (unsigned int index = 0,b_index = 0,slice_index = 0;check_prog(index,file_list.size());++index)
+        if(terminated || failed)
+            return;
+        if(thread_index == 0)
         {
-            if(!dicom_header2.load_from_file(file_list[index].toLocal8Bit().begin()))
-                return false;
-            if(slice_index == 0)
+            if(prog_aborted())
             {
-                dwi_files.push_back(std::make_shared<DwiHeader>());
-                dwi_files.back()->open(file_list[index].toLocal8Bit().begin());
-                dwi_files.back()->image.resize(geo);
-                dwi_files.back()->file_name = file_list[index].toLocal8Bit().begin();
-                dicom_header.get_voxel_size(dwi_files.back()->voxel_size);
-            }
-            dicom_header2.save_to_buffer(
-                    dwi_files[b_index]->image.begin() + slice_index*geo.plane_size(),geo.plane_size());
-            ++b_index;
-            if(b_index >= b_num)
-            {
-                b_index = 0;
-                ++slice_index;
+                terminated = true;
+                return;
             }
+            check_prog(index,file_count);
         }
+        unsigned int b_index = iterate_slice_first ? index / slice_num : index % b_num;
+        unsigned int slice_index = iterate_slice_first ? index % slice_num : index / b_num;
+        if(slice_index >= geo[2])
+            return;
+        image::io::dicom header;
+        if(!header.load_from_file(file_names[index].c_str()))
+        {
+            failed = true;
+            return;
+        }
+        DwiHeader& dwi = *dwi_files[dwi_offset+b_index];
+        if(slice_index == 0)
+            get_report_from_dicom(header,dwi.report);
+        header.save_to_buffer(dwi.image.begin() + slice_index*geo.plane_size(),geo.plane_size());
+    });
+    check_prog(file_count,file_count);
+    if(terminated || failed)
+    {
+        dwi_files.resize(dwi_offset);
+        return false;
     }
     return true;
 }
@@ -525,15 +592,37 @@ bool load_4d_fdf(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >&
 
 bool load_3d_series(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
+    unsigned int file_count = file_list.size();
+    std::vector<std::string> file_names(file_count);
+    for(unsigned int index = 0;index < file_count;++index)
+        file_names[index] = file_list[index].toLocal8Bit().begin();
+    std::vector<std::shared_ptr<DwiHeader> > new_files(file_count);
+    std::atomic<bool> terminated(false);
     begin_prog("loading images");
-    for (unsigned int index = 0;check_prog(index,file_list.size());++index)
+    image::par_for2(file_count,[&](int index,int thread_index)
     {
+        if(terminated)
+            return;
+        if(thread_index == 0)
+        {
+            if(prog_aborted())
+            {
+                terminated = true;
+                return;
+            }
+            check_prog(index,file_count);
+        }
         std::shared_ptr<DwiHeader> new_file(new DwiHeader);
-        if (!new_file->open(file_list[index].toLocal8Bit().begin()))
-            continue;
-        new_file->file_name = file_list[index].toLocal8Bit().begin();
-        dwi_files.push_back(new_file);
-    }
+        if (!new_file->open(file_names[index].c_str()))
+            return;
+        new_file->file_name = file_names[index];
+        new_files[index] = new_file;
+    });
+    check_prog(file_count,file_count);
+    // keep the file order regardless of completion order
+    for (unsigned int index = 0;index < file_count;++index)
+        if(new_files[index].get())
+            dwi_files.push_back(new_files[index]);
     return !dwi_files.empty();
 }
 
@@ -1,5 +1,7 @@
 #include <sstream>
 #include <string>
+#include <future>
+#include <thread>
 #include "image/image.hpp"
 #include "dwi_header.hpp"
 #include "gzip_interface.hpp"
@@ -57,7 +59,13 @@ bool DwiHeader::open(const char* filename)
         analyze_header.get_voxel_size(voxel_size);
         return true;
     }
+    read_dicom_diffusion(header);
+    return true;
+}
 
+// read TE and b-table from the header without touching the pixel data
+void DwiHeader::read_dicom_diffusion(image::io::dicom& header)
+{
     unsigned char man_id = 0;
     {
         std::string manu;
@@ -192,7 +200,6 @@ bool DwiHeader::open(const char* filename)
     bvec.normalize();
     if(bvalue == 0.0)
         bvec[0] = bvec[1] = bvec[2] = 0.0;
-    return true;
 }
 
 /*
@@ -233,6 +240,18 @@ void sort_dwi(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
                 dwi_files[i].swap(dwi_files[j]);
 }
 
+// offsets of the neighbors returned by image::get_neighbors at the given range
+static void get_neighbor_offsets(int range,std::vector<image::vector<3,int> >& offsets)
+{
+    image::geometry<3> geo(range*2+1,range*2+1,range*2+1);
+    std::vector<image::pixel_index<3> > neighbors;
+    image::get_neighbors(image::pixel_index<3>(range,range,range,geo),geo,range,neighbors);
+    // the voxel itself is always sampled first
+    offsets.push_back(image::vector<3,int>(0,0,0));
+    for (unsigned int i = 0;i < neighbors.size();++i)
+        offsets.push_back(image::vector<3,int>(neighbors[i].x()-range,neighbors[i].y()-range,neighbors[i].z()-range));
+}
+
 void correct_t2(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
 {
     image::geometry<3> geo = dwi_files.front()->image.geometry();
@@ -261,86 +280,90 @@ void correct_t2(std::vector<std::shared_ptr<DwiHeader> >& dwi_files)
     {
         std::vector<double> neg_inv_T2(geo.size());//-1/T2
         {
+            // the sampling stencil: the voxel and its neighbors, and if there are
+            // not enough b0 images, the voxel and its second-order neighbors again
+            std::vector<image::vector<3,int> > stencil;
+            get_neighbor_offsets(1,stencil);
+            if (b0_te.size() < 4)
+                get_neighbor_offsets(2,stencil);
+            // log of every possible signal value
+            std::vector<float> log_table(65536);
+            for (unsigned int i = 1;i < log_table.size();++i)
+                log_table[i] = std::log((float)i);
+
             //begin_prog("Eliminating T2 effect");
-            for (image::pixel_index<3> index(geo);index < geo.size();++index)
+            image::par_for(geo.depth(),[&](int z)
             {
-                std::vector<float> te_samples;
-                std::vector<float> log_Mxy_samples;
-                std::vector<image::pixel_index<3> > neighbor_index1,neighbor_index2;
-                image::get_neighbors(index,geo,1,neighbor_index1);
-                for (unsigned int i = 0;i < b0_te.size();++i)
-                {
-                    log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[index.index()]);
-                    te_samples.push_back(b0_te[i]);
-                    for (unsigned int j = 0;j < neighbor_index1.size();++j)
-                    {
-                        log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[neighbor_index1[j].index()]);
-                        te_samples.push_back(b0_te[i]);
-                    }
-                }
-                // if not enough b0 images, take the neighbors!
-                if (b0_te.size() < 4)
+                std::vector<double> sum_log(b0_te.size()),count(b0_te.size());
+                for (int y = 0,index = z*geo.plane_size();y < geo.height();++y)
+                for (int x = 0;x < geo.width();++x,++index)
                 {
-                    image::get_neighbors(index,geo,2,neighbor_index2);
-                    for (unsigned int i = 0;i < b0_te.size();++i)
+                    std::fill(sum_log.begin(),sum_log.end(),0.0);
+                    std::fill(count.begin(),count.end(),0.0);
+                    for (unsigned int j = 0;j < stencil.size();++j)
                     {
-                        log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[index.index()]);
-                        te_samples.push_back(b0_te[i]);
-
-                        for (unsigned int j = 0;j < neighbor_index2.size();++j)
+                        int nx = x+stencil[j][0];
+                        int ny = y+stencil[j][1];
+                        int nz = z+stencil[j][2];
+                        if (nx < 0 || ny < 0 || nz < 0 ||
+                            nx >= geo.width() || ny >= geo.height() || nz >= geo.depth())
+                            continue;
+                        int pos = (nz*geo.height()+ny)*geo.width()+nx;
+                        for (unsigned int i = 0;i < b0_te.size();++i)
                         {
-                            log_Mxy_samples.push_back(dwi_files[b0_index[i]]->image[neighbor_index2[j].index()]);
-                            te_samples.push_back(b0_te[i]);
+                            unsigned short value = dwi_files[b0_index[i]]->image[pos];
+                            // zero signals are excluded from the fitting
+                            if (value)
+                            {
+                                sum_log[i] += log_table[value];
+                                count[i] += 1.0;
+                            }
                         }
                     }
-                }
-                for (unsigned int i = 0;i < log_Mxy_samples.size();)
-                {
-                    if (log_Mxy_samples[i])
+                    // least-squares fit of log(Mxy) = logM0 - TE/T2
+                    double n = 0.0,sx = 0.0,sy = 0.0,sxx = 0.0,sxy = 0.0;
+                    for (unsigned int i = 0;i < b0_te.size();++i)
                     {
-                        log_Mxy_samples[i] = std::log(log_Mxy_samples[i]);
-                        ++i;
+                        n += count[i];
+                        sx += count[i]*b0_te[i];
+                        sxx += count[i]*b0_te[i]*b0_te[i];
+                        sy += sum_log[i];
+                        sxy += sum_log[i]*b0_te[i];
                     }
-                    else
+                    double denominator = n*sxx-sx*sx;
+                    if (n == 0.0 || denominator == 0.0)
+                        continue;
+                    // (-1/T2,logM0);
+                    double slope = (n*sxy-sx*sy)/denominator;
+                    double intercept = (sy-slope*sx)/n;
+                    /*												T1			T2
+                    Cerebrospinal fluid (similar to pure water) 	2200-2400 	500-1400
+                    Gray matter of cerebrum 						920 		100
+                    White matter of cerebrum 						780 		90
+                    */
+                    if (slope < -1.0/2000.0)
                     {
-                        log_Mxy_samples[i] = log_Mxy_samples.back();
-                        te_samples[i] = te_samples.back();
-                        log_Mxy_samples.pop_back();
-                        te_samples.pop_back();
+                        spin_density[index] = std::exp(intercept);
+                        neg_inv_T2[index] = slope;
                     }
+                    // If the T2 is too long, then exp(-TE/T2)~1, spin density is just the averaged b0 signal
                 }
-                if (log_Mxy_samples.empty())
-                    continue;
-                // (-1/T2,logM0);
-                std::pair<double,double> T2_M0 = image::linear_regression(te_samples.begin(),te_samples.end(),log_Mxy_samples.begin());
-                /*												T1			T2
-                Cerebrospinal fluid (similar to pure water) 	2200-2400 	500-1400
-                Gray matter of cerebrum 						920 		100
-                White matter of cerebrum 						780 		90
-                */
-                if (T2_M0.first < -1.0/2000.0)
-                {
-                    spin_density[index.index()] = std::exp(T2_M0.second);
-                    neg_inv_T2[index.index()] = T2_M0.first;
-                }
-                // If the T2 is too long, then exp(-TE/T2)~1, spin density is just the averaged b0 signal
-
-            }
+            });
         }
 
 
         // perform correction for each image
-        for (unsigned int index = 0;index < dwi_files.size();++index)
+        image::par_for(dwi_files.size(),[&](int index)
         {
             // b0 will be handled later
             if (dwi_files[index]->bvalue == 0.0)
-                continue;
+                return;
             DwiHeader& cur_image = *dwi_files[index];
             float cur_te = dwi_files[index]->te;
             for (unsigned int i = 0;i < geo.size();++i)
                 if (neg_inv_T2[i] != 0.0)
                     cur_image[i] *= std::exp(-cur_te*neg_inv_T2[i]);
-        }
+        });
 
         for (unsigned int index = 0;index < geo.size();++index)
         {
@@ -498,39 +521,58 @@ bool DwiHeader::output_src(const char* di_file,std::vector<std::shared_ptr<DwiHe
         write_mat.write("mask",&*dwi_files[0]->mask.begin(),1,dwi_files[0]->mask.size());
 
     //store images
-    begin_prog("Save Files");
-    for (unsigned int index = 0;check_prog(index,dwi_files.size());++index)
+    // resampling runs ahead of the writer on worker threads, while the
+    // volumes are written in order through the single compressed stream
+    std::vector<image::basic_image<unsigned short,3> > buffer(dwi_files.size());
+    std::vector<std::shared_ptr<std::future<void> > > resampled(dwi_files.size());
+    unsigned int max_in_flight = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    auto resample = [&](unsigned int index)
     {
-        std::ostringstream name;
-        image::basic_image<unsigned short,3> buffer;
-        const unsigned short* ptr = 0;
-        name << "image" << index;
-        ptr = (const unsigned short*)dwi_files[index]->begin();
-        if(upsampling)
+        resampled[index].reset(new std::future<void>(std::async(std::launch::async,[&,index]()
         {
-            buffer.resize(geo);
-            std::copy(ptr,ptr+geo.size(),buffer.begin());
+            const unsigned short* ptr = (const unsigned short*)dwi_files[index]->begin();
+            buffer[index].resize(geo);
+            std::copy(ptr,ptr+geo.size(),buffer[index].begin());
             if(upsampling == 1)
-                image::upsampling(buffer);
+                image::upsampling(buffer[index]);
             if(upsampling == 2)
-                image::downsampling(buffer);
+                image::downsampling(buffer[index]);
             if(upsampling == 3)
             {
-                image::upsampling(buffer);
-                image::upsampling(buffer);
+                image::upsampling(buffer[index]);
+                image::upsampling(buffer[index]);
             }
             if(upsampling == 4)
             {
-                image::downsampling(buffer);
-                image::downsampling(buffer);
+                image::downsampling(buffer[index]);
+                image::downsampling(buffer[index]);
             }
-            ptr = (const unsigned short*)&*buffer.begin();
+        })));
+    };
+    if(upsampling)
+        for(unsigned int index = 0;index < max_in_flight && index < dwi_files.size();++index)
+            resample(index);
+    begin_prog("Save Files");
+    for (unsigned int index = 0;check_prog(index,dwi_files.size());++index)
+    {
+        std::ostringstream name;
+        const unsigned short* ptr = 0;
+        name << "image" << index;
+        ptr = (const unsigned short*)dwi_files[index]->begin();
+        if(upsampling)
+        {
+            resampled[index]->wait();
+            if(index + max_in_flight < dwi_files.size())
+                resample(index + max_in_flight);
+            ptr = (const unsigned short*)&*buffer[index].begin();
         }
         write_mat.write(name.str().c_str(),ptr,1,output_size);
+        image::basic_image<unsigned short,3>().swap(buffer[index]);
     }
-
-
-
+    // wait for the remaining workers if the output was aborted
+    for (unsigned int index = 0;index < resampled.size();++index)
+        if(resampled[index].get())
+            resampled[index]->wait();
 
     std::string report1 = dwi_files.front()->report;
     std::string report2;
@@ -22,6 +22,7 @@ public:
 public:
     DwiHeader(void): bvalue(0.0), te(0.0) {}
     bool open(const char* filename);
+    void read_dicom_diffusion(image::io::dicom& header);
 public:
     const unsigned short* begin(void) const
     {
@@ -48,6 +48,7 @@ HEADERS += mainwindow.h \
     libs/dsi/mix_gaussian_model.hpp \
     libs/dsi/layout.hpp \
     libs/dsi/image_model.hpp \
+    libs/dsi/motion_correction.hpp \
     libs/dsi/gqi_process.hpp \
     libs/dsi/gqi_mni_reconstruction.hpp \
     libs/dsi/dti_process.hpp \
@@ -69,6 +70,12 @@ HEADERS += mainwindow.h \
     tracking/region/Regions.h \
     tracking/region/RegionModel.h \
     libs/tracking/tract_model.hpp \
+    libs/tracking/tract_geometry.hpp \
+    libs/tracking/tract_lod.hpp \
+    libs/tracking/tract_grid.hpp \
+    libs/tracking/tract_file.hpp \
+    libs/utility/text_io.hpp \
+    libs/utility/profile.hpp \
     tracking/tract/tracttablewidget.h \
     opengl/renderingtablewidget.h \
     qcolorcombobox.h \
@@ -121,8 +128,11 @@ SOURCES += main.cpp \
     dicom/dicom_parser.cpp \
     dicom/dwi_header.cpp \
     libs/utility/prog_interface.cpp \
+    libs/utility/text_io.cpp \
+    libs/utility/profile.cpp \
     libs/dsi/sample_model.cpp \
     libs/dsi/dsi_interface_imp.cpp \
+    libs/dsi/motion_correction.cpp \
     libs/tracking/interpolation_process.cpp \
     libs/tracking/tract_cluster.cpp \
     SliceModel.cpp \
@@ -134,6 +144,10 @@ SOURCES += main.cpp \
     tracking/region/Regions.cpp \
     tracking/region/RegionModel.cpp \
     libs/tracking/tract_model.cpp \
+    libs/tracking/tract_geometry.cpp \
+    libs/tracking/tract_lod.cpp \
+    libs/tracking/tract_grid.cpp \
+    libs/tracking/tract_file.cpp \
     tracking/tract/tracttablewidget.cpp \
     opengl/renderingtablewidget.cpp \
     qcolorcombobox.cpp \
@@ -5,9 +5,11 @@
 #include <boost/mpl/inherit_linearly.hpp>
 #include <image/image.hpp>
 #include <string>
+#include <atomic>
 #include "tessellated_icosahedron.hpp"
 #include "gzip_interface.hpp"
 #include "prog_interface_static_link.h"
+#include "utility/profile.hpp"
 struct ImageModel;
 struct VoxelParam;
 class Voxel;
@@ -28,6 +30,7 @@ struct VoxelData
 {
     unsigned int voxel_index;
     std::vector<float> space;
+    std::vector<float> space_buffer; // workspace reused across voxels of a thread
     std::vector<float> odf;
     std::vector<float> fa;
     std::vector<image::vector<3,float> > dir;
@@ -68,6 +71,7 @@ public:// parameters;
 public:// DTI
     bool output_diffusivity;
     bool output_tensor;
+    unsigned char dti_fit = 0;// 0: least squares 1: weighted least squares 2: robust (reweighted)
 public://used in GQI
     bool r2_weighted;// used in GQI only
     bool scheme_balance,csf_calibration;
@@ -142,28 +146,47 @@ public:
         try{
 
         size_t total_voxel = 0;
-        bool terminated = false;
+        std::atomic<bool> terminated(false);
+        // voxels done by each thread since its last add_prog, one cache line apart
+        const unsigned int prog_step = 4096,pending_stride = 16;
+        std::vector<unsigned int> pending(std::max<int>(1,thread_count)*pending_stride);
         begin_prog("reconstructing");
         for(size_t index = 0;index < mask.size();++index)
             if (mask[index])
                 ++total_voxel;
+        check_prog(0,total_voxel);
+        std::vector<std::string> stage_names;
+        for (unsigned int index = 0; index < process_list.size(); ++index)
+            stage_names.push_back(profile_type_name(typeid(*process_list[index])));
+        profile_table profile("reconstruction",thread_count,stage_names);
 
         image::par_for2(mask.size(),
                         [&](int voxel_index,int thread_index)
         {
             if(terminated || !mask[voxel_index])
                 return;
-            if(thread_index == 0)
+            unsigned int& done = pending[thread_index*pending_stride];
+            if(++done == prog_step)
             {
-                if(prog_aborted())
+                done = 0;
+                if(!add_prog(prog_step))
                 {
                     terminated = true;
                     return;
                 }
-                check_prog(voxel_index,total_voxel);
             }
             voxel_data[thread_index].init();
             voxel_data[thread_index].voxel_index = voxel_index;
+            if(profile.is_on())
+            {
+                for (int index = 0; index < process_list.size(); ++index)
+                {
+                    long long t = profile.tic();
+                    process_list[index]->run(*this,voxel_data[thread_index]);
+                    profile.toc(thread_index,index,t);
+                }
+                return;
+            }
             for (int index = 0; index < process_list.size(); ++index)
                 process_list[index]->run(*this,voxel_data[thread_index]);
         },thread_count);
@@ -182,8 +205,16 @@ public:
     void end(gz_mat_write& writer)
     {
         begin_prog("output data");
+        std::vector<std::string> stage_names;
+        for (unsigned int index = 0; index < process_list.size(); ++index)
+            stage_names.push_back(profile_type_name(typeid(*process_list[index])));
+        profile_table profile("output",1,stage_names);
         for (unsigned int index = 0; check_prog(index,process_list.size()); ++index)
+        {
+            long long t = profile.tic();
             process_list[index]->end(*this,writer);
+            profile.toc(0,index,t);
+        }
     }
 
     BaseProcess* get(unsigned int index)
@@ -1,3 +1,9 @@
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <thread>
 #include <boost/mpl/vector.hpp>
 #include <boost/mpl/insert_range.hpp>
 #include <boost/mpl/begin_end.hpp>
@@ -215,10 +221,168 @@ void flip_fib_dir(std::vector<float>& fib_dir,bool x,bool y,bool z)
 }
 
 
+// The candidate corrections of the b-table: the axes permuted (the new axis i
+// is the old axis b_table_perm[p][i]), then none or one of them flipped.
+// Flipping two axes gives the same directions as flipping the third one.
+const unsigned char b_table_perm[6][3] = {{0,1,2},{1,0,2},{0,2,1},{2,1,0},{1,2,0},{2,0,1}};
+const unsigned int b_table_candidate_count = 24;// 6 permutations x 4 flips
+
+void correct_fib_dir(const std::vector<float>& fib_dir,unsigned int candidate,std::vector<float>& new_fib_dir)
+{
+    const unsigned char* perm = b_table_perm[candidate/4];
+    unsigned int flip = candidate % 4;
+    new_fib_dir.resize(fib_dir.size());
+    for(unsigned int j = 0;j+2 < fib_dir.size();j += 3)
+        for(unsigned int k = 0;k < 3;++k)
+            new_fib_dir[j+k] = (flip == k+1 ? -fib_dir[j+perm[k]] : fib_dir[j+perm[k]]);
+}
+
+// Scores the fiber coherence of every candidate correction in one pass. The
+// score is that of evaluate_fib for a single fiber: a voxel adds the fa of each
+// neighbor along its direction whose direction also points back to it.
+void evaluate_b_table(const image::geometry<3>& dim,
+                      const std::vector<float>& fib_fa,
+                      const std::vector<float>& fib_dir,
+                      std::vector<float>& score)
+{
+    char dx[13] = {1,0,0,1,1,0, 1, 1, 0, 1,-1, 1, 1};
+    char dy[13] = {0,1,0,1,0,1,-1, 0, 1, 1, 1,-1, 1};
+    char dz[13] = {0,0,1,0,1,1, 0,-1,-1, 1, 1, 1,-1};
+    std::vector<image::vector<3> > dis(13);
+    for(unsigned int i = 0;i < 13;++i)
+    {
+        dis[i] = image::vector<3>(dx[i],dy[i],dz[i]);
+        dis[i].normalize();
+    }
+    // the same fa threshold as evaluate_fib
+    float otsu = *std::max_element(fib_fa.begin(),fib_fa.end())*0.1;
+    // per-slice sums keep the result independent of the thread count
+    std::vector<std::vector<double> > slice_score(dim.depth(),std::vector<double>(b_table_candidate_count));
+    image::par_for(dim.depth(),[&](int z)
+    {
+        for(int y = 0,index = z*dim.plane_size();y < dim.height();++y)
+        for(int x = 0;x < dim.width();++x,++index)
+        {
+            if(fib_fa[index] <= otsu)
+                continue;
+            for(unsigned int i = 0;i < 13;++i)
+            for(unsigned int j = 0;j < 2;++j)
+            {
+                int px = j ? x+dx[i] : x-dx[i];
+                int py = j ? y+dy[i] : y-dy[i];
+                int pz = j ? z+dz[i] : z-dz[i];
+                if(px < 0 || py < 0 || pz < 0 ||
+                   px >= dim.width() || py >= dim.height() || pz >= dim.depth())
+                    continue;
+                int other_index = (pz*dim.height()+py)*dim.width()+px;
+                if(fib_fa[other_index] <= otsu)
+                    continue;
+                const float* v1 = &fib_dir[index*3];
+                const float* v2 = &fib_dir[other_index*3];
+                for(unsigned int c = 0;c < b_table_candidate_count;++c)
+                {
+                    const unsigned char* perm = b_table_perm[c/4];
+                    float d1 = 0.0,d2 = 0.0;
+                    for(unsigned int k = 0;k < 3;++k)
+                    {
+                        float sign = (c % 4 == k+1) ? -1.0f : 1.0f;
+                        d1 += sign*v1[perm[k]]*dis[i][k];
+                        d2 += sign*v2[perm[k]]*dis[i][k];
+                    }
+                    if(std::abs(d1) > 0.8665 && std::abs(d2) > 0.8665)
+                        slice_score[z][c] += fib_fa[other_index];
+                }
+            }
+        }
+    });
+    score.clear();
+    score.resize(b_table_candidate_count);
+    for(unsigned int z = 0;z < slice_score.size();++z)
+        for(unsigned int c = 0;c < b_table_candidate_count;++c)
+            score[c] += slice_score[z][c];
+}
+
+std::string check_b_table(ImageModel* image_model,unsigned int thread_count)
+{
+    // The candidates are first scored on tensors fitted in alternating slabs
+    // of three slices. The correct orientation usually leads the others by far
+    // more than this margin; a smaller lead is left to the full check.
+    const float min_confidence = 0.05f;
+    set_title("checking b-table");
+    bool output_dif = image_model->voxel.output_diffusivity;
+    bool output_tensor = image_model->voxel.output_tensor;
+    unsigned char dti_fit = image_model->voxel.dti_fit;
+    image_model->voxel.output_diffusivity = false;
+    image_model->voxel.output_tensor = false;
+    image_model->voxel.dti_fit = 0;// the directions need only the least-squares fit
+    std::vector<float> score;
+    bool confident = false;
+    if(image_model->voxel.dim.depth() >= 12)
+    {
+        image::basic_image<unsigned char,3> mask(image_model->mask);
+        for(unsigned int z = 0;z < mask.depth();++z)
+            if((z/3) & 1)
+                std::fill(mask.begin()+z*mask.plane_size(),mask.begin()+(z+1)*mask.plane_size(),0);
+        mask.swap(image_model->mask);
+        image_model->reconstruct<dti_process>(thread_count);
+        mask.swap(image_model->mask);
+        if(!prog_aborted())
+        {
+            evaluate_b_table(image_model->voxel.dim,image_model->voxel.fib_fa,image_model->voxel.fib_dir,score);
+            std::vector<float> sorted_score(score);
+            std::sort(sorted_score.begin(),sorted_score.end(),std::greater<float>());
+            float confidence = sorted_score[0] == 0.0 ? 0.0:(sorted_score[0]-sorted_score[1])/sorted_score[0];
+            std::cout << "b-table check confidence (subsampled):" << confidence << std::endl;
+            confident = confidence >= min_confidence;
+        }
+    }
+    // the full check: evaluate_fib on the whole mask for each candidate
+    if(!confident && !prog_aborted() && image_model->reconstruct<dti_process>(thread_count))
+    {
+        std::vector<std::vector<float> > fib_fa(1);
+        fib_fa[0].swap(image_model->voxel.fib_fa);
+        score.resize(b_table_candidate_count);
+        image::par_for(b_table_candidate_count,[&](int c)
+        {
+            std::vector<std::vector<float> > fib_dir(1);
+            correct_fib_dir(image_model->voxel.fib_dir,c,fib_dir[0]);
+            score[c] = evaluate_fib(image_model->voxel.dim,fib_fa,fib_dir).first;
+        });
+        fib_fa[0].swap(image_model->voxel.fib_fa);
+    }
+    image_model->voxel.output_diffusivity = output_dif;
+    image_model->voxel.output_tensor = output_tensor;
+    image_model->voxel.dti_fit = dti_fit;
+    if(score.empty() || prog_aborted())
+        return std::string();
+    // correct only if the score is strictly better than all other choices
+    unsigned int best = std::max_element(score.begin(),score.end())-score.begin();
+    if(best == 0 || std::count(score.begin(),score.end(),score[best]) != 1)
+        return std::string();
+    std::string suffix;
+    const char axis_name[4] = "xyz";
+    if(best/4)
+    {
+        image_model->permute_b_table(b_table_perm[best/4]);
+        suffix = ".p";
+        for(unsigned int k = 0;k < 3;++k)
+            suffix.push_back(axis_name[b_table_perm[best/4][k]]);
+    }
+    if(best % 4)
+    {
+        image_model->flip_b_table(best % 4 - 1);
+        suffix += ".f";
+        suffix.push_back(axis_name[best % 4 - 1]);
+    }
+    std::cout << "b-table corrected: " << suffix.substr(1) << std::endl;
+    return suffix;
+}
+
+
 const char* reconstruction(ImageModel* image_model,
                            unsigned int method_id,
                            const float* param_values,
-                           bool check_b_table,
+                           bool check_btable,
                            unsigned int thread_count)
 {
     static std::string output_name;
@@ -276,52 +440,8 @@ const char* reconstruction(ImageModel* image_model,
         }
 
         // correct for b-table orientation
-        if(check_b_table)
-        {
-            set_title("checking b-table");
-            bool output_dif = image_model->voxel.output_diffusivity;
-            bool output_tensor = image_model->voxel.output_tensor;
-            image_model->voxel.output_diffusivity = false;
-            image_model->voxel.output_tensor = false;
-            image_model->reconstruct<dti_process>(thread_count);
-            image_model->voxel.output_diffusivity = output_dif;
-            image_model->voxel.output_tensor = output_tensor;
-            std::vector<std::vector<float> > fib_fa(1);
-            std::vector<std::vector<float> > fib_dir(1);
-            fib_fa[0].swap(image_model->voxel.fib_fa);
-            fib_dir[0].swap(image_model->voxel.fib_dir);
-            float cur_score = evaluate_fib(image_model->voxel.dim,fib_fa,fib_dir).first;
-            flip_fib_dir(fib_dir[0],true,false,false);
-            float flip_x_score = evaluate_fib(image_model->voxel.dim,fib_fa,fib_dir).first;
-            flip_fib_dir(fib_dir[0],true,true,false);
-            float flip_y_score = evaluate_fib(image_model->voxel.dim,fib_fa,fib_dir).first;
-            flip_fib_dir(fib_dir[0],false,true,true);
-            float flip_z_score = evaluate_fib(image_model->voxel.dim,fib_fa,fib_dir).first;
-            if(flip_x_score > cur_score &&
-               flip_x_score > flip_y_score && flip_x_score > flip_z_score)
-            {
-                std::cout << "b-table flipped x" << std::endl;
-                out << ".fx";
-                image_model->flip_b_table(0);
-            }
-            if(flip_y_score > cur_score &&
-               flip_y_score > flip_x_score && flip_y_score > flip_z_score)
-            {
-                std::cout << "b-table flipped y" << std::endl;
-                out << ".fy";
-                image_model->flip_b_table(1);
-            }
-            if(flip_z_score > cur_score &&
-               flip_z_score > flip_y_score && flip_z_score > flip_x_score)
-            {
-                std::cout << "b-table flipped z" << std::endl;
-                out << ".fz";
-                image_model->flip_b_table(2);
-            }
-        }
-
-
-
+        if(check_btable)
+            out << check_b_table(image_model,thread_count);
 
         switch (method_id)
         {
@@ -338,7 +458,12 @@ const char* reconstruction(ImageModel* image_model,
                 return "reconstruction canceled";
             break;
         case 1://DTI
-            image_model->voxel.recon_report << " The diffusion tensor was calculated.";
+            image_model->voxel.recon_report << " The diffusion tensor was calculated";
+            if(image_model->voxel.dti_fit == 1)
+                image_model->voxel.recon_report << " using weighted least squares";
+            if(image_model->voxel.dti_fit == 2)
+                image_model->voxel.recon_report << " using iteratively reweighted least squares with outlier down-weighting";
+            image_model->voxel.recon_report << ".";
             out << ".dti.fib.gz";
             image_model->voxel.max_fiber_number = 1;
             if (!image_model->reconstruct<dti_process>(thread_count))
@@ -483,22 +608,25 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
     tessellated_icosahedron ti;
     float vs[3];
     image::basic_image<unsigned char,3> mask;
-    std::vector<std::vector<float> > odfs;
+    std::vector<std::vector<float> > odfs,odfs_c; // Kahan sums and their compensations
     unsigned int half_vertex_count = 0;
-    unsigned int row,col;
     float mni[16]={0};
-    begin_prog("averaging");
-    for (unsigned int index = 0;check_prog(index,file_names.size());++index)
+    std::vector<std::string> file_error(file_names.size());
+
+    // read one subject and check it against the first one
+    auto load_subject = [&](unsigned int index,gz_mat_read& reader,
+                            std::vector<const float*>& odf_bufs,
+                            std::vector<unsigned int>& odf_bufs_size,
+                            const float*& fa0)->bool
     {
         const char* file_name = file_names[index].c_str();
-        gz_mat_read reader;
-        set_title(file_names[index].c_str());
+        std::string& error_msg = file_error[index];
+        unsigned int row,col;
         if(!reader.load_from_file(file_name))
         {
             error_msg = "Cannot open file ";
             error_msg += file_name;
-            check_prog(0,0);
-            return error_msg.c_str();
+            return false;
         }
         if(index == 0)
         {
@@ -514,7 +642,6 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
             const float* fa0;
             const float* mni_ptr;
             unsigned int face_num,odf_num;
-            error_msg = "";
             if(!reader.read("dimension",row,col,dimension))
                 error_msg = "dimension";
             if(!reader.read("fa0",row,col,fa0))
@@ -531,13 +658,9 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
             {
                 error_msg += " missing in ";
                 error_msg += file_name;
-                check_prog(0,0);
-                return error_msg.c_str();
+                return false;
             }
             mask.resize(image::geometry<3>(dimension));
-            for(unsigned int index = 0;index < mask.size();++index)
-                if(fa0[index] != 0.0)
-                    mask[index] = 1;
             std::copy(vs_ptr,vs_ptr+3,vs);
             ti.init(odf_num,odf_buffer,face_num,face_buffer);
             half_vertex_count = odf_num >> 1;
@@ -549,7 +672,6 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
             const float* odf_buffer;
             const unsigned short* dimension;
             unsigned int odf_num;
-            error_msg = "";
             if(!reader.read("dimension",row,col,dimension))
                 error_msg = "dimension";
             if(!reader.read("odf_vertices",row,odf_num,odf_buffer))
@@ -558,8 +680,7 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
             {
                 error_msg += " missing in ";
                 error_msg += file_name;
-                check_prog(0,0);
-                return error_msg.c_str();
+                return false;
             }
 
             if(odf_num != ti.vertices_count || dimension[0] != mask.width() ||
@@ -567,8 +688,7 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
             {
                 error_msg = "Inconsistent dimension in ";
                 error_msg += file_name;
-                check_prog(0,0);
-                return error_msg.c_str();
+                return false;
             }
             for (unsigned int index = 0;index < col;++index,odf_buffer += 3)
             {
@@ -578,27 +698,18 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
                 {
                     error_msg = "Inconsistent ODF orientations in ";
                     error_msg += file_name;
-                    return error_msg.c_str();
+                    return false;
                 }
             }
         }
 
+        if(!reader.read("fa0",row,col,fa0))
         {
-            const float* fa0;
-            if(!reader.read("fa0",row,col,fa0))
-            {
-                error_msg = "Cannot find image information in ";
-                error_msg += file_name;
-                check_prog(0,0);
-                return error_msg.c_str();
-            }
-            for(unsigned int index = 0;index < mask.size();++index)
-                if(fa0[index] != 0.0)
-                    mask[index] = 1;
+            error_msg = "Cannot find image information in ";
+            error_msg += file_name;
+            return false;
         }
 
-        std::vector<const float*> odf_bufs;
-        std::vector<unsigned int> odf_bufs_size;
         //get_odf_bufs(reader,odf_bufs,odf_bufs_size);
         {
             odf_bufs.clear();
@@ -618,41 +729,150 @@ const char* odf_average(const char* out_name,std::vector<std::string>& file_name
         {
             error_msg += "No ODF data found in ";
             error_msg += file_name;
-            check_prog(0,0);
-            return error_msg.c_str();
+            return false;
         }
+        return true;
+    };
+    // add the ODFs of a loaded subject to the running sums
+    auto add_odfs = [&](unsigned int index,
+                        const std::vector<const float*>& odf_bufs,
+                        const std::vector<unsigned int>& odf_bufs_size,
+                        const float* fa0)->bool
+    {
         if(index == 0)
         {
             odfs.resize(odf_bufs.size());
+            odfs_c.resize(odf_bufs.size());
             for(unsigned int i = 0;i < odf_bufs.size();++i)
+            {
                 odfs[i].resize(odf_bufs_size[i]);
+                odfs_c[i].resize(odf_bufs_size[i]);
+            }
         }
         else
         {
             bool inconsistence = false;
             if(odfs.size() != odf_bufs.size())
                 inconsistence = true;
-            for(unsigned int i = 0;i < odf_bufs.size();++i)
+            for(unsigned int i = 0;i < odf_bufs.size() && !inconsistence;++i)
                 if(odfs[i].size() != odf_bufs_size[i])
                     inconsistence = true;
             if(inconsistence)
             {
-                error_msg = "Inconsistent mask coverage in ";
-                error_msg += file_name;
-                check_prog(0,0);
-                return error_msg.c_str();
+                file_error[index] = "Inconsistent mask coverage in ";
+                file_error[index] += file_names[index];
+                return false;
             }
         }
+        for(unsigned int index = 0;index < mask.size();++index)
+            if(fa0[index] != 0.0)
+                mask[index] = 1;
+        // Kahan summation keeps the mean accurate over large cohorts
         for(unsigned int i = 0;i < odf_bufs.size();++i)
-            image::add(odfs[i].begin(),odfs[i].end(),odf_bufs[i]);
+        {
+            float* sum = &odfs[i][0];
+            float* c = &odfs_c[i][0];
+            const float* buf = odf_bufs[i];
+            for(unsigned int j = 0;j < odf_bufs_size[i];++j)
+            {
+                float y = buf[j]-c[j];
+                float t = sum[j]+y;
+                c[j] = (t-sum[j])-y;
+                sum[j] = t;
+            }
+        }
+        return true;
+    };
+
+    if(file_names.empty())
+    {
+        error_msg = "No file assigned";
+        return error_msg.c_str();
+    }
+    // Subjects are read in parallel, at most one file per thread resident, but
+    // added to the sums in file order, so that the template does not depend on
+    // the thread timing and the first failure in file order is reported.
+    std::mutex add_odf_mutex;
+    std::condition_variable add_odf_turn;
+    unsigned int next_add = 0;
+    std::atomic<bool> terminated(false);
+    auto add_subject = [&](unsigned int index)
+    {
+        gz_mat_read reader;
+        std::vector<const float*> odf_bufs;
+        std::vector<unsigned int> odf_bufs_size;
+        const float* fa0 = 0;
+        bool loaded = !terminated && !prog_aborted() &&
+                      load_subject(index,reader,odf_bufs,odf_bufs_size,fa0);
+        std::unique_lock<std::mutex> lock(add_odf_mutex);
+        add_odf_turn.wait(lock,[&](){return next_add == index;});
+        if(!terminated && (!loaded || !add_odfs(index,odf_bufs,odf_bufs_size,fa0)))
+            terminated = true;
+        ++next_add;
+        add_odf_turn.notify_all();
+    };
+
+    begin_prog("averaging");
+    // the first subject defines the ODF geometry and mask dimension
+    set_title(file_names[0].c_str());
+    add_subject(0);
+    if(terminated)
+    {
+        check_prog(0,0);
+        error_msg = file_error[0];
+        return error_msg.empty() ? 0 : error_msg.c_str();
+    }
+    // the workers take the files in increasing order, so the next subject to
+    // add is always being read by one of them
+    std::atomic<unsigned int> next_file(1),finished(1);
+    auto run_worker = [&](unsigned int thread_index)
+    {
+        for(unsigned int index;(index = next_file++) < file_names.size();)
+        {
+            if(thread_index == 0)
+            {
+                // file reading reports within the step of this subject
+                prog_stage stage(file_names[index].c_str());
+                add_subject(index);
+            }
+            else
+            {
+                gz_quiet_scope quiet;
+                add_subject(index);
+            }
+            ++finished;
+            if(thread_index == 0)
+                check_prog(finished,file_names.size());
+        }
+    };
+    {
+        unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+        std::vector<std::shared_ptr<std::future<void> > > threads;
+        for(unsigned int index = 1;index < thread_count;++index)
+            threads.push_back(std::make_shared<std::future<void> >(
+                std::async(std::launch::async,[&run_worker,index](){run_worker(index);})));
+        run_worker(0);
+        for(unsigned int index = 0;index < threads.size();++index)
+            threads[index]->wait();
     }
-    if (prog_aborted())
+    check_prog(file_names.size(),file_names.size());
+    for(unsigned int index = 0;index < file_error.size();++index)
+        if(!file_error[index].empty())
+        {
+            check_prog(0,0);
+            error_msg = file_error[index];
+            return error_msg.c_str();
+        }
+    if (prog_aborted() || terminated)
         return 0;
+    std::vector<std::vector<float> >().swap(odfs_c);
 
     set_title("averaging odfs");
-    for (unsigned int odf_index = 0;odf_index < odfs.size();++odf_index)
+    image::par_for(odfs.size(),[&](int odf_index)
+    {
         for (unsigned int j = 0;j < odfs[odf_index].size();++j)
             odfs[odf_index][j] /= (double)file_names.size();
+    });
 
     std::ostringstream out;
     out << "A group average template was constructed from a total of " << file_names.size() << " subjects." << report.c_str();
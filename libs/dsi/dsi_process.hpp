@@ -73,15 +73,18 @@ public:
     }
     virtual void run(Voxel&, VoxelData& data)
     {
-        std::vector<float> pdf(qspace_size),buffer(qspace_size);
+        // the thread's buffers keep their capacity, so nothing is allocated per voxel
+        std::vector<float>& pdf = data.space_buffer;
+        pdf.assign(qspace_size,0.0f);
         for (unsigned int index = 0; index < qspace_mapping1.size(); ++index)
         {
             float value = data.space[index]*hanning_filter[index];
             pdf[qspace_mapping1[index]] += value;
             pdf[qspace_mapping2[index]] += value;
         }
-        fft->apply_inverse(pdf,buffer);
-        data.space.resize(qspace_size);
+        // the signal is no longer needed, its storage becomes the fft buffer
+        data.space.assign(qspace_size,0.0f);
+        fft->apply_inverse(pdf,data.space);
         for(unsigned int index = 0; index < qspace_size; ++index)
             data.space[index] = std::abs(pdf[index]);
     }
@@ -92,27 +95,48 @@ public:
  */
 struct Pdf2Odf : public BaseProcess
 {
-    std::vector<SamplePoint> sample_group;
+    // sparse (CSR) sampling matrix from the pdf to the odf
+    std::vector<unsigned int> sample_row,sample_index;
+    std::vector<float> sample_weighting;
     unsigned int b0_index;
 public:
     virtual void init(Voxel& voxel)
     {
         // initialize dsi sample points
+        // all radial samples of one direction are merged into a single row
         unsigned int odf_size = voxel.ti.half_vertices_count;
+        sample_row.clear();
+        sample_index.clear();
+        sample_weighting.clear();
+        sample_row.push_back(0);
+        std::vector<double> weighting(qspace_size);
         for (unsigned int index = 0; index < odf_size; ++index)
+        {
+            std::fill(weighting.begin(),weighting.end(),0.0);
             for (float r = odf_min_radius; r <= odf_max_radius; r += odf_sampling_interval)
-                sample_group.push_back(
-                    SamplePoint(index,voxel.ti.vertices[index][0]*r,
-                                voxel.ti.vertices[index][1]*r,
-                                voxel.ti.vertices[index][2]*r,r*r));
+                SamplePoint(index,voxel.ti.vertices[index][0]*r,
+                            voxel.ti.vertices[index][1]*r,
+                            voxel.ti.vertices[index][2]*r,r*r).add_weighting(weighting);
+            for (unsigned int i = 0; i < qspace_size; ++i)
+                if (weighting[i] != 0.0)
+                {
+                    sample_index.push_back(i);
+                    sample_weighting.push_back(weighting[i]);
+                }
+            sample_row.push_back(sample_index.size());
+        }
         b0_index = SpaceMapping<dsi_range>::getIndex(0,0,0);
     }
     virtual void run(Voxel&, VoxelData& data)
     {
         // calculate sum(p(u*r)*r^2)dr
-        std::fill(data.odf.begin(),data.odf.end(),0.0f);
-        for(unsigned int index = 0;index < sample_group.size();++index)
-            sample_group[index].sampleODFValueWeighted(data.space,data.odf);
+        for(unsigned int index = 0;index+1 < sample_row.size();++index)
+        {
+            float value = 0.0f;
+            for(unsigned int j = sample_row[index];j < sample_row[index+1];++j)
+                value += data.space[sample_index[j]]*sample_weighting[j];
+            data.odf[index] = value;
+        }
         // normalization
         float sum = image::mean(data.odf.begin(),data.odf.end());
         if (sum != 0.0)
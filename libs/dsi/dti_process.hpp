@@ -15,12 +15,104 @@ class Dwi2Tensor : public BaseProcess
         float ll3 = l3-ll;
         return std::min(1.0,std::sqrt(1.5*(ll1*ll1+ll2*ll2+ll3*ll3)/(l1*l1+l2*l2+l3*l3)));
     }
+    // closed-form eigenvalues of a symmetric 3-by-3 matrix (descending) and the
+    // principal eigenvector in V[0..2]. returns false for (nearly) degenerate
+    // tensors, which are left to the iterative solver
+    static bool eigen_sym3(const double* A,double* V,double* d)
+    {
+        double p1 = A[1]*A[1]+A[2]*A[2]+A[5]*A[5];
+        if(p1 == 0.0)
+            return false;
+        double q = (A[0]+A[4]+A[8])/3.0;
+        double a0 = A[0]-q,a4 = A[4]-q,a8 = A[8]-q;
+        double p = std::sqrt((a0*a0+a4*a4+a8*a8+2.0*p1)/6.0);
+        if(p == 0.0)
+            return false;
+        // r = det((A-qI)/p)/2
+        double r = (a0*(a4*a8-A[5]*A[5])-A[1]*(A[1]*a8-A[5]*A[2])+A[2]*(A[1]*A[5]-a4*A[2]))/(2.0*p*p*p);
+        double phi = std::acos(std::max<double>(-1.0,std::min<double>(1.0,r)))/3.0;
+        d[0] = q+2.0*p*std::cos(phi);
+        d[2] = q+2.0*p*std::cos(phi+2.0943951023931955);
+        d[1] = 3.0*q-d[0]-d[2];
+        if(d[0]-d[1] <= 1.0e-6*std::fabs(d[0]))
+            return false;
+        // the eigenvector is the largest cross product of two rows of A-d0*I
+        double r0[3] = {A[0]-d[0],A[1],A[2]};
+        double r1[3] = {A[3],A[4]-d[0],A[5]};
+        double r2[3] = {A[6],A[7],A[8]-d[0]};
+        double c[3][3] = {{r0[1]*r1[2]-r0[2]*r1[1],r0[2]*r1[0]-r0[0]*r1[2],r0[0]*r1[1]-r0[1]*r1[0]},
+                          {r0[1]*r2[2]-r0[2]*r2[1],r0[2]*r2[0]-r0[0]*r2[2],r0[0]*r2[1]-r0[1]*r2[0]},
+                          {r1[1]*r2[2]-r1[2]*r2[1],r1[2]*r2[0]-r1[0]*r2[2],r1[0]*r2[1]-r1[1]*r2[0]}};
+        double n[3];
+        for(unsigned int i = 0;i < 3;++i)
+            n[i] = c[i][0]*c[i][0]+c[i][1]*c[i][1]+c[i][2]*c[i][2];
+        unsigned int m = std::max_element(n,n+3)-n;
+        if(n[m] <= 1.0e-24)
+            return false;
+        double length = std::sqrt(n[m]);
+        for(unsigned int i = 0;i < 3;++i)
+            V[i] = c[m][i]/length;
+        return true;
+    }
 private:
     //math::dynamic_matrix<float> iKtKKt;
     std::vector<std::vector<double> > iKtK; // 6-by-6
     std::vector<std::vector<unsigned int> > iKtK_pivot;
     std::vector<double> Kt;
+    std::vector<double> iKtKKt; // 6-by-b_count pseudo inverse of K
     unsigned int b_count;
+private:
+    // Refits the log signal with weights, starting from the least-squares fit.
+    // The weights are the squared predicted signals, the inverse variance of
+    // the log signal. The robust fit then down-weights outliers by the Cauchy
+    // function of their residuals, scaled by the median absolute residual.
+    // buffer holds 3*b_count values of the thread's workspace.
+    void refit(unsigned char fit,float s0,const float* signal,float* buffer,double* tensor_param) const
+    {
+        float* w = buffer;
+        float* e = buffer+b_count;
+        float* abs_e = buffer+b_count*2;
+        unsigned int iteration_count = (fit == 2 ? 5 : 1);
+        for(unsigned int iteration = 0;iteration < iteration_count;++iteration)
+        {
+            for(unsigned int j = 0;j < b_count;++j)
+            {
+                double p = 0.0;
+                for(unsigned int k = 0;k < 6;++k)
+                    p += Kt[k*b_count+j]*tensor_param[k];
+                double predicted = s0*std::exp(-std::max<double>(-5.0,std::min<double>(50.0,p)));
+                w[j] = predicted*predicted;
+                e[j] = (signal[j]-p)*predicted;// in signal units
+                abs_e[j] = std::fabs(e[j]);
+            }
+            if(iteration)
+            {
+                std::nth_element(abs_e,abs_e+b_count/2,abs_e+b_count);
+                double c = 2.385*1.4826*abs_e[b_count/2];
+                if(c > 0.0)
+                    for(unsigned int j = 0;j < b_count;++j)
+                        w[j] /= 1.0+(e[j]/c)*(e[j]/c);
+            }
+            double KtWK[36],KtWS[6];
+            std::fill(KtWK,KtWK+36,0.0);
+            std::fill(KtWS,KtWS+6,0.0);
+            for(unsigned int j = 0;j < b_count;++j)
+                for(unsigned int k = 0;k < 6;++k)
+                {
+                    double kw = Kt[k*b_count+j]*w[j];
+                    KtWS[k] += kw*signal[j];
+                    for(unsigned int l = k;l < 6;++l)
+                        KtWK[k*6+l] += kw*Kt[l*b_count+j];
+                }
+            for(unsigned int k = 0;k < 6;++k)
+                for(unsigned int l = 0;l < k;++l)
+                    KtWK[k*6+l] = KtWK[l*6+k];
+            unsigned int pivot[6];
+            if(!image::mat::lu_decomposition(KtWK,pivot,image::dyndim(6,6)))
+                return;
+            image::mat::lu_solve(KtWK,pivot,KtWS,tensor_param,image::dyndim(6,6));
+        }
+    }
 public:
     virtual void init(Voxel& voxel)
     {
@@ -101,11 +193,25 @@ public:
             }
             image::mat::lu_decomposition(iKtK[i].begin(),iKtK_pivot[i].begin(),image::dyndim(6,6));
         }
+        // the unregularized solution is a single product with the pseudo inverse
+        iKtKKt.resize(6*b_count);
+        for(unsigned int j = 0;j < b_count;++j)
+        {
+            double col[6],x[6];
+            for(unsigned int k = 0;k < 6;++k)
+                col[k] = Kt[k*b_count+j];
+            image::mat::lu_solve(iKtK[0].begin(),iKtK_pivot[0].begin(),col,x,image::dyndim(6,6));
+            for(unsigned int k = 0;k < 6;++k)
+                iKtKKt[k*b_count+j] = x[k];
+        }
     }
 public:
     virtual void run(Voxel& voxel, VoxelData& data)
     {
-        std::vector<float> signal(data.space.size());
+        // the log signal followed by the workspace of refit, kept by the thread
+        std::vector<float>& buffer = data.space_buffer;
+        buffer.assign(b_count*4,0.0f);
+        float* signal = buffer.data();
         if (data.space.front() != 0.0)
         {
             float logs0 = std::log(std::max<float>(1.0,data.space.front()));
@@ -116,17 +222,24 @@ public:
         double KtS[6],tensor_param[6];
         double tensor[9];
         double V[9],d[3];
+        unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
+        image::mat::product(iKtKKt.begin(),signal,tensor_param,image::dyndim(6,b_count),image::dyndim(b_count,1));
+        if(voxel.dti_fit && data.space.front() != 0.0 && b_count >= 6)
+            refit(voxel.dti_fit,std::max<float>(1.0,data.space.front()),signal,signal+b_count,tensor_param);
         for(unsigned int i = 0;i < iKtK.size();++i)
         {
-            image::mat::product(Kt.begin(),signal.begin(),KtS,image::dyndim(6,b_count),image::dyndim(b_count,1));
-            image::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,image::dyndim(6,6));
-
-
-            unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
+            // increasing regularization when the tensor is not positive definite
+            if(i)
+            {
+                if(i == 1)
+                    image::mat::product(Kt.begin(),signal,KtS,image::dyndim(6,b_count),image::dyndim(b_count,1));
+                image::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,image::dyndim(6,6));
+            }
             for (unsigned int index = 0; index < 9; ++index)
                 tensor[index] = tensor_param[tensor_index[index]];
 
-            image::mat::eigen_decomposition_sym(tensor,V,d,image::dim<3,3>());
+            if(!eigen_sym3(tensor,V,d))
+                image::mat::eigen_decomposition_sym(tensor,V,d,image::dim<3,3>());
             if(d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0)
                 break;
         }
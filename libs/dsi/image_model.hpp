@@ -8,6 +8,11 @@ struct ImageModel
 {
 private:
     std::vector<image::basic_image<unsigned short,3> > new_dwi;//used in rotated volume
+private:// pending flips and rotations, mapping the output space to the current volumes
+    image::matrix<4,4,double> pending_trans;
+    image::geometry<3> pending_dim;
+    std::vector<unsigned char> pending_flip;
+    bool pending_resample = false;
 public:
     Voxel voxel;
     std::string file_name,error_msg;
@@ -35,6 +40,24 @@ public:
             }
         }
     }
+    // the new axis i of the b-table is the old axis perm[i]
+    void permute_b_table(const unsigned char* perm)
+    {
+        for(unsigned int index = 0;index < voxel.bvectors.size();++index)
+        {
+            image::vector<3,float> v(voxel.bvectors[index]);
+            for(unsigned int i = 0;i < 3;++i)
+                voxel.bvectors[index][i] = v[perm[i]];
+        }
+        if(!voxel.grad_dev.empty())
+        {
+            // P*Gra_dev*P'
+            std::vector<image::pointer_image<float,3> > grad_dev(voxel.grad_dev);
+            for(unsigned int i = 0;i < 3;++i)
+                for(unsigned int j = 0;j < 3;++j)
+                    voxel.grad_dev[i*3+j] = grad_dev[perm[i]*3+perm[j]];
+        }
+    }
     // 0:xy 1:yz 2: xz
     void rotate_b_table(unsigned char dim)
     {
@@ -57,28 +80,40 @@ public:
 
     // 0: x  1: y  2: z
     // 3: xy 4: yz 5: xz
-    void flip(unsigned char type)
+    // the b-table is updated immediately, the volumes when apply_transform is called
+    void add_flip(unsigned char type)
     {
+        if(!has_pending_transform())
+        {
+            pending_trans.identity();
+            pending_dim = voxel.dim;
+        }
         if(type < 3)
             flip_b_table(type);
         else
-        {
             rotate_b_table(type-3);
-
-        }
-        image::flip(voxel.dwi_sum,type);
-        image::flip(mask,type);
-        for(unsigned int i = 0;i < voxel.grad_dev.size();++i)
+        // maps the flipped space to the space before flipping
+        image::matrix<4,4,double> F;
+        F.identity();
+        if(type < 3)
         {
-            auto I = image::make_image((float*)&*(voxel.grad_dev[i].begin()),voxel.dim);
-            image::flip(I,type);
+            F[type*4+type] = -1.0;
+            F[type*4+3] = pending_dim[type]-1;
         }
-        for (unsigned int index = 0;check_prog(index,dwi_data.size());++index)
+        else
         {
-            auto I = image::make_image((unsigned short*)dwi_data[index],voxel.dim);
-            image::flip(I,type);
+            unsigned char a = type-3,b = (type-2)%3;
+            F[a*4+a] = F[b*4+b] = 0.0;
+            F[a*4+b] = F[b*4+a] = 1.0;
+            std::swap(pending_dim[a],pending_dim[b]);
         }
-        voxel.dim = voxel.dwi_sum.geometry();
+        pending_trans = pending_trans*F;
+        pending_flip.push_back(type);
+    }
+    void flip(unsigned char type)
+    {
+        add_flip(type);
+        apply_transform();
     }
     // used in eddy correction for each dwi
     void rotate_dwi(unsigned int dwi_index,const image::transformation_matrix<double>& affine)
@@ -97,18 +132,14 @@ public:
         voxel.bvectors[dwi_index] = v;
     }
 
-    void rotate(image::geometry<3> new_geo,const image::transformation_matrix<double>& affine)
+    // the b-table is updated immediately, the volumes when apply_transform is called
+    void add_rotation(image::geometry<3> new_geo,const image::transformation_matrix<double>& affine)
     {
-        std::vector<image::basic_image<unsigned short,3> > dwi(dwi_data.size());
-        for (unsigned int index = 0;check_prog(index,dwi_data.size());++index)
+        if(!has_pending_transform())
         {
-            dwi[index].resize(new_geo);
-            auto I = image::make_image((unsigned short*)dwi_data[index],voxel.dim);
-            image::resample(I,dwi[index],affine,image::cubic);
-            dwi_data[index] = &(dwi[index][0]);
+            pending_trans.identity();
+            pending_dim = voxel.dim;
         }
-        dwi.swap(new_dwi);
-
         // rotate b-table
         image::matrix<3,3,float> iT = image::inverse(affine.get());
         for (unsigned int index = 0;index < voxel.bvalues.size();++index)
@@ -124,8 +155,7 @@ public:
             // <R*Gra_dev*b_table,ODF>
             // = <(R*Gra_dev*inv(R))*R*b_table,ODF>
             float det = std::abs(iT.det());
-            begin_prog("rotating grad_dev");
-            for(unsigned int index = 0;check_prog(index,voxel.dim.size());++index)
+            image::par_for(voxel.grad_dev[0].size(),[&](int index)
             {
                 image::matrix<3,3,float> grad_dev,G_invR;
                 for(unsigned int i = 0; i < 9; ++i)
@@ -134,21 +164,106 @@ public:
                 grad_dev = iT*G_invR;
                 for(unsigned int i = 0; i < 9; ++i)
                     voxel.grad_dev[i][index] = grad_dev[i]/det;
+            });
+        }
+        image::matrix<4,4,double> A;
+        A.identity();
+        affine.save_to_transform(A.begin());
+        pending_trans = pending_trans*A;
+        pending_dim = new_geo;
+        pending_resample = true;
+    }
+    void rotate(image::geometry<3> new_geo,const image::transformation_matrix<double>& affine)
+    {
+        add_rotation(new_geo,affine);
+        apply_transform();
+    }
+    bool has_pending_transform(void) const
+    {
+        return pending_resample || !pending_flip.empty();
+    }
+    // dimension of the volumes after the pending transformation
+    image::geometry<3> transformed_dim(void) const
+    {
+        return has_pending_transform() ? pending_dim : voxel.dim;
+    }
+    // resample each volume once for all the pending flips and rotations
+    void apply_transform(void)
+    {
+        if(!has_pending_transform())
+            return;
+        if(!pending_resample)
+        {
+            // flipping alone does not need interpolation
+            image::par_for2(dwi_data.size(),[&](int index,int id)
+            {
+                if(id == 0)
+                    check_prog(index,dwi_data.size());
+                image::geometry<3> dim = voxel.dim;
+                for(unsigned int i = 0;i < pending_flip.size();++i)
+                {
+                    auto I = image::make_image((unsigned short*)dwi_data[index],dim);
+                    image::flip(I,pending_flip[i]);
+                    if(pending_flip[i] >= 3)
+                        std::swap(dim[pending_flip[i]-3],dim[(pending_flip[i]-2)%3]);
+                }
+            });
+            check_prog(dwi_data.size(),dwi_data.size());
+            image::par_for(voxel.grad_dev.size(),[&](int index)
+            {
+                image::geometry<3> dim = voxel.dim;
+                for(unsigned int i = 0;i < pending_flip.size();++i)
+                {
+                    auto I = image::make_image((float*)&*(voxel.grad_dev[index].begin()),dim);
+                    image::flip(I,pending_flip[i]);
+                    if(pending_flip[i] >= 3)
+                        std::swap(dim[pending_flip[i]-3],dim[(pending_flip[i]-2)%3]);
+                }
+            });
+            for(unsigned int i = 0;i < pending_flip.size();++i)
+            {
+                image::flip(voxel.dwi_sum,pending_flip[i]);
+                image::flip(mask,pending_flip[i]);
             }
+            for(unsigned int index = 0;index < voxel.grad_dev.size();++index)
+                voxel.grad_dev[index] = image::make_image((float*)&*(voxel.grad_dev[index].begin()),pending_dim);
+            voxel.dim = pending_dim;
+            pending_flip.clear();
+            return;
+        }
+        image::transformation_matrix<double> T;
+        T.load_from_transform(pending_trans.begin());
+        std::vector<image::basic_image<unsigned short,3> > dwi(dwi_data.size());
+        image::par_for2(dwi_data.size(),[&](int index,int id)
+        {
+            if(id == 0)
+                check_prog(index,dwi_data.size());
+            dwi[index].resize(pending_dim);
+            auto I = image::make_image((unsigned short*)dwi_data[index],voxel.dim);
+            image::resample(I,dwi[index],T,image::cubic);
+        });
+        check_prog(dwi_data.size(),dwi_data.size());
+        for (unsigned int index = 0;index < dwi_data.size();++index)
+            dwi_data[index] = &(dwi[index][0]);
+        dwi.swap(new_dwi);
+
+        if(!voxel.grad_dev.empty())
+        {
             std::vector<image::basic_image<float,3> > new_gra_dev(voxel.grad_dev.size());
-            begin_prog("rotating grad_dev volume");
-            for (unsigned int index = 0;check_prog(index,new_gra_dev.size());++index)
+            image::par_for(new_gra_dev.size(),[&](int index)
             {
-                new_gra_dev[index].resize(new_geo);
-                image::resample(voxel.grad_dev[index],new_gra_dev[index],affine,image::cubic);
-                voxel.grad_dev[index] = image::make_image((float*)&(new_gra_dev[index][0]),voxel.dim);
-            }
+                new_gra_dev[index].resize(pending_dim);
+                image::resample(voxel.grad_dev[index],new_gra_dev[index],T,image::cubic);
+            });
+            for (unsigned int index = 0;index < new_gra_dev.size();++index)
+                voxel.grad_dev[index] = image::make_image((float*)&(new_gra_dev[index][0]),pending_dim);
             new_gra_dev.swap(voxel.new_grad_dev);
         }
-        voxel.dim = new_geo;
+        voxel.dim = pending_dim;
+        pending_flip.clear();
+        pending_resample = false;
         calculate_dwi_sum();
         calculate_mask();
-
     }
     void trim(void)
     {
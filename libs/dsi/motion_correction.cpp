@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <future>
+#include <memory>
+#include <vector>
+#include "image/image.hpp"
+#include "image_model.hpp"
+#include "motion_correction.hpp"
+
+// smoothed gradient magnitude used as the registration feature
+static void prepare_motion_image(image::basic_image<float,3>& I)
+{
+    image::filter::mean(I);
+    image::filter::mean(I);
+    image::filter::mean(I);
+    image::filter::gradient_magnitude(I);
+    image::normalize(I);
+}
+// level 0 is the full resolution, each further level halves the dimension
+static void build_motion_pyramid(image::basic_image<float,3>& I,image::vector<3> vs,
+                                 std::vector<image::basic_image<float,3> >& pyramid,
+                                 std::vector<image::vector<3> >& pyramid_vs)
+{
+    pyramid.resize(1);
+    pyramid_vs.resize(1);
+    pyramid[0].swap(I);
+    pyramid_vs[0] = vs;
+    while(pyramid.size() < 3 &&
+          *std::min_element(pyramid.back().geometry().begin(),pyramid.back().geometry().end()) >= 32)
+    {
+        image::basic_image<float,3> next(pyramid.back());
+        image::downsampling(next);
+        image::normalize(next);
+        pyramid.push_back(image::basic_image<float,3>());
+        pyramid.back().swap(next);
+        image::vector<3> next_vs(pyramid_vs.back());
+        next_vs *= 2.0;
+        pyramid_vs.push_back(next_vs);
+    }
+}
+
+void rec_motion_correction_parallel(ImageModel* handle,
+                                    const std::vector<image::basic_image<float,3> >& ref,
+                                    const std::vector<image::vector<3> >& ref_vs,
+                                    std::vector<image::affine_transform<double> >& args,
+                                    unsigned int total_thread,unsigned int id,unsigned int& progress,bool& terminated)
+{
+    image::affine_transform<float> upper,lower;
+    upper.translocation[0] = 2;
+    upper.translocation[1] = 2;
+    upper.translocation[2] = 2;
+    lower.translocation[0] = -2;
+    lower.translocation[1] = -2;
+    lower.translocation[2] = -2;
+    upper.rotation[0] = 3.1415926*3.0/180.0;
+    upper.rotation[1] = 3.1415926*3.0/180.0;
+    upper.rotation[2] = 3.1415926*3.0/180.0;
+    lower.rotation[0] = -3.1415926*3.0/180.0;
+    lower.rotation[1] = -3.1415926*3.0/180.0;
+    lower.rotation[2] = -3.1415926*3.0/180.0;
+    upper.scaling[0] = 1.03;
+    upper.scaling[1] = 1.03;
+    upper.scaling[2] = 1.03;
+    lower.scaling[0] = 0.96;
+    lower.scaling[1] = 0.96;
+    lower.scaling[2] = 0.96;
+    upper.affine[0] = 0.04;
+    upper.affine[1] = 0.04;
+    upper.affine[2] = 0.04;
+    lower.affine[0] = -0.04;
+    lower.affine[1] = -0.04;
+    lower.affine[2] = -0.04;
+    for(unsigned int i = id;i < handle->voxel.bvalues.size() && !terminated;i += total_thread)
+    {
+
+        if(id == 0)
+            progress = i*99/handle->voxel.bvalues.size();
+        if(i == 0)
+            continue;
+        image::basic_image<float,3> I1;
+        I1 = image::make_image(handle->dwi_data[i],handle->voxel.dim);
+        prepare_motion_image(I1);
+        std::vector<image::basic_image<float,3> > I;
+        std::vector<image::vector<3> > vs;
+        build_motion_pyramid(I1,handle->voxel.vs,I,vs);
+
+        // coarse-to-fine: each level starts from the optimum of the coarser one,
+        // so the full-resolution search converges in a few steps
+        for(int level = std::min<int>(I.size(),ref.size())-1;level >= 0 && !terminated;--level)
+        {
+            image::reg::fun_adoptor<image::basic_image<float,3>,
+                                    image::vector<3>,
+                                    image::affine_transform<double>,
+                                    image::affine_transform<double>,
+                                    image::reg::square_error> fun(ref[level],ref_vs[level],I[level],vs[level],args[i]);
+            double optimal_value = fun(args[i][0]);
+            image::optimization::graient_descent(args[i].begin(),args[i].end(),
+                                                 upper.begin(),lower.begin(),fun,optimal_value,terminated,0.05);
+        }
+        if(terminated)
+            return;
+        // the volume is no longer read by other threads, apply the correction right away
+        handle->rotate_dwi(i,image::transformation_matrix<double>(args[i],handle->voxel.dim,handle->voxel.vs,handle->voxel.dim,handle->voxel.vs));
+        //for(unsigned int index = 0;index < 12;++index)
+        //    std::cout << args[i][index] << " ";
+        //std::cout << std::endl;
+    }
+}
+
+void rec_motion_correction(ImageModel* handle,unsigned int total_thread,
+                           std::vector<image::affine_transform<double> >& args,
+                           unsigned int& progress,
+                           bool& terminated)
+{
+    args.resize(handle->voxel.bvalues.size());
+    // the b0 reference and its pyramid are prepared once and shared read-only
+    std::vector<image::basic_image<float,3> > ref;
+    std::vector<image::vector<3> > ref_vs;
+    {
+        image::basic_image<float,3> I0;
+        I0 = image::make_image(handle->dwi_data[0],handle->voxel.dim);
+        prepare_motion_image(I0);
+        build_motion_pyramid(I0,handle->voxel.vs,ref,ref_vs);
+    }
+    std::vector<std::shared_ptr<std::future<void> > > threads;
+    for(unsigned int i = 1;i < total_thread;++i)
+        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
+            [&,i](){rec_motion_correction_parallel(handle,ref,ref_vs,args,total_thread,i,progress,terminated);})));
+    rec_motion_correction_parallel(handle,ref,ref_vs,args,total_thread,0,progress,terminated);
+    for(unsigned int i = 0;i < threads.size();++i)
+        threads[i]->wait();
+    args.clear();
+    progress = 100;
+}
@@ -0,0 +1,15 @@
+#ifndef MOTION_CORRECTION_HPP
+#define MOTION_CORRECTION_HPP
+#include <vector>
+#include "image/image.hpp"
+
+struct ImageModel;
+// Registers every DWI to the b0 volume, coarse to fine, on total_thread
+// threads, and resamples it and rotates its b-vector in place. progress goes
+// from 0 to 100, and setting terminated stops the threads early.
+void rec_motion_correction(ImageModel* handle,unsigned int total_thread,
+                           std::vector<image::affine_transform<double> >& args,
+                           unsigned int& progress,
+                           bool& terminated);
+
+#endif//MOTION_CORRECTION_HPP
@@ -45,3 +45,8 @@ void SamplePoint::sampleODFValueWeighted(const std::vector<float>& pdf,std::vect
         value += pdf[sample_index[index]]*ratio[index];
     odf[odf_index] += value;
 }
+void SamplePoint::add_weighting(std::vector<double>& weighting) const
+{
+    for (unsigned int index = 0; index < 8; ++index)
+        weighting[sample_index[index]] += ratio[index];
+}
@@ -11,6 +11,8 @@ public:
     SamplePoint(void):ratio(8),sample_index(8),odf_index(0) {}
     SamplePoint(unsigned int odf_index_,float x,float y,float z,float weighting);
     void sampleODFValueWeighted(const std::vector<float>& pdf,std::vector<float>& odf) const;
+    // add the interpolation weights to a dense pdf-sized weighting vector
+    void add_weighting(std::vector<double>& weighting) const;
 
 };
 #endif//SAMPLE_MODEL_HPP
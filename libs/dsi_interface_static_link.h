@@ -1,4 +1,9 @@
+#include <string>
+#include <vector>
 class ImageModel;
+// corrects the b-table by the fiber coherence of a DTI fit, and returns the
+// suffix of the output file name for the correction (empty if none)
+std::string check_b_table(ImageModel* image_model,unsigned int thread_count);
 const char* reconstruction(ImageModel* image_model,
                    unsigned int method_id,
                    const float* param_values,
@@ -7,7 +7,19 @@
 #endif
 #include "image/image.hpp"
 #include "prog_interface_static_link.h"
-extern bool prog_aborted_;
+// Set on reader threads whose caller reports the overall progress, so that
+// their file reads do not report progress of their own.
+inline bool& gz_quiet_thread(void)
+{
+    static thread_local bool quiet = false;
+    return quiet;
+}
+class gz_quiet_scope{
+    bool previous;
+public:
+    gz_quiet_scope(void):previous(gz_quiet_thread()){gz_quiet_thread() = true;}
+    ~gz_quiet_scope(void){gz_quiet_thread() = previous;}
+};
 class gz_istream{
     size_t size_;
     std::ifstream in;
@@ -32,7 +44,6 @@ public:
     template<class char_type>
     bool open(const char_type* file_name)
     {
-        prog_aborted_ = false;
         in.open(file_name,std::ios::binary);
         unsigned int gz_size = 0;
         if(in)
@@ -53,7 +64,8 @@ public:
     }
     bool read(void* buf,size_t buf_size)
     {
-        check_prog((unsigned int)cur(),(unsigned int)size());
+        if(!gz_quiet_thread())
+            check_prog((unsigned int)cur(),(unsigned int)size());
         if(prog_aborted())
             return false;
         if(handle)
@@ -105,7 +117,8 @@ public:
         }
         if(in)
             in.close();
-        check_prog(0,0);
+        if(!gz_quiet_thread())
+            check_prog(0,0);
     }
     size_t cur(void)
     {
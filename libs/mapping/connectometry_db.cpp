@@ -1,4 +1,7 @@
 #include "connectometry_db.hpp"
+#include <atomic>
+#include <chrono>
+#include <future>
 #include "fib_data.hpp"
 
 void connectometry_db::read_db(fib_data* handle_)
@@ -80,7 +83,6 @@ bool connectometry_db::sample_odf(gz_mat_read& m,std::vector<float>& data)
     odf_data subject_odf;
     if(!subject_odf.read(m))
         return false;
-    set_title("load data");
     for(unsigned int index = 0;index < si2vi.size();++index)
     {
         unsigned int cur_index = si2vi[index];
@@ -119,18 +121,22 @@ bool connectometry_db::sample_index(gz_mat_read& m,std::vector<float>& data,cons
     return true;
 }
 bool connectometry_db::is_consistent(gz_mat_read& m)
+{
+    return is_consistent(m,handle->error_msg);
+}
+bool connectometry_db::is_consistent(gz_mat_read& m,std::string& error_msg) const
 {
     unsigned int row,col;
     const float* odf_buffer = 0;
     m.read("odf_vertices",row,col,odf_buffer);
     if (!odf_buffer)
     {
-        handle->error_msg = "No odf_vertices matrix in ";
+        error_msg = "No odf_vertices matrix in ";
         return false;
     }
     if(col != handle->dir.odf_table.size())
     {
-        handle->error_msg = "Inconsistent ODF dimension in ";
+        error_msg = "Inconsistent ODF dimension in ";
         return false;
     }
     for (unsigned int index = 0;index < col;++index,odf_buffer += 3)
@@ -139,7 +145,7 @@ bool connectometry_db::is_consistent(gz_mat_read& m)
            handle->dir.odf_table[index][1] != odf_buffer[1] ||
            handle->dir.odf_table[index][2] != odf_buffer[2])
         {
-            handle->error_msg = "Inconsistent ODF in ";
+            error_msg = "Inconsistent ODF in ";
             return false;
         }
     }
@@ -147,22 +153,79 @@ bool connectometry_db::is_consistent(gz_mat_read& m)
     m.read("voxel_size",row,col,voxel_size);
     if(!voxel_size)
     {
-        handle->error_msg = "No voxel_size matrix in ";
+        error_msg = "No voxel_size matrix in ";
         return false;
     }
     if(voxel_size[0] != handle->vs[0])
     {
         std::ostringstream out;
         out << "Inconsistency in image resolution. Please use a correct atlas. The atlas resolution (" << handle->vs[0] << " mm) is different from that in ";
-        handle->error_msg = out.str();
+        error_msg = out.str();
+        return false;
+    }
+    return true;
+}
+
+bool connectometry_db::load_subject_file(const std::string& file_name,unsigned int subject_index,
+                                         const char* index_name,std::string& error_msg,std::string* report)
+{
+    gz_mat_read m;
+    if(!m.load_from_file(file_name.c_str()))
+    {
+        error_msg = "failed to load subject data ";
+        error_msg += file_name;
+        return false;
+    }
+    // check if the odf table is consistent or not
+    if(std::string(index_name) == "sdf")
+    {
+        if(!is_consistent(m,error_msg))
+        {
+            error_msg += file_name;
+            return false;
+        }
+        if(!sample_odf(m,subject_qa_buf[subject_index]))
+        {
+            error_msg = "Failed to read odf ";
+            error_msg += file_name;
+            return false;
+        }
+    }
+    else
+    {
+        if(!sample_index(m,subject_qa_buf[subject_index],index_name))
+        {
+            error_msg = "failed to sample ";
+            error_msg += index_name;
+            error_msg += " in ";
+            error_msg += file_name;
+            return false;
+        }
+    }
+    // load R2
+    const float* value= 0;
+    unsigned int row,col;
+    m.read("R2",row,col,value);
+    if(!value || *value != *value)
+    {
+        error_msg = "Invalid R2 value in ";
+        error_msg += file_name;
         return false;
     }
+    R2[subject_index] = *value;
+    if(report)
+    {
+        const char* report_buf = 0;
+        if(m.read("report",row,col,report_buf))
+            *report = std::string(report_buf,report_buf+row*col);
+    }
     return true;
 }
 
 bool connectometry_db::load_subject_files(const std::vector<std::string>& file_names,
                         const std::vector<std::string>& subject_names_,
-                        const char* index_name)
+                        const char* index_name,
+                        unsigned int thread_count)
 {
     num_subjects = (unsigned int)file_names.size();
     subject_qa.clear();
@@ -173,72 +236,59 @@ bool connectometry_db::load_subject_files(const std::vector<std::string>& file_n
         subject_qa_buf[index].resize(handle->dir.num_fiber*si2vi.size());
     for(unsigned int index = 0;index < num_subjects;++index)
         subject_qa[index] = &(subject_qa_buf[index][0]);
-    for(unsigned int subject_index = 0;check_prog(subject_index,num_subjects);++subject_index)
+
+    // each reader owns at most one decompressed subject at a time,
+    // so the memory in flight is bounded by thread_count
+    thread_count = std::max<unsigned int>(1,std::min<unsigned int>(thread_count,num_subjects));
+    std::vector<std::string> error_msg(num_subjects);
+    std::vector<unsigned char> failed(num_subjects);
+    std::atomic<unsigned int> next_subject(0),finished_count(0);
+    std::atomic<bool> aborted(false);
+    auto reader = [&](void)
     {
-        if(prog_aborted())
-        {
-            check_prog(1,1);
-            return false;
-        }
-        gz_mat_read m;
-        if(!m.load_from_file(file_names[subject_index].c_str()))
-        {
-            handle->error_msg = "failed to load subject data ";
-            handle->error_msg += file_names[subject_index];
-            return false;
-        }
-        // check if the odf table is consistent or not
-        if(std::string(index_name) == "sdf")
+        gz_quiet_scope quiet;
+        for(unsigned int subject_index = next_subject++;
+            subject_index < num_subjects && !aborted;subject_index = next_subject++)
         {
-            if(!is_consistent(m))
+            if(!load_subject_file(file_names[subject_index],subject_index,index_name,error_msg[subject_index],
+                                  subject_index == 0 ? &subject_report : 0))
             {
-                handle->error_msg += file_names[subject_index];
-                return false;
-            }
-            if(!sample_odf(m,subject_qa_buf[subject_index]))
-            {
-                handle->error_msg = "Failed to read odf ";
-                handle->error_msg += file_names[subject_index];
-                return false;
+                failed[subject_index] = 1;
+                aborted = true;
             }
+            ++finished_count;
         }
-        else
-        {
-            if(!sample_index(m,subject_qa_buf[subject_index],index_name))
-            {
-                handle->error_msg = "failed to sample ";
-                handle->error_msg += index_name;
-                handle->error_msg += " in ";
-                handle->error_msg += file_names[subject_index];
-                return false;
-            }
-        }
-        // load R2
-        const float* value= 0;
-        unsigned int row,col;
-        m.read("R2",row,col,value);
-        if(!value || *value != *value)
+    };
+    std::vector<std::shared_ptr<std::future<void> > > threads;
+    for(unsigned int index = 0;index < thread_count;++index)
+        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,reader)));
+    // progress and cancellation are handled on the calling thread
+    while(finished_count < num_subjects && !aborted)
+    {
+        check_prog(finished_count,num_subjects);
+        if(prog_aborted())
+            aborted = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    for(unsigned int index = 0;index < threads.size();++index)
+        threads[index]->wait();
+    check_prog(num_subjects,num_subjects);
+    // report the first failing subject in file order regardless of completion order
+    for(unsigned int subject_index = 0;subject_index < num_subjects;++subject_index)
+        if(failed[subject_index])
         {
-            handle->error_msg = "Invalid R2 value in ";
-            handle->error_msg += file_names[subject_index];
+            handle->error_msg = error_msg[subject_index];
             return false;
         }
-        R2[subject_index] = *value;
-        if(subject_index == 0)
-        {
-            const char* report_buf = 0;
-            if(m.read("report",row,col,report_buf))
-                subject_report = std::string(report_buf,report_buf+row*col);
-        }
-    }
+    if(aborted || prog_aborted())
+        return false;
     subject_names = subject_names_;
     return true;
 }
-void connectometry_db::get_subject_vector(std::vector<std::vector<float> >& subject_vector,
-                        const image::basic_image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const
+void connectometry_db::get_subject_vector_pos(std::vector<unsigned int>& subject_vector_pos,
+                                              const image::basic_image<int,3>& cerebrum_mask,float fiber_threshold) const
 {
-    subject_vector.clear();
-    subject_vector.resize(num_subjects);
+    subject_vector_pos.clear();
     for(unsigned int s_index = 0;s_index < si2vi.size();++s_index)
     {
         unsigned int cur_index = si2vi[s_index];
@@ -246,34 +296,38 @@ void connectometry_db::get_subject_vector(std::vector<std::vector<float> >& subj
             continue;
         for(unsigned int j = 0,fib_offset = 0;j < handle->dir.num_fiber && handle->dir.fa[j][cur_index] > fiber_threshold;
                 ++j,fib_offset+=si2vi.size())
-        {
-            unsigned int pos = s_index + fib_offset;
-            for(unsigned int index = 0;index < num_subjects;++index)
-                subject_vector[index].push_back(subject_qa[index][pos]);
-        }
+            subject_vector_pos.push_back(s_index + fib_offset);
     }
-    if(normalize_fp)
-    for(unsigned int index = 0;index < num_subjects;++index)
+}
+void connectometry_db::get_subject_vector(std::vector<std::vector<float> >& subject_vector,
+                        const image::basic_image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const
+{
+    std::vector<unsigned int> subject_vector_pos;
+    get_subject_vector_pos(subject_vector_pos,cerebrum_mask,fiber_threshold);
+    subject_vector.clear();
+    subject_vector.resize(num_subjects);
+    image::par_for(num_subjects,[&](int index)
     {
-        float sd = image::standard_deviation(subject_vector[index].begin(),subject_vector[index].end(),image::mean(subject_vector[index].begin(),subject_vector[index].end()));
-        if(sd > 0.0)
-            image::multiply_constant(subject_vector[index].begin(),subject_vector[index].end(),1.0/sd);
-    }
+        subject_vector[index].resize(subject_vector_pos.size());
+        for(unsigned int i = 0;i < subject_vector_pos.size();++i)
+            subject_vector[index][i] = subject_qa[index][subject_vector_pos[i]];
+        if(normalize_fp)
+        {
+            float sd = image::standard_deviation(subject_vector[index].begin(),subject_vector[index].end(),image::mean(subject_vector[index].begin(),subject_vector[index].end()));
+            if(sd > 0.0)
+                image::multiply_constant(subject_vector[index].begin(),subject_vector[index].end(),1.0/sd);
+        }
+    });
 }
 
 void connectometry_db::get_subject_vector(unsigned int subject_index,std::vector<float>& subject_vector,
                         const image::basic_image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const
 {
-    subject_vector.clear();
-    for(unsigned int s_index = 0;s_index < si2vi.size();++s_index)
-    {
-        unsigned int cur_index = si2vi[s_index];
-        if(!cerebrum_mask[cur_index])
-            continue;
-        for(unsigned int j = 0,fib_offset = 0;j < handle->dir.num_fiber && handle->dir.fa[j][cur_index] > fiber_threshold;
-                ++j,fib_offset+=si2vi.size())
-            subject_vector.push_back(subject_qa[subject_index][s_index + fib_offset]);
-    }
+    std::vector<unsigned int> subject_vector_pos;
+    get_subject_vector_pos(subject_vector_pos,cerebrum_mask,fiber_threshold);
+    subject_vector.resize(subject_vector_pos.size());
+    for(unsigned int i = 0;i < subject_vector_pos.size();++i)
+        subject_vector[i] = subject_qa[subject_index][subject_vector_pos[i]];
     if(normalize_fp)
     {
         float sd = image::standard_deviation(subject_vector.begin(),subject_vector.end(),image::mean(subject_vector.begin(),subject_vector.end()));
@@ -285,15 +339,74 @@ void connectometry_db::get_dif_matrix(std::vector<float>& matrix,const image::ba
 {
     matrix.clear();
     matrix.resize(num_subjects*num_subjects);
-    std::vector<std::vector<float> > subject_vector;
-    get_subject_vector(subject_vector,cerebrum_mask,fiber_threshold,normalize_fp);
+    std::vector<unsigned int> subject_vector_pos;
+    get_subject_vector_pos(subject_vector_pos,cerebrum_mask,fiber_threshold);
+    if(subject_vector_pos.empty())
+        return;
+    // the fp normalization only scales each subject vector, so it is applied to the Gram matrix
+    std::vector<double> scale(num_subjects,1.0);
+    if(normalize_fp)
+        image::par_for(num_subjects,[&](int i)
+        {
+            double sum = 0.0,sum2 = 0.0;
+            for(unsigned int k = 0;k < subject_vector_pos.size();++k)
+            {
+                double v = subject_qa[i][subject_vector_pos[k]];
+                sum += v;
+                sum2 += v*v;
+            }
+            double mean = sum/subject_vector_pos.size();
+            double sd = std::sqrt(std::max<double>(0.0,sum2/subject_vector_pos.size()-mean*mean));
+            if(sd > 0.0)
+                scale[i] = 1.0/sd;
+        });
+
+    // ||a-b||^2 = ||a||^2 + ||b||^2 - 2a.b, with a.b accumulated block by block
+    // so that only num_subjects x block_size values are gathered at a time.
+    // The blocks are gathered from subject_qa, which holds every subject in
+    // memory; reading the subject vectors from disk block by block is not supported.
+    const unsigned int block_size = 4096;
+    std::vector<float> block(num_subjects*block_size);
+    std::vector<double> gram(num_subjects*num_subjects);
     begin_prog("calculating");
-    for(unsigned int i = 0; check_prog(i,num_subjects);++i)
-        for(unsigned int j = i+1; j < num_subjects;++j)
+    for(unsigned int from = 0;check_prog(from,subject_vector_pos.size());from += block_size)
+    {
+        unsigned int size = std::min<unsigned int>(block_size,subject_vector_pos.size()-from);
+        image::par_for(num_subjects,[&](int i)
+        {
+            float* out = &block[i*block_size];
+            for(unsigned int k = 0;k < size;++k)
+                out[k] = subject_qa[i][subject_vector_pos[from+k]];
+        });
+        // pair row i with row n-1-i so that each task covers the same number of upper-triangle entries
+        image::par_for((num_subjects+1) >> 1,[&](int task)
+        {
+            unsigned int rows[2] = {(unsigned int)task,num_subjects-1-task};
+            for(unsigned int r = 0;r < 2;++r)
+            {
+                if(r && rows[1] == rows[0])
+                    break;
+                unsigned int i = rows[r];
+                const float* a = &block[i*block_size];
+                double* g = &gram[i*num_subjects];
+                for(unsigned int j = i;j < num_subjects;++j)
+                {
+                    const float* b = &block[j*block_size];
+                    double sum = 0.0;
+                    for(unsigned int k = 0;k < size;++k)
+                        sum += (double)a[k]*b[k];
+                    g[j] += sum;
+                }
+            }
+        });
+    }
+    for(unsigned int i = 0;i < num_subjects;++i)
+        for(unsigned int j = i+1;j < num_subjects;++j)
         {
-            double result = image::root_mean_suqare_error(
-                        subject_vector[i].begin(),subject_vector[i].end(),
-                        subject_vector[j].begin());
+            double d2 = gram[i*num_subjects+i]*scale[i]*scale[i] +
+                        gram[j*num_subjects+j]*scale[j]*scale[j] -
+                        2.0*gram[i*num_subjects+j]*scale[i]*scale[j];
+            double result = std::sqrt(std::max<double>(0.0,d2)/subject_vector_pos.size());
             matrix[i*num_subjects+j] = result;
             matrix[j*num_subjects+i] = result;
         }
@@ -436,6 +549,7 @@ bool connectometry_db::get_odf_profile(const char* file_name,std::vector<float>&
         return false;
     cur_subject_data.clear();
     cur_subject_data.resize(handle->dir.num_fiber*si2vi.size());
+    set_title("load data");
     if(!sample_odf(single_subject,cur_subject_data))
     {
         handle->error_msg += file_name;
@@ -531,12 +645,21 @@ bool connectometry_db::add_db(const connectometry_db& rhs)
 
 
 void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,stat_model& info,
-                   float fiber_threshold,bool normalize_qa,bool& terminated)
+                   float fiber_threshold,bool normalize_qa,bool& terminated,unsigned int thread_count)
 {
     data.initialize(handle);
-    std::vector<double> population(handle->db.subject_qa.size());
-    for(unsigned int s_index = 0;s_index < handle->db.si2vi.size() && !terminated;++s_index)
+    if(!thread_count)
+        thread_count = 1;
+    // each thread owns its population and statistics buffers
+    std::vector<stat_workspace> workspace(thread_count);
+    for(unsigned int i = 0;i < thread_count;++i)
+        workspace[i].population.resize(handle->db.subject_qa.size());
+    auto run_voxel = [&](int s_index,int thread_index)
     {
+        if(terminated)
+            return;
+        stat_workspace& w = workspace[thread_index];
+        std::vector<double>& population = w.population;
         unsigned int cur_index = handle->db.si2vi[s_index];
         for(unsigned int fib = 0,fib_offset = 0;fib < handle->dir.num_fiber && handle->dir.fa[fib][cur_index] > fiber_threshold;
                 ++fib,fib_offset+=handle->db.si2vi.size())
@@ -551,7 +674,7 @@ void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,s
 
             if(std::find(population.begin(),population.end(),0.0) != population.end())
                 continue;
-            double result = info(population,pos);
+            double result = info(population,pos,w);
 
             if(result > 0.0) // group 0 > group 1
                 data.greater[fib][cur_index] = result;
@@ -559,7 +682,15 @@ void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,s
                 data.lesser[fib][cur_index] = -result;
 
         }
+    };
+    // nested calls from permutation workers use thread_count = 1 and stay on the caller's thread
+    if(thread_count == 1)
+    {
+        for(unsigned int s_index = 0;s_index < handle->db.si2vi.size() && !terminated;++s_index)
+            run_voxel(s_index,0);
     }
+    else
+        image::par_for2(handle->db.si2vi.size(),run_voxel,thread_count);
 }
 
 
@@ -935,21 +1066,30 @@ bool stat_model::resample(stat_model& rhs,bool null,bool bootstrap)
 }
 void stat_model::select(const std::vector<double>& population,std::vector<double>& selected_population) const
 {
+    selected_population.resize(subject_index.size());
     for(unsigned int index = 0;index < subject_index.size();++index)
         selected_population[index] = population[subject_index[index]];
-    selected_population.resize(subject_index.size());
 }
 
 double stat_model::operator()(const std::vector<double>& original_population,unsigned int pos) const
 {
-    std::vector<double> population(subject_index.size());
+    stat_workspace w;
+    return (*this)(original_population,pos,w);
+}
+
+double stat_model::operator()(const std::vector<double>& original_population,unsigned int pos,stat_workspace& w) const
+{
+    std::vector<double>& population = w.selected;
     select(original_population,population);
     switch(type)
     {
     case 0: // group
         if(threshold_type == t)
         {
-            std::vector<double> g0(group1_count),g1(group2_count);
+            std::vector<double>& g0 = w.g0;
+            std::vector<double>& g1 = w.g1;
+            g0.resize(group1_count);
+            g1.resize(group2_count);
             for(unsigned int index = 0,i0 = 0,i1 = 0;index < label.size();++index)
                 if(label[index])
                 {
@@ -992,7 +1132,8 @@ double stat_model::operator()(const std::vector<double>& original_population,uns
     case 1: // multiple regression
         if(threshold_type == percentage)
         {
-            std::vector<double> b(feature_count);
+            std::vector<double>& b = w.b;
+            b.resize(feature_count);
             mr.regress(&*population.begin(),&*b.begin());
             double mean = image::mean(population.begin(),population.end());
             return mean == 0 ? 0:b[study_feature]*X_range[study_feature]/mean;
@@ -1000,14 +1141,18 @@ double stat_model::operator()(const std::vector<double>& original_population,uns
         else
             if(threshold_type == beta)
             {
-                std::vector<double> b(feature_count);
+                std::vector<double>& b = w.b;
+                b.resize(feature_count);
                 mr.regress(&*population.begin(),&*b.begin());
                 return b[study_feature];
             }
             else
                 if(threshold_type == t)
                 {
-                    std::vector<double> b(feature_count),t(feature_count);
+                    std::vector<double>& b = w.b;
+                    std::vector<double>& t = w.t;
+                    b.resize(feature_count);
+                    t.resize(feature_count);
                     mr.regress(&*population.begin(),&*b.begin(),&*t.begin());
                     return t[study_feature];
                 }
@@ -1044,7 +1189,8 @@ double stat_model::operator()(const std::vector<double>& original_population,uns
         if(threshold_type == t)
         {
             unsigned int half_size = population.size() >> 1;
-            std::vector<double> dif(population.begin(),population.begin()+half_size);
+            std::vector<double>& dif = w.g0;
+            dif.assign(population.begin(),population.begin()+half_size);
             image::minus(dif.begin(),dif.end(),population.begin()+half_size);
             return image::t_statistics(dif.begin(),dif.end());
         }
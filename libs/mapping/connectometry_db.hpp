@@ -2,6 +2,7 @@
 #define CONNECTOMETRY_DB_H
 #include <vector>
 #include <string>
+#include <thread>
 #include "gzip_interface.hpp"
 #include "image/image.hpp"
 class fib_data;
@@ -28,9 +29,15 @@ public:
     bool sample_odf(gz_mat_read& m,std::vector<float>& data);
     bool sample_index(gz_mat_read& m,std::vector<float>& data,const char* index_name);
     bool is_consistent(gz_mat_read& m);
+    bool is_consistent(gz_mat_read& m,std::string& error_msg) const;
+    bool load_subject_file(const std::string& file_name,unsigned int subject_index,
+                           const char* index_name,std::string& error_msg,std::string* report);
     bool load_subject_files(const std::vector<std::string>& file_names,
                             const std::vector<std::string>& subject_names_,
-                            const char* index_name);
+                            const char* index_name,
+                            unsigned int thread_count = std::thread::hardware_concurrency());
+    void get_subject_vector_pos(std::vector<unsigned int>& subject_vector_pos,
+                            const image::basic_image<int,3>& cerebrum_mask,float fiber_threshold) const;
     void get_subject_vector(std::vector<std::vector<float> >& subject_vector,
                             const image::basic_image<int,3>& cerebrum_mask,float fiber_threshold,bool normalize_fp) const;
     void get_subject_vector(unsigned int subject_index,std::vector<float>& subject_vector,
@@ -54,6 +61,11 @@ public:
 
 
 
+// per-thread scratch buffers used by stat_model::operator() to avoid allocation at each position
+struct stat_workspace{
+    std::vector<double> population,selected,g0,g1,b,t;
+};
+
 class stat_model{
 public:
     image::uniform_dist<int> rand_gen;
@@ -86,6 +98,7 @@ public:
     bool pre_process(void);
     void select(const std::vector<double>& population,std::vector<double>& selected_population)const;
     double operator()(const std::vector<double>& population,unsigned int pos) const;
+    double operator()(const std::vector<double>& population,unsigned int pos,stat_workspace& w) const;
     void clear(void)
     {
         label.clear();
@@ -133,7 +146,8 @@ public:
 };
 
 void calculate_spm(std::shared_ptr<fib_data> handle,connectometry_result& data,stat_model& info,
-                   float fiber_threshold,bool normalize_qa,bool& terminated);
+                   float fiber_threshold,bool normalize_qa,bool& terminated,
+                   unsigned int thread_count = std::thread::hardware_concurrency());
 
 
 #endif // CONNECTOMETRY_DB_H
@@ -1,11 +1,31 @@
 #ifndef PROG_INTERFACE_STATIC_LINKH
 #define PROG_INTERFACE_STATIC_LINKH
 
-
+// Progress of the current operation. The thread that calls begin_prog owns the
+// progress and updates the dialog; check_prog, add_prog, and prog_aborted can be
+// called from any thread.
 void begin_prog(const char* title,bool lock = false);
 void set_title(const char* title);
 bool check_prog(unsigned int now,unsigned int total);
+// adds finished steps to the range of the last check_prog, e.g. from the
+// threads of a parallel loop. Returns false once the operation is cancelled.
+bool add_prog(unsigned int count = 1);
+void cancel_prog(void);
 bool prog_aborted(void);
 bool is_running(void);
+// appends the progress as JSON lines to a file; an empty name stops logging
+void set_prog_log(const char* file_name);
+
+// A nested stage. It takes the step of the enclosing check_prog(now,total)
+// range, so that the begin_prog and check_prog calls inside it report within
+// that step and do not close the dialog.
+class prog_stage{
+    bool active;
+    prog_stage(const prog_stage&);
+    void operator=(const prog_stage&);
+public:
+    prog_stage(const char* title);
+    ~prog_stage(void);
+};
 #endif
 
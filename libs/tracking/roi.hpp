@@ -46,6 +46,15 @@ public:
     {
         return havePoint(point[0],point[1],point[2]);
     }
+    void getPoints(std::vector<image::vector<3,short> >& points) const
+    {
+        points.clear();
+        for(unsigned int x = 0; x < roi_filter.size(); ++x)
+            for(unsigned int y = 0; y < roi_filter[x].size(); ++y)
+                for(unsigned int z = 0; z < roi_filter[x][y].size(); ++z)
+                    if(roi_filter[x][y][z])
+                        points.push_back(image::vector<3,short>(x,y,z));
+    }
     bool included(const float* track,unsigned int buffer_size) const
     {
         for(unsigned int index = 0; index < buffer_size; index += 3)
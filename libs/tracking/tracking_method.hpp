@@ -57,6 +57,10 @@ public:// Parameters
     image::vector<3,float> next_dir;
     bool terminated;
     bool forward;
+public:// why the last start_tracking returned false
+    enum {no_failure = 0,excluded_failure,too_long_failure,too_short_failure,
+          no_roi_failure,no_end_failure};
+    unsigned char failure;
 public:
     const tracking_data& trk;
     const TrackingParam& param;
@@ -86,7 +90,7 @@ public:
 public:
     TrackingMethod(const tracking_data& trk_,basic_interpolation* interpolation_,
                    const RoiMgr& roi_mgr_,const TrackingParam& param_):
-        trk(trk_),interpolation(interpolation_),roi_mgr(roi_mgr_),param(param_),init_fib_index(0)
+        failure(no_failure),trk(trk_),interpolation(interpolation_),roi_mgr(roi_mgr_),param(param_),init_fib_index(0)
 	{
         // floatd for full backward or full forward
         track_buffer.resize(param.max_points_count3 << 1);
@@ -118,12 +122,19 @@ public:
         buffer_back_pos = param.max_points_count3;
         image::vector<3,float> end_point1;
         terminated = false;
+        failure = no_failure;
 		do
 		{
             if(get_buffer_size() > param.max_points_count3 || buffer_back_pos + 3 >= track_buffer.size())
+            {
+                failure = too_long_failure;
 				return false;
+            }
             if(roi_mgr.is_excluded_point(position))
+            {
+                failure = excluded_failure;
 				return false;
+            }
             track_buffer[buffer_back_pos] = position[0];
             track_buffer[buffer_back_pos+1] = position[1];
             track_buffer[buffer_back_pos+2] = position[2];
@@ -146,12 +157,18 @@ public:
 		    tracking(ProcessList());	
 			// make sure that the length won't overflow
             if(get_buffer_size() > param.max_points_count3 || buffer_front_pos < 3)
-				return false;			
+            {
+                failure = too_long_failure;
+				return false;
+            }
             if(terminated)
 				break;
 			buffer_front_pos -= 3;
             if(roi_mgr.is_excluded_point(position))
+            {
+                failure = excluded_failure;
 				return false;
+            }
             track_buffer[buffer_front_pos] = position[0];
             track_buffer[buffer_front_pos+1] = position[1];
             track_buffer[buffer_front_pos+2] = position[2];
@@ -181,9 +198,15 @@ public:
             smoothed.swap(track_buffer);
         }
 
-        return get_buffer_size() >= param.min_points_count3 &&
-               roi_mgr.have_include(get_result(),get_buffer_size()) &&
-               roi_mgr.fulfill_end_point(position,end_point1);
+        if(get_buffer_size() < param.min_points_count3)
+            failure = too_short_failure;
+        else
+        if(!roi_mgr.have_include(get_result(),get_buffer_size()))
+            failure = no_roi_failure;
+        else
+        if(!roi_mgr.fulfill_end_point(position,end_point1))
+            failure = no_end_failure;
+        return failure == no_failure;
 
 
 	}
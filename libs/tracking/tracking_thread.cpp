@@ -20,7 +20,18 @@ void ThreadData::end_thread(void)
         for(int i = 0;i < threads.size();++i)
             threads[i]->wait();
         threads.clear();
+        joinning = false;
     }
+    profile.reset();
+}
+
+namespace {
+// items of the tracking profile
+enum {seed_item = 0,init_item,init_failed_item,tracking_item,
+      excluded_item,too_long_item,too_short_item,no_roi_item,no_end_item,
+      other_item,ending_item,accepted_item};
+const unsigned char failure_item[] = {other_item,excluded_item,too_long_item,
+                                      too_short_item,no_roi_item,no_end_item};
 }
 
 void ThreadData::run_thread(TrackingMethod* method_ptr,unsigned int thread_count,unsigned int thread_id,unsigned int max_count)
@@ -29,6 +40,7 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,unsigned int thread_count
     std::uniform_real_distribution<float> rand_gen(0,1);
     unsigned int iteration = thread_id; // for center seed
     float white_matter_t = method_ptr->param.threshold*1.2;
+    profile_table& prof = *profile;
     if(!seeds.empty())
     try{
         std::vector<std::vector<float> > local_track_buffer;
@@ -41,12 +53,16 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,unsigned int thread_count
             if(!pushing_data && (iteration & 0x00000FFF) == 0x00000FFF && !local_track_buffer.empty())
                 push_tracts(local_track_buffer);
             ++seed_count[thread_id];
+            prof.count(thread_id,seed_item);
+            long long t = prof.tic();
             if(center_seed)
             {
                 if(!method->init(initial_direction,
                                  image::vector<3,float>(seeds[iteration].x(),seeds[iteration].y(),seeds[iteration].z()),
                                  seed))
                 {
+                    prof.toc(thread_id,init_item,t);
+                    prof.count(thread_id,init_failed_item);
                     iteration+=thread_count;
                     continue;
                 }
@@ -64,17 +80,30 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,unsigned int thread_count
                 pos[1] = (float)seeds[i].y() + rand_gen(seed)-0.5;
                 pos[2] = (float)seeds[i].z() + rand_gen(seed)-0.5;
                 if(!method->init(initial_direction,pos,seed))
+                {
+                    prof.toc(thread_id,init_item,t);
+                    prof.count(thread_id,init_failed_item);
                     continue;
+                }
             }
+            prof.toc(thread_id,init_item,t);
+            t = prof.tic();
             unsigned int point_count;
             const float *result = method->tracking(tracking_method,point_count);
+            prof.toc(thread_id,tracking_item,t);
             if(!result)
+            {
+                prof.count(thread_id,failure_item[method->failure]);
                 continue;
+            }
             const float* end = result+point_count+point_count+point_count;
             if(check_ending)
             {
                 if(point_count < 2)
+                {
+                    prof.count(thread_id,ending_item);
                     continue;
+                }
                 image::vector<3> p0(result),p1(result+3),p2(end-6),p3(end-3);
                 p1 -= p0;
                 p0 -= p1;
@@ -82,9 +111,13 @@ void ThreadData::run_thread(TrackingMethod* method_ptr,unsigned int thread_count
                 p3 -= p2;
                 if(method->trk.is_white_matter(p0,white_matter_t) ||
                    method->trk.is_white_matter(p3,white_matter_t))
+                {
+                    prof.count(thread_id,ending_item);
                     continue;
+                }
             }
             ++tract_count[thread_id];
+            prof.count(thread_id,accepted_item);
             local_track_buffer.push_back(std::vector<float>(result,end));
         }
         push_tracts(local_track_buffer);
@@ -208,6 +241,10 @@ void ThreadData::run(const tracking_data& trk,
     end_thread();
     if(thread_count > termination_count)
         thread_count = termination_count;
+    profile.reset(new profile_table("tracking",thread_count,
+        {"seed","init","init_failed","tracking",
+         "rejected_roa","rejected_too_long","rejected_too_short","rejected_roi","rejected_end_region",
+         "rejected_other","rejected_ending","accepted"}));
     unsigned int run_count = std::max<int>(1,termination_count/thread_count);
     unsigned int total_run_count = 0;
     for (unsigned int index = 0;index < thread_count-1;++index,total_run_count += run_count)
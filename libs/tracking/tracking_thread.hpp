@@ -9,6 +9,7 @@
 #include "tracking_method.hpp"
 #include "fib_data.hpp"
 #include "tract_model.hpp"
+#include "utility/profile.hpp"
 
 struct ThreadData
 {
@@ -47,11 +48,16 @@ public:
     {
         end_thread();
     }
+    void reset_seed(unsigned int value = 0)
+    {
+        seed.seed(value);
+    }
 public:
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> seed_count;
     std::vector<unsigned int> tract_count;
     std::vector<unsigned char> running;
+    std::shared_ptr<profile_table> profile;// seed outcomes of each thread
     bool joinning,pushing_data;
     std::mutex  lock_feed_function,lock_seed_function;
     unsigned int get_total_seed_count(void)const
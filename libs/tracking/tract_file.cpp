@@ -0,0 +1,326 @@
+#include <cstring>
+#include <algorithm>
+#include "tract_file.hpp"
+#include "gzip_interface.hpp"
+
+static const char tract_file_magic[8] = {'D','S','I','T','R','A','C','T'};
+
+bool is_tract_file(const char* file_name)
+{
+    std::string name(file_name);
+    return name.length() > 4 && name.substr(name.length()-4) == ".tti";
+}
+
+static void init_header(TractFileHeader& header,const image::geometry<3>& dim,const image::vector<3>& vs,
+                        bool compressed,unsigned int chunk_size)
+{
+    std::memset(&header,0,sizeof(header));
+    std::copy(tract_file_magic,tract_file_magic+8,header.magic);
+    header.version = 1;
+    header.flags = compressed ? 1:0;
+    std::copy(dim.begin(),dim.end(),header.dim);
+    std::copy(vs.begin(),vs.end(),header.vs);
+    header.chunk_size = std::max<unsigned int>(chunk_size,1);
+}
+
+static void get_record(const std::vector<float>& tract,unsigned int color,unsigned int cluster,
+                       TractFileRecord& record)
+{
+    record.point_count = tract.size()/3;
+    record.color = color;
+    record.cluster = cluster;
+    std::fill(record.bound,record.bound+6,0.0f);
+    if(tract.size() < 3)
+        return;
+    std::copy(tract.begin(),tract.begin()+3,record.bound);
+    std::copy(tract.begin(),tract.begin()+3,record.bound+3);
+    for(unsigned int index = 3;index+2 < tract.size();index += 3)
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            record.bound[d] = std::min<float>(record.bound[d],tract[index+d]);
+            record.bound[d+3] = std::max<float>(record.bound[d+3],tract[index+d]);
+        }
+}
+
+static void encode_chunk(const std::vector<float>& raw,bool compressed,std::vector<unsigned char>& stored)
+{
+    const unsigned char* raw_ptr = raw.empty() ? 0 : (const unsigned char*)&raw[0];
+    uLong raw_bytes = raw.size()*sizeof(float);
+    if(compressed && raw_bytes)
+    {
+        uLongf size = compressBound(raw_bytes);
+        stored.resize(size);
+        // a chunk that does not shrink is stored as is, so stored_size == raw bytes
+        // always means an uncompressed chunk
+        if(compress2(&stored[0],&size,raw_ptr,raw_bytes,1) == Z_OK && size < raw_bytes)
+        {
+            stored.resize(size);
+            return;
+        }
+    }
+    stored.assign(raw_ptr,raw_ptr+raw_bytes);
+}
+
+static void write_index(std::ofstream& out,TractFileHeader& header,
+                        const std::vector<TractFileChunk>& chunks,
+                        const std::vector<TractFileRecord>& records)
+{
+    header.index_offset = out.tellp();
+    header.chunk_count = chunks.size();
+    header.tract_count = records.size();
+    if(!chunks.empty())
+        out.write((const char*)&chunks[0],sizeof(TractFileChunk)*chunks.size());
+    if(!records.empty())
+        out.write((const char*)&records[0],sizeof(TractFileRecord)*records.size());
+    out.seekp(0,std::ios::beg);
+    out.write((const char*)&header,sizeof(header));
+}
+
+bool TractFileWriter::open(const char* file_name,const image::geometry<3>& dim,const image::vector<3>& vs,
+                           bool compressed,unsigned int chunk_size)
+{
+    close();
+    out.open(file_name,std::ios::binary);
+    if(!out)
+        return false;
+    init_header(header,dim,vs,compressed,chunk_size);
+    out.write((const char*)&header,sizeof(header));
+    return out.good();
+}
+
+void TractFileWriter::flush_chunk(void)
+{
+    if(buffer_records.empty())
+        return;
+    std::vector<unsigned char> stored;
+    encode_chunk(buffer,header.flags & 1,stored);
+    TractFileChunk chunk;
+    chunk.offset = out.tellp();
+    chunk.stored_size = stored.size();
+    chunk.raw_size = buffer.size();
+    if(!stored.empty())
+        out.write((const char*)&stored[0],stored.size());
+    for(unsigned int index = 0;index < buffer_records.size();++index)
+        buffer_records[index].chunk = chunks.size();
+    chunks.push_back(chunk);
+    records.insert(records.end(),buffer_records.begin(),buffer_records.end());
+    buffer.clear();
+    buffer_records.clear();
+}
+
+void TractFileWriter::add(const std::vector<float>& tract,unsigned int color,unsigned int cluster)
+{
+    TractFileRecord record;
+    get_record(tract,color,cluster,record);
+    std::lock_guard<std::mutex> lock(add_mutex);
+    if(!out.is_open())
+        return;
+    record.offset = buffer.size();
+    record.point_count = tract.size()/3;
+    buffer.insert(buffer.end(),tract.begin(),tract.begin()+record.point_count*3);
+    buffer_records.push_back(record);
+    if(buffer_records.size() >= header.chunk_size)
+        flush_chunk();
+}
+
+void TractFileWriter::add(const std::vector<std::vector<float> >& tracts,unsigned int color)
+{
+    for(unsigned int index = 0;index < tracts.size();++index)
+        add(tracts[index],color);
+}
+
+bool TractFileWriter::close(void)
+{
+    std::lock_guard<std::mutex> lock(add_mutex);
+    if(!out.is_open())
+        return false;
+    flush_chunk();
+    write_index(out,header,chunks,records);
+    bool result = out.good();
+    out.close();
+    chunks.clear();
+    records.clear();
+    return result;
+}
+
+bool TractFileWriter::save(const char* file_name,const image::geometry<3>& dim,const image::vector<3>& vs,
+                           const std::vector<std::vector<float> >& tracts,
+                           const std::vector<unsigned int>& color,
+                           const std::vector<unsigned int>& cluster)
+{
+    std::ofstream out(file_name,std::ios::binary);
+    if(!out)
+        return false;
+    TractFileHeader header;
+    init_header(header,dim,vs,true,4096);
+    out.write((const char*)&header,sizeof(header));
+
+    unsigned int chunk_count = (tracts.size()+header.chunk_size-1)/header.chunk_size;
+    std::vector<TractFileRecord> records(tracts.size());
+    std::vector<TractFileChunk> chunks(chunk_count);
+    std::vector<std::vector<unsigned char> > stored(chunk_count);
+    image::par_for(chunk_count,[&](int chunk)
+    {
+        unsigned int from = chunk*header.chunk_size;
+        unsigned int to = std::min<unsigned int>(from+header.chunk_size,tracts.size());
+        std::vector<float> raw;
+        for(unsigned int index = from;index < to;++index)
+        {
+            get_record(tracts[index],index < color.size() ? color[index]:0,
+                       index < cluster.size() ? cluster[index]:0,records[index]);
+            records[index].chunk = chunk;
+            records[index].offset = raw.size();
+            raw.insert(raw.end(),tracts[index].begin(),tracts[index].begin()+records[index].point_count*3);
+        }
+        chunks[chunk].raw_size = raw.size();
+        encode_chunk(raw,true,stored[chunk]);
+        chunks[chunk].stored_size = stored[chunk].size();
+    });
+    for(unsigned int chunk = 0;chunk < chunk_count;++chunk)
+    {
+        chunks[chunk].offset = out.tellp();
+        if(!stored[chunk].empty())
+            out.write((const char*)&stored[chunk][0],stored[chunk].size());
+        std::vector<unsigned char>().swap(stored[chunk]);
+    }
+    write_index(out,header,chunks,records);
+    return out.good();
+}
+
+bool TractFileReader::open(const char* file_name)
+{
+    ptr = 0;
+    file_buf.clear();
+    if(file.isOpen())
+        file.close();
+    file.setFileName(file_name);
+    if(!file.open(QIODevice::ReadOnly) || file.size() < (qint64)sizeof(header))
+        return false;
+    ptr = file.map(0,file.size());
+    if(!ptr)
+    {
+        file_buf.resize(file.size());
+        if(file.read((char*)&file_buf[0],file.size()) != file.size())
+            return false;
+        ptr = &file_buf[0];
+    }
+    unsigned long long file_size = file.size();
+    std::memcpy(&header,ptr,sizeof(header));
+    if(!std::equal(tract_file_magic,tract_file_magic+8,header.magic) ||
+        header.index_offset +
+        (unsigned long long)header.chunk_count*sizeof(TractFileChunk) +
+        (unsigned long long)header.tract_count*sizeof(TractFileRecord) > file_size)
+        return false;
+    chunks.resize(header.chunk_count);
+    records.resize(header.tract_count);
+    const unsigned char* index_ptr = ptr + header.index_offset;
+    if(!chunks.empty())
+        std::memcpy(&chunks[0],index_ptr,sizeof(TractFileChunk)*chunks.size());
+    index_ptr += sizeof(TractFileChunk)*chunks.size();
+    if(!records.empty())
+        std::memcpy(&records[0],index_ptr,sizeof(TractFileRecord)*records.size());
+    for(unsigned int index = 0;index < chunks.size();++index)
+        if(chunks[index].offset > header.index_offset ||
+           chunks[index].stored_size > header.index_offset - chunks[index].offset)
+            return false;
+    for(unsigned int index = 0;index < records.size();++index)
+        if(records[index].chunk >= chunks.size() ||
+           (unsigned long long)records[index].offset + (unsigned long long)records[index].point_count*3 > chunks[records[index].chunk].raw_size)
+            return false;
+    return true;
+}
+
+bool TractFileReader::read_chunk(unsigned int chunk,std::vector<float>& buf) const
+{
+    const TractFileChunk& c = chunks[chunk];
+    buf.resize(c.raw_size);
+    if(buf.empty())
+        return true;
+    uLongf raw_bytes = c.raw_size*sizeof(float);
+    if(c.stored_size == raw_bytes)// stored without compression
+    {
+        std::memcpy(&buf[0],ptr + c.offset,raw_bytes);
+        return true;
+    }
+    return uncompress((unsigned char*)&buf[0],&raw_bytes,ptr + c.offset,c.stored_size) == Z_OK &&
+           raw_bytes == c.raw_size*sizeof(float);
+}
+
+bool TractFileReader::read(unsigned int index,std::vector<float>& tract) const
+{
+    if(index >= records.size())
+        return false;
+    const TractFileRecord& r = records[index];
+    const TractFileChunk& c = chunks[r.chunk];
+    if(c.stored_size == c.raw_size*sizeof(float))
+    {
+        const float* from = (const float*)(ptr + c.offset) + r.offset;
+        tract.resize(r.point_count*3);
+        if(!tract.empty())
+            std::memcpy(&tract[0],from,tract.size()*sizeof(float));
+        return true;
+    }
+    std::vector<float> buf;
+    if(!read_chunk(r.chunk,buf))
+        return false;
+    tract.assign(buf.begin()+r.offset,buf.begin()+r.offset+r.point_count*3);
+    return true;
+}
+
+bool TractFileReader::read(const std::vector<unsigned int>& index,std::vector<std::vector<float> >& tracts) const
+{
+    tracts.clear();
+    tracts.resize(index.size());
+    // group the requests by chunk so that each chunk is decoded once
+    std::vector<std::vector<unsigned int> > chunk_request(chunks.size());
+    for(unsigned int i = 0;i < index.size();++i)
+    {
+        if(index[i] >= records.size())
+            return false;
+        chunk_request[records[index[i]].chunk].push_back(i);
+    }
+    std::vector<unsigned int> request_chunks;
+    for(unsigned int chunk = 0;chunk < chunk_request.size();++chunk)
+        if(!chunk_request[chunk].empty())
+            request_chunks.push_back(chunk);
+    std::vector<unsigned char> failed(request_chunks.size());
+    image::par_for(request_chunks.size(),[&](int i)
+    {
+        unsigned int chunk = request_chunks[i];
+        std::vector<float> buf;
+        if(!read_chunk(chunk,buf))
+        {
+            failed[i] = 1;
+            return;
+        }
+        for(unsigned int j = 0;j < chunk_request[chunk].size();++j)
+        {
+            unsigned int k = chunk_request[chunk][j];
+            const TractFileRecord& r = records[index[k]];
+            tracts[k].assign(buf.begin()+r.offset,buf.begin()+r.offset+r.point_count*3);
+        }
+    });
+    return std::find(failed.begin(),failed.end(),1) == failed.end();
+}
+
+bool TractFileReader::read_all(std::vector<std::vector<float> >& tracts) const
+{
+    std::vector<unsigned int> index(records.size());
+    for(unsigned int i = 0;i < index.size();++i)
+        index[i] = i;
+    return read(index,tracts);
+}
+
+void TractFileReader::query(const image::vector<3,float>& from,const image::vector<3,float>& to,
+                            std::vector<unsigned int>& index) const
+{
+    index.clear();
+    for(unsigned int i = 0;i < records.size();++i)
+    {
+        const float* b = records[i].bound;
+        if(b[0] <= to[0] && b[3] >= from[0] &&
+           b[1] <= to[1] && b[4] >= from[1] &&
+           b[2] <= to[2] && b[5] >= from[2])
+            index.push_back(i);
+    }
+}
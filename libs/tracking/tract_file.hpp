@@ -0,0 +1,99 @@
+#ifndef TRACT_FILE_HPP
+#define TRACT_FILE_HPP
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <QFile>
+#include "image/image.hpp"
+
+/*
+    Native indexed tract file (*.tti)
+
+    header (64 bytes)
+    chunks: the coordinates (voxel space, float) of up to chunk_size tracts,
+            optionally zlib-compressed
+    index (at header.index_offset): TractFileChunk[chunk_count]
+                                    TractFileRecord[tract_count]
+ */
+struct TractFileHeader
+{
+    char magic[8];              // "DSITRACT"
+    unsigned long long index_offset;
+    unsigned int version;
+    unsigned int flags;         // 1: compressed chunks
+    unsigned int dim[3];
+    float vs[3];
+    unsigned int chunk_size;    // maximum number of tracts in a chunk
+    unsigned int tract_count;
+    unsigned int chunk_count;
+    char reserved[4];
+};
+
+struct TractFileChunk
+{
+    unsigned long long offset;  // file offset
+    unsigned int stored_size;   // bytes in file
+    unsigned int raw_size;      // number of floats
+};
+
+struct TractFileRecord
+{
+    unsigned int chunk;
+    unsigned int offset;        // first float of the tract in the decoded chunk
+    unsigned int point_count;
+    unsigned int color;
+    unsigned int cluster;
+    float bound[6];             // min x,y,z max x,y,z
+};
+
+bool is_tract_file(const char* file_name);
+
+// Writes tracts as they come. add() can be called from several threads; the
+// index is written by close().
+class TractFileWriter
+{
+    std::ofstream out;
+    TractFileHeader header;
+    std::vector<TractFileChunk> chunks;
+    std::vector<TractFileRecord> records;
+    std::vector<float> buffer;
+    std::vector<TractFileRecord> buffer_records;
+    std::mutex add_mutex;
+    void flush_chunk(void);
+public:
+    ~TractFileWriter(void){close();}
+    bool open(const char* file_name,const image::geometry<3>& dim,const image::vector<3>& vs,
+              bool compressed = true,unsigned int chunk_size = 4096);
+    void add(const std::vector<float>& tract,unsigned int color = 0,unsigned int cluster = 0);
+    void add(const std::vector<std::vector<float> >& tracts,unsigned int color = 0);
+    bool close(void);
+    // encodes the chunks in parallel
+    static bool save(const char* file_name,const image::geometry<3>& dim,const image::vector<3>& vs,
+                     const std::vector<std::vector<float> >& tracts,
+                     const std::vector<unsigned int>& color,
+                     const std::vector<unsigned int>& cluster);
+};
+
+// Memory-maps the file and decodes only the chunks of the requested tracts.
+class TractFileReader
+{
+    QFile file;
+    const unsigned char* ptr = 0;
+    std::vector<unsigned char> file_buf;// used if the file cannot be mapped
+    bool read_chunk(unsigned int chunk,std::vector<float>& buf) const;
+public:
+    TractFileHeader header;
+    std::vector<TractFileChunk> chunks;
+    std::vector<TractFileRecord> records;
+public:
+    bool open(const char* file_name);
+    unsigned int size(void) const{return records.size();}
+    bool read(unsigned int index,std::vector<float>& tract) const;
+    bool read(const std::vector<unsigned int>& index,std::vector<std::vector<float> >& tracts) const;
+    bool read_all(std::vector<std::vector<float> >& tracts) const;
+    // tracts whose bounding box intersects [from,to]
+    void query(const image::vector<3,float>& from,const image::vector<3,float>& to,
+               std::vector<unsigned int>& index) const;
+};
+
+#endif//TRACT_FILE_HPP
@@ -0,0 +1,289 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "tract_geometry.hpp"
+#include "tract_lod.hpp"
+
+void make_tract_geometry(const float* data_iter,unsigned int vertex_count,
+                         const std::vector<image::vector<3,float> >& color,
+                         const TractRenderParam& param,
+                         TractGeometry& geo)
+{
+    geo.clear();
+    if (vertex_count <= 1)
+        return;
+    std::vector<image::vector<3,float> > points(8),previous_points(8),
+                                      normals(8),previous_normals(8);
+    image::vector<3,float> last_pos(data_iter),pos,
+        vec_a(1,0,0),vec_b(0,1,0),
+        vec_n,prev_vec_n,vec_ab,vec_ba,cur_color,previous_color;
+    if(color.size() == 1)
+        cur_color = color[0];
+    geo.begin_strip();
+    for (unsigned int index = 0; index < vertex_count;data_iter += 3, ++index)
+    {
+        pos[0] = data_iter[0];
+        pos[1] = data_iter[1];
+        pos[2] = data_iter[2];
+        if (index + 1 < vertex_count)
+        {
+            vec_n[0] = data_iter[3] - data_iter[0];
+            vec_n[1] = data_iter[4] - data_iter[1];
+            vec_n[2] = data_iter[5] - data_iter[2];
+            vec_n.normalize();
+        }
+
+        if(color.empty())//directional
+        {
+            cur_color[0] = std::fabs(vec_n[0]);
+            cur_color[1] = std::fabs(vec_n[1]);
+            cur_color[2] = std::fabs(vec_n[2]);
+        }
+        else
+            if(color.size() > 1 && index < color.size())// local
+                cur_color = color[index];
+
+        if(!param.tube)
+        {
+            geo.add(pos,image::vector<3,float>(),cur_color);
+            continue;
+        }
+        // skip straight line!
+        if (index != 0 && index+1 != vertex_count)
+        {
+            image::vector<3,float> displacement(data_iter+3);
+            displacement -= last_pos;
+            displacement -= prev_vec_n*(prev_vec_n*displacement);
+            if (displacement.length() < param.tube_detail)
+                continue;
+        }
+
+        if (index == 0 && std::fabs(vec_a*vec_n) > 0.5)
+            std::swap(vec_a,vec_b);
+
+        vec_b = vec_a.cross_product(vec_n);
+        vec_a = vec_n.cross_product(vec_b);
+        vec_a.normalize();
+        vec_b.normalize();
+        vec_ba = vec_ab = vec_a;
+        vec_ab += vec_b;
+        vec_ba -= vec_b;
+        vec_ab.normalize();
+        vec_ba.normalize();
+        // get normals
+        {
+            normals[0] = vec_a;
+            normals[1] = vec_ab;
+            normals[2] = vec_b;
+            normals[3] = -vec_ba;
+            normals[4] = -vec_a;
+            normals[5] = -vec_ab;
+            normals[6] = -vec_b;
+            normals[7] = vec_ba;
+        }
+        vec_ab *= param.tube_diameter;
+        vec_ba *= param.tube_diameter;
+        vec_a *= param.tube_diameter;
+        vec_b *= param.tube_diameter;
+
+        // add point
+        {
+            std::fill(points.begin(),points.end(),pos);
+            points[0] += vec_a;
+            points[1] += vec_ab;
+            points[2] += vec_b;
+            points[3] -= vec_ba;
+            points[4] -= vec_a;
+            points[5] -= vec_ab;
+            points[6] -= vec_b;
+            points[7] += vec_ba;
+        }
+        // add end
+        static const unsigned char end_sequence[8] = {4,3,5,2,6,1,7,0};
+        if (index == 0)
+        {
+            image::vector<3,float> shift(vec_n);
+            shift *= param.show_end_points ? -(int)param.end_point_shift : 0;
+            for (unsigned int k = 0;k < 8;++k)
+            {
+                image::vector<3,float> cur_point = points[end_sequence[k]];
+                cur_point += shift;
+                geo.add(cur_point,-vec_n,cur_color);
+            }
+            // only the end caps are drawn
+            if(param.show_end_points)
+                geo.end_strip();
+        }
+        else
+        // add tube
+        {
+            if(!param.show_end_points)
+            {
+                geo.add(points[0],normals[0],cur_color);
+                for (unsigned int k = 1;k < 8;++k)
+                {
+                    geo.add(previous_points[k],previous_normals[k],previous_color);
+                    geo.add(points[k],normals[k],cur_color);
+                }
+                geo.add(points[0],normals[0],cur_color);
+            }
+            if(index +1 == vertex_count)
+            {
+                if(param.show_end_points)
+                    geo.begin_strip();
+                image::vector<3,float> shift(vec_n);
+                shift *= param.show_end_points ? (int)param.end_point_shift : 0;
+                for (int k = 7;k >= 0;--k)
+                {
+                    image::vector<3,float> cur_point = points[end_sequence[k]];
+                    cur_point += shift;
+                    geo.add(cur_point,vec_n,cur_color);
+                }
+            }
+        }
+
+        previous_points.swap(points);
+        previous_normals.swap(normals);
+        previous_color = cur_color;
+        prev_vec_n = vec_n;
+        last_pos = pos;
+    }
+    geo.end_strip();
+}
+
+static unsigned int tract_checksum(const float* data,unsigned int vertex_count,
+                                   const std::vector<image::vector<3,float> >& color)
+{
+    unsigned int sum = 2166136261u;
+    auto add = [&sum](const float* from,unsigned int count)
+    {
+        for(unsigned int index = 0;index < count;++index)
+        {
+            unsigned int value;
+            std::memcpy(&value,from+index,sizeof(value));
+            sum = (sum ^ value)*16777619u;
+        }
+    };
+    add(data,vertex_count*3);
+    sum = (sum ^ color.size())*16777619u;
+    if(!color.empty())
+        add(color[0].begin(),color.size()*3);
+    return sum;
+}
+
+static void build_tract(const float* data,unsigned int vertex_count,
+                        const std::vector<image::vector<3,float> >& color,
+                        const TractRenderParam& param,
+                        TractGeometry& geo)
+{
+    std::vector<unsigned int> kept;
+    simplify_tract(data,vertex_count,param.simplify_error,kept);
+    if(kept.size() < vertex_count)
+    {
+        std::vector<float> points(kept.size()*3);
+        std::vector<image::vector<3,float> > kept_color(color.size() > 1 ? kept.size() : color.size());
+        for(unsigned int i = 0;i < kept.size();++i)
+        {
+            std::copy(data+kept[i]*3,data+kept[i]*3+3,points.begin()+i*3);
+            if(color.size() > 1)
+                kept_color[i] = color[std::min<unsigned int>(kept[i],color.size()-1)];
+        }
+        if(color.size() == 1)
+            kept_color[0] = color[0];
+        make_tract_geometry(&points[0],kept.size(),kept_color,param,geo);
+    }
+    else
+        make_tract_geometry(data,vertex_count,color,param,geo);
+}
+
+unsigned int TractGeometryCache::update(const std::vector<const float*>& data,
+                                        const std::vector<unsigned int>& vertex_count,
+                                        const std::vector<std::vector<image::vector<3,float> > >& color,
+                                        const TractRenderParam& new_param,
+                                        compile_type compile,release_type release)
+{
+    std::vector<tract_key> keys(data.size());
+    image::par_for(data.size(),[&](int index)
+    {
+        keys[index].data = data[index];
+        keys[index].vertex_count = vertex_count[index];
+        keys[index].checksum = tract_checksum(data[index],vertex_count[index],color[index]);
+    });
+    // a block ends after about one in 256 tracts, and has at most 1024
+    std::vector<block_type> new_blocks;
+    std::vector<unsigned int> block_begin;
+    for(unsigned int index = 0;index < keys.size();++index)
+    {
+        if(new_blocks.empty() ||
+           (new_blocks.back().tracts.back().checksum & 255) == 0 ||
+           new_blocks.back().tracts.size() >= 1024)
+        {
+            new_blocks.push_back(block_type());
+            new_blocks.back().handle = 0;
+            block_begin.push_back(index);
+        }
+        new_blocks.back().tracts.push_back(keys[index]);
+    }
+
+    // reuse the blocks with the same tracts
+    std::map<const float*,unsigned int> previous;
+    if(has_param && param == new_param)
+        for(unsigned int index = 0;index < blocks.size();++index)
+            previous[blocks[index].tracts[0].data] = index;
+    std::vector<unsigned char> reused(blocks.size());
+    std::vector<unsigned int> rebuild;
+    for(unsigned int index = 0;index < new_blocks.size();++index)
+    {
+        auto iter = previous.find(new_blocks[index].tracts[0].data);
+        if(iter != previous.end() && !reused[iter->second] &&
+           blocks[iter->second].tracts == new_blocks[index].tracts)
+        {
+            new_blocks[index].handle = blocks[iter->second].handle;
+            reused[iter->second] = 1;
+        }
+        else
+            rebuild.push_back(index);
+    }
+    for(unsigned int index = 0;index < blocks.size();++index)
+        if(!reused[index])
+            release(blocks[index].handle);
+    blocks.swap(new_blocks);
+    param = new_param;
+    has_param = true;
+
+    // build about 65536 tracts at a time and keep them only until compiled
+    unsigned int rebuilt = 0;
+    for(unsigned int from = 0;from < rebuild.size();)
+    {
+        std::vector<std::pair<unsigned int,unsigned int> > batch;// block and tract
+        unsigned int to = from;
+        for(;to < rebuild.size() && batch.size() < 65536;++to)
+            for(unsigned int j = 0;j < blocks[rebuild[to]].tracts.size();++j)
+                batch.push_back(std::make_pair(to-from,j));
+        std::vector<std::vector<TractGeometry> > geo(to-from);
+        for(unsigned int k = from;k < to;++k)
+            geo[k-from].resize(blocks[rebuild[k]].tracts.size());
+        image::par_for(batch.size(),[&](int i)
+        {
+            unsigned int index = block_begin[rebuild[from+batch[i].first]]+batch[i].second;
+            build_tract(data[index],vertex_count[index],color[index],param,
+                        geo[batch[i].first][batch[i].second]);
+        });
+        for(unsigned int k = from;k < to;++k)
+        {
+            blocks[rebuild[k]].handle = compile(geo[k-from]);
+            std::vector<TractGeometry>().swap(geo[k-from]);
+        }
+        rebuilt += batch.size();
+        from = to;
+    }
+    return rebuilt;
+}
+
+void TractGeometryCache::clear(release_type release)
+{
+    for(unsigned int index = 0;index < blocks.size();++index)
+        release(blocks[index].handle);
+    blocks.clear();
+    has_param = false;
+}
@@ -0,0 +1,107 @@
+#ifndef TRACT_GEOMETRY_HPP
+#define TRACT_GEOMETRY_HPP
+#include <vector>
+#include <map>
+#include <functional>
+#include "image/image.hpp"
+
+struct TractRenderParam
+{
+    bool tube;              // triangle strips of tubes, otherwise line strips
+    bool show_end_points;   // draw only the two end caps
+    float tube_diameter;
+    float tube_detail;      // cross sections closer than this to a straight line are skipped
+    float end_point_shift;
+    float simplify_error;   // Douglas-Peucker error bound, 0 to keep all points
+    float alpha;            // applied to the colors when compiled
+    bool operator==(const TractRenderParam& rhs) const
+    {
+        return tube == rhs.tube && show_end_points == rhs.show_end_points &&
+               tube_diameter == rhs.tube_diameter && tube_detail == rhs.tube_detail &&
+               end_point_shift == rhs.end_point_shift && simplify_error == rhs.simplify_error &&
+               alpha == rhs.alpha;
+    }
+};
+
+// packed vertex, normal, and color (rgb) arrays of one tract. Strip i uses
+// strip_count[i] vertices starting at strip_begin[i].
+class TractGeometry
+{
+public:
+    std::vector<float> vertex,normal,color;
+    std::vector<unsigned int> strip_begin,strip_count;
+public:
+    unsigned int size(void) const{return vertex.size()/3;}
+    void clear(void)
+    {
+        vertex.clear();
+        normal.clear();
+        color.clear();
+        strip_begin.clear();
+        strip_count.clear();
+    }
+    void begin_strip(void)
+    {
+        strip_begin.push_back(size());
+    }
+    void end_strip(void)
+    {
+        if(strip_begin.size() > strip_count.size())
+            strip_count.push_back(size()-strip_begin.back());
+    }
+    void add(const image::vector<3,float>& v,const image::vector<3,float>& n,const image::vector<3,float>& c)
+    {
+        vertex.insert(vertex.end(),v.begin(),v.end());
+        normal.insert(normal.end(),n.begin(),n.end());
+        color.insert(color.end(),c.begin(),c.end());
+    }
+};
+
+// color: empty for directional color, one color for the whole tract, or one
+// color for each point
+void make_tract_geometry(const float* data,unsigned int vertex_count,
+                         const std::vector<image::vector<3,float> >& color,
+                         const TractRenderParam& param,
+                         TractGeometry& geo);
+
+// Keeps the compiled blocks of the last update and only rebuilds blocks with
+// tracts whose coordinates, colors, or rendering parameters changed. A block
+// ends after a tract chosen by its checksum, so removing or adding tracts only
+// changes the blocks around them. The geometry is built in parallel, handed to
+// compile (e.g. a display list) on the calling thread, and then released, so
+// no copy stays in memory.
+class TractGeometryCache
+{
+public:
+    typedef std::function<unsigned int(const std::vector<TractGeometry>&)> compile_type;
+    typedef std::function<void(unsigned int)> release_type;
+private:
+    struct tract_key{
+        const float* data;
+        unsigned int vertex_count;
+        unsigned int checksum;// of the coordinates and colors
+        bool operator==(const tract_key& rhs) const
+        {
+            return data == rhs.data && vertex_count == rhs.vertex_count && checksum == rhs.checksum;
+        }
+    };
+    struct block_type{
+        std::vector<tract_key> tracts;
+        unsigned int handle;
+    };
+    TractRenderParam param;
+    bool has_param = false;
+    std::vector<block_type> blocks;
+public:
+    // returns the number of tracts rebuilt
+    unsigned int update(const std::vector<const float*>& data,
+                        const std::vector<unsigned int>& vertex_count,
+                        const std::vector<std::vector<image::vector<3,float> > >& color,
+                        const TractRenderParam& param,
+                        compile_type compile,release_type release);
+    unsigned int size(void) const{return blocks.size();}
+    unsigned int operator[](unsigned int index) const{return blocks[index].handle;}
+    void clear(release_type release);
+};
+
+#endif//TRACT_GEOMETRY_HPP
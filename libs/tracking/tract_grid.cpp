@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <cmath>
+#include "tract_grid.hpp"
+
+void TractGrid::clear(void)
+{
+    entries.clear();
+    cell_begin.clear();
+    source.clear();
+    max_step = 0.0f;
+}
+
+bool TractGrid::is_valid(const std::vector<std::vector<float> >& tracts) const
+{
+    if(empty() || source.size() != tracts.size())
+        return false;
+    for(unsigned int index = 0;index < tracts.size();++index)
+        if(source[index].first != tracts[index].data() ||
+           source[index].second != tracts[index].size())
+            return false;
+    return true;
+}
+
+unsigned int TractGrid::get_cell(const float* p) const
+{
+    unsigned int c[3];
+    for(unsigned int d = 0;d < 3;++d)
+    {
+        float v = std::floor(p[d]/(float)cell_size);
+        c[d] = !(v > 0.0f) ? 0 : (v >= (float)(dim[d]-1) ? dim[d]-1 : (unsigned int)v);
+    }
+    return c[0] + (c[1] + c[2]*dim[1])*dim[0];
+}
+
+void TractGrid::get_cell_range(unsigned int cell,image::vector<3,float>& from,image::vector<3,float>& to) const
+{
+    unsigned int c[3] = {cell % dim[0],(cell/dim[0]) % dim[1],cell/(dim[0]*dim[1])};
+    for(unsigned int d = 0;d < 3;++d)
+    {
+        from[d] = c[d]*cell_size;
+        to[d] = (c[d]+1)*cell_size;
+        if(c[d] == 0)
+            from[d] = std::min<float>(from[d],bound_min[d]);
+        if(c[d]+1 == dim[d])
+            to[d] = std::max<float>(to[d],bound_max[d]);
+    }
+}
+
+void TractGrid::add_entries(const std::vector<std::vector<float> >& tracts,const std::vector<unsigned int>& index,
+                            std::vector<TractGridEntry>& out_entries)
+{
+    std::vector<std::vector<TractGridEntry> > new_entries(index.size());
+    std::vector<float> step(index.size()),bound(index.size()*6);
+    image::par_for(index.size(),[&](int i)
+    {
+        const std::vector<float>& tract = tracts[index[i]];
+        unsigned int count = tract.size()/3;
+        if(!count)
+            return;
+        std::vector<TractGridEntry>& out = new_entries[i];
+        float* b = &bound[i*6];
+        std::copy(tract.begin(),tract.begin()+3,b);
+        std::copy(tract.begin(),tract.begin()+3,b+3);
+        float max_step2 = 0.0f;
+        for(unsigned int j = 0;j < count;++j)
+        {
+            const float* p = &tract[j*3];
+            unsigned int cell = get_cell(p);
+            if(out.empty() || out.back().cell != cell)
+            {
+                TractGridEntry e = {cell,index[i],j,j+1};
+                out.push_back(e);
+            }
+            else
+                ++out.back().to;
+            for(unsigned int d = 0;d < 3;++d)
+            {
+                b[d] = std::min<float>(b[d],p[d]);
+                b[d+3] = std::max<float>(b[d+3],p[d]);
+            }
+            if(j)
+            {
+                float dx = p[0]-p[-3],dy = p[1]-p[-2],dz = p[2]-p[-1];
+                max_step2 = std::max<float>(max_step2,dx*dx+dy*dy+dz*dz);
+            }
+        }
+        step[i] = std::sqrt(max_step2);
+    });
+    for(unsigned int i = 0;i < index.size();++i)
+    {
+        if(new_entries[i].empty())
+            continue;
+        out_entries.insert(out_entries.end(),new_entries[i].begin(),new_entries[i].end());
+        max_step = std::max<float>(max_step,step[i]);
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            bound_min[d] = std::min<float>(bound_min[d],bound[i*6+d]);
+            bound_max[d] = std::max<float>(bound_max[d],bound[i*6+d+3]);
+        }
+    }
+}
+
+// counting sort by cell, keeping the order within a cell
+void TractGrid::sort_entries(std::vector<TractGridEntry>& cell_entries,std::vector<unsigned int>& begin) const
+{
+    begin.clear();
+    begin.resize(dim.size()+1);
+    for(unsigned int i = 0;i < cell_entries.size();++i)
+        ++begin[cell_entries[i].cell+1];
+    for(unsigned int cell = 0;cell < dim.size();++cell)
+        begin[cell+1] += begin[cell];
+    std::vector<unsigned int> pos(begin.begin(),begin.end()-1);
+    std::vector<TractGridEntry> sorted(cell_entries.size());
+    for(unsigned int i = 0;i < cell_entries.size();++i)
+        sorted[pos[cell_entries[i].cell]++] = cell_entries[i];
+    cell_entries.swap(sorted);
+}
+
+void TractGrid::set_source(const std::vector<std::vector<float> >& tracts)
+{
+    source.resize(tracts.size());
+    for(unsigned int index = 0;index < tracts.size();++index)
+        source[index] = std::make_pair(tracts[index].data(),tracts[index].size());
+}
+
+void TractGrid::build(const std::vector<std::vector<float> >& tracts,const image::geometry<3>& geo)
+{
+    clear();
+    dim = image::geometry<3>(std::max<unsigned int>(1,(geo[0]+cell_size-1)/cell_size),
+                             std::max<unsigned int>(1,(geo[1]+cell_size-1)/cell_size),
+                             std::max<unsigned int>(1,(geo[2]+cell_size-1)/cell_size));
+    for(unsigned int d = 0;d < 3;++d)
+    {
+        bound_min[d] = 0.0f;
+        bound_max[d] = geo[d];
+    }
+    std::vector<unsigned int> index(tracts.size());
+    for(unsigned int i = 0;i < index.size();++i)
+        index[i] = i;
+    add_entries(tracts,index,entries);
+    sort_entries(entries,cell_begin);
+    set_source(tracts);
+}
+
+// The entries are already grouped by cell, so only the entries of the added
+// tracts are sorted, and each cell keeps its remaining entries followed by the
+// added ones in a single pass.
+void TractGrid::update(const std::vector<std::vector<float> >& tracts,
+                       const std::vector<unsigned int>& new_index,
+                       const std::vector<unsigned int>& added)
+{
+    if(empty())
+        return;
+    std::vector<TractGridEntry> added_entries;
+    std::vector<unsigned int> added_begin;
+    add_entries(tracts,added,added_entries);
+    sort_entries(added_entries,added_begin);
+    unsigned int cell_count = dim.size();
+    std::vector<unsigned int> new_begin(cell_count+1);
+    image::par_for(cell_count,[&](int cell)
+    {
+        unsigned int count = added_begin[cell+1]-added_begin[cell];
+        for(unsigned int i = cell_begin[cell];i < cell_begin[cell+1];++i)
+        {
+            entries[i].tract = new_index[entries[i].tract];
+            if(entries[i].tract != ~0u)
+                ++count;
+        }
+        new_begin[cell+1] = count;
+    });
+    for(unsigned int cell = 0;cell < cell_count;++cell)
+        new_begin[cell+1] += new_begin[cell];
+    std::vector<TractGridEntry> new_entries(new_begin.back());
+    image::par_for(cell_count,[&](int cell)
+    {
+        TractGridEntry* out = new_entries.data()+new_begin[cell];
+        for(unsigned int i = cell_begin[cell];i < cell_begin[cell+1];++i)
+            if(entries[i].tract != ~0u)
+                *out++ = entries[i];
+        std::copy(added_entries.begin()+added_begin[cell],added_entries.begin()+added_begin[cell+1],out);
+    });
+    entries.swap(new_entries);
+    cell_begin.swap(new_begin);
+    set_source(tracts);
+}
@@ -0,0 +1,68 @@
+#ifndef TRACT_GRID_HPP
+#define TRACT_GRID_HPP
+#include <vector>
+#include "image/image.hpp"
+
+// a run of consecutive points [from,to) of a tract inside one cell
+struct TractGridEntry
+{
+    unsigned int cell;
+    unsigned int tract;
+    unsigned int from,to;
+};
+
+// Sparse voxel grid over the tract points. The volume is divided into cells of
+// cell_size voxels, and each occupied cell lists the tract segments passing it,
+// so that an edit only visits the tracts near its query. Points outside the
+// volume are kept in the border cells.
+class TractGrid
+{
+    image::geometry<3> dim;// in cells
+    unsigned int cell_size = 8;
+    image::vector<3,float> bound_min,bound_max;// covers all points added so far
+    float max_step = 0.0f;// longest segment between two points
+    std::vector<TractGridEntry> entries;// grouped by cell
+    std::vector<unsigned int> cell_begin;
+    // data pointer and size of each tract, to detect changes made elsewhere
+    std::vector<std::pair<const float*,size_t> > source;
+private:
+    void add_entries(const std::vector<std::vector<float> >& tracts,const std::vector<unsigned int>& index,
+                     std::vector<TractGridEntry>& out_entries);
+    void sort_entries(std::vector<TractGridEntry>& cell_entries,std::vector<unsigned int>& begin) const;
+    void set_source(const std::vector<std::vector<float> >& tracts);
+public:
+    void clear(void);
+    bool empty(void) const{return cell_begin.empty();}
+    bool is_valid(const std::vector<std::vector<float> >& tracts) const;
+    void build(const std::vector<std::vector<float> >& tracts,const image::geometry<3>& geo);
+    // new_index[i] is the position of tract i after the edit, or ~0 if it was
+    // removed. added lists the positions of the inserted tracts.
+    void update(const std::vector<std::vector<float> >& tracts,
+                const std::vector<unsigned int>& new_index,
+                const std::vector<unsigned int>& added);
+public:
+    const image::geometry<3>& get_dim(void) const{return dim;}
+    unsigned int get_cell_size(void) const{return cell_size;}
+    float get_max_step(void) const{return max_step;}
+    unsigned int get_cell(const float* p) const;
+    // the region covered by a cell; border cells extend to the points outside the volume
+    void get_cell_range(unsigned int cell,image::vector<3,float>& from,image::vector<3,float>& to) const;
+    const TractGridEntry* begin(unsigned int cell) const{return entries.data()+cell_begin[cell];}
+    const TractGridEntry* end(unsigned int cell) const{return entries.data()+cell_begin[cell+1];}
+    // sets hit[i] for the tracts in the cells accepted by cell_filter(cell,from,to)
+    template<class fun_type>
+    void get_tracts(fun_type cell_filter,std::vector<unsigned char>& hit) const
+    {
+        image::vector<3,float> from,to;
+        for(unsigned int cell = 0;cell+1 < cell_begin.size();++cell)
+            if(cell_begin[cell] != cell_begin[cell+1])
+            {
+                get_cell_range(cell,from,to);
+                if(cell_filter(cell,from,to))
+                    for(unsigned int i = cell_begin[cell];i < cell_begin[cell+1];++i)
+                        hit[entries[i].tract] = 1;
+            }
+    }
+};
+
+#endif//TRACT_GRID_HPP
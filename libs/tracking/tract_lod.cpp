@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include "tract_lod.hpp"
+
+static float point_segment_distance2(const float* p,const float* a,const float* b)
+{
+    float ab[3] = {b[0]-a[0],b[1]-a[1],b[2]-a[2]};
+    float ap[3] = {p[0]-a[0],p[1]-a[1],p[2]-a[2]};
+    float ab2 = ab[0]*ab[0]+ab[1]*ab[1]+ab[2]*ab[2];
+    float t = 0.0f;
+    if(ab2 > 0.0f)
+        t = std::min<float>(1.0f,std::max<float>(0.0f,(ap[0]*ab[0]+ap[1]*ab[1]+ap[2]*ab[2])/ab2));
+    float d[3] = {ap[0]-t*ab[0],ap[1]-t*ab[1],ap[2]-t*ab[2]};
+    return d[0]*d[0]+d[1]*d[1]+d[2]*d[2];
+}
+
+void simplify_tract(const float* data,unsigned int vertex_count,float max_error,
+                    std::vector<unsigned int>& kept)
+{
+    kept.clear();
+    if(vertex_count <= 2 || max_error <= 0.0f)
+    {
+        for(unsigned int index = 0;index < vertex_count;++index)
+            kept.push_back(index);
+        return;
+    }
+    float max_error2 = max_error*max_error;
+    std::vector<unsigned char> keep(vertex_count);
+    keep[0] = keep[vertex_count-1] = 1;
+    std::vector<std::pair<unsigned int,unsigned int> > segments;
+    segments.push_back(std::make_pair(0,vertex_count-1));
+    while(!segments.empty())
+    {
+        unsigned int from = segments.back().first;
+        unsigned int to = segments.back().second;
+        segments.pop_back();
+        if(to <= from+1)
+            continue;
+        float max_d2 = 0.0f;
+        unsigned int max_index = from;
+        for(unsigned int index = from+1;index < to;++index)
+        {
+            float d2 = point_segment_distance2(data+index*3,data+from*3,data+to*3);
+            if(d2 > max_d2)
+            {
+                max_d2 = d2;
+                max_index = index;
+            }
+        }
+        if(max_d2 <= max_error2)
+            continue;
+        keep[max_index] = 1;
+        segments.push_back(std::make_pair(from,max_index));
+        segments.push_back(std::make_pair(max_index,to));
+    }
+    for(unsigned int index = 0;index < vertex_count;++index)
+        if(keep[index])
+            kept.push_back(index);
+}
+
+static unsigned long long get_cell_key(const float* p,float cell_size)
+{
+    unsigned long long key = 0;
+    for(unsigned int d = 0;d < 3;++d)
+        key = (key << 21) | ((unsigned long long)((long long)std::floor(p[d]/cell_size)+(1 << 20)) & 0x1FFFFF);
+    return key;
+}
+
+static unsigned long long mix_key(unsigned long long key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+void get_tract_lod_order(const std::vector<std::vector<float> >& tracts,float cell_size,
+                         std::vector<unsigned int>& order)
+{
+    order.clear();
+    if(tracts.empty())
+        return;
+    if(cell_size <= 0.0f)
+        cell_size = 1.0f;
+    // (group hash, group key, tract index)
+    std::vector<std::pair<std::pair<unsigned long long,unsigned long long>,unsigned int> > items;
+    items.reserve(tracts.size());
+    for(unsigned int index = 0;index < tracts.size();++index)
+    {
+        const std::vector<float>& tract = tracts[index];
+        unsigned long long key = 0;
+        if(tract.size() >= 3)
+        {
+            unsigned long long key1 = get_cell_key(&tract[0],cell_size);
+            unsigned long long key2 = get_cell_key(&tract[tract.size()-3],cell_size);
+            if(key1 > key2)
+                std::swap(key1,key2);
+            key = mix_key(key1)^key2;
+        }
+        // visit groups in a scattered order so that a partial round is not spatially biased
+        items.push_back(std::make_pair(std::make_pair(mix_key(key),key),index));
+    }
+    std::sort(items.begin(),items.end());
+
+    std::vector<unsigned int> group_begin;
+    for(unsigned int index = 0;index < items.size();++index)
+        if(index == 0 || items[index].first != items[index-1].first)
+            group_begin.push_back(index);
+    group_begin.push_back(items.size());
+
+    // tract j of a group of n comes at j/n, so that any prefix takes from each
+    // group in proportion to its size, and every group starts at zero
+    struct rank_type{
+        unsigned int rank,group_size,group;
+        bool operator<(const rank_type& rhs) const
+        {
+            unsigned long long lhs_key = (unsigned long long)rank*rhs.group_size;
+            unsigned long long rhs_key = (unsigned long long)rhs.rank*group_size;
+            return lhs_key < rhs_key || (lhs_key == rhs_key && group < rhs.group);
+        }
+    };
+    std::vector<rank_type> ranks(items.size());
+    for(unsigned int g = 0;g+1 < group_begin.size();++g)
+        for(unsigned int i = group_begin[g];i < group_begin[g+1];++i)
+        {
+            ranks[i].rank = i-group_begin[g];
+            ranks[i].group_size = group_begin[g+1]-group_begin[g];
+            ranks[i].group = g;
+        }
+    std::vector<unsigned int> position(items.size());
+    for(unsigned int index = 0;index < position.size();++index)
+        position[index] = index;
+    std::sort(position.begin(),position.end(),[&ranks](unsigned int lhs,unsigned int rhs)
+    {
+        return ranks[lhs] < ranks[rhs];
+    });
+    order.resize(items.size());
+    for(unsigned int index = 0;index < position.size();++index)
+        order[index] = items[position[index]].second;
+}
+
+void TractLOD::update(const std::vector<std::vector<float> >& tracts,float cell_size_)
+{
+    bool valid = cell_size_ == cell_size && source.size() == tracts.size();
+    for(unsigned int index = 0;valid && index < tracts.size();++index)
+        if(source[index].first != tracts[index].data() ||
+           source[index].second != tracts[index].size())
+            valid = false;
+    if(valid)
+        return;
+    get_tract_lod_order(tracts,cell_size_,order);
+    source.resize(tracts.size());
+    for(unsigned int index = 0;index < tracts.size();++index)
+        source[index] = std::make_pair(tracts[index].data(),(unsigned int)tracts[index].size());
+    cell_size = cell_size_;
+}
+
+void TractLOD::get_subset(unsigned int count,std::vector<unsigned int>& subset) const
+{
+    count = std::min<unsigned int>(count,order.size());
+    subset.assign(order.begin(),order.begin()+count);
+    std::sort(subset.begin(),subset.end());
+}
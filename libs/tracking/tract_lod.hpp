@@ -0,0 +1,33 @@
+#ifndef TRACT_LOD_HPP
+#define TRACT_LOD_HPP
+#include <utility>
+#include <vector>
+
+// Douglas-Peucker simplification. kept receives the indices of the retained
+// points (always including both ends) such that no removed point is farther
+// than max_error from the simplified polyline.
+void simplify_tract(const float* data,unsigned int vertex_count,float max_error,
+                    std::vector<unsigned int>& kept);
+
+// Coverage-preserving order of tracts. Tracts are grouped by the grid cells
+// (cell_size wide) of their two end points, and tract j of a group of n is
+// placed at j/n, so any prefix of the order is a proportional sample of all
+// bundles that includes each bundle once. The order only depends on the
+// tract coordinates.
+void get_tract_lod_order(const std::vector<std::vector<float> >& tracts,float cell_size,
+                         std::vector<unsigned int>& order);
+
+// precomputed order of a tract set, used to take the first count tracts
+class TractLOD
+{
+    std::vector<std::pair<const float*,unsigned int> > source;// data and size of each tract
+    float cell_size = 0;
+public:
+    std::vector<unsigned int> order;
+public:
+    // recompute only when a tract was added, removed, moved, or resized
+    void update(const std::vector<std::vector<float> >& tracts,float cell_size_);
+    void get_subset(unsigned int count,std::vector<unsigned int>& subset) const;
+};
+
+#endif//TRACT_LOD_HPP
@@ -5,11 +5,15 @@
 #include <iterator>
 #include <set>
 #include <map>
+#include <thread>
+#include <cstring>
 #include "roi.hpp"
 #include "tract_model.hpp"
+#include "tract_file.hpp"
 #include "prog_interface_static_link.h"
 #include "fib_data.hpp"
 #include "gzip_interface.hpp"
+#include "utility/text_io.hpp"
 #include "mapping/atlas.hpp"
 #include "gzip_interface.hpp"
 #include "../../tracking/region/Regions.h"
@@ -76,6 +80,159 @@ struct TrackVis
     }
 };
 //---------------------------------------------------------------------------
+// reads the trk records block by block and converts the complete records of
+// each block in parallel, so that only one block of the file is held besides
+// the tracts
+static bool load_trk(const char* file_name,const image::vector<3>& vs,
+                     std::vector<std::vector<float> >& tracts,
+                     std::vector<unsigned int>& cluster)
+{
+    std::streamoff file_size = 0;
+    {
+        std::ifstream in(file_name,std::ios::binary);
+        if(!in)
+            return false;
+        in.seekg(0,std::ios::end);
+        file_size = in.tellg();
+    }
+    gzFile handle = gzopen(file_name,"rb");
+    if(!handle)
+        return false;
+    TrackVis trk;
+    if(gzread(handle,&trk,1000) != 1000)
+    {
+        gzclose(handle);
+        return false;
+    }
+    const size_t index_shift = 3 + trk.n_scalars;
+    const size_t block_size = 1 << 26;
+    const size_t max_record_size = (size_t)1 << 32;// larger records are corrupt
+    std::vector<char> buf(block_size);
+    std::vector<size_t> offset;
+    std::vector<unsigned int> point_count;
+    size_t used = 0;
+    bool result = true,eof = false;
+    begin_prog("loading");
+    while(trk.n_count <= 0 || tracts.size() < (size_t)trk.n_count)
+    {
+        while(!eof && used < buf.size())
+        {
+            int count = gzread(handle,&buf[used],(unsigned int)std::min<size_t>(buf.size()-used,1 << 30));
+            if(count < 0)
+                result = false;
+            if(count <= 0)
+                eof = true;
+            else
+                used += count;
+        }
+        // locate the complete records in the block
+        offset.clear();
+        point_count.clear();
+        size_t pos = 0;
+        bool grown = false;
+        while(pos + sizeof(int) <= used &&
+              (trk.n_count <= 0 || tracts.size()+offset.size() < (size_t)trk.n_count))
+        {
+            unsigned int n_point;
+            std::memcpy(&n_point,&buf[pos],sizeof(int));
+            size_t record_size = sizeof(int) + sizeof(float)*(index_shift*n_point + trk.n_properties);
+            if(pos + record_size > used)
+            {
+                // a record larger than the block
+                if(pos == 0 && !eof && record_size > buf.size() && record_size <= max_record_size)
+                {
+                    buf.resize(record_size);
+                    grown = true;
+                }
+                break;
+            }
+            offset.push_back(pos + sizeof(int));
+            point_count.push_back(n_point);
+            pos += record_size;
+        }
+        if(grown)
+            continue;
+        // the end of the file, or a corrupt record size
+        if(offset.empty())
+            break;
+        // convert to voxel coordinates
+        size_t base = tracts.size();
+        tracts.resize(base+offset.size());
+        if(trk.n_properties == 1)
+            cluster.resize(tracts.size());
+        image::par_for(offset.size(),[&](int index)
+        {
+            unsigned int n_point = point_count[index];
+            const char* from = &buf[offset[index]];
+            std::vector<float>& tract = tracts[base+index];
+            tract.resize((size_t)n_point*3);
+            for (size_t i = 0;i < n_point;++i,from += sizeof(float)*index_shift)
+            {
+                float p[3];
+                std::memcpy(p,from,sizeof(p));
+                tract[i*3] = p[0]/vs[0];
+                tract[i*3+1] = p[1]/vs[1];
+                tract[i*3+2] = p[2]/vs[2];
+            }
+            if(trk.n_properties == 1)
+            {
+                float c;
+                std::memcpy(&c,from,sizeof(float));
+                cluster[base+index] = c;
+            }
+        });
+        // keep the incomplete record for the next block
+        if(pos)
+        {
+            std::memmove(&buf[0],&buf[pos],used-pos);
+            used -= pos;
+        }
+        // compressed files are shown against the uncompressed size read so far (in KB)
+        size_t now = gztell(handle);
+        check_prog(std::min<size_t>(now,file_size) >> 10,(std::max<size_t>(now,file_size) >> 10)+1);
+        if(prog_aborted())
+        {
+            result = false;
+            break;
+        }
+    }
+    gzclose(handle);
+    check_prog(0,0);
+    // a truncated file, or a corrupt record size that ended the blocks early
+    if(trk.n_count > 0 && tracts.size() < (size_t)trk.n_count)
+        result = false;
+    return result;
+}
+//---------------------------------------------------------------------------
+// encodes tracts [from,to) as trk records (point count, coordinates in mm,
+// and an optional property) in parallel
+static void encode_trk(const std::vector<std::vector<float> >& tract_data,unsigned int from,unsigned int to,
+                       const image::vector<3>& vs,const float* property,std::vector<char>& buf)
+{
+    std::vector<size_t> offset(to-from+1);
+    for(unsigned int i = from;i < to;++i)
+        offset[i-from+1] = offset[i-from] + sizeof(int) + sizeof(float)*(tract_data[i].size() + (property ? 1:0));
+    buf.resize(offset.back());
+    image::par_for(to-from,[&](int i)
+    {
+        const std::vector<float>& tract = tract_data[from+i];
+        int n_point = tract.size()/3;
+        char* ptr = &buf[0] + offset[i];
+        std::memcpy(ptr,&n_point,sizeof(int));
+        std::vector<float> buffer(tract.size() + (property ? 1:0));
+        for (unsigned int j = 0;j+2 < tract.size();j += 3)
+        {
+            buffer[j] = tract[j]*vs[0];
+            buffer[j+1] = tract[j+1]*vs[1];
+            buffer[j+2] = tract[j+2]*vs[2];
+        }
+        if(property)
+            buffer.back() = *property;
+        if(!buffer.empty())
+            std::memcpy(ptr+sizeof(int),&buffer[0],sizeof(float)*buffer.size());
+    });
+}
+//---------------------------------------------------------------------------
 TractModel::TractModel(std::shared_ptr<fib_data> handle_):handle(handle_),
         report(handle_->report),geometry(handle_->dim),vs(handle_->vs),fib(new tracking_data)
 {
@@ -84,23 +241,18 @@ TractModel::TractModel(std::shared_ptr<fib_data> handle_):handle(handle_),
 //---------------------------------------------------------------------------
 void TractModel::add(const TractModel& rhs)
 {
-    for(unsigned int index = 0;index < rhs.redo_size.size();++index)
-        redo_size.push_back(std::make_pair(rhs.redo_size[index].first + tract_data.size(),
-                                           rhs.redo_size[index].second));
+    // the edits of rhs refer to positions after the current tracts
+    unsigned int shift = tract_data.size();
+    for(unsigned int index = 0;index < rhs.edit_history.size();++index)
+    {
+        edit_history.push_back(rhs.edit_history[index]);
+        for(unsigned int i = 0;i < edit_history.back().removed_index.size();++i)
+            edit_history.back().removed_index[i] += shift;
+        edit_history.back().added_begin += shift;
+    }
+    redo_history.clear();
     tract_data.insert(tract_data.end(),rhs.tract_data.begin(),rhs.tract_data.end());
     tract_color.insert(tract_color.end(),rhs.tract_color.begin(),rhs.tract_color.end());
-    deleted_tract_data.insert(deleted_tract_data.end(),
-                              rhs.deleted_tract_data.begin(),
-                              rhs.deleted_tract_data.end());
-    deleted_tract_color.insert(deleted_tract_color.end(),
-                               rhs.deleted_tract_color.begin(),
-                               rhs.deleted_tract_color.end());
-    deleted_count.insert(deleted_count.begin(),
-                         rhs.deleted_count.begin(),
-                         rhs.deleted_count.end());
-    deleted_cut_count.insert(deleted_cut_count.end(),
-                              rhs.deleted_cut_count.begin(),
-                              rhs.deleted_cut_count.end());
 }
 //---------------------------------------------------------------------------
 bool TractModel::load_from_file(const char* file_name_,bool append)
@@ -108,6 +260,7 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
     std::string file_name(file_name_);
     std::vector<std::vector<float> > loaded_tract_data;
     std::vector<unsigned int> loaded_tract_cluster;
+    std::vector<unsigned int> loaded_tract_color;
 
     std::string ext;
     if(file_name.length() > 4)
@@ -115,65 +268,27 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
 
     if(ext == std::string(".trk") || ext == std::string("k.gz"))
         {
-            TrackVis trk;
-            gz_istream in;
-            if (!in.open(file_name_))
+            if (!load_trk(file_name_,vs,loaded_tract_data,loaded_tract_cluster))
                 return false;
-            in.read((char*)&trk,1000);
-            unsigned int track_number = trk.n_count;
-            begin_prog("loading");
-            for (unsigned int index = 0;check_prog(index,track_number);++index)
-            {
-                unsigned int n_point;
-                in.read((char*)&n_point,sizeof(int));
-                unsigned int index_shift = 3 + trk.n_scalars;
-                std::vector<float> tract(index_shift*n_point + trk.n_properties);
-                in.read((char*)&*tract.begin(),sizeof(float)*tract.size());
-
-                loaded_tract_data.push_back(std::vector<float>());
-                loaded_tract_data.back().resize(n_point*3);
-                const float *from = &*tract.begin();
-                float *to = &*loaded_tract_data.back().begin();
-                for (unsigned int i = 0;i < n_point;++i,from += index_shift,to += 3)
-                {
-                    float x = from[0]/vs[0];
-                    float y = from[1]/vs[1];
-                    float z = from[2]/vs[2];
-                    to[0] = x;
-                    to[1] = y;
-                    to[2] = z;
-                }
-                if(trk.n_properties == 1)
-                    loaded_tract_cluster.push_back(from[0]);
-            }
         }
         else
         if (ext == std::string(".txt"))
         {
-            std::ifstream in(file_name_);
-            if (!in)
-                return false;
-            std::string line;
-            in.seekg(0,std::ios::end);
-            unsigned int total = in.tellg();
-            in.seekg(0,std::ios::beg);
+            std::vector<std::vector<float> > rows;
             begin_prog("loading");
-            while (std::getline(in,line))
+            if (!load_text_rows(file_name_,rows))
+                return false;
+            for (unsigned int index = 0;index < rows.size();++index)
             {
-                check_prog(in.tellg(),total);
-                loaded_tract_data.push_back(std::vector<float>());
-                std::istringstream in(line);
-                std::copy(std::istream_iterator<float>(in),
-                          std::istream_iterator<float>(),std::back_inserter(loaded_tract_data.back()));
-                if (loaded_tract_data.back().size() < 6)
+                if (rows[index].size() < 6)
                 {
-                    if(loaded_tract_data.back().size() == 1)// cluster info
-                        loaded_tract_cluster.push_back(loaded_tract_data.back()[0]);
-                    loaded_tract_data.pop_back();
+                    if(rows[index].size() == 1)// cluster info
+                        loaded_tract_cluster.push_back(rows[index][0]);
                     continue;
                 }
+                loaded_tract_data.push_back(std::vector<float>());
+                loaded_tract_data.back().swap(rows[index]);
             }
-
         }
         else
             if (ext == std::string(".mat"))
@@ -200,10 +315,26 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
                     buf += loaded_tract_data[index].size();
                 }
             }
+    else
+            if (is_tract_file(file_name_))
+            {
+                TractFileReader in;
+                if(!in.open(file_name_) || !in.read_all(loaded_tract_data))
+                    return false;
+                for(unsigned int index = 0;index < in.records.size();++index)
+                {
+                    loaded_tract_color.push_back(in.records[index].color);
+                    loaded_tract_cluster.push_back(in.records[index].cluster);
+                }
+                if(std::find_if(loaded_tract_cluster.begin(),loaded_tract_cluster.end(),
+                                [](unsigned int c){return c != 0;}) == loaded_tract_cluster.end())
+                    loaded_tract_cluster.clear();
+            }
     else
                 if (ext == std::string(".tck"))
                 {
                     unsigned int offset = 0;
+                    size_t count = 0;
                     {
                         std::ifstream in(file_name.c_str());
                         if(!in)
@@ -211,6 +342,8 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
                         std::string line;
                         while(std::getline(in,line))
                         {
+                            if(line.substr(0,6) == std::string("count:"))
+                                std::istringstream(line.substr(6)) >> count;
                             if(line.size() > 4 &&
                                     line.substr(0,7) == std::string("file: ."))
                             {
@@ -227,29 +360,49 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
                     if(!in)
                         return false;
                     in.seekg(0,std::ios::end);
-                    unsigned int total_size = in.tellg();
+                    std::streamoff total_size = in.tellg();
+                    if(total_size < (std::streamoff)offset+16)
+                        return false;
                     in.seekg(offset,std::ios::beg);
                     std::vector<unsigned int> buf((total_size-offset)/4);
                     in.read((char*)&*buf.begin(),total_size-offset-16);// 16 skip the final inf
-                    for(unsigned int index = 0;index < buf.size();)
+                    // first pass: locate the NaN terminators
+                    std::vector<std::pair<size_t,size_t> > range;
+                    for(size_t index = 0;index < buf.size();)
                     {
-                        unsigned int end = std::find(buf.begin()+index,buf.end(),2143289344)-buf.begin(); // NaN
-                        loaded_tract_data.push_back(std::vector<float>());
-                        loaded_tract_data.back().resize(end-index);
-                        std::copy((const float*)&*buf.begin() + index,
-                                  (const float*)&*buf.begin() + end,
-                                  loaded_tract_data.back().begin());
-                        image::divide_constant(loaded_tract_data.back().begin(),loaded_tract_data.back().end(),handle->vs[0]);
+                        size_t end = std::find(buf.begin()+index,buf.end(),2143289344)-buf.begin(); // NaN
+                        if(end == buf.size())// no terminator: the end of the file
+                            break;
+                        range.push_back(std::make_pair(index,end));
                         index = end+3;
                     }
-
+                    // a truncated file
+                    if(range.size() < count)
+                        return false;
+                    // second pass: copy and convert to voxel coordinates
+                    loaded_tract_data.resize(range.size());
+                    image::par_for(range.size(),[&](int index)
+                    {
+                        std::vector<float>& tract = loaded_tract_data[index];
+                        tract.resize((range[index].second-range[index].first)/3*3);
+                        const float* from = (const float*)&*buf.begin() + range[index].first;
+                        for(unsigned int i = 0;i < tract.size();i += 3)
+                        {
+                            tract[i] = from[i]/vs[0];
+                            tract[i+1] = from[i+1]/vs[1];
+                            tract[i+2] = from[i+2]/vs[2];
+                        }
+                    });
                 }
 
     if (loaded_tract_data.empty())
         return false;
     if (append)
     {
+        unsigned int old_size = tract_data.size();
         add_tracts(loaded_tract_data);
+        if(loaded_tract_color.size() == tract_data.size()-old_size)
+            std::copy(loaded_tract_color.begin(),loaded_tract_color.end(),tract_color.begin()+old_size);
         return true;
     }
     if(loaded_tract_cluster.size() == loaded_tract_data.size())
@@ -257,32 +410,57 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
     else
         tract_cluster.clear();
     loaded_tract_data.swap(tract_data);
-    tract_color.resize(tract_data.size());
-    std::fill(tract_color.begin(),tract_color.end(),0);
-    deleted_tract_data.clear();
-    deleted_tract_color.clear();
-    deleted_count.clear();
-    deleted_cut_count.clear();
-    redo_size.clear();
+    if(loaded_tract_color.size() == tract_data.size())
+        loaded_tract_color.swap(tract_color);
+    else
+    {
+        tract_color.resize(tract_data.size());
+        std::fill(tract_color.begin(),tract_color.end(),0);
+    }
+    edit_history.clear();
+    redo_history.clear();
     return true;
 }
 
+//---------------------------------------------------------------------------
+bool TractModel::load_from_tract_file(const char* file_name,int cluster,
+                                      const image::vector<3,float>& from,const image::vector<3,float>& to)
+{
+    TractFileReader in;
+    if(!in.open(file_name))
+        return false;
+    std::vector<unsigned int> index;
+    in.query(from,to,index);
+    if(cluster >= 0)
+        index.erase(std::remove_if(index.begin(),index.end(),
+                    [&](unsigned int i){return in.records[i].cluster != (unsigned int)cluster;}),index.end());
+    std::vector<std::vector<float> > loaded_tract_data;
+    if(index.empty() || !in.read(index,loaded_tract_data))
+        return false;
+    loaded_tract_data.swap(tract_data);
+    tract_color.resize(index.size());
+    tract_cluster.resize(index.size());
+    for(unsigned int i = 0;i < index.size();++i)
+    {
+        tract_color[i] = in.records[index[i]].color;
+        tract_cluster[i] = in.records[index[i]].cluster;
+    }
+    edit_history.clear();
+    redo_history.clear();
+    return true;
+}
 //---------------------------------------------------------------------------
 bool TractModel::save_data_to_file(const char* file_name,const std::string& index_name)
 {
     std::vector<std::vector<float> > data;
     if(!get_tracts_data(index_name,data) || data.empty())
         return false;
-    std::ofstream out(file_name,std::ios::binary);
-    if (!out)
-        return false;
     begin_prog("saving");
-    for (unsigned int i = 0;check_prog(i,data.size());++i)
+    return save_text_rows(file_name,data.size(),[&](unsigned int i,std::string& line)
     {
-        std::copy(data[i].begin(),data[i].end(),std::ostream_iterator<float>(out," "));
-        out << std::endl;
-    }
-    return true;
+        append_floats(line,data[i].begin(),data[i].end(),' ');
+        line.push_back('\n');
+    });
 }
 //---------------------------------------------------------------------------
 bool TractModel::save_tracts_to_file(const char* file_name_)
@@ -305,40 +483,71 @@ bool TractModel::save_tracts_to_file(const char* file_name_)
             out.write((const char*)&trk,1000);
         }
         begin_prog("saving");
-        for (unsigned int i = 0;check_prog(i,tract_data.size());++i)
+        // encode blocks in parallel, write them in order
+        const unsigned int block_size = 65536;
+        std::vector<char> buf;
+        for (unsigned int i = 0;check_prog(i,tract_data.size());i += block_size)
         {
-            int n_point = tract_data[i].size()/3;
-            std::vector<float> buffer(tract_data[i].size());
-            const float *from = &*tract_data[i].begin();
-            const float *end = from + tract_data[i].size();
-            float* to = &*buffer.begin();
-            for (unsigned int flag = 0;from != end;++from,++to)
-            {
-                *to = (*from)*vs[flag];
-                ++flag;
-                if (flag == 3)
-                    flag = 0;
-            }
-            out.write((const char*)&n_point,sizeof(int));
-            out.write((const char*)&*buffer.begin(),sizeof(float)*buffer.size());
+            encode_trk(tract_data,i,std::min<unsigned int>(i+block_size,tract_data.size()),vs,0,buf);
+            if(!buf.empty())
+                out.write(&buf[0],buf.size());
         }
         return true;
     }
-    if (ext == std::string(".txt"))
+    if (ext == std::string(".tck"))
     {
         std::ofstream out(file_name_,std::ios::binary);
         if (!out)
             return false;
+        std::ostringstream header;
+        header << "mrtrix tracks" << std::endl
+               << "datatype: Float32LE" << std::endl
+               << "count: " << tract_data.size() << std::endl;
+        unsigned int offset = header.str().length() + 24;
+        header << "file: . " << offset << std::endl << "END" << std::endl;
+        std::string header_str = header.str();
+        header_str.resize(offset,' ');
+        out.write(header_str.c_str(),header_str.length());
         begin_prog("saving");
-        for (unsigned int i = 0;check_prog(i,tract_data.size());++i)
+        const unsigned int block_size = 65536;
+        const unsigned int nan_value = 2143289344,inf_value = 2139095040;
+        for (unsigned int i = 0;check_prog(i,tract_data.size());i += block_size)
         {
-            std::copy(tract_data[i].begin(),
-                      tract_data[i].end(),
-                      std::ostream_iterator<float>(out," "));
-            out << std::endl;
+            unsigned int to = std::min<unsigned int>(i+block_size,tract_data.size());
+            std::vector<size_t> pos(to-i+1);
+            for(unsigned int j = i;j < to;++j)
+                pos[j-i+1] = pos[j-i] + tract_data[j].size() + 3;
+            std::vector<float> buf(pos.back());
+            image::par_for(to-i,[&](int j)
+            {
+                const std::vector<float>& tract = tract_data[i+j];
+                float* ptr = &buf[0] + pos[j];
+                for(unsigned int k = 0;k+2 < tract.size();k += 3)
+                {
+                    ptr[k] = tract[k]*vs[0];
+                    ptr[k+1] = tract[k+1]*vs[1];
+                    ptr[k+2] = tract[k+2]*vs[2];
+                }
+                std::memcpy(ptr+tract.size(),&nan_value,4);
+                std::memcpy(ptr+tract.size()+1,&nan_value,4);
+                std::memcpy(ptr+tract.size()+2,&nan_value,4);
+            });
+            if(!buf.empty())
+                out.write((const char*)&buf[0],buf.size()*sizeof(float));
         }
+        unsigned int end_mark[3] = {inf_value,inf_value,inf_value};
+        out.write((const char*)end_mark,sizeof(end_mark));
         return true;
     }
+    if (ext == std::string(".txt"))
+    {
+        begin_prog("saving");
+        return save_text_rows(file_name_,tract_data.size(),[&](unsigned int i,std::string& line)
+        {
+            append_floats(line,tract_data[i].begin(),tract_data[i].end(),' ');
+            line.push_back('\n');
+        });
+    }
     if (ext == std::string(".mat"))
     {
         image::io::mat_write out(file_name.c_str());
@@ -355,6 +564,8 @@ bool TractModel::save_tracts_to_file(const char* file_name_)
         out.write("length",&*length.begin(),1,(unsigned int)length.size());
         return true;
     }
+    if (is_tract_file(file_name_))
+        return TractFileWriter::save(file_name_,geometry,vs,tract_data,tract_color,tract_cluster);
     if (ext == std::string(".nii") || ext == std::string("i.gz"))
     {
         std::vector<image::vector<3,short> >points;
@@ -571,20 +782,19 @@ bool TractModel::save_all(const char* file_name_,const std::vector<TractModel*>&
 
     if (ext == std::string(".txt"))
     {
-        std::ofstream out(file_name_,std::ios::binary);
-        if (!out)
-            return false;
+        std::vector<std::pair<unsigned int,unsigned int> > rows;
+        for(unsigned int index = 0;index < all.size();++index)
+            for (unsigned int i = 0;i < all[index]->tract_data.size();++i)
+                rows.push_back(std::make_pair(index,i));
         begin_prog("saving");
-        for(unsigned int index = 0;check_prog(index,all.size());++index)
-        for (unsigned int i = 0;i < all[index]->tract_data.size();++i)
+        return save_text_rows(file_name_,rows.size(),[&](unsigned int i,std::string& line)
         {
-            std::copy(all[index]->tract_data[i].begin(),
-                      all[index]->tract_data[i].end(),
-                      std::ostream_iterator<float>(out," "));
-            out << std::endl;
-            out << index << std::endl;
-        }
-        return true;
+            const std::vector<float>& tract = all[rows[i].first]->tract_data[rows[i].second];
+            append_floats(line,tract.begin(),tract.end(),' ');
+            line.push_back('\n');
+            line += std::to_string(rows[i].first);
+            line.push_back('\n');
+        });
     }
 
     if (ext == std::string(".trk") || ext == std::string("k.gz"))
@@ -604,24 +814,13 @@ bool TractModel::save_all(const char* file_name_,const std::vector<TractModel*>&
             out.write((const char*)&trk,1000);
 
         }
+        std::vector<char> buf;
         for(unsigned int index = 0;check_prog(index,all.size());++index)
-        for (unsigned int i = 0;i < all[index]->tract_data.size();++i)
         {
-            int n_point = all[index]->tract_data[i].size()/3;
-            std::vector<float> buffer(all[index]->tract_data[i].size()+1);
-            const float *from = &*all[index]->tract_data[i].begin();
-            const float *end = from + all[index]->tract_data[i].size();
-            float* to = &*buffer.begin();
-            for (unsigned int flag = 0;from != end;++from,++to)
-            {
-                *to = (*from)*all[index]->vs[flag];
-                ++flag;
-                if (flag == 3)
-                    flag = 0;
-            }
-            buffer.back() = index;
-            out.write((const char*)&n_point,sizeof(int));
-            out.write((const char*)&*buffer.begin(),sizeof(float)*buffer.size());
+            float cluster = index;
+            encode_trk(all[index]->tract_data,0,all[index]->tract_data.size(),all[index]->vs,&cluster,buf);
+            if(!buf.empty())
+                out.write(&buf[0],buf.size());
         }
         return true;
     }
@@ -646,16 +845,29 @@ bool TractModel::save_all(const char* file_name_,const std::vector<TractModel*>&
         out.write("cluster",&*cluster.begin(),1,cluster.size());
         return true;
     }
+    if (is_tract_file(file_name_))
+    {
+        TractFileWriter out;
+        if(!out.open(file_name_,all[0]->geometry,all[0]->vs))
+            return false;
+        begin_prog("saving");
+        for(unsigned int index = 0;check_prog(index,all.size());++index)
+            for (unsigned int i = 0;i < all[index]->tract_data.size();++i)
+                out.add(all[index]->tract_data[i],all[index]->tract_color[i],index);
+        return out.close();
+    }
     return false;
 }
 //---------------------------------------------------------------------------
 bool TractModel::save_transformed_tracts_to_file(const char* file_name,const float* transform,bool end_point)
 {
     std::vector<std::vector<float> > new_tract_data(tract_data);
-    for(unsigned int i = 0;i < tract_data.size();++i)
+    image::par_for(tract_data.size(),[&](int i)
+    {
         for(unsigned int j = 0;j < tract_data[i].size();j += 3)
         image::vector_transformation(&(new_tract_data[i][j]),
                                     &(tract_data[i][j]),transform,image::vdim<3>());
+    });
     bool result = true;
     if(end_point)
         save_end_points(file_name);
@@ -741,10 +953,12 @@ void TractModel::save_end_points(const char* file_name_) const
     std::string file_name(file_name_);
     if (file_name.find(".txt") != std::string::npos)
     {
-        std::ofstream out(file_name_,std::ios::out);
+        std::ofstream out(file_name_,std::ios::binary);
         if (!out)
             return;
-        std::copy(buffer.begin(),buffer.end(),std::ostream_iterator<float>(out," "));
+        std::string text;
+        append_floats(text,buffer.begin(),buffer.end(),' ');
+        out << text;
     }
     if (file_name.find(".mat") != std::string::npos)
     {
@@ -804,9 +1018,25 @@ void TractModel::select(float select_angle,
     std::fill(selected.begin(),selected.end(),0);
 
     float select_angle_cos = std::cos(select_angle*3.141592654/180);
-    unsigned int total_track_number = tract_data.size();
-    for (unsigned int index = 0;index < total_track_number;++index)
+    // a selected point is within one step from the plane, so only the tracts
+    // in the cells near the plane are checked
+    update_grid();
+    std::vector<unsigned char> candidate(tract_data.size());
+    float max_distance = tract_grid.get_max_step()+1.0f;
+    tract_grid.get_tracts([&](unsigned int,const image::vector<3,float>& from,const image::vector<3,float>& to)
+    {
+        float distance = 0.0,extent = 0.0;
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            distance += ((from[d]+to[d])*0.5f-from_pos[d])*z_axis[d];
+            extent += std::abs((to[d]-from[d])*0.5f*z_axis[d]);
+        }
+        return std::abs(distance) <= extent+max_distance;
+    },candidate);
+    image::par_for(tract_data.size(),[&](int index)
     {
+        if(!candidate[index])
+            return;
         float angle = 0.0;
         const float* ptr = &*tract_data[index].begin();
         const float* end = ptr + tract_data[index].size();
@@ -838,7 +1068,13 @@ void TractModel::select(float select_angle,
             }
             angle = next_angle;
         }
-    }
+    });
+}
+//---------------------------------------------------------------------------
+void TractModel::update_grid(void)
+{
+    if(!tract_grid.is_valid(tract_data))
+        tract_grid.build(tract_data,geometry);
 }
 //---------------------------------------------------------------------------
 void TractModel::release_tracts(std::vector<std::vector<float> >& released_tracks)
@@ -846,41 +1082,143 @@ void TractModel::release_tracts(std::vector<std::vector<float> >& released_track
     released_tracks.clear();
     released_tracks.swap(tract_data);
     tract_color.clear();
-    redo_size.clear();
+    edit_history.clear();
+    redo_history.clear();
 }
 //---------------------------------------------------------------------------
-void TractModel::delete_tracts(const std::vector<unsigned int>& tracts_to_delete)
+// removes the tracts at edit.removed_index and inserts edit.added_tracts
+void TractModel::apply_edit(TractEdit& edit)
 {
-    if (tracts_to_delete.empty())
-        return;
-    for (unsigned int index = 0;index < tracts_to_delete.size();++index)
-    {
-        deleted_tract_data.push_back(std::vector<float>());
-        deleted_tract_data.back().swap(tract_data[tracts_to_delete[index]]);
-        deleted_tract_color.push_back(tract_color[tracts_to_delete[index]]);
-    }
-    // delete all blank tract
-    std::vector<unsigned int> index_list(tract_data.size()+1);
-    unsigned int new_ptr = 0;
-    for (unsigned int index = 0;index < tract_data.size();++index)
-    {
-        index_list[index] = new_ptr;
-        if (!tract_data[index].empty())
+    bool keep_grid = tract_grid.is_valid(tract_data);
+    unsigned int old_size = tract_data.size();
+    const std::vector<unsigned int>& removed_index = edit.removed_index;
+    edit.removed_tracts.resize(removed_index.size());
+    edit.removed_color.resize(removed_index.size());
+    if(!removed_index.empty())
+    {
+        unsigned int new_ptr = removed_index[0];
+        for (unsigned int index = removed_index[0],i = 0;index < tract_data.size();++index)
         {
-            if(new_ptr != index)
+            if (i < removed_index.size() && removed_index[i] == index)
             {
-                tract_data[new_ptr].swap(tract_data[index]);
-                std::swap(tract_color[new_ptr],tract_color[index]);
+                edit.removed_tracts[i].swap(tract_data[index]);
+                edit.removed_color[i] = tract_color[index];
+                ++i;
+                continue;
             }
+            tract_data[new_ptr].swap(tract_data[index]);
+            tract_color[new_ptr] = tract_color[index];
             ++new_ptr;
         }
+        tract_data.resize(new_ptr);
+        tract_color.resize(new_ptr);
+    }
+    edit.added_begin = std::min<unsigned int>(edit.added_begin,tract_data.size());
+    edit.added_count = edit.added_tracts.size();
+    tract_data.insert(tract_data.begin()+edit.added_begin,edit.added_count,std::vector<float>());
+    tract_color.insert(tract_color.begin()+edit.added_begin,edit.added_color.begin(),edit.added_color.end());
+    for(unsigned int index = 0;index < edit.added_count;++index)
+        tract_data[edit.added_begin+index].swap(edit.added_tracts[index]);
+    edit.added_tracts.clear();
+    edit.added_color.clear();
+    if(keep_grid)
+    {
+        std::vector<unsigned int> new_index(old_size,~0u),added(edit.added_count);
+        for(unsigned int index = 0,i = 0,pos = 0;index < old_size;++index)
+        {
+            if(i < removed_index.size() && removed_index[i] == index)
+            {
+                ++i;
+                continue;
+            }
+            new_index[index] = pos < edit.added_begin ? pos : pos + edit.added_count;
+            ++pos;
+        }
+        for(unsigned int index = 0;index < added.size();++index)
+            added[index] = edit.added_begin+index;
+        tract_grid.update(tract_data,new_index,added);
+    }
+}
+//---------------------------------------------------------------------------
+// takes out the added tracts and puts the removed tracts back to their positions
+void TractModel::revert_edit(TractEdit& edit)
+{
+    bool keep_grid = tract_grid.is_valid(tract_data);
+    unsigned int old_size = tract_data.size();
+    edit.added_tracts.resize(edit.added_count);
+    edit.added_color.assign(tract_color.begin()+edit.added_begin,
+                            tract_color.begin()+edit.added_begin+edit.added_count);
+    for(unsigned int index = 0;index < edit.added_count;++index)
+        edit.added_tracts[index].swap(tract_data[edit.added_begin+index]);
+    tract_data.erase(tract_data.begin()+edit.added_begin,tract_data.begin()+edit.added_begin+edit.added_count);
+    tract_color.erase(tract_color.begin()+edit.added_begin,tract_color.begin()+edit.added_begin+edit.added_count);
+
+    const std::vector<unsigned int>& removed_index = edit.removed_index;
+    if(!removed_index.empty())
+    {
+        // merge from the back
+        unsigned int old_size = tract_data.size();
+        tract_data.resize(old_size+removed_index.size());
+        tract_color.resize(old_size+removed_index.size());
+        int from = old_size-1,i = removed_index.size()-1;
+        for(int index = tract_data.size()-1;index >= (int)removed_index[0];--index)
+        {
+            if (i >= 0 && removed_index[i] == (unsigned int)index)
+            {
+                tract_data[index].swap(edit.removed_tracts[i]);
+                tract_color[index] = edit.removed_color[i];
+                --i;
+                continue;
+            }
+            tract_data[index].swap(tract_data[from]);
+            tract_color[index] = tract_color[from];
+            --from;
+        }
+    }
+    edit.removed_tracts.clear();
+    edit.removed_color.clear();
+    if(keep_grid)
+    {
+        std::vector<unsigned int> new_index(old_size,~0u);
+        for(unsigned int index = 0,i = 0,pos = 0;index < old_size;++index)
+        {
+            if(index >= edit.added_begin && index < edit.added_begin+edit.added_count)
+                continue;
+            for(;i < removed_index.size() && removed_index[i] == pos;++i)
+                ++pos;
+            new_index[index] = pos++;
+        }
+        tract_grid.update(tract_data,new_index,removed_index);
     }
-    index_list.back() = new_ptr;
-    tract_data.resize(new_ptr);
-    deleted_count.push_back(tracts_to_delete.size());
-    deleted_cut_count.push_back(std::make_pair(tract_data.size(),0));
+}
+//---------------------------------------------------------------------------
+void TractModel::edit_tracts(const std::vector<unsigned int>& tracts_to_delete,
+                             std::vector<std::vector<float> >& new_tracts,
+                             std::vector<unsigned int>& new_tract_color)
+{
+    edit_history.push_back(TractEdit());
+    TractEdit& edit = edit_history.back();
+    edit.removed_index = tracts_to_delete;
+    std::sort(edit.removed_index.begin(),edit.removed_index.end());
+    edit.removed_index.erase(std::unique(edit.removed_index.begin(),edit.removed_index.end()),
+                             edit.removed_index.end());
+    while(!edit.removed_index.empty() && edit.removed_index.back() >= tract_data.size())
+        edit.removed_index.pop_back();
+    edit.added_begin = tract_data.size()-edit.removed_index.size();
+    edit.added_tracts.swap(new_tracts);
+    edit.added_color.swap(new_tract_color);
+    apply_edit(edit);
     // no redo once track deleted
-    redo_size.clear();
+    redo_history.clear();
+}
+//---------------------------------------------------------------------------
+void TractModel::delete_tracts(const std::vector<unsigned int>& tracts_to_delete)
+{
+    if (tracts_to_delete.empty())
+        return;
+    std::vector<std::vector<float> > new_tracts;
+    std::vector<unsigned int> new_tract_color;
+    edit_tracts(tracts_to_delete,new_tracts,new_tract_color);
 }
 //---------------------------------------------------------------------------
 void TractModel::select_tracts(const std::vector<unsigned int>& tracts_to_select)
@@ -988,64 +1326,111 @@ void TractModel::cut(float select_angle,const image::vector<3,float>& from_dir,c
         }
     if(tract_to_delete.empty())
         return;
-    delete_tracts(tract_to_delete);
-    deleted_cut_count.back().second = new_tract.size();
-    for (unsigned int index = 0;index < new_tract.size();++index)
-    {
-        tract_data.push_back(std::vector<float>());
-        tract_data.back().swap(new_tract[index]);
-        tract_color.push_back(new_tract_color[index]);
-    }
-    redo_size.clear();
-
+    edit_tracts(tract_to_delete,new_tract,new_tract_color);
 }
 void TractModel::cut_by_slice(unsigned int dim, unsigned int pos,bool greater)
 {
-    std::vector<std::vector<float> > new_tract;
-    std::vector<unsigned int> new_tract_color;
-    std::vector<unsigned int> tract_to_delete;
-    for(unsigned int i = 0;i < tract_data.size();++i)
+    // only the tracts with points in the cells on the removed side are cut
+    update_grid();
+    std::vector<unsigned char> candidate(tract_data.size());
+    tract_grid.get_tracts([&](unsigned int,const image::vector<3,float>& from,const image::vector<3,float>& to)
+    {
+        return greater ? to[dim] >= pos : from[dim] < pos;
+    },candidate);
+    std::vector<std::vector<std::vector<float> > > new_tract(tract_data.size());
+    std::vector<unsigned char> cut(tract_data.size());
+    image::par_for(tract_data.size(),[&](int i)
     {
+        if(tract_data[i].size() < 6)
+        {
+            cut[i] = 1;
+            return;
+        }
+        if(!candidate[i])
+            return;
         bool adding = false;
         for(unsigned int j = 0;j < tract_data[i].size();j += 3)
         {
             if(tract_data[i][j+dim] < pos ^ greater)
             {
+                cut[i] = 1;
                 if(!adding)
                     continue;
                 adding = false;
             }
             if(!adding)
             {
-                new_tract.push_back(std::vector<float>());
-                new_tract_color.push_back(tract_color[i]);
+                new_tract[i].push_back(std::vector<float>());
                 adding = true;
             }
-            new_tract.back().push_back(tract_data[i][j]);
-            new_tract.back().push_back(tract_data[i][j+1]);
-            new_tract.back().push_back(tract_data[i][j+2]);
+            new_tract[i].back().push_back(tract_data[i][j]);
+            new_tract[i].back().push_back(tract_data[i][j+1]);
+            new_tract[i].back().push_back(tract_data[i][j+2]);
         }
-        tract_to_delete.push_back(i);
-    }
-    delete_tracts(tract_to_delete);
-    for (unsigned int index = 0;index < new_tract.size();++index)
-    if(new_tract[index].size() >= 6)
+    });
+    std::vector<unsigned int> tract_to_delete;
+    std::vector<std::vector<float> > added_tract;
+    std::vector<unsigned int> added_tract_color;
+    for(unsigned int i = 0;i < tract_data.size();++i)
+        if(cut[i])
         {
-            tract_data.push_back(std::vector<float>());
-            tract_data.back().swap(new_tract[index]);
-            tract_color.push_back(new_tract_color[index]);
-            ++deleted_cut_count.back().second;
+            tract_to_delete.push_back(i);
+            for (unsigned int index = 0;index < new_tract[i].size();++index)
+            if(new_tract[i][index].size() >= 6)
+            {
+                added_tract.push_back(std::vector<float>());
+                added_tract.back().swap(new_tract[i][index]);
+                added_tract_color.push_back(tract_color[i]);
+            }
         }
-    redo_size.clear();
+    if(tract_to_delete.empty())
+        return;
+    edit_tracts(tract_to_delete,added_tract,added_tract_color);
 }
 //---------------------------------------------------------------------------
 void TractModel::filter_by_roi(RoiMgr& roi_mgr)
 {
-    std::vector<unsigned int> tracts_to_delete;
-    for (unsigned int index = 0;index < tract_data.size();++index)
-    if(tract_data[index].size() >= 6)
+    // the tracts in the cells covering a region
+    update_grid();
+    auto get_roi_tracts = [&](const Roi& roi,std::vector<unsigned char>& hit)
+    {
+        std::vector<image::vector<3,short> > points;
+        roi.getPoints(points);
+        std::vector<unsigned char> cell_mask(tract_grid.get_dim().size());
+        for(unsigned int index = 0;index < points.size();++index)
+            for(unsigned int corner = 0;corner < 8;++corner)
+            {
+                // a voxel takes the points rounded to it
+                float p[3] = {points[index][0]+((corner & 1) ? 0.5f:-0.5f),
+                              points[index][1]+((corner & 2) ? 0.5f:-0.5f),
+                              points[index][2]+((corner & 4) ? 0.5f:-0.5f)};
+                cell_mask[tract_grid.get_cell(p)] = 1;
+            }
+        hit.clear();
+        hit.resize(tract_data.size());
+        tract_grid.get_tracts([&](unsigned int cell,const image::vector<3,float>&,const image::vector<3,float>&)
+        {
+            return cell_mask[cell] != 0;
+        },hit);
+    };
+    std::vector<unsigned char> included(tract_data.size(),1),excluded;
+    for(unsigned int i = 0;i < roi_mgr.inclusive.size();++i)
     {
-        if(!roi_mgr.have_include(&(tract_data[index][0]),tract_data[index].size()) ||
+        std::vector<unsigned char> hit;
+        get_roi_tracts(*roi_mgr.inclusive[i].get(),hit);
+        for(unsigned int index = 0;index < included.size();++index)
+            included[index] &= hit[index];
+    }
+    if(roi_mgr.exclusive.get())
+        get_roi_tracts(*roi_mgr.exclusive.get(),excluded);
+
+    std::vector<unsigned char> to_delete(tract_data.size());
+    image::par_for(tract_data.size(),[&](int index)
+    {
+        if(tract_data[index].size() < 6)
+            return;
+        if(!included[index] ||
+           !roi_mgr.have_include(&(tract_data[index][0]),tract_data[index].size()) ||
            !roi_mgr.fulfill_end_point(image::vector<3,float>(tract_data[index][0],
                                                              tract_data[index][1],
                                                              tract_data[index][2]),
@@ -1053,21 +1438,25 @@ void TractModel::filter_by_roi(RoiMgr& roi_mgr)
                                                              tract_data[index][tract_data[index].size()-2],
                                                              tract_data[index][tract_data[index].size()-1])))
         {
-            tracts_to_delete.push_back(index);
-            continue;
+            to_delete[index] = 1;
+            return;
         }
-        if(roi_mgr.exclusive.get())
+        if(roi_mgr.exclusive.get() && excluded[index])
         {
             for(unsigned int i = 0;i < tract_data[index].size();i+=3)
                 if(roi_mgr.is_excluded_point(image::vector<3,float>(tract_data[index][i],
                                                                     tract_data[index][i+1],
                                                                     tract_data[index][i+2])))
                 {
-                    tracts_to_delete.push_back(index);
+                    to_delete[index] = 1;
                     break;
                 }
         }
-    }
+    });
+    std::vector<unsigned int> tracts_to_delete;
+    for (unsigned int index = 0;index < to_delete.size();++index)
+        if(to_delete[index])
+            tracts_to_delete.push_back(index);
     delete_tracts(tracts_to_delete);
 }
 //---------------------------------------------------------------------------
@@ -1145,113 +1534,123 @@ void TractModel::cut_by_mask(const char* file_name)
 //---------------------------------------------------------------------------
 bool TractModel::trim(void)
 {
-    image::basic_image<unsigned int,3> label(geometry);
-
-
-    int total_track_number = tract_data.size();
-    int no_fiber_label = total_track_number;
-    int have_multiple_fiber_label = total_track_number+1;
-
-    int width = label.width();
-    int height = label.height();
-    int depth = label.depth();
-    int wh = width*height;
-    std::fill(label.begin(),label.end(),no_fiber_label);
-    int shift[8] = {0,1,width,wh,1+width,1+wh,width+wh,1+width+wh};
-    for (unsigned int index = 0;index < total_track_number;++index)
-    {
-        const float* ptr = &*tract_data[index].begin();
-        const float* end = ptr + tract_data[index].size();
-        for (;ptr < end;ptr += 3)
-        {
-            int x = *ptr;
-            if (x <= 0 || x >= width)
-                continue;
-            int y = *(ptr+1);
-            if (y <= 0 || y >= height)
-                continue;
-            int z = *(ptr+2);
-            if (z <= 0 || z >= depth)
-                continue;
-            for(unsigned int i = 0;i < 8;++i)
-            {
-                unsigned int pixel_index = z*wh+y*width+x+shift[i];
-                if (pixel_index >= label.size())
-                    continue;
-                unsigned int cur_label = label[pixel_index];
-                if (cur_label == have_multiple_fiber_label || cur_label == index)
-                    continue;
-                if (cur_label == no_fiber_label)
-                    label[pixel_index] = index;
-                else
-                    label[pixel_index] = have_multiple_fiber_label;
-            }
-        }
-    }
+    update_grid();
+    unsigned int total_track_number = tract_data.size();
+    unsigned int no_fiber_label = total_track_number;
+    unsigned int have_multiple_fiber_label = total_track_number+1;
+
+    int width = geometry.width();
+    int height = geometry.height();
+    int depth = geometry.depth();
+    const image::geometry<3>& grid_dim = tract_grid.get_dim();
+    int cell_size = tract_grid.get_cell_size();
+    // each cell labels its own voxels from the points in it and in the cells
+    // below it, since a point labels its voxel and the seven voxels above
+    std::vector<std::vector<unsigned int> > cell_tracts_to_delete(grid_dim.size());
+    image::par_for(grid_dim.size(),[&](int cell)
+    {
+        int cx = cell % grid_dim[0];
+        int cy = (cell / grid_dim[0]) % grid_dim[1];
+        int cz = cell / (grid_dim[0]*grid_dim[1]);
+        int x0 = cx*cell_size,x1 = std::min<int>(x0+cell_size,width);
+        int y0 = cy*cell_size,y1 = std::min<int>(y0+cell_size,height);
+        int z0 = cz*cell_size,z1 = std::min<int>(z0+cell_size,depth);
+        std::vector<unsigned int> label;
+        for(int dz = -1;dz <= 0;++dz)
+            for(int dy = -1;dy <= 0;++dy)
+                for(int dx = -1;dx <= 0;++dx)
+                {
+                    if(cx+dx < 0 || cy+dy < 0 || cz+dz < 0)
+                        continue;
+                    unsigned int source_cell = cx+dx + (cy+dy + (cz+dz)*grid_dim[1])*grid_dim[0];
+                    for(const TractGridEntry* e = tract_grid.begin(source_cell);e != tract_grid.end(source_cell);++e)
+                    {
+                        const float* ptr = &tract_data[e->tract][0] + e->from*3;
+                        const float* end = &tract_data[e->tract][0] + e->to*3;
+                        for (;ptr < end;ptr += 3)
+                        {
+                            int x = *ptr;
+                            if (x <= 0 || x >= width || x+1 < x0 || x >= x1)
+                                continue;
+                            int y = *(ptr+1);
+                            if (y <= 0 || y >= height || y+1 < y0 || y >= y1)
+                                continue;
+                            int z = *(ptr+2);
+                            if (z <= 0 || z >= depth || z+1 < z0 || z >= z1)
+                                continue;
+                            if(label.empty())
+                                label.resize(cell_size*cell_size*cell_size,no_fiber_label);
+                            for(unsigned int i = 0;i < 8;++i)
+                            {
+                                int tx = x+(i & 1),ty = y+((i >> 1) & 1),tz = z+(i >> 2);
+                                if(tx < x0 || tx >= x1 || ty < y0 || ty >= y1 || tz < z0 || tz >= z1)
+                                    continue;
+                                unsigned int& cur_label = label[tx-x0 + (ty-y0 + (tz-z0)*cell_size)*cell_size];
+                                if (cur_label == have_multiple_fiber_label || cur_label == e->tract)
+                                    continue;
+                                if (cur_label == no_fiber_label)
+                                    cur_label = e->tract;
+                                else
+                                    cur_label = have_multiple_fiber_label;
+                            }
+                        }
+                    }
+                }
+        for (unsigned int index = 0;index < label.size();++index)
+            if (label[index] < total_track_number)
+                cell_tracts_to_delete[cell].push_back(label[index]);
+    });
 
-    std::set<unsigned int> tracts_to_delete;
-    for (unsigned int index = 0;index < label.size();++index)
-        if (label[index] < total_track_number)
-            tracts_to_delete.insert(label[index]);
+    std::vector<unsigned int> tracts_to_delete;
+    for (unsigned int index = 0;index < cell_tracts_to_delete.size();++index)
+        tracts_to_delete.insert(tracts_to_delete.end(),
+                                cell_tracts_to_delete[index].begin(),
+                                cell_tracts_to_delete[index].end());
     if(tracts_to_delete.empty())
         return false;
-    delete_tracts(std::vector<unsigned int>(tracts_to_delete.begin(),tracts_to_delete.end()));
+    std::sort(tracts_to_delete.begin(),tracts_to_delete.end());
+    tracts_to_delete.erase(std::unique(tracts_to_delete.begin(),tracts_to_delete.end()),tracts_to_delete.end());
+    delete_tracts(tracts_to_delete);
     return true;
 }
 //---------------------------------------------------------------------------
 void TractModel::clear_deleted(void)
 {
-    deleted_count.clear();
-    deleted_cut_count.clear();
-    deleted_tract_data.clear();
-    deleted_tract_color.clear();
-    redo_size.clear();
+    edit_history.clear();
+    redo_history.clear();
 }
-
+//---------------------------------------------------------------------------
+void TractModel::get_deleted_tracts(std::vector<std::vector<float> >& tracts) const
+{
+    tracts.clear();
+    for(unsigned int index = 0;index < edit_history.size();++index)
+        tracts.insert(tracts.end(),
+                      edit_history[index].removed_tracts.begin(),
+                      edit_history[index].removed_tracts.end());
+}
+//---------------------------------------------------------------------------
 void TractModel::undo(void)
 {
-    if (deleted_count.empty())
+    if (edit_history.empty())
         return;
-    redo_size.push_back(std::make_pair((unsigned int)tract_data.size(),deleted_count.back()));
-    if(deleted_cut_count.back().second)
-    {
-        std::vector<unsigned int> cut_tracts(deleted_cut_count.back().second);
-        for (unsigned int index = 0;index < cut_tracts.size();++index)
-            cut_tracts[index] = deleted_cut_count.back().first + index;
-        delete_tracts(cut_tracts);
-        for(unsigned int index = 0;index < cut_tracts.size();++index)
-            deleted_tract_data.pop_back();
-        deleted_count.pop_back();
-        deleted_cut_count.pop_back();
-    }
-    for (unsigned int index = 0;index < deleted_count.back();++index)
+    // tracts changed outside of the journal
+    if(edit_history.back().added_begin + edit_history.back().added_count > tract_data.size())
     {
-        tract_data.push_back(std::vector<float>());
-        tract_data.back().swap(deleted_tract_data.back());
-        tract_color.push_back(deleted_tract_color.back());
-        deleted_tract_data.pop_back();
-        deleted_tract_color.pop_back();
+        clear_deleted();
+        return;
     }
-    deleted_count.pop_back();
-    deleted_cut_count.pop_back();
-
+    redo_history.push_back(std::move(edit_history.back()));
+    edit_history.pop_back();
+    revert_edit(redo_history.back());
 }
-
-
 //---------------------------------------------------------------------------
 void TractModel::redo(void)
 {
-    if(redo_size.empty())
+    if(redo_history.empty())
         return;
-    std::vector<unsigned int> redo_tracts(redo_size.back().second);
-    for (unsigned int index = 0;index < redo_tracts.size();++index)
-        redo_tracts[index] = redo_size.back().first + index;
-    redo_size.pop_back();
-    // keep redo because delete tracts will clear redo
-    std::vector<std::pair<unsigned int,unsigned int> > keep_redo;
-    keep_redo.swap(redo_size);
-    delete_tracts(redo_tracts);
-    keep_redo.swap(redo_size);
+    edit_history.push_back(std::move(redo_history.back()));
+    redo_history.pop_back();
+    apply_edit(edit_history.back());
 }
 //---------------------------------------------------------------------------
 void TractModel::add_tracts(std::vector<std::vector<float> >& new_tracks)
@@ -1415,9 +1814,8 @@ void TractModel::get_quantitative_data(std::vector<float>& data)
 
     // mean length
     {
-        float sum_length = 0.0;
-        float sum_length2 = 0.0;
-        for (unsigned int i = 0;i < tract_data.size();++i)
+        std::vector<float> tract_length(tract_data.size());
+        image::par_for(tract_data.size(),[&](int i)
         {
             float length = 0.0;
             for (unsigned int j = 3;j < tract_data[i].size();j += 3)
@@ -1428,10 +1826,16 @@ void TractModel::get_quantitative_data(std::vector<float>& data)
                     vs[2]*(tract_data[i][j+2]-tract_data[i][j-1])).length();
 
             }
-            sum_length += length;
-            sum_length2 += length*length;
+            tract_length[i] = length;
+        });
+        double sum_length = 0.0;
+        double sum_length2 = 0.0;
+        for (unsigned int i = 0;i < tract_data.size();++i)
+        {
+            sum_length += tract_length[i];
+            sum_length2 += (double)tract_length[i]*tract_length[i];
         }
-        data.push_back(sum_length/((float)tract_data.size()));
+        data.push_back(sum_length/((double)tract_data.size()));
         data.push_back(std::sqrt(sum_length2/(double)tract_data.size()-
                                  sum_length*sum_length/(double)tract_data.size()/(double)tract_data.size()));
     }
@@ -1439,40 +1843,86 @@ void TractModel::get_quantitative_data(std::vector<float>& data)
 
     // tract volume
     {
-
-        std::set<image::vector<3,int> > pass_map;
-        for (unsigned int i = 0;i < tract_data.size();++i)
+        // voxels as packed keys, sorted and counted once
+        std::vector<std::vector<unsigned long long> > tract_voxels(tract_data.size());
+        image::par_for(tract_data.size(),[&](int i)
+        {
             for (unsigned int j = 0;j < tract_data[i].size();j += 3)
-                pass_map.insert(image::vector<3,int>(std::round(tract_data[i][j]),
-                                              std::round(tract_data[i][j+1]),
-                                              std::round(tract_data[i][j+2])));
-
-        data.push_back(pass_map.size()*voxel_volume);
+            {
+                unsigned long long key = 0;
+                for(unsigned int d = 0;d < 3;++d)
+                    key = (key << 21) | (((unsigned long long)((long long)std::round(tract_data[i][j+d]) + (1 << 20))) & 0x1FFFFF);
+                tract_voxels[i].push_back(key);
+            }
+            std::sort(tract_voxels[i].begin(),tract_voxels[i].end());
+            tract_voxels[i].erase(std::unique(tract_voxels[i].begin(),tract_voxels[i].end()),tract_voxels[i].end());
+        });
+        std::vector<unsigned long long> pass_map;
+        for (unsigned int i = 0;i < tract_voxels.size();++i)
+        {
+            pass_map.insert(pass_map.end(),tract_voxels[i].begin(),tract_voxels[i].end());
+            std::vector<unsigned long long>().swap(tract_voxels[i]);
+        }
+        std::sort(pass_map.begin(),pass_map.end());
+        data.push_back((std::unique(pass_map.begin(),pass_map.end())-pass_map.begin())*voxel_volume);
     }
 
-    // output mean and std of each index
+    // output mean and std of each index, all sampled in one pass with
+    // per-thread sums, so that only one tract per thread is held
+    std::vector<unsigned int> index_num;
     for(int data_index = 0;data_index < handle->view_item.size();++data_index)
-    {
-        if(handle->view_item[data_index].name == "color")
-            continue;
-        float sum_data = 0.0;
-        float sum_data2 = 0.0;
-        unsigned int total = 0;
-        for (unsigned int i = 0;i < tract_data.size();++i)
+        if(handle->view_item[data_index].name != "color")
+            index_num.push_back(data_index);
+    if(index_num.empty())
+        return;
+    unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+    std::vector<std::vector<double> > sum(thread_count),sum2(thread_count);
+    std::vector<std::vector<float> > buffer(thread_count);
+    std::vector<size_t> total(thread_count);
+    image::par_for2(tract_data.size(),[&](int i,int id)
+    {
+        unsigned int count = tract_data[i].size()/3;
+        if(!count)
+            return;
+        if(sum[id].empty())
+        {
+            sum[id].resize(index_num.size());
+            sum2[id].resize(index_num.size());
+        }
+        buffer[id].resize((size_t)count*index_num.size());
+        std::vector<float*> out(index_num.size());
+        for(unsigned int k = 0;k < index_num.size();++k)
+            out[k] = &buffer[id][0] + (size_t)k*count;
+        sample_tract(i,index_num,&out[0]);
+        for(unsigned int k = 0;k < index_num.size();++k)
         {
-            std::vector<float> data;
-            get_tract_data(i,data_index,data);
-            for(int j = 0;j < data.size();++j)
+            double s = 0.0,s2 = 0.0;
+            for(unsigned int j = 0;j < count;++j)
             {
-                float value = data[j];
-                sum_data += value;
-                sum_data2 += value*value;
-                ++total;
+                double value = out[k][j];
+                s += value;
+                s2 += value*value;
             }
+            sum[id][k] += s;
+            sum2[id][k] += s2;
         }
-
-        data.push_back(sum_data/((double)total));
-        data.push_back(std::sqrt(sum_data2/(double)total-sum_data*sum_data/(double)total/(double)total));
+        total[id] += count;
+    },thread_count);
+    double n = 0.0;
+    for(unsigned int id = 0;id < thread_count;++id)
+        n += total[id];
+    for(unsigned int k = 0;k < index_num.size();++k)
+    {
+        double sum_data = 0.0;
+        double sum_data2 = 0.0;
+        for(unsigned int id = 0;id < thread_count;++id)
+            if(!sum[id].empty())
+            {
+                sum_data += sum[id][k];
+                sum_data2 += sum2[id][k];
+            }
+        data.push_back(sum_data/n);
+        data.push_back(std::sqrt(sum_data2/n-sum_data*sum_data/n/n));
     }
 }
 
@@ -1609,14 +2059,24 @@ void TractModel::get_report(unsigned int profile_dir,float band_width,const std:
         {
             data_profile.resize(data.size());
             data_profile_w.resize(data.size());
-            for(unsigned int index = 0;index < data_profile.size();++index)
+            image::par_for(data_profile.size(),[&](int index)
             {
                 data_profile[index] = image::mean(data[index].begin(),data[index].end());
                 data_profile_w[index] = 1.0;
-            }
+            });
         }
         else
-            for(int i = 0;i < data.size();++i)
+        {
+            // per-thread histograms of the values at each position
+            unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+            std::vector<std::vector<double> > sum(thread_count),count(thread_count);
+            image::par_for2(data.size(),[&](int i,int id)
+            {
+                if(sum[id].empty())
+                {
+                    sum[id].resize(profile_width);
+                    count[id].resize(profile_width);
+                }
                 for(int j = 0;j < data[i].size();++j)
                 {
                     int pos = profile_on_length ?
@@ -1626,23 +2086,40 @@ void TractModel::get_report(unsigned int profile_dir,float band_width,const std:
                         pos = 0;
                     if(pos >= profile_width)
                         pos = profile_width-1;
-
-                    data_profile[pos] += data[i][j]*weighting[0];
-                    data_profile_w[pos] += weighting[0];
+                    sum[id][pos] += data[i][j];
+                    count[id][pos] += 1.0;
+                }
+            });
+            std::vector<double> hist_sum(profile_width),hist_count(profile_width);
+            for(unsigned int id = 0;id < thread_count;++id)
+                for(unsigned int pos = 0;pos < sum[id].size();++pos)
+                {
+                    hist_sum[pos] += sum[id][pos];
+                    hist_count[pos] += count[id][pos];
+                }
+            // one convolution with the Gaussian kernel. A value at pos spreads
+            // to pos-k only when pos > k, so bin 0 gets only its own values.
+            for(int q = 0;q < (int)profile_width;++q)
+            {
+                double v = hist_sum[q]*weighting[0],w = hist_count[q]*weighting[0];
+                if(q > 0)
                     for(int k = 1;k < weighting.size();++k)
                     {
-                        if(pos > k)
+                        if(q+k < (int)profile_width)
                         {
-                            data_profile[pos-k] += data[i][j]*weighting[k];
-                            data_profile_w[pos-k] += weighting[k];
+                            v += hist_sum[q+k]*weighting[k];
+                            w += hist_count[q+k]*weighting[k];
                         }
-                        if(pos+k < data_profile.size())
+                        if(q-k >= 0)
                         {
-                            data_profile[pos+k] += data[i][j]*weighting[k];
-                            data_profile_w[pos+k] += weighting[k];
+                            v += hist_sum[q-k]*weighting[k];
+                            w += hist_count[q-k]*weighting[k];
                         }
                     }
-                }
+                data_profile[q] = v;
+                data_profile_w[q] = w;
+            }
+        }
     }
 
     for(unsigned int j = 0;j < data_profile.size();++j)
@@ -1686,50 +2163,72 @@ void gradient(input_iterator from,input_iterator to,output_iterator out)
         ++next_from;
     }
 }
-void TractModel::get_tract_data(unsigned int fiber_index,unsigned int index_num,std::vector<float>& data) const
+void TractModel::sample_tract(unsigned int fiber_index,const std::vector<unsigned int>& index_num,
+                              float* const* out) const
 {
-    data.clear();
-    if(tract_data[fiber_index].empty())
+    const std::vector<float>& tract = tract_data[fiber_index];
+    unsigned int count = tract.size()/3;
+    if(!count)
         return;
-    unsigned int count = tract_data[fiber_index].size()/3;
-    data.resize(count);
-    // track specific index
-    if(index_num < handle->get_name_index("color"))
-    {
-        std::vector<image::vector<3,float> > gradient(count);
-        const float (*tract_ptr)[3] = (const float (*)[3])&(tract_data[fiber_index][0]);
+    unsigned int color_index = handle->get_name_index("color");
+    bool has_track_specific_index = false;
+    for(unsigned int k = 0;k < index_num.size();++k)
+        if(index_num[k] < color_index)
+            has_track_specific_index = true;
+    std::vector<image::vector<3,float> > gradient;
+    if(has_track_specific_index)
+    {
+        gradient.resize(count);
+        const float (*tract_ptr)[3] = (const float (*)[3])&(tract[0]);
         ::gradient(tract_ptr,tract_ptr+count,gradient.begin());
-        for (unsigned int point_index = 0,tract_index = 0;
-             point_index < count;++point_index,tract_index += 3)
+    }
+    for (unsigned int point_index = 0,tract_index = 0;
+         point_index < count;++point_index,tract_index += 3)
+    {
+        const float* pos = &(tract[tract_index]);
+        // the location and direction are shared by all indices
+        image::interpolation<image::linear_weighting,3> tri_interpo;
+        bool in_range = false;
+        if(has_track_specific_index)
         {
-            image::interpolation<image::linear_weighting,3> tri_interpo;
             gradient[point_index].normalize();
-            if (tri_interpo.get_location(fib->dim,&(tract_data[fiber_index][tract_index])))
+            in_range = tri_interpo.get_location(fib->dim,pos);
+        }
+        for(unsigned int k = 0;k < index_num.size();++k)
+        {
+            float& result = out[k][point_index];
+            // track specific index
+            if(index_num[k] < color_index && in_range)
             {
                 float value,average_value = 0.0;
                 float sum_value = 0.0;
                 for (unsigned int index = 0;index < 8;++index)
                 {
-                    if ((value = fib->get_track_specific_index(tri_interpo.dindex[index],index_num,gradient[point_index])) == 0.0)
+                    if ((value = fib->get_track_specific_index(tri_interpo.dindex[index],index_num[k],gradient[point_index])) == 0.0)
                         continue;
                     average_value += value*tri_interpo.ratio[index];
                     sum_value += tri_interpo.ratio[index];
                 }
                 if (sum_value > 0.5)
-                    data[point_index] = average_value/sum_value;
-                else
-                    image::estimate(handle->view_item[index_num].image_data,&(tract_data[fiber_index][tract_index]),data[point_index],image::linear);
+                {
+                    result = average_value/sum_value;
+                    continue;
+                }
             }
-            else
-                image::estimate(handle->view_item[index_num].image_data,&(tract_data[fiber_index][tract_index]),data[point_index],image::linear);
+            // voxel-based index
+            image::estimate(handle->view_item[index_num[k]].image_data,pos,result,image::linear);
         }
     }
-    else
-    // voxel-based index
-    {
-        for (unsigned int data_index = 0,index = 0;index < tract_data[fiber_index].size();index += 3,++data_index)
-            image::estimate(handle->view_item[index_num].image_data,&(tract_data[fiber_index][index]),data[data_index],image::linear);
-    }
+}
+
+void TractModel::get_tract_data(unsigned int fiber_index,unsigned int index_num,std::vector<float>& data) const
+{
+    data.clear();
+    if(tract_data[fiber_index].empty())
+        return;
+    data.resize(tract_data[fiber_index].size()/3);
+    float* out = &data[0];
+    sample_tract(fiber_index,std::vector<unsigned int>(1,index_num),&out);
 }
 
 bool TractModel::get_tracts_data(
@@ -1741,8 +2240,10 @@ bool TractModel::get_tracts_data(
         return false;
     data.clear();
     data.resize(tract_data.size());
-    for (unsigned int i = 0;i < tract_data.size();++i)
+    image::par_for(tract_data.size(),[&](int i)
+    {
         get_tract_data(i,index_num,data[i]);
+    });
     return true;
 }
 
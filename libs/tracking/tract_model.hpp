@@ -4,6 +4,7 @@
 #include <iosfwd>
 #include "image/image.hpp"
 #include "fib_data.hpp"
+#include "tract_grid.hpp"
 
 class RoiMgr;
 class TractModel{
@@ -16,13 +17,31 @@ private:
         std::auto_ptr<tracking_data> fib;
 private:
         std::vector<std::vector<float> > tract_data;
-        std::vector<std::vector<float> > deleted_tract_data;
         std::vector<unsigned int> tract_color;
-        std::vector<unsigned int> deleted_tract_color;
-        std::vector<unsigned int> deleted_count;
-        std::vector<std::pair<unsigned int,unsigned int> > deleted_cut_count;
-        std::vector<std::pair<unsigned int,unsigned int> > redo_size;
-        // offset, size
+private:
+        // Edit journal. An edit removes the tracts at removed_index (sorted
+        // positions before the edit) and then inserts added_count tracts at
+        // added_begin. Undo and redo move only the tracts involved.
+        struct TractEdit{
+            std::vector<unsigned int> removed_index;
+            std::vector<std::vector<float> > removed_tracts;
+            std::vector<unsigned int> removed_color;
+            unsigned int added_begin = 0;
+            unsigned int added_count = 0;
+            std::vector<std::vector<float> > added_tracts;// held while the edit is undone
+            std::vector<unsigned int> added_color;
+        };
+        std::vector<TractEdit> edit_history,redo_history;
+        void apply_edit(TractEdit& edit);
+        void revert_edit(TractEdit& edit);
+        void edit_tracts(const std::vector<unsigned int>& tracts_to_delete,
+                         std::vector<std::vector<float> >& new_tracts,
+                         std::vector<unsigned int>& new_tract_color);
+private:
+        // spatial index for select, cut, trim, and filter_by_roi; built on first
+        // use and kept up to date by the edits
+        TractGrid tract_grid;
+        void update_grid(void);
 private:
         // for loading multiple clusters
         std::vector<unsigned int> tract_cluster;
@@ -55,6 +74,11 @@ public:
         tracking_data& get_fib(void){return *fib.get();}
         void add(const TractModel& rhs);
         bool load_from_file(const char* file_name,bool append = false);
+        // loads the tracts of a *.tti file in the cluster (any cluster if
+        // negative) whose bounding boxes intersect [from,to], decoding only
+        // the chunks that hold them
+        bool load_from_tract_file(const char* file_name,int cluster,
+                                  const image::vector<3,float>& from,const image::vector<3,float>& to);
 
         bool save_tracts_to_file(const char* file_name);
         void save_vrml(const char* file_name,
@@ -100,12 +124,18 @@ public:
         void get_end_points(std::vector<image::vector<3,short> >& points);
         void get_tract_points(std::vector<image::vector<3,short> >& points);
 
-        size_t get_deleted_track_count(void) const{return deleted_tract_data.size();}
+        size_t get_deleted_track_count(void) const
+        {
+            size_t count = 0;
+            for(unsigned int index = 0;index < edit_history.size();++index)
+                count += edit_history[index].removed_tracts.size();
+            return count;
+        }
         size_t get_visible_track_count(void) const{return tract_data.size();}
         
         const std::vector<float>& get_tract(unsigned int index) const{return tract_data[index];}
         const std::vector<std::vector<float> >& get_tracts(void) const{return tract_data;}
-        const std::vector<std::vector<float> >& get_deleted_tracts(void) const{return deleted_tract_data;}
+        void get_deleted_tracts(std::vector<std::vector<float> >& tracts) const;
         std::vector<std::vector<float> >& get_tracts(void) {return tract_data;}
         unsigned int get_tract_color(unsigned int index) const{return tract_color[index];}
         size_t get_tract_length(unsigned int index) const{return tract_data[index].size();}
@@ -123,6 +153,10 @@ public:
                         std::vector<float>& values,
                         std::vector<float>& data_profile);
 
+private:
+        // out[k][i] receives index_num[k] at point i of the tract
+        void sample_tract(unsigned int fiber_index,const std::vector<unsigned int>& index_num,
+                          float* const* out) const;
 public:
         void get_tract_data(unsigned int fiber_index,
                             unsigned int index_num,
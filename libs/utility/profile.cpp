@@ -0,0 +1,196 @@
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <locale>
+#include <mutex>
+#include <sstream>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+#include "profile.hpp"
+
+namespace {
+
+struct profile_item{
+    std::string name;
+    std::vector<long long> count,time;// of each thread
+};
+
+struct profile_record{
+    std::string name;
+    unsigned int run_count;
+    double wall_time;
+    std::vector<profile_item> items;
+    bool same_items(const profile_record& rhs) const
+    {
+        if(items.size() != rhs.items.size())
+            return false;
+        for(unsigned int j = 0;j < items.size();++j)
+            if(items[j].name != rhs.items[j].name)
+                return false;
+        return true;
+    }
+    // sums the runs of a table created again and again, e.g. by a tracking
+    // thread reused for each permutation, so the report stays one record long
+    void add(const profile_record& rhs)
+    {
+        run_count += rhs.run_count;
+        wall_time += rhs.wall_time;
+        for(unsigned int j = 0;j < items.size();++j)
+        {
+            std::vector<long long>& count = items[j].count;
+            std::vector<long long>& time = items[j].time;
+            if(count.size() < rhs.items[j].count.size())
+            {
+                count.resize(rhs.items[j].count.size());
+                time.resize(rhs.items[j].time.size());
+            }
+            for(unsigned int t = 0;t < rhs.items[j].count.size();++t)
+            {
+                count[t] += rhs.items[j].count[t];
+                time[t] += rhs.items[j].time[t];
+            }
+        }
+    }
+};
+
+std::atomic<bool> profile_on(false);
+std::mutex profile_mutex;
+std::vector<profile_record> profile_records;
+
+std::string json_name(const std::string& str)
+{
+    std::string result("\"");
+    for(unsigned int index = 0;index < str.size();++index)
+    {
+        if(str[index] == '"' || str[index] == '\\')
+            result.push_back('\\');
+        if((unsigned char)str[index] >= 0x20)
+            result.push_back(str[index]);
+    }
+    result.push_back('"');
+    return result;
+}
+
+template<class value_type>
+void write_array(std::ostream& out,const std::vector<value_type>& values,double scale)
+{
+    out << "[";
+    for(unsigned int index = 0;index < values.size();++index)
+        out << (index ? ",":"") << values[index]*scale;
+    out << "]";
+}
+
+}
+
+void profile_enable(bool on)
+{
+    profile_on = on;
+}
+
+bool profile_enabled(void)
+{
+    return profile_on;
+}
+
+std::string profile_type_name(const std::type_info& info)
+{
+    std::string name(info.name());
+#ifdef __GNUG__
+    int status = 0;
+    char* readable = abi::__cxa_demangle(info.name(),0,0,&status);
+    if(readable)
+    {
+        if(status == 0)
+            name = readable;
+        std::free(readable);
+    }
+#endif
+    return name;
+}
+
+bool profile_write(const char* file_name)
+{
+    std::ostringstream out;
+    out.imbue(std::locale::classic());
+    {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        out << "{\"profile\":[";
+        for(unsigned int i = 0;i < profile_records.size();++i)
+        {
+            const profile_record& r = profile_records[i];
+            out << (i ? ",":"") << "\n{\"name\":" << json_name(r.name)
+                << ",\"run_count\":" << r.run_count << ",\"wall_time\":" << r.wall_time << ",\"items\":[";
+            for(unsigned int j = 0;j < r.items.size();++j)
+            {
+                const profile_item& item = r.items[j];
+                long long count = 0,time = 0;
+                for(unsigned int t = 0;t < item.count.size();++t)
+                {
+                    count += item.count[t];
+                    time += item.time[t];
+                }
+                out << (j ? ",":"") << "\n  {\"name\":" << json_name(item.name)
+                    << ",\"count\":" << count << ",\"time\":" << time*1.0e-9
+                    << ",\"thread_count\":";
+                write_array(out,item.count,1.0);
+                out << ",\"thread_time\":";
+                write_array(out,item.time,1.0e-9);
+                out << "}";
+            }
+            out << "]}";
+        }
+        out << "]}\n";
+    }
+    std::ofstream file(file_name);
+    if(!file)
+        return false;
+    file << out.str();
+    return file.good();
+}
+
+#ifndef NO_PROFILE
+profile_table::profile_table(const char* name_,unsigned int thread_count_,const std::vector<std::string>& items_):
+    on(profile_on),name(name_),items(items_),thread_count(thread_count_),stride(0),rows(0)
+{
+    if(!on)
+        return;
+    // whole cache lines for each row, starting at a line boundary within one
+    // extra line
+    stride = ((items.size()*2+7)/8)*8;
+    data.resize((thread_count+1)*stride+8);
+    rows = &data[0];
+    while(reinterpret_cast<uintptr_t>(rows) % 64)
+        ++rows;
+    begin_time = std::chrono::steady_clock::now();
+}
+
+profile_table::~profile_table(void)
+{
+    if(!on)
+        return;
+    profile_record r;
+    r.name = name;
+    r.run_count = 1;
+    r.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin_time).count();
+    r.items.resize(items.size());
+    for(unsigned int j = 0;j < items.size();++j)
+    {
+        r.items[j].name = items[j];
+        for(unsigned int t = 0;t < thread_count;++t)
+        {
+            r.items[j].count.push_back(rows[t*stride+j*2]);
+            r.items[j].time.push_back(rows[t*stride+j*2+1]);
+        }
+    }
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    for(unsigned int i = 0;i < profile_records.size();++i)
+        if(profile_records[i].name == r.name && profile_records[i].same_items(r))
+        {
+            profile_records[i].add(r);
+            return;
+        }
+    profile_records.push_back(r);
+}
+#endif
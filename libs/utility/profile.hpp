@@ -0,0 +1,68 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+#include <chrono>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+// Counters and timers of the stages of a long operation. Profiling is off until
+// profile_enable(true) is called before the operation starts, and costs a
+// branch per call while off. Define NO_PROFILE to compile it out.
+void profile_enable(bool on);
+bool profile_enabled(void);
+// a readable class name for the items of a table
+std::string profile_type_name(const std::type_info& info);
+// writes the tables finished so far as JSON
+bool profile_write(const char* file_name);
+
+#ifdef NO_PROFILE
+class profile_table{
+public:
+    profile_table(const char*,unsigned int,const std::vector<std::string>&){}
+    bool is_on(void) const{return false;}
+    void count(unsigned int,unsigned int,unsigned int = 1){}
+    long long tic(void) const{return 0;}
+    void toc(unsigned int,unsigned int,long long){}
+};
+#else
+// One row of items for each thread, each row on its own cache lines. Every item
+// has a count and a time, and the table adds its totals to the report when
+// destroyed, so it should outlive the threads that use it. Tables of the same
+// name and items add up in one record of the report.
+class profile_table{
+    bool on;
+    std::string name;
+    std::vector<std::string> items;
+    unsigned int thread_count,stride;
+    std::vector<long long> data;// count and nanoseconds of each item
+    long long* rows;// data aligned to a cache line
+    std::chrono::steady_clock::time_point begin_time;
+    profile_table(const profile_table&);
+    void operator=(const profile_table&);
+public:
+    profile_table(const char* name_,unsigned int thread_count_,const std::vector<std::string>& items_);
+    ~profile_table(void);
+    bool is_on(void) const{return on;}
+    void count(unsigned int thread,unsigned int item,unsigned int n = 1)
+    {
+        if(on)
+            rows[thread*stride+item*2] += n;
+    }
+    long long tic(void) const
+    {
+        return on ? std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count() : 0;
+    }
+    // counts the item once and adds the time since tic
+    void toc(unsigned int thread,unsigned int item,long long t)
+    {
+        if(!on)
+            return;
+        long long* p = rows+thread*stride+item*2;
+        ++p[0];
+        p[1] += tic()-t;
+    }
+};
+#endif
+
+#endif//PROFILE_HPP
@@ -1,30 +1,243 @@
 #include <QProgressDialog>
 #include <QApplication>
+#include <QThread>
 #include <QObject>
 #include <memory>
-#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <locale>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 #include <iostream>
-#include <QTime>
+#include <string>
+#include <vector>
+#include "prog_interface_static_link.h"
 
 std::auto_ptr<QProgressDialog> progressDialog;
-QTime t_total,t_last;
+std::atomic<bool> prog_aborted_(false);
+
+namespace {
+
+struct prog_level{
+    std::string title;
+    unsigned int now,total;
+};
+
+const long long gui_interval = 500;// ms
+const long long log_interval = 2000;
+
+std::mutex prog_mutex;// guards the titles, the stage stack, and the log file
+std::string prog_title;
+std::vector<prog_level> prog_stack;// the enclosing levels of the current stage
+std::ofstream prog_log;
+std::atomic<bool> prog_log_on(false);
+
+std::atomic<bool> prog_active(false);
+std::atomic<std::thread::id> prog_owner;
+std::atomic<bool> prog_gui(false);
+std::atomic<unsigned int> prog_now(0),prog_total(0);
+std::atomic<long long> prog_begin_time(0),loop_begin_time(0);
+std::atomic<long long> log_next_report(0);
+// used only by the owner thread
 bool lock_dialog = false;
-bool prog_aborted_ = false;
+long long gui_next_update = 0;
+
+long long get_time(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool is_owner(void)
+{
+    return prog_active && prog_owner.load() == std::this_thread::get_id();
+}
+
+bool is_main_thread(void)
+{
+    return !QCoreApplication::instance() ||
+            QThread::currentThread() == QCoreApplication::instance()->thread();
+}
+
+// overall progress of the nested levels, prog_mutex held
+double get_fraction(unsigned int now,unsigned int total)
+{
+    double f = total ? std::min<double>(1.0,(double)now/(double)total) : 0.0;
+    for(int index = (int)prog_stack.size()-1;index >= 0;--index)
+        if(prog_stack[index].total)
+            f = std::min<double>(1.0,(prog_stack[index].now+f)/(double)prog_stack[index].total);
+    return f;
+}
+
+// prog_mutex held
+std::string get_full_title(void)
+{
+    std::string title;
+    for(unsigned int index = 0;index < prog_stack.size();++index)
+        if(!prog_stack[index].title.empty())
+            title += prog_stack[index].title + " > ";
+    return title + prog_title;
+}
+
+std::string json_string(const std::string& str)
+{
+    std::string result("\"");
+    for(unsigned int index = 0;index < str.size();++index)
+    {
+        unsigned char c = str[index];
+        if(c == '"' || c == '\\')
+        {
+            result.push_back('\\');
+            result.push_back(c);
+            continue;
+        }
+        if(c < 0x20)
+        {
+            char buf[8];
+            std::sprintf(buf,"\\u%04x",c);
+            result += buf;
+            continue;
+        }
+        result.push_back(c);
+    }
+    result.push_back('"');
+    return result;
+}
+
+// console and log file
+void write_report(long long t,const char* event)
+{
+    unsigned int now = prog_now,total = prog_total;
+    std::lock_guard<std::mutex> lock(prog_mutex);
+    std::string title = get_full_title();
+    if(prog_log_on)
+    {
+        std::ostringstream out;
+        out.imbue(std::locale::classic());
+        out << "{\"event\":\"" << event << "\",\"time\":" << (t-prog_begin_time)/1000.0
+            << ",\"title\":" << json_string(title)
+            << ",\"now\":" << now << ",\"total\":" << total
+            << ",\"progress\":" << get_fraction(now,total) << "}\n";
+        prog_log << out.str() << std::flush;
+    }
+    if(!prog_gui && total && std::string(event) == "progress")
+        std::cout << title << ": " << now << " of " << total << std::endl;
+}
+
+void update_dialog(long long t)
+{
+    if(progressDialog->wasCanceled())
+    {
+        prog_aborted_ = true;
+        return;
+    }
+    unsigned int now = prog_now,total = prog_total;
+    double f;
+    QString label;
+    {
+        std::lock_guard<std::mutex> lock(prog_mutex);
+        f = get_fraction(now,total);
+        label = get_full_title().c_str();
+    }
+    long expected_sec = 0;
+    if(now && now < total)
+        expected_sec = ((double)(t-loop_begin_time)*(double)(total-now)/(double)now/1000.0);
+    progressDialog->setRange(0,1000);
+    progressDialog->setValue(f*1000.0);
+    if(expected_sec)
+        progressDialog->setLabelText(label + QString(": %1 of %2, estimated time: %3 min %4 sec").
+                                         arg(now).arg(total).arg(expected_sec/60).arg(expected_sec%60));
+    else
+        progressDialog->setLabelText(label + QString(": %1 of %2...").arg(now).arg(total));
+    progressDialog->show();
+    QApplication::processEvents();
+}
+
+// rate-limited: the dialog is updated by the owner in the GUI thread, and the
+// console or log by whichever thread comes first
+void update_prog(void)
+{
+    long long t = get_time();
+    if(prog_gui && is_owner() && t >= gui_next_update &&
+       progressDialog.get() && progressDialog->isVisible() &&
+       QThread::currentThread() == progressDialog->thread())
+    {
+        gui_next_update = t + gui_interval;
+        update_dialog(t);
+    }
+    long long next = log_next_report;
+    if(t >= next && (!prog_gui || prog_log_on) &&
+       log_next_report.compare_exchange_strong(next,t + log_interval))
+        write_report(t,"progress");
+}
+
+void end_prog(void)
+{
+    if(progressDialog.get() && QThread::currentThread() == progressDialog->thread())
+    {
+        if(progressDialog->wasCanceled())
+            prog_aborted_ = true;
+        progressDialog.reset(new QProgressDialog("","Cancel",0,100,0));
+        QApplication::processEvents();
+    }
+    if(prog_log_on)
+        write_report(get_time(),"end");
+    prog_active = false;
+}
+
+}
 
 void begin_prog(const char* title,bool lock)
 {
+    // a worker thread cannot take over the progress of another thread
+    if(prog_active && !is_owner() && !is_main_thread())
+        return;
+    long long t = get_time();
+    if(is_owner() && !prog_stack.empty())
+    {
+        // a new loop inside the current stage
+        {
+            std::lock_guard<std::mutex> guard(prog_mutex);
+            prog_title = title;
+        }
+        prog_now = 0;
+        prog_total = 0;
+        loop_begin_time = t;
+        if(!prog_gui)
+            std::cout << title << std::endl;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(prog_mutex);
+        prog_title = title;
+        prog_stack.clear();
+    }
+    prog_owner = std::this_thread::get_id();
+    prog_now = 0;
+    prog_total = 0;
+    prog_begin_time = t;
+    loop_begin_time = t;
+    log_next_report = t + log_interval;
+    prog_gui = progressDialog.get() != 0;
+    prog_active = true;
+    prog_aborted_ = false;
+    if(prog_log_on)
+        write_report(t,"begin");
     if(!progressDialog.get())
     {
         std::cout << title << std::endl;
         return;
     }
     lock_dialog = lock;
+    if(QThread::currentThread() != progressDialog->thread())
+        return;
+    gui_next_update = t + gui_interval;
     progressDialog.reset(new QProgressDialog(title,"Cancel",0,100,0));
     progressDialog->show();
     QApplication::processEvents();
-    t_total.start();
-    t_last.start();
-    prog_aborted_ = false;
 }
 bool is_running(void)
 {
@@ -35,57 +248,105 @@ bool is_running(void)
 
 void set_title(const char* title)
 {
+    if(prog_active && !is_owner())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(prog_mutex);
+        prog_title = title;
+    }
     if(!progressDialog.get())
     {
         std::cout << title << std::endl;
         return;
     }
+    if(QThread::currentThread() != progressDialog->thread())
+        return;
     progressDialog->setLabelText(title);
     QApplication::processEvents();
 }
 bool check_prog(unsigned int now,unsigned int total)
 {
-    if(now >= total && progressDialog.get() && !lock_dialog)
+    if(!is_owner())
+        return now < total && !(prog_active && prog_aborted_);
+    if(now == 0 || now < prog_now)
+        loop_begin_time = get_time();
+    prog_now = now;
+    prog_total = total;
+    if(now >= total)
     {
-        prog_aborted_ = progressDialog->wasCanceled();
-        progressDialog.reset(new QProgressDialog("","Cancel",0,100,0));
-        QApplication::processEvents();
+        if(prog_stack.empty() && !lock_dialog)
+            end_prog();
         return false;
     }
-    if(progressDialog.get() && !progressDialog->isVisible())
-        return now < total;
-    if(now == 0 || now == total)
-        t_total.start();
-    if(progressDialog.get() && (t_last.elapsed() > 500))
-    {
-        t_last.start();
-        long expected_sec = 0;
-        if(now)
-            expected_sec = ((double)t_total.elapsed()*(double)(total-now)/(double)now/1000.0);
-        if(progressDialog->wasCanceled())
-            return false;
-        progressDialog->setRange(0, total);
-        progressDialog->setValue(now);
-        QString label = progressDialog->labelText().split(':').at(0);
-        if(expected_sec)
-            progressDialog->setLabelText(label + QString(": %1 of %2, estimated time: %3 min %4 sec").
-                                             arg(now).arg(total).arg(expected_sec/60).arg(expected_sec%60));
-        else
-            progressDialog->setLabelText(label + QString(": %1 of %2...").arg(now).arg(total));
-        progressDialog->show();
-        QApplication::processEvents();
-    }
-    return now < total;
+    update_prog();
+    return !prog_aborted_;
+}
+
+bool add_prog(unsigned int count)
+{
+    if(!prog_active)
+        return !prog_aborted_;
+    prog_now.fetch_add(count);
+    update_prog();
+    return !prog_aborted_;
+}
+
+void cancel_prog(void)
+{
+    prog_aborted_ = true;
 }
 
 bool prog_aborted(void)
 {
     if(prog_aborted_)
         return true;
-    if(progressDialog.get())
-        return progressDialog->wasCanceled();
-    return false;
+    if(progressDialog.get() && QThread::currentThread() == progressDialog->thread() &&
+       progressDialog->wasCanceled())
+        prog_aborted_ = true;
+    return prog_aborted_;
 }
 
+void set_prog_log(const char* file_name)
+{
+    std::lock_guard<std::mutex> lock(prog_mutex);
+    prog_log_on = false;
+    if(prog_log.is_open())
+        prog_log.close();
+    if(!file_name || !*file_name)
+        return;
+    prog_log.open(file_name,std::ios::app);
+    prog_log_on = prog_log.is_open();
+}
+
+prog_stage::prog_stage(const char* title):active(is_owner())
+{
+    if(!active)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(prog_mutex);
+        prog_level level;
+        level.title = prog_title;
+        level.now = prog_now;
+        level.total = prog_total;
+        prog_stack.push_back(level);
+        prog_title = title;
+    }
+    prog_now = 0;
+    prog_total = 0;
+    loop_begin_time = get_time();
+}
+
+prog_stage::~prog_stage(void)
+{
+    if(!active || !is_owner())
+        return;
+    std::lock_guard<std::mutex> lock(prog_mutex);
+    if(prog_stack.empty())
+        return;
+    prog_title = prog_stack.back().title;
+    prog_now = prog_stack.back().now;
+    prog_total = prog_stack.back().total;
+    prog_stack.pop_back();
+}
 
 
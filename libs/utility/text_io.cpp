@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cctype>
+#include <clocale>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include "image/image.hpp"
+#include "prog_interface_static_link.h"
+#include "text_io.hpp"
+
+static const double pow10_table[23] = {1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+                                       1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+static const float pow10f_table[11] = {1e0f,1e1f,1e2f,1e3f,1e4f,1e5f,1e6f,1e7f,1e8f,1e9f,1e10f};
+
+// strtof reads the decimal point of the C locale, which the application may
+// have changed, so the '.' of the text is translated before the call
+static bool parse_strtof(const char* ptr,const char* end,float& value)
+{
+    char buf[64];
+    std::string long_buf;
+    char* str = buf;
+    size_t length = end-ptr;
+    if(length >= sizeof(buf))
+    {
+        long_buf.resize(length+1);
+        str = &long_buf[0];
+    }
+    char point = std::localeconv()->decimal_point[0];
+    for(size_t i = 0;i < length;++i)
+        str[i] = (ptr[i] == '.' ? point : ptr[i]);
+    str[length] = 0;
+    char* str_end = 0;
+    value = std::strtof(str,&str_end);
+    return str_end == str+length;
+}
+
+const char* parse_float(const char* ptr,const char* end,float& value)
+{
+    while(ptr != end && std::isspace((unsigned char)*ptr))
+        ++ptr;
+    const char* begin = ptr;
+    bool negative = false;
+    if(ptr != end && (*ptr == '-' || *ptr == '+'))
+        negative = (*(ptr++) == '-');
+    unsigned long long mantissa = 0;
+    int digits = 0,exponent = 0;
+    bool has_digit = false;
+    for(;ptr != end && *ptr >= '0' && *ptr <= '9';++ptr,has_digit = true)
+        if(digits < 19)
+        {
+            mantissa = mantissa*10 + (*ptr-'0');
+            if(mantissa)
+                ++digits;
+        }
+        else
+            ++exponent;
+    if(ptr != end && *ptr == '.')
+        for(++ptr;ptr != end && *ptr >= '0' && *ptr <= '9';++ptr,has_digit = true)
+            if(digits < 19)
+            {
+                mantissa = mantissa*10 + (*ptr-'0');
+                if(mantissa)
+                    ++digits;
+                --exponent;
+            }
+    if(!has_digit)
+    {
+        // nan, inf, and other rare forms
+        const char* token_end = begin;
+        while(token_end != end && !std::isspace((unsigned char)*token_end))
+            ++token_end;
+        if(token_end == begin || !parse_strtof(begin,token_end,value))
+            return 0;
+        return token_end;
+    }
+    if(ptr != end && (*ptr == 'e' || *ptr == 'E'))
+    {
+        const char* e = ptr+1;
+        bool e_negative = false;
+        if(e != end && (*e == '-' || *e == '+'))
+            e_negative = (*(e++) == '-');
+        if(e != end && *e >= '0' && *e <= '9')
+        {
+            int e_value = 0;
+            for(;e != end && *e >= '0' && *e <= '9';++e)
+                if(e_value < 10000)
+                    e_value = e_value*10 + (*e-'0');
+            exponent += e_negative ? -e_value : e_value;
+            ptr = e;
+        }
+    }
+    if(mantissa == 0)
+        value = negative ? -0.0f : 0.0f;
+    else
+    if(mantissa <= (1ull << 24) && exponent >= -10 && exponent <= 10)
+    {
+        // mantissa and power are exact floats: a single rounding
+        float result = (float)mantissa;
+        result = exponent < 0 ? result/pow10f_table[-exponent] : result*pow10f_table[exponent];
+        value = negative ? -result : result;
+    }
+    else
+        if(!parse_strtof(begin,ptr,value))
+            return 0;
+    return ptr;
+}
+
+void parse_floats(const char* ptr,const char* end,std::vector<float>& values)
+{
+    float value;
+    while((ptr = parse_float(ptr,end,value)))
+        values.push_back(value);
+}
+
+static void append_exponent(std::string& out,int e10)
+{
+    out.push_back('e');
+    out.push_back(e10 < 0 ? '-':'+');
+    e10 = std::abs(e10);
+    if(e10 >= 100)
+        out.push_back('0'+e10/100);
+    out.push_back('0'+(e10/10)%10);
+    out.push_back('0'+e10%10);
+}
+
+// value*10^e, with e in [-44,44]
+static double scale10(double value,int e)
+{
+    for(;e > 22;e -= 22)
+        value *= pow10_table[22];
+    for(;e < -22;e += 22)
+        value /= pow10_table[22];
+    return e < 0 ? value/pow10_table[-e] : value*pow10_table[e];
+}
+
+void append_float(std::string& out,float value)
+{
+    if(value != value)
+    {
+        out += "nan";
+        return;
+    }
+    if(std::signbit(value))
+    {
+        out.push_back('-');
+        value = -value;
+    }
+    if(value == 0.0f)
+    {
+        out.push_back('0');
+        return;
+    }
+    if(std::isinf(value))
+    {
+        out += "inf";
+        return;
+    }
+    // Any decimal strictly between the midpoints to the neighbouring floats
+    // reads back to value; on a midpoint it does if the mantissa is even.
+    // Everything is scaled to nine digits before the point, where the rounding
+    // errors of the double arithmetic are far below the distance to the
+    // midpoints, and only candidates close to a midpoint are read back.
+    double v = value;
+    double lower = (v+(double)std::nextafter(value,0.0f))*0.5;
+    double upper = value == std::numeric_limits<float>::max() ?
+                   v+(v-lower) : (v+(double)std::nextafter(value,std::numeric_limits<float>::infinity()))*0.5;
+    int e10 = (int)std::floor(std::log10(v));
+    double scaled = scale10(v,8-e10);
+    if(scaled >= pow10_table[9])
+        scaled = scale10(v,8-(++e10));
+    if(scaled < pow10_table[8])
+        scaled = scale10(v,8-(--e10));
+    lower = scale10(lower,8-e10);
+    upper = scale10(upper,8-e10);
+    const double margin = 1.0e-4;
+    unsigned long long n = 0;
+    for(unsigned int precision = 1;precision <= 9;++precision)
+    {
+        double unit = pow10_table[9-precision];
+        double candidate = std::floor(scaled/unit+0.5)*unit;
+        if(candidate > lower+margin && candidate < upper-margin)
+        {
+            n = (unsigned long long)candidate;
+            break;
+        }
+        if(candidate < lower-margin || candidate > upper+margin)
+            continue;
+        // close to a midpoint: read it back
+        char buf[32];
+        int length = std::sprintf(buf,"%llue%d",(unsigned long long)candidate,e10-8);
+        float read_value;
+        if(parse_float(buf,buf+length,read_value) && read_value == value)
+        {
+            n = (unsigned long long)candidate;
+            break;
+        }
+    }
+    // n has nine digits, or ten after rounding up to the next power of ten
+    if(n >= 1000000000ull)
+    {
+        n /= 10;
+        ++e10;
+    }
+    char digits[9];
+    for(int i = 8;i >= 0;--i,n /= 10)
+        digits[i] = '0'+(n%10);
+    unsigned int precision = 9;
+    while(precision > 1 && digits[precision-1] == '0')
+        --precision;
+    if(e10 < -4 || e10 >= (int)std::max<unsigned int>(precision,6))
+    {
+        // scientific
+        out.push_back(digits[0]);
+        if(precision > 1)
+        {
+            out.push_back('.');
+            out.append(digits+1,digits+precision);
+        }
+        append_exponent(out,e10);
+        return;
+    }
+    if(e10 < 0)
+    {
+        out += "0.";
+        out.append(-e10-1,'0');
+        out.append(digits,digits+precision);
+        return;
+    }
+    if((int)precision <= e10+1)
+    {
+        out.append(digits,digits+precision);
+        out.append(e10+1-precision,'0');
+        return;
+    }
+    out.append(digits,digits+e10+1);
+    out.push_back('.');
+    out.append(digits+e10+1,digits+precision);
+}
+
+bool save_text_rows(const char* file_name,unsigned int row_count,
+                    std::function<void(unsigned int,std::string&)> get_row)
+{
+    std::ofstream out(file_name,std::ios::binary);
+    if (!out)
+        return false;
+    const unsigned int block_size = 4096;
+    std::vector<std::string> lines;
+    for(unsigned int from = 0;check_prog(from,row_count);from += block_size)
+    {
+        unsigned int to = std::min<unsigned int>(from+block_size,row_count);
+        lines.resize(to-from);
+        image::par_for(to-from,[&](int i)
+        {
+            lines[i].clear();
+            get_row(from+i,lines[i]);
+        });
+        for(unsigned int i = 0;i < lines.size();++i)
+            out.write(lines[i].c_str(),lines[i].length());
+    }
+    check_prog(0,0);
+    return out.good() && !prog_aborted();
+}
+
+bool load_text_rows(const char* file_name,std::vector<std::vector<float> >& rows)
+{
+    std::ifstream in(file_name,std::ios::binary);
+    if (!in)
+        return false;
+    std::string text;
+    in.seekg(0,std::ios::end);
+    text.resize(in.tellg());
+    in.seekg(0,std::ios::beg);
+    if(!text.empty() && !in.read(&text[0],text.size()))
+        return false;
+    std::vector<std::pair<size_t,size_t> > line;
+    for(size_t pos = 0;pos < text.size();)
+    {
+        size_t end = text.find('\n',pos);
+        if(end == std::string::npos)
+            end = text.size();
+        line.push_back(std::make_pair(pos,end));
+        pos = end+1;
+    }
+    rows.clear();
+    rows.resize(line.size());
+    image::par_for(line.size(),[&](int i)
+    {
+        const char* ptr = text.c_str();
+        parse_floats(ptr+line[i].first,ptr+line[i].second,rows[i]);
+    });
+    return true;
+}
@@ -0,0 +1,34 @@
+#ifndef TEXT_IO_HPP
+#define TEXT_IO_HPP
+#include <string>
+#include <vector>
+#include <functional>
+
+// Locale-independent number text. append_float writes the shortest decimal
+// that reads back to the same float ("%g" style, '.' as the decimal point).
+void append_float(std::string& out,float value);
+template<class iterator_type>
+void append_floats(std::string& out,iterator_type from,iterator_type to,char delimiter)
+{
+    for(;from != to;++from)
+    {
+        append_float(out,*from);
+        out.push_back(delimiter);
+    }
+}
+
+// returns the position after the number, or 0 if no number can be read
+const char* parse_float(const char* ptr,const char* end,float& value);
+// reads white-space separated numbers until the first one that cannot be read
+void parse_floats(const char* ptr,const char* end,std::vector<float>& values);
+
+// Formats the rows on several threads and writes them in order. get_row(i,line)
+// appends row i, including its line break, to line.
+bool save_text_rows(const char* file_name,unsigned int row_count,
+                    std::function<void(unsigned int,std::string&)> get_row);
+
+// Reads a text file and parses each line (without the line break) on several
+// threads.
+bool load_text_rows(const char* file_name,std::vector<std::vector<float> >& rows);
+
+#endif//TEXT_IO_HPP
@@ -1,5 +1,7 @@
 #include <cstdlib>     /* srand, rand */
 #include <ctime>
+#include <fstream>
+#include <iterator>
 #include "vbc_database.h"
 #include "fib_data.hpp"
 #include "libs/tracking/tract_model.hpp"
@@ -37,19 +39,23 @@ bool vbc_database::load_database(const char* database_name)
 }
 
 
-int vbc_database::run_track(const tracking_data& fib,std::vector<std::vector<float> >& tracks,float seed_ratio, unsigned int thread_count)
+void vbc_database::calculate_track_candidate(void)
 {
-    std::vector<image::vector<3,short> > seed;
+    // calculate_spm only assigns values where fa0 of the template passes fiber_threshold
+    track_candidate.clear();
+    track_candidate_pos.clear();
     for(image::pixel_index<3> index(handle->dim);index < handle->dim.size();++index)
-        if(fib.fa[0][index.index()] > tracking_threshold)
-            seed.push_back(image::vector<3,short>(index.x(),index.y(),index.z()));
-    unsigned int count = seed.size()*seed_ratio/1000.0;
-    if(!count)
-    {
-        tracks.clear();
-        return 0;
-    }
-    ThreadData tracking_thread(false);
+        if(handle->dir.fa[0][index.index()] > fiber_threshold || tracking_threshold <= 0.0)
+        {
+            track_candidate.push_back(index.index());
+            track_candidate_pos.push_back(image::vector<3,short>(index.x(),index.y(),index.z()));
+        }
+}
+
+void vbc_database::init_track_context(vbc_track_context& context)
+{
+    context.tracking_thread = std::make_shared<ThreadData>(false);
+    ThreadData& tracking_thread = *context.tracking_thread.get();
     tracking_thread.param.threshold = tracking_threshold;
     tracking_thread.param.cull_cos_angle = std::cos(60 * 3.1415926 / 180.0);
     tracking_thread.param.step_size = 1.0; // fixed 1 mm
@@ -62,13 +68,34 @@ int vbc_database::run_track(const tracking_data& fib,std::vector<std::vector<flo
     tracking_thread.stop_by_tract = 0;// stop by seed
     tracking_thread.center_seed = 0;// subvoxel seeding
     // if no seed assigned, assign whole brain
-    if(roi_list.empty() || std::find(roi_type.begin(),roi_type.end(),3) == roi_type.end())
-        tracking_thread.setRegions(fib.dim,seed,3,"whole brain");
-    if(!roi_list.empty())
+    context.whole_brain_seed = (roi_list.empty() || std::find(roi_type.begin(),roi_type.end(),3) == roi_type.end());
+    if(context.whole_brain_seed)
+        tracking_thread.setRegions(handle->dim,std::vector<image::vector<3,short> >(),3,"whole brain");
+    for(unsigned int index = 0;index < roi_list.size();++index)
+        tracking_thread.setRegions(handle->dim,roi_list[index],roi_type[index],"user assigned region");
+}
+
+int vbc_database::run_track(vbc_track_context& context,const tracking_data& fib,std::vector<std::vector<float> >& tracks,float seed_ratio, unsigned int thread_count)
+{
+    ThreadData& tracking_thread = *context.tracking_thread.get();
+    unsigned int seed_size = 0;
+    if(context.whole_brain_seed)
+        tracking_thread.seeds.clear();
+    for(unsigned int index = 0;index < track_candidate.size();++index)
+        if(fib.fa[0][track_candidate[index]] > tracking_threshold)
+        {
+            if(context.whole_brain_seed)
+                tracking_thread.seeds.push_back(track_candidate_pos[index]);
+            ++seed_size;
+        }
+    unsigned int count = seed_size*seed_ratio/1000.0;
+    if(!count)
     {
-        for(unsigned int index = 0;index < roi_list.size();++index)
-            tracking_thread.setRegions(fib.dim,roi_list[index],roi_type[index],"user assigned region");
+        tracks.clear();
+        return 0;
     }
+    tracking_thread.reset_seed();
+    tracking_thread.track_buffer.clear();
     tracking_thread.run(fib,thread_count,count,true);
     tracking_thread.track_buffer.swap(tracks);
 
@@ -124,6 +151,8 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
     fib.read(*handle);
     float voxel_density = seeding_density*fib.vs[0]*fib.vs[1]*fib.vs[2];
     std::vector<std::vector<float> > tracks;
+    vbc_track_context context;
+    init_track_context(context);
 
     if(model->type == 2) // individual
     {
@@ -150,7 +179,7 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
                 }
                 calculate_spm(data,info,normalize_qa);
                 fib.fa = data.lesser_ptr;
-                run_track(fib,tracks,voxel_density);
+                run_track(context,fib,tracks,voxel_density);
                 cal_hist(tracks,(null) ? subject_lesser_null : subject_lesser);
 
                 if(output_resampling && !null)
@@ -162,7 +191,7 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
 
 
                 fib.fa = data.greater_ptr;
-                run_track(fib,tracks,voxel_density);
+                run_track(context,fib,tracks,voxel_density);
                 cal_hist(tracks,(null) ? subject_greater_null : subject_greater);
 
                 if(output_resampling && !null)
@@ -188,16 +217,16 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
             info.resample(*model.get(),false,false);
             info.individual_data = &(individual_data[subject_id][0]);
             info.individual_data_sd = normalize_qa ? individual_data_sd[subject_id]:1.0;
-            calculate_spm(*spm_maps[subject_id],info,normalize_qa);
+            calculate_spm(*spm_maps[subject_id],info,normalize_qa,threads.size());
             if(terminated)
                 return;
             if(!output_resampling)
             {
                 fib.fa = spm_maps[subject_id]->lesser_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
+                run_track(context,fib,tracks,voxel_density*permutation_count,threads.size());
                 lesser_tracks[subject_id]->add_tracts(tracks,length_threshold);
                 fib.fa = spm_maps[subject_id]->greater_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
+                run_track(context,fib,tracks,voxel_density*permutation_count,threads.size());
                 greater_tracks[subject_id]->add_tracts(tracks,length_threshold);
             }
         }
@@ -214,7 +243,7 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
             calculate_spm(data,info,normalize_qa);
 
             fib.fa = data.lesser_ptr;
-            unsigned int s = run_track(fib,tracks,voxel_density);
+            unsigned int s = run_track(context,fib,tracks,voxel_density);
             if(null)
                 seed_lesser_null[i] = s;
             else
@@ -232,7 +261,7 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
             info.resample(*model.get(),null,true);
             calculate_spm(data,info,normalize_qa);
             fib.fa = data.greater_ptr;
-            s = run_track(fib,tracks,voxel_density);
+            s = run_track(context,fib,tracks,voxel_density);
             if(null)
                 seed_greater_null[i] = s;
             else
@@ -258,17 +287,17 @@ void vbc_database::run_permutation_multithread(unsigned int id,unsigned int thre
         {
             stat_model info;
             info.resample(*model.get(),false,false);
-            calculate_spm(*spm_maps[0],info,normalize_qa);
+            calculate_spm(*spm_maps[0],info,normalize_qa,threads.size());
 
             if(terminated)
                 return;
             if(!output_resampling)
             {
                 fib.fa = spm_maps[0]->lesser_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
+                run_track(context,fib,tracks,voxel_density*permutation_count,threads.size());
                 lesser_tracks[0]->add_tracts(tracks,length_threshold);
                 fib.fa = spm_maps[0]->greater_ptr;
-                run_track(fib,tracks,voxel_density*permutation_count,threads.size());
+                run_track(context,fib,tracks,voxel_density*permutation_count,threads.size());
                 greater_tracks[0]->add_tracts(tracks,length_threshold);
             }
         }
@@ -442,6 +471,7 @@ void vbc_database::run_permutation(unsigned int thread_count,unsigned int permut
         spm_maps.push_back(std::make_shared<connectometry_result>());
     }
     clear();
+    calculate_track_candidate();
     progress = 0;
     for(unsigned int index = 0;index < thread_count;++index)
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
@@ -465,3 +495,148 @@ void vbc_database::calculate_FDR(void)
     }
 
 }
+
+bool vbc_database::load_demographic_file(const char* file_name,unsigned int model_type,std::vector<std::string>& feature_names,
+                                         std::function<bool(unsigned int)> match_subjects)
+{
+    unsigned int num_subjects = handle->db.num_subjects;
+    std::ifstream in(file_name);
+    if(!in)
+    {
+        error_msg = "cannot find the demographic file at ";
+        error_msg += file_name;
+        return false;
+    }
+    std::vector<std::string> items;
+    std::copy(std::istream_iterator<std::string>(in),
+              std::istream_iterator<std::string>(),std::back_inserter(items));
+    auto parse = [this](const std::string& str,double& value)
+    {
+        char* end = 0;
+        value = std::strtod(str.c_str(),&end);
+        if(str.empty() || *end)
+        {
+            error_msg = "invalid demographic file: cannot parse ";
+            error_msg += str;
+            return false;
+        }
+        return true;
+    };
+    auto parse_label = [this](const std::string& str,int& value)
+    {
+        char* end = 0;
+        value = std::strtol(str.c_str(),&end,10);
+        if(str.empty() || *end)
+        {
+            error_msg = "invalid demographic file: cannot parse ";
+            error_msg += str;
+            return false;
+        }
+        return true;
+    };
+
+    model.reset(new stat_model);
+    model->init(num_subjects);
+    feature_names.clear();
+    switch(model_type)
+    {
+    case 0: // multiple regression
+        {
+            unsigned int feature_count = items.size()/(num_subjects+1);
+            if(feature_count*(num_subjects+1) != items.size())
+            {
+                if(!feature_count || !match_subjects || !match_subjects(items.size()))
+                {
+                    error_msg = "subject number mismatch in the demographic file";
+                    return false;
+                }
+                items.resize(feature_count*(num_subjects+1));
+            }
+            std::vector<double> X;
+            for(unsigned int i = 0,index = 0;i < num_subjects;++i)
+            {
+                X.push_back(1); // for the intercep
+                for(unsigned int j = 0;j < feature_count;++j,++index)
+                {
+                    double value;
+                    if(!parse(items[index+feature_count],value))
+                        return false;
+                    X.push_back(value);
+                }
+            }
+            model->type = 1;
+            model->X = X;
+            model->feature_count = feature_count+1; // additional one for intercept
+            for(unsigned int index = 0;index < feature_count;++index)
+            {
+                std::replace(items[index].begin(),items[index].end(),'/','_');
+                std::replace(items[index].begin(),items[index].end(),'\\','_');
+                feature_names.push_back(items[index]);
+            }
+        }
+        break;
+    case 1: // group difference
+    case 2: // paired difference
+        {
+            if(num_subjects != items.size() && num_subjects+1 != items.size())
+            {
+                error_msg = "invalid demographic file: subject number mismatch.";
+                return false;
+            }
+            if(num_subjects+1 == items.size())
+                items.erase(items.begin());
+            std::vector<int> label;
+            for(unsigned int i = 0;i < num_subjects;++i)
+            {
+                int value;
+                if(!parse_label(items[i],value))
+                    return false;
+                label.push_back(value);
+            }
+            if(model_type == 1)
+            {
+                model->type = 0;
+                model->label = label;
+                break;
+            }
+            model->type = 3;
+            model->subject_index.clear();
+            model->paired.clear();
+            for(unsigned int i = 0;i < label.size();++i)
+                if(label[i] > 0)
+                {
+                    for(unsigned int j = 0;j < label.size();++j)
+                        if(label[j] == -label[i])
+                        {
+                            model->subject_index.push_back(i);
+                            model->paired.push_back(j);
+                        }
+                }
+        }
+        break;
+    default:
+        error_msg = "unsupported statistical model";
+        return false;
+    }
+    if(!model->pre_process())
+    {
+        error_msg = "invalid subjet information for statistical analysis";
+        return false;
+    }
+    return true;
+}
+
+float vbc_database::suggest_threshold(stat_model& info,unsigned int thread_count)
+{
+    connectometry_result result;
+    calculate_spm(result,info,normalize_qa,thread_count);
+    std::vector<float> values;
+    values.reserve(handle->dim.size()/8);
+    for(unsigned int index = 0;index < handle->dim.size();++index)
+        if(handle->dir.fa[0][index] > fiber_threshold)
+            values.push_back(result.lesser_ptr[0][index] == 0 ?
+                result.greater_ptr[0][index] :  result.lesser_ptr[0][index]);
+    if(values.empty())
+        return 0.0;
+    return image::segmentation::otsu_threshold(values);
+}
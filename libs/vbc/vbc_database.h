@@ -2,6 +2,7 @@
 #define VBC_DATABASE_H
 #include <vector>
 #include <iostream>
+#include <functional>
 #include "image/image.hpp"
 #include "gzip_interface.hpp"
 #include "prog_interface_static_link.h"
@@ -11,7 +12,13 @@
 class fib_data;
 class tracking;
 class TractModel;
+struct ThreadData;
 
+// per-worker tracking setup reused across permutations; only fib.fa changes between runs
+struct vbc_track_context{
+    std::shared_ptr<ThreadData> tracking_thread;
+    bool whole_brain_seed;
+};
 
 
 class vbc_database
@@ -33,12 +40,16 @@ public:// database information
     bool normalize_qa;
     bool output_resampling;
 public:
-    void calculate_spm(connectometry_result& data,stat_model& info,bool nqa)
+    void calculate_spm(connectometry_result& data,stat_model& info,bool nqa,unsigned int thread_count = 1)
     {
-        ::calculate_spm(handle,data,info,fiber_threshold,nqa,terminated);
+        ::calculate_spm(handle,data,info,fiber_threshold,nqa,terminated,thread_count);
     }
 private: // single subject analysis result
-    int run_track(const tracking_data& fib,std::vector<std::vector<float> >& track,float seed_ratio = 1.0,unsigned int thread_count = 1);
+    std::vector<unsigned int> track_candidate;// voxels where the spm maps can be nonzero
+    std::vector<image::vector<3,short> > track_candidate_pos;
+    void calculate_track_candidate(void);
+    void init_track_context(vbc_track_context& context);
+    int run_track(vbc_track_context& context,const tracking_data& fib,std::vector<std::vector<float> >& track,float seed_ratio = 1.0,unsigned int thread_count = 1);
 public:// for FDR analysis
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> subject_greater_null;
@@ -78,6 +89,12 @@ public:// Multiple regression
     void run_permutation_multithread(unsigned int id,unsigned int thread_count,unsigned int permutation_count);
     void run_permutation(unsigned int thread_count,unsigned int permutation_count);
     void calculate_FDR(void);
+public:// GUI-free model setup used by the command line
+    // match_subjects(item_count) is asked whether to drop the extra items of a
+    // regression file that does not match the subject count
+    bool load_demographic_file(const char* file_name,unsigned int model_type,std::vector<std::string>& feature_names,
+                               std::function<bool(unsigned int)> match_subjects = std::function<bool(unsigned int)>());
+    float suggest_threshold(stat_model& info,unsigned int thread_count);
 public:
 };
 
@@ -10,10 +10,11 @@
 #include "image/image.hpp"
 #include "mapping/fa_template.hpp"
 #include "mapping/atlas.hpp"
+#include "fib_data.hpp"
 #include <iostream>
 #include <iterator>
 #include "program_option.hpp"
-#include "cmd/cnt.cpp" // Qt project cannot build cnt.cpp without adding this.
+#include "utility/profile.hpp"
 
 track_recognition track_network;
 fa_template fa_template_imp;
@@ -71,11 +72,14 @@ int run_cmd(int ac, char *av[])
     {
         std::cout << "DSI Studio " << __DATE__ << ", Fang-Cheng Yeh" << std::endl;
         po.init(ac,av);
+        if(po.has("progress_log"))
+            set_prog_log(po.get("progress_log").c_str());
+        if(po.has("profile"))
+            profile_enable(true);
         std::auto_ptr<QApplication> gui;
         std::auto_ptr<QCoreApplication> cmd;
         for (int i = 1; i < ac; ++i)
-            if (std::string(av[i]) == std::string("--action=cnt") ||
-                std::string(av[i]) == std::string("--action=vis"))
+            if (std::string(av[i]) == std::string("--action=vis"))
             {
                 gui.reset(new QApplication(ac, av));
                 init_application(*gui.get());
@@ -112,6 +116,12 @@ int run_cmd(int ac, char *av[])
             vis();
         if(po.get("action") == std::string("ren"))
             ren();
+        if(po.has("profile"))
+        {
+            std::cout << "write profile to " << po.get("profile") << std::endl;
+            if(!profile_write(po.get("profile").c_str()))
+                std::cout << "cannot write " << po.get("profile") << std::endl;
+        }
         if(gui.get() && po.get("stay_open") == std::string("1"))
             gui->exec();
         return 1;
@@ -594,7 +594,7 @@ void MainWindow::on_warpImage_clicked()
 }
 */
 bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
-bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,unsigned int max_in_flight = 0);
 QString get_src_name(QString file_name);
 
 void MainWindow::on_batch_src_clicked()
@@ -615,6 +615,7 @@ void MainWindow::on_batch_src_clicked()
         begin_prog("batch creating src");
         for(unsigned int i = 0;check_prog(i,dir_list.size()) && !prog_aborted();++i)
         {
+            prog_stage stage(dir_list[i].toLocal8Bit().begin());
             QDir cur_dir = dir_list[i];
             QStringList new_list = cur_dir.entryList(QStringList(""),QDir::AllDirs|QDir::NoDotAndDotDot);
             for(unsigned int index = 0;index < new_list.size();++index)
@@ -59,6 +59,7 @@ GLWidget::~GLWidget()
     deleteTexture(slice_texture[0]);
     deleteTexture(slice_texture[1]);
     deleteTexture(slice_texture[2]);
+    tract_geometry.clear([](unsigned int list){glDeleteLists(list, 1);});
     glDeleteLists(tracts, 1);
     //std::cout << __FUNCTION__ << " " << __FILE__ << std::endl;
 }
@@ -854,71 +855,26 @@ void GLWidget::add_odf(image::pixel_index<3> pos)
         *(iter+half_odf) -= displacement;
     }
 }
-void myglColor(const image::vector<3,float>& color,float alpha)
-{
-    if(alpha == 1.0)
-        glColor3fv(color.begin());
-    else
-        glColor4f(color[0],color[1],color[2],alpha);
-}
 
 void GLWidget::makeTracts(void)
 {
     if(!tracts)
         return;
     makeCurrent();
-    glDeleteLists(tracts, 1);
-    glNewList(tracts, GL_COMPILE);
     float alpha = (tract_alpha_style == 0)? tract_alpha/2.0:tract_alpha;
     const float detail_option[] = {1.0,0.5,0.25,0.0,0.0};
-    bool show_end_points = tract_style == 2;
-    float tube_detail = tube_diameter*detail_option[tract_tube_detail]*4.0;
+    TractRenderParam param;
+    param.tube = tract_style;
+    param.show_end_points = tract_style == 2;
+    param.tube_diameter = tube_diameter;
+    param.tube_detail = tube_diameter*detail_option[tract_tube_detail]*4.0;
+    param.end_point_shift = end_point_shift;
+    param.alpha = alpha;
     float skip_rate = 1.0;
 
-    float color_r;
-    std::vector<float> mean_fa;
-    unsigned int mean_fa_index = 0;
     unsigned int track_num_index = cur_tracking_window.handle->get_name_index(cur_tracking_window.color_bar->get_tract_color_name().toStdString());
-    // show tract by index value
-    if (tract_color_style > 1)
-    {
-        if(tract_color_style == 3)// mean value
-        {
-            for (unsigned int active_tract_index = 0;
-                    active_tract_index < cur_tracking_window.tractWidget->rowCount();
-                    ++active_tract_index)
-            {
-                if(cur_tracking_window.tractWidget->item(active_tract_index,0)->checkState() != Qt::Checked)
-                    continue;
-                TractModel* active_tract_model =
-                    cur_tracking_window.tractWidget->tract_models[active_tract_index];
-                if (active_tract_model->get_visible_track_count() == 0)
-                    continue;
-                unsigned int tracks_count = active_tract_model->get_visible_track_count();
-                for (unsigned int data_index = 0; data_index < tracks_count; ++data_index)
-                {
-                    unsigned int vertex_count =
-                            active_tract_model->get_tract_length(data_index)/3;
-                    if (vertex_count <= 1)
-                        continue;
-
-                    std::vector<float> fa_values;
-                    active_tract_model->get_tract_data(data_index,track_num_index,fa_values);
-                    float sum = std::accumulate(fa_values.begin(),fa_values.end(),0.0f);
-                    sum /= (float)fa_values.size();
-                    mean_fa.push_back(sum);
-                }
-            }
-        }
-    }
-
-    std::vector<image::vector<3,float> > points(8),previous_points(8),
-                                      normals(8),previous_normals(8);
-    image::rgb_color paint_color;
-    image::vector<3,float> paint_color_f;
-    std::vector<float> color;
 
-    unsigned int visible_tracts = get_param("tract_visible_tract");
+    std::vector<TractModel*> active_tract_models;
     {
         unsigned int total_tracts = 0;
         for (unsigned int active_tract_index = 0;
@@ -931,244 +887,144 @@ void GLWidget::makeTracts(void)
                 cur_tracking_window.tractWidget->tract_models[active_tract_index];
             if (active_tract_model->get_visible_track_count() == 0)
                 continue;
-
+            active_tract_models.push_back(active_tract_model);
             total_tracts += active_tract_model->get_visible_track_count();
         }
+        unsigned int visible_tracts = get_param("tract_visible_tract");
         if(total_tracts != 0)
             skip_rate = (float)visible_tracts/(float)total_tracts;
     }
-    image::uniform_dist<float> uniform_gen(0,1.0);
+    // reduced detail when only part of the tracts can be shown (half voxel error)
+    param.simplify_error = (skip_rate < 1.0) ? 0.5:0.0;
+
+    // select the tracts to draw: a prefix of the coverage-preserving order keeps
+    // the same subset between rebuilds and samples small bundles evenly
+    std::vector<TractModel*> tract_model;
+    std::vector<unsigned int> tract_index;
     {
-        for (unsigned int active_tract_index = 0;
-                active_tract_index < cur_tracking_window.tractWidget->rowCount();
-                ++active_tract_index)
+        std::map<const TractModel*,TractLOD> active_lod;
+        for (unsigned int i = 0;i < active_tract_models.size();++i)
         {
-            if(cur_tracking_window.tractWidget->item(active_tract_index,0)->checkState() != Qt::Checked)
-                continue;
-            TractModel* active_tract_model =
-                cur_tracking_window.tractWidget->tract_models[active_tract_index];
-            if (active_tract_model->get_visible_track_count() == 0)
-                continue;
-
-            unsigned int tracks_count = active_tract_model->get_visible_track_count();
-            for (unsigned int data_index = 0; data_index < tracks_count; ++data_index)
+            TractModel* model = active_tract_models[i];
+            std::vector<unsigned int> subset;
+            if(skip_rate < 1.0)
             {
-                unsigned int vertex_count =
-                        active_tract_model->get_tract_length(data_index)/3;
-                if (vertex_count <= 1)
-                    continue;
-
-                if(skip_rate < 1.0 && uniform_gen() > skip_rate)
-                {
-                    mean_fa_index++;
+                TractLOD& lod = active_lod[model];
+                auto iter = tract_lod.find(model);
+                if(iter != tract_lod.end())
+                    std::swap(lod,iter->second);
+                lod.update(model->get_tracts(),4.0);
+                lod.get_subset(std::ceil(skip_rate*model->get_visible_track_count()),subset);
+            }
+            else
+            {
+                subset.resize(model->get_visible_track_count());
+                for(unsigned int j = 0;j < subset.size();++j)
+                    subset[j] = j;
+            }
+            for (unsigned int j = 0;j < subset.size();++j)
+            {
+                if (model->get_tract_length(subset[j])/3 <= 1)
                     continue;
-                }
-
-                const float* data_iter = &*(active_tract_model->get_tract(data_index).begin());
+                tract_model.push_back(model);
+                tract_index.push_back(subset[j]);
+            }
+        }
+        tract_lod.swap(active_lod);
+    }
 
-                switch(tract_color_style)
-                {
-                case 1:
-                    paint_color = active_tract_model->get_tract_color(data_index);
-                    paint_color_f = image::vector<3,float>(paint_color.r,paint_color.g,paint_color.b);
-                    paint_color_f /= 255.0;
-                    break;
-                case 2:// local
-                    active_tract_model->get_tract_data(data_index,track_num_index,color);
-                    break;
-                case 3:// mean
-                    paint_color_f = cur_tracking_window.color_bar->get_color(mean_fa[mean_fa_index++]);
-                    break;
-                }
-                image::vector<3,float> last_pos(data_iter),pos,
-                    vec_a(1,0,0),vec_b(0,1,0),
-                    vec_n,prev_vec_n,vec_ab,vec_ba,cur_color,previous_color;
+    // get the color of each tract
+    std::vector<const float*> data(tract_model.size());
+    std::vector<unsigned int> vertex_count(tract_model.size());
+    std::vector<std::vector<image::vector<3,float> > > color(tract_model.size());
+    image::par_for(tract_model.size(),[&](int i)
+    {
+        const TractModel* model = tract_model[i];
+        unsigned int data_index = tract_index[i];
+        data[i] = &*(model->get_tract(data_index).begin());
+        vertex_count[i] = model->get_tract_length(data_index)/3;
+        switch(tract_color_style)
+        {
+        case 1:// manual assigned
+            {
+                image::rgb_color paint_color = model->get_tract_color(data_index);
+                image::vector<3,float> paint_color_f(paint_color.r,paint_color.g,paint_color.b);
+                paint_color_f /= 255.0;
+                color[i].push_back(paint_color_f);
+            }
+            break;
+        case 2:// local anisotropy
+            {
+                std::vector<float> values;
+                model->get_tract_data(data_index,track_num_index,values);
+                color[i].resize(values.size());
+                for(unsigned int j = 0;j < values.size();++j)
+                    color[i][j] = cur_tracking_window.color_bar->get_color(values[j]);
+            }
+            break;
+        case 3:// mean anisotropy
+            {
+                std::vector<float> values;
+                model->get_tract_data(data_index,track_num_index,values);
+                float sum = std::accumulate(values.begin(),values.end(),0.0f);
+                sum /= (float)values.size();
+                color[i].push_back(cur_tracking_window.color_bar->get_color(sum));
+            }
+            break;
+        }
+    });
 
-                glBegin((tract_style) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP);
-                for (unsigned int j = 0, index = 0; index < vertex_count;j += 3, data_iter += 3, ++index)
+    // each block of tracts gets its own display list, so that unchanged blocks
+    // are not compiled again
+    auto compile = [&](const std::vector<TractGeometry>& block)
+    {
+        GLuint list = glGenLists(1);
+        glNewList(list, GL_COMPILE);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        if(param.tube)
+            glEnableClientState(GL_NORMAL_ARRAY);
+        std::vector<float> rgba;
+        for(unsigned int i = 0;i < block.size();++i)
+        {
+            const TractGeometry& geo = block[i];
+            if(geo.strip_count.empty() || geo.vertex.empty())
+                continue;
+            glVertexPointer(3,GL_FLOAT,0,&geo.vertex[0]);
+            if(param.tube)
+                glNormalPointer(GL_FLOAT,0,&geo.normal[0]);
+            if(alpha == 1.0)
+                glColorPointer(3,GL_FLOAT,0,&geo.color[0]);
+            else
+            {
+                rgba.resize(geo.size()*4);
+                for(unsigned int j = 0,k = 0;j < rgba.size();j += 4,k += 3)
                 {
-                    pos[0] = data_iter[0];
-                    pos[1] = data_iter[1];
-                    pos[2] = data_iter[2];
-                    if (index + 1 < vertex_count)
-                    {
-                        vec_n[0] = data_iter[3] - data_iter[0];
-                        vec_n[1] = data_iter[4] - data_iter[1];
-                        vec_n[2] = data_iter[5] - data_iter[2];
-                        vec_n.normalize();
-                    }
-
-                    switch(tract_color_style)
-                    {
-                    case 0://directional
-                        cur_color[0] = std::fabs(vec_n[0]);
-                        cur_color[1] = std::fabs(vec_n[1]);
-                        cur_color[2] = std::fabs(vec_n[2]);
-                        break;
-                    case 1://manual assigned
-                    case 3://mean anisotropy
-                    case 4://mean directional
-                        cur_color = paint_color_f;
-                        break;
-                    case 2://local anisotropy
-                        if(index < color.size())
-                            cur_color = cur_tracking_window.color_bar->get_color(color[index]);
-                        break;
-                    }
-
-                    // skip straight line!
-                    if(tract_style)
-                    {
-                    if (index != 0 && index+1 != vertex_count)
-                    {
-                        image::vector<3,float> displacement(data_iter+3);
-                        displacement -= last_pos;
-                        displacement -= prev_vec_n*(prev_vec_n*displacement);
-                        if (displacement.length() < tube_detail)
-                            continue;
-                    }
-\
-                    if (index == 0 && std::fabs(vec_a*vec_n) > 0.5)
-                        std::swap(vec_a,vec_b);
-
-                    vec_b = vec_a.cross_product(vec_n);
-                    vec_a = vec_n.cross_product(vec_b);
-                    vec_a.normalize();
-                    vec_b.normalize();
-                    vec_ba = vec_ab = vec_a;
-                    vec_ab += vec_b;
-                    vec_ba -= vec_b;
-                    vec_ab.normalize();
-                    vec_ba.normalize();
-                    // get normals
-                    {
-                        normals[0] = vec_a;
-                        normals[1] = vec_ab;
-                        normals[2] = vec_b;
-                        normals[3] = -vec_ba;
-                        normals[4] = -vec_a;
-                        normals[5] = -vec_ab;
-                        normals[6] = -vec_b;
-                        normals[7] = vec_ba;
-                    }
-                    vec_ab *= tube_diameter;
-                    vec_ba *= tube_diameter;
-                    vec_a *= tube_diameter;
-                    vec_b *= tube_diameter;
-
-                    // add point
-                    {
-                        std::fill(points.begin(),points.end(),pos);
-                        points[0] += vec_a;
-                        points[1] += vec_ab;
-                        points[2] += vec_b;
-                        points[3] -= vec_ba;
-                        points[4] -= vec_a;
-                        points[5] -= vec_ab;
-                        points[6] -= vec_b;
-                        points[7] += vec_ba;
-                    }
-                    // add end
-                    static const unsigned char end_sequence[8] = {4,3,5,2,6,1,7,0};
-                    if (index == 0)
-                    {
-                        /*
-                        glColor3fv(cur_color.begin());
-                        glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
-                        for (unsigned int k = 0;k < 8;++k)
-                            glVertex3fv(points[end_sequence[k]].begin());
-                        if(show_end_points)
-                            glEnd();*/
-                        if(show_end_points)
-                        {
-                            myglColor(cur_color,alpha);
-                            glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
-                            image::vector<3,float> shift(vec_n);
-                            shift *= -(int)end_point_shift;
-                            for (unsigned int k = 0;k < 8;++k)
-                            {
-                                image::vector<3,float> cur_point = points[end_sequence[k]];
-                                cur_point += shift;
-                                glVertex3fv(cur_point.begin());
-                            }
-                            glEnd();
-                        }
-                        else
-                        {
-                            myglColor(cur_color,alpha);
-                            glNormal3f(-vec_n[0],-vec_n[1],-vec_n[2]);
-                            for (unsigned int k = 0;k < 8;++k)
-                                glVertex3fv(points[end_sequence[k]].begin());
-                        }
-                    }
-                    else
-                    // add tube
-                    {
-
-                        if(!show_end_points)
-                        {
-                            myglColor(cur_color,alpha);
-                            glNormal3fv(normals[0].begin());
-                            glVertex3fv(points[0].begin());
-                            for (unsigned int k = 1;k < 8;++k)
-                            {
-                               myglColor(previous_color,alpha);
-                               glNormal3fv(previous_normals[k].begin());
-                               glVertex3fv(previous_points[k].begin());
-
-                               myglColor(cur_color,alpha);
-                               glNormal3fv(normals[k].begin());
-                               glVertex3fv(points[k].begin());
-                            }
-                            myglColor(cur_color,alpha);
-                            glNormal3fv(normals[0].begin());
-                            glVertex3fv(points[0].begin());
-                        }
-                        if(index +1 == vertex_count)
-                        {
-                            if(show_end_points)
-                            {
-                                glBegin((tract_style) ? GL_TRIANGLE_STRIP : GL_LINE_STRIP);
-                                myglColor(cur_color,alpha);
-                                glNormal3fv(vec_n.begin());
-                                image::vector<3,float> shift(vec_n);
-                                shift *= (int)end_point_shift;
-                                for (int k = 7;k >= 0;--k)
-                                {
-                                    image::vector<3,float> cur_point = points[end_sequence[k]];
-                                    cur_point += shift;
-                                    glVertex3fv(cur_point.begin());
-                                }
-                            }
-                            else
-                            {
-                                myglColor(cur_color,alpha);
-                                glNormal3fv(vec_n.begin());
-                                for (int k = 7;k >= 0;--k)
-                                    glVertex3fv(points[end_sequence[k]].begin());
-                            }
-                        }
-
-                    }
-
-                    previous_points.swap(points);
-                    previous_normals.swap(normals);
-                    previous_color = cur_color;
-                    prev_vec_n = vec_n;
-                    last_pos = pos;
-                    }
-                    else
-                    {
-                        myglColor(cur_color,alpha);
-                        glVertex3fv(pos.begin());
-                    }
+                    rgba[j] = geo.color[k];
+                    rgba[j+1] = geo.color[k+1];
+                    rgba[j+2] = geo.color[k+2];
+                    rgba[j+3] = alpha;
                 }
-                glEnd();
+                glColorPointer(4,GL_FLOAT,0,&rgba[0]);
             }
+            for(unsigned int j = 0;j < geo.strip_count.size();++j)
+                glDrawArrays(param.tube ? GL_TRIANGLE_STRIP : GL_LINE_STRIP,
+                             geo.strip_begin[j],geo.strip_count[j]);
         }
-    }
-
+        if(param.tube)
+            glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glEndList();
+        return (unsigned int)list;
+    };
+    tract_geometry.update(data,vertex_count,color,param,compile,
+                          [](unsigned int list){glDeleteLists(list, 1);});
 
+    glDeleteLists(tracts, 1);
+    glNewList(tracts, GL_COMPILE);
+    for(unsigned int i = 0;i < tract_geometry.size();++i)
+        glCallList(tract_geometry[i]);
     glEndList();
 
     check_error(__FUNCTION__);
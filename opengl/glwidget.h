@@ -4,10 +4,14 @@
 #include <QTime>
 #define NOMINMAX
 #include <memory>
+#include <map>
 #include "QtOpenGL/QGLWidget"
 #include "tracking/region/RegionModel.h"
 #include "tracking/tracking_window.h"
+#include "libs/tracking/tract_geometry.hpp"
+#include "libs/tracking/tract_lod.hpp"
 class RenderingTableWidget;
+class TractModel;
 class GLWidget : public QGLWidget
 {
 Q_OBJECT
@@ -123,6 +127,8 @@ Q_OBJECT
      unsigned char slice_index;
  public:
      GLuint tracts,slice_texture[3];
+     TractGeometryCache tract_geometry;
+     std::map<const TractModel*,TractLOD> tract_lod;
      int slice_pos[3];
      QPoint lastPos;
      image::matrix<4,4,float> mat,transformation_matrix,rotation_matrix;
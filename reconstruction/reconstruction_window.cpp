@@ -14,6 +14,7 @@
 #include "prog_interface_static_link.h"
 #include "tracking/region/Regions.h"
 #include "libs/dsi/image_model.hpp"
+#include "libs/dsi/motion_correction.hpp"
 #include "gzip_interface.hpp"
 #include "manual_alignment.h"
 
@@ -851,91 +852,6 @@ void reconstruction_window::on_SlicePos_valueChanged(int position)
     scene.addRect(0, 0, dwi.width()*ratio,dwi.height()*ratio,QPen(),slice_image);
 }
 
-void rec_motion_correction_parallel(ImageModel* handle,
-                                    std::vector<image::affine_transform<double> >& args,
-                                    unsigned int total_thread,unsigned int id,unsigned int& progress,bool& terminated)
-{
-    for(unsigned int i = id;i < handle->voxel.bvalues.size() && !terminated;i += total_thread)
-    {
-
-        if(id == 0)
-            progress = i*99/handle->voxel.bvalues.size();
-        if(i == 0)
-            continue;
-        image::basic_image<float,3> I0,I1;
-        I0 = image::make_image(handle->dwi_data[0],handle->voxel.dim);
-        I1 = image::make_image(handle->dwi_data[i],handle->voxel.dim);
-        image::filter::mean(I0);
-        image::filter::mean(I1);
-        image::filter::mean(I0);
-        image::filter::mean(I1);
-        image::filter::mean(I0);
-        image::filter::mean(I1);
-        image::filter::gradient_magnitude(I0);
-        image::filter::gradient_magnitude(I1);
-        image::normalize(I0);
-        image::normalize(I1);
-
-
-        image::affine_transform<float> upper,lower;
-        upper.translocation[0] = 2;
-        upper.translocation[1] = 2;
-        upper.translocation[2] = 2;
-        lower.translocation[0] = -2;
-        lower.translocation[1] = -2;
-        lower.translocation[2] = -2;
-        upper.rotation[0] = 3.1415926*3.0/180.0;
-        upper.rotation[1] = 3.1415926*3.0/180.0;
-        upper.rotation[2] = 3.1415926*3.0/180.0;
-        lower.rotation[0] = -3.1415926*3.0/180.0;
-        lower.rotation[1] = -3.1415926*3.0/180.0;
-        lower.rotation[2] = -3.1415926*3.0/180.0;
-        upper.scaling[0] = 1.03;
-        upper.scaling[1] = 1.03;
-        upper.scaling[2] = 1.03;
-        lower.scaling[0] = 0.96;
-        lower.scaling[1] = 0.96;
-        lower.scaling[2] = 0.96;
-        upper.affine[0] = 0.04;
-        upper.affine[1] = 0.04;
-        upper.affine[2] = 0.04;
-        lower.affine[0] = -0.04;
-        lower.affine[1] = -0.04;
-        lower.affine[2] = -0.04;
-        image::normalize(I1);
-        image::reg::fun_adoptor<image::basic_image<float,3>,
-                                image::vector<3>,
-                                image::affine_transform<double>,
-                                image::affine_transform<double>,
-                                image::reg::square_error> fun(I0,handle->voxel.vs,I1,handle->voxel.vs,args[i]);
-        double optimal_value = fun(args[i][0]);
-        image::optimization::graient_descent(args[i].begin(),args[i].end(),
-                                             upper.begin(),lower.begin(),fun,optimal_value,terminated,0.05);
-        //for(unsigned int index = 0;index < 12;++index)
-        //    std::cout << args[i][index] << " ";
-        //std::cout << std::endl;
-    }
-}
-
-void rec_motion_correction(ImageModel* handle,unsigned int total_thread,
-                           std::vector<image::affine_transform<double> >& args,
-                           unsigned int& progress,
-                           bool& terminated)
-{
-    args.resize(handle->voxel.bvalues.size());
-    std::vector<std::shared_ptr<std::future<void> > > threads;
-    for(unsigned int i = 1;i < total_thread;++i)
-        threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
-            [&,i](){rec_motion_correction_parallel(handle,args,total_thread,i,progress,terminated);})));
-    rec_motion_correction_parallel(handle,args,total_thread,0,progress,terminated);
-    for(unsigned int i = 0;i < threads.size();++i)
-        threads[i]->wait();
-    for(unsigned int i = 0;i < handle->voxel.bvalues.size();++i)
-        handle->rotate_dwi(i,image::transformation_matrix<double>(args[i],handle->voxel.dim,handle->voxel.vs,handle->voxel.dim,handle->voxel.vs));
-    args.clear();
-    progress = 100;
-}
-
 void reconstruction_window::on_motion_correction_clicked()
 {
     if(motion_correction_thread.get())
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "image/image.hpp"
+#include "image_model.hpp"
+#include "dsi_interface_static_link.h"
+#include "test.hpp"
+
+namespace {
+
+// thin straight bundles along (1,1,0), (0,1,1) and (1,0,1). Every wrong
+// b-table changes the direction of at least one of them.
+void make_bundles(const image::geometry<3>& dim,std::vector<image::vector<3,float> >& fiber_dir)
+{
+    const float axis[3][3] = {{1.0f,1.0f,0.0f},{0.0f,1.0f,1.0f},{1.0f,0.0f,1.0f}};
+    const float shift[3][3] = {{0.0f,0.0f,-2.0f},{6.0f,0.0f,0.0f},{0.0f,-7.0f,0.0f}};
+    fiber_dir.assign(dim.size(),image::vector<3,float>());
+    for(image::pixel_index<3> index(dim);index < dim.size();++index)
+        for(unsigned int i = 0;i < 3;++i)
+        {
+            image::vector<3,float> a(axis[i]),d;
+            a.normalize();
+            for(unsigned int k = 0;k < 3;++k)
+                d[k] = index[k]-dim[k]*0.5f-shift[i][k];
+            float along = a*d;
+            if(d*d-along*along < 1.5f*1.5f)
+                fiber_dir[index.index()] = a;
+        }
+}
+
+// the signals of the tensors of the bundles, isotropic elsewhere
+void make_model(const image::geometry<3>& dim,const std::vector<image::vector<3,float> >& bvectors,
+                const std::vector<float>& bvalues,ImageModel& model,
+                std::vector<image::basic_image<unsigned short,3> >& dwi)
+{
+    std::vector<image::vector<3,float> > fiber_dir;
+    make_bundles(dim,fiber_dir);
+    model.voxel.dim = dim;
+    model.voxel.vs = image::vector<3>(2.0f,2.0f,2.0f);
+    model.voxel.bvalues = bvalues;
+    model.voxel.bvectors = bvectors;
+    model.voxel.ti.init(8);
+    model.voxel.max_fiber_number = 1;
+    dwi.resize(bvalues.size());
+    model.dwi_data.clear();
+    for(unsigned int i = 0;i < bvalues.size();++i)
+    {
+        dwi[i].resize(dim);
+        for(unsigned int index = 0;index < dim.size();++index)
+        {
+            float cos = bvectors[i]*fiber_dir[index];
+            float d = (fiber_dir[index]*fiber_dir[index] > 0.0f) ? 0.3e-3f+1.4e-3f*cos*cos : 0.7e-3f;
+            dwi[i][index] = 1000.0f*std::exp(-bvalues[i]*d);
+        }
+        model.dwi_data.push_back(&dwi[i][0]);
+    }
+    model.mask.resize(dim);
+    std::fill(model.mask.begin(),model.mask.end(),1);
+}
+
+}
+
+// DWI of known tensors given with a b-table flipped along x, y or z, or with
+// x and y swapped. The check must restore the b-table both on the subsampled
+// fit of a thick volume and on the full check (evaluate_fib) of a thin one,
+// and leave a correct b-table alone.
+bool test_btable(bool benchmark)
+{
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> unit(-1.0f,1.0f);
+    std::vector<image::vector<3,float> > bvectors(1);
+    std::vector<float> bvalues(1,0.0f);
+    for(unsigned int i = 0;i < 64;++i)
+    {
+        image::vector<3,float> v;
+        do{
+            v = image::vector<3,float>(unit(gen),unit(gen),unit(gen));
+        }while(v.length() > 1.0f || v.length() < 0.1f);
+        v.normalize();
+        bvectors.push_back(v);
+        bvalues.push_back(1000.0f);
+    }
+    const char* suffix[5] = {"",".fx",".fy",".fz",".pyxz"};
+    image::geometry<3> dims[2] = {image::geometry<3>(40,44,36),image::geometry<3>(40,44,10)};
+    for(unsigned int d = 0;d < 2;++d)
+        for(unsigned int wrong = 0;wrong < 5;++wrong)
+        {
+            std::vector<image::vector<3,float> > wrong_bvectors(bvectors);
+            for(unsigned int i = 0;i < wrong_bvectors.size();++i)
+                if(wrong == 4)
+                    std::swap(wrong_bvectors[i][0],wrong_bvectors[i][1]);
+                else
+                    if(wrong)
+                        wrong_bvectors[i][wrong-1] = -wrong_bvectors[i][wrong-1];
+            ImageModel model;
+            std::vector<image::basic_image<unsigned short,3> > dwi;
+            make_model(dims[d],bvectors,bvalues,model,dwi);
+            model.voxel.bvectors = wrong_bvectors;
+            TEST_CHECK(check_b_table(&model,1) == suffix[wrong]);
+            for(unsigned int i = 0;i < bvectors.size();++i)
+                for(unsigned int k = 0;k < 3;++k)
+                    TEST_CHECK(model.voxel.bvectors[i][k] == bvectors[i][k]);
+        }
+    if(benchmark)
+    {
+        ImageModel model;
+        std::vector<image::basic_image<unsigned short,3> > dwi;
+        make_model(image::geometry<3>(128,128,72),bvectors,bvalues,model,dwi);
+        unsigned int thread_count = std::max<unsigned int>(1,std::thread::hardware_concurrency());
+        auto begin = std::chrono::steady_clock::now();
+        check_b_table(&model,thread_count);
+        std::cout << "btable: 128x128x72 checked in "
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count()
+                  << " s" << std::endl;
+    }
+    return true;
+}
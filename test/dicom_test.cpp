@@ -0,0 +1,200 @@
+#include <QDir>
+#include <QStringList>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "dicom/dwi_header.hpp"
+#include "gzip_interface.hpp"
+#include "test.hpp"
+
+bool load_all_files(QStringList file_list,std::vector<std::shared_ptr<DwiHeader> >& dwi_files);
+bool load_4d_nii(const char* file_name,std::vector<std::shared_ptr<DwiHeader> >& dwi_files,unsigned int max_in_flight);
+
+namespace {
+
+// a minimal explicit VR little endian DICOM file, elements in ascending order
+class dicom_writer{
+    std::vector<char> buf;
+    void add_tag(unsigned short group,unsigned short element,const char* vr)
+    {
+        add_value(group);
+        add_value(element);
+        buf.insert(buf.end(),vr,vr+2);
+    }
+public:
+    template<class value_type>
+    void add_value(value_type value)
+    {
+        const char* ptr = (const char*)&value;
+        buf.insert(buf.end(),ptr,ptr+sizeof(value_type));
+    }
+    void add(unsigned short group,unsigned short element,const char* vr,const void* data,unsigned int size)
+    {
+        add_tag(group,element,vr);
+        unsigned int padded_size = (size+1)/2*2;
+        if(std::string(vr) == "OW")
+        {
+            add_value((unsigned short)0);
+            add_value(padded_size);
+        }
+        else
+            add_value((unsigned short)padded_size);
+        buf.insert(buf.end(),(const char*)data,(const char*)data+size);
+        if(padded_size != size)
+            buf.push_back(std::string(vr) == "UI" ? 0 : ' ');
+    }
+    void add(unsigned short group,unsigned short element,const char* vr,const std::string& text)
+    {
+        add(group,element,vr,text.c_str(),text.size());
+    }
+    void add(unsigned short group,unsigned short element,unsigned short value)
+    {
+        add(group,element,"US",&value,sizeof(value));
+    }
+    bool save(const std::string& file_name) const
+    {
+        std::ofstream out(file_name.c_str(),std::ios::binary);
+        std::vector<char> header(128);
+        header.insert(header.end(),"DICM","DICM"+4);
+        out.write(&header[0],header.size());
+        out.write(&buf[0],buf.size());
+        return out.good();
+    }
+};
+
+void write_slice(const std::string& file_name,unsigned int width,unsigned int height,
+                 float bvalue,const double* bvec,float location,const std::vector<unsigned short>& pixels)
+{
+    std::string transfer_syntax("1.2.840.10008.1.2.1");
+    unsigned int meta_length = 8+(transfer_syntax.size()+1)/2*2;
+    dicom_writer dicom;
+    dicom.add(0x0002,0x0000,"UL",&meta_length,sizeof(meta_length));
+    dicom.add(0x0002,0x0010,"UI",transfer_syntax);
+    dicom.add(0x0008,0x0070,"LO",std::string("Philips"));
+    dicom.add(0x0018,0x0050,"DS",std::string("2"));
+    dicom.add(0x0018,0x0081,"DS",std::string("90"));
+    double b = bvalue;
+    dicom.add(0x0018,0x9087,"FD",&b,sizeof(b));
+    dicom.add(0x0018,0x9089,"FD",bvec,3*sizeof(double));
+    dicom.add(0x0020,0x0037,"DS",std::string("1\\0\\0\\0\\1\\0"));
+    std::ostringstream out;
+    out << location;
+    dicom.add(0x0020,0x1041,"DS",out.str());
+    dicom.add(0x0028,0x0002,1);
+    dicom.add(0x0028,0x0010,height);
+    dicom.add(0x0028,0x0011,width);
+    dicom.add(0x0028,0x0030,"DS",std::string("2\\2"));
+    dicom.add(0x0028,0x0100,16);
+    dicom.add(0x0028,0x0101,16);
+    dicom.add(0x0028,0x0102,15);
+    dicom.add(0x0028,0x0103,0);
+    dicom.add(0x7FE0,0x0010,"OW",&pixels[0],pixels.size()*sizeof(unsigned short));
+    dicom.save(file_name);
+}
+
+unsigned short pixel_value(unsigned int dwi,unsigned int slice,unsigned int x,unsigned int y)
+{
+    return (dwi*7+slice*13+x+y*3) % 4096;
+}
+
+}
+
+// A single-slice DICOM series written in slice order, loaded back as DWI
+// volumes with their b-table, and the loading throughput. A float 4D NIfTI
+// loaded back on the integer scale.
+bool test_dicom(bool benchmark)
+{
+    const unsigned int width = benchmark ? 128 : 32,height = benchmark ? 128 : 24;
+    const unsigned int slice_count = benchmark ? 60 : 10,dwi_count = benchmark ? 65 : 7;
+    QDir dir(QDir::temp().filePath("dsi_studio_test_dicom"));
+    dir.removeRecursively();
+    TEST_CHECK(QDir::temp().mkpath("dsi_studio_test_dicom"));
+    std::vector<std::vector<double> > bvec(dwi_count,std::vector<double>(3));
+    QStringList file_list;
+    for(unsigned int dwi = 0,file = 0;dwi < dwi_count;++dwi)
+    {
+        float bvalue = dwi ? 1000.0f : 0.0f;
+        if(dwi)
+        {
+            double angle = dwi*2.4;
+            bvec[dwi][0] = std::cos(angle)*0.6;
+            bvec[dwi][1] = std::sin(angle)*0.6;
+            bvec[dwi][2] = 0.8;
+        }
+        for(unsigned int slice = 0;slice < slice_count;++slice,++file)
+        {
+            std::vector<unsigned short> pixels(width*height);
+            for(unsigned int y = 0,i = 0;y < height;++y)
+                for(unsigned int x = 0;x < width;++x,++i)
+                    pixels[i] = pixel_value(dwi,slice,x,y);
+            char name[32];
+            std::sprintf(name,"IM%05d.dcm",file);
+            QString file_name = dir.filePath(name);
+            write_slice(file_name.toStdString(),width,height,bvalue,&bvec[dwi][0],10.0f+slice*2.0f,pixels);
+            file_list << file_name;
+        }
+    }
+    std::vector<std::shared_ptr<DwiHeader> > dwi_files;
+    auto begin = std::chrono::steady_clock::now();
+    bool loaded = load_all_files(file_list,dwi_files);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+    dir.removeRecursively();
+    TEST_CHECK(loaded && dwi_files.size() == dwi_count);
+    for(unsigned int dwi = 0;dwi < dwi_count;++dwi)
+    {
+        const DwiHeader& header = *dwi_files[dwi];
+        TEST_CHECK(header.image.width() == width && header.image.height() == height &&
+                   header.image.depth() == slice_count);
+        TEST_CHECK(header.te == 90.0f && header.bvalue == (dwi ? 1000.0f : 0.0f));
+        if(dwi)
+            for(unsigned int d = 0;d < 3;++d)
+                TEST_CHECK(std::fabs(header.bvec[d]-bvec[dwi][d]) < 1.0e-5);
+        for(unsigned int slice = 0,i = 0;slice < slice_count;++slice)
+            for(unsigned int y = 0;y < height;++y)
+                for(unsigned int x = 0;x < width;++x,++i)
+                    TEST_CHECK(header.image[i] == pixel_value(dwi,slice,x,y));
+    }
+    // a float 4D NIfTI with negative values and a different maximum in each
+    // volume, read in batches of two, is scaled by its global maximum
+    {
+        image::geometry<4> nifti_dim(20,16,8,9);
+        image::basic_image<float,4> buffer(nifti_dim);
+        for(unsigned int i = 0;i < buffer.size();++i)
+            buffer[i] = ((i*7) % 97)*1.37f*(1.0f+i/(nifti_dim.size()/9))-5.0f;
+        float max_value = *std::max_element(buffer.begin(),buffer.end());
+        TEST_CHECK(QDir::temp().mkpath("dsi_studio_test_nifti"));
+        QDir nifti_dir(QDir::temp().filePath("dsi_studio_test_nifti"));
+        std::string file_name = nifti_dir.filePath("dwi.nii.gz").toStdString();
+        {
+            gz_nifti header;
+            float vs[4] = {2.0f,2.0f,2.0f,1.0f};
+            header.set_voxel_size(vs);
+            image::basic_image<float,4> flipped(buffer);
+            image::flip_xy(flipped);
+            header << flipped;
+            TEST_CHECK(header.save_to_file(file_name.c_str()));
+        }
+        std::vector<std::shared_ptr<DwiHeader> > nifti_files;
+        bool loaded = load_4d_nii(file_name.c_str(),nifti_files,2);
+        nifti_dir.removeRecursively();
+        TEST_CHECK(loaded && nifti_files.size() == 9);
+        for(unsigned int dwi = 0,i = 0;dwi < nifti_files.size();++dwi)
+        {
+            const image::basic_image<unsigned short,3>& I = nifti_files[dwi]->image;
+            TEST_CHECK(I.width() == 20 && I.height() == 16 && I.depth() == 8);
+            for(unsigned int index = 0;index < I.size();++index,++i)
+                TEST_CHECK(std::fabs(I[index]-std::max<float>(0.0f,buffer[i])*32767.0f/max_value) <= 1.0f);
+        }
+    }
+    if(benchmark)
+        std::cout << "dicom: " << file_list.size() << " slices in " << seconds << " s, "
+                  << file_list.size()*width*height*2/seconds/1048576.0 << " MB/s" << std::endl;
+    return true;
+}
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "image/image.hpp"
+#include "basic_voxel.hpp"
+#include "sample_model.hpp"
+#include "space_mapping.hpp"
+#include "dsi_process.hpp"
+#include "test.hpp"
+
+namespace {
+
+// the ODF of a voxel as computed before the sampling matrix: a pdf with its
+// own fft buffers, sampled by each SamplePoint in turn
+class reference_dsi{
+    std::vector<unsigned int> mapping1,mapping2;
+    std::vector<float> filter;
+    std::vector<SamplePoint> sample_group;
+    image::fftn<3> fft;
+public:
+    reference_dsi(const Voxel& voxel):fft(image::geometry<3>(space_length,space_length,space_length))
+    {
+        std::vector<image::vector<3,int> > q_table;
+        QSpace2Pdf::get_q_table(voxel,q_table);
+        for (unsigned int index = 0; index < q_table.size(); ++index)
+        {
+            int x = q_table[index][0],y = q_table[index][1],z = q_table[index][2];
+            mapping1.push_back(SpaceMapping<dsi_range>::getIndex(x,y,z));
+            mapping2.push_back(SpaceMapping<dsi_range>::getIndex(-x,-y,-z));
+            float r = std::sqrt((float)(x*x+y*y+z*z));
+            filter.push_back(0.5*(1.0+std::cos(2.0*r*M_PI/voxel.param[0])));
+        }
+        for (unsigned int index = 0; index < voxel.ti.half_vertices_count; ++index)
+            for (float r = odf_min_radius; r <= odf_max_radius; r += odf_sampling_interval)
+                sample_group.push_back(SamplePoint(index,voxel.ti.vertices[index][0]*r,
+                                                   voxel.ti.vertices[index][1]*r,
+                                                   voxel.ti.vertices[index][2]*r,r*r));
+    }
+    void run(const std::vector<float>& signal,std::vector<float>& odf)
+    {
+        std::vector<float> pdf(qspace_size),buffer(qspace_size);
+        for (unsigned int index = 0; index < mapping1.size(); ++index)
+        {
+            pdf[mapping1[index]] += signal[index]*filter[index];
+            pdf[mapping2[index]] += signal[index]*filter[index];
+        }
+        fft.apply_inverse(pdf,buffer);
+        for (unsigned int index = 0; index < qspace_size; ++index)
+            pdf[index] = std::abs(pdf[index]);
+        std::fill(odf.begin(),odf.end(),0.0f);
+        for (unsigned int index = 0; index < sample_group.size(); ++index)
+            sample_group[index].sampleODFValueWeighted(pdf,odf);
+        float sum = image::mean(odf.begin(),odf.end());
+        if (sum != 0.0)
+            image::multiply_constant(odf,pdf[SpaceMapping<dsi_range>::getIndex(0,0,0)]/sum);
+    }
+};
+
+// the q-space signal of two crossing fibers
+void make_signal(std::mt19937& gen,const Voxel& voxel,std::vector<float>& signal)
+{
+    std::uniform_real_distribution<float> unit(-1.0f,1.0f);
+    image::vector<3,float> dir[2];
+    for(unsigned int f = 0;f < 2;++f)
+    {
+        dir[f] = image::vector<3,float>(unit(gen),unit(gen),unit(gen));
+        dir[f].normalize();
+    }
+    signal.resize(voxel.bvalues.size());
+    for(unsigned int i = 0;i < signal.size();++i)
+    {
+        float s = 0.0f;
+        for(unsigned int f = 0;f < 2;++f)
+        {
+            float cos = voxel.bvectors[i]*dir[f];
+            s += 500.0f*std::exp(-voxel.bvalues[i]*(0.3e-3f+1.4e-3f*cos*cos));
+        }
+        signal[i] = s;
+    }
+}
+
+}
+
+// The ODFs from the merged sampling matrix, with the pdf in the thread's
+// buffer and the signal storage reused for the fft, against the ODFs of the
+// SamplePoint interpolations with freshly allocated buffers.
+bool test_dsi(bool benchmark)
+{
+    std::mt19937 gen(0);
+    Voxel voxel;
+    // the DSI grid within a radius of 4 on a b-value of 4000 at the edge
+    voxel.bvalues.push_back(0.0f);
+    voxel.bvectors.push_back(image::vector<3,float>());
+    for(int z = -4;z <= 4;++z)
+        for(int y = -4;y <= 4;++y)
+            for(int x = -4;x <= 4;++x)
+            {
+                int r2 = x*x+y*y+z*z;
+                if(r2 == 0 || r2 > 16)
+                    continue;
+                image::vector<3,float> v(x,y,z);
+                v.normalize();
+                voxel.bvalues.push_back(250.0f*r2);
+                voxel.bvectors.push_back(v);
+            }
+    float param[1] = {17.0f};
+    voxel.param = param;
+    voxel.ti.init(8);
+    QSpace2Pdf q2p;
+    Pdf2Odf p2o;
+    q2p.init(voxel);
+    p2o.init(voxel);
+    reference_dsi reference(voxel);
+
+    VoxelData data;
+    data.odf.resize(voxel.ti.half_vertices_count);
+    std::vector<float> signal,odf(data.odf.size());
+    unsigned int voxel_count = benchmark ? 20000 : 200;
+    double max_error = 0.0,new_time = 0.0,old_time = 0.0;
+    // the same VoxelData for all voxels, as in one thread
+    for(unsigned int i = 0;i < voxel_count;++i)
+    {
+        make_signal(gen,voxel,signal);
+        data.space = signal;
+        auto begin = std::chrono::steady_clock::now();
+        q2p.run(voxel,data);
+        p2o.run(voxel,data);
+        new_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        begin = std::chrono::steady_clock::now();
+        reference.run(signal,odf);
+        old_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        float max_odf = *std::max_element(odf.begin(),odf.end());
+        TEST_CHECK(max_odf > 0.0f);
+        for(unsigned int j = 0;j < odf.size();++j)
+            max_error = std::max<double>(max_error,std::fabs(data.odf[j]-odf[j])/max_odf);
+    }
+    TEST_CHECK(max_error < 1.0e-4);
+    if(benchmark)
+        std::cout << "dsi: " << voxel_count << " voxels, sampling matrix " << new_time
+                  << " s, sample points " << old_time << " s, max relative difference "
+                  << max_error << std::endl;
+    return true;
+}
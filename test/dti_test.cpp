@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "image/image.hpp"
+#include "dti_process.hpp"
+#include "test.hpp"
+
+namespace {
+
+const float fa_truth = 0.7990f;// of the eigenvalues 1.7, 0.3 and 0.3
+
+// a b0 and two shells of random directions
+void make_btable(std::mt19937& gen,Voxel& voxel)
+{
+    std::uniform_real_distribution<float> unit(-1.0f,1.0f);
+    voxel.bvalues.assign(1,0.0f);
+    voxel.bvectors.assign(1,image::vector<3,float>());
+    for(unsigned int index = 0;index < 64;++index)
+    {
+        image::vector<3,float> dir;
+        do{
+            dir = image::vector<3,float>(unit(gen),unit(gen),unit(gen));
+        }while(dir.length() > 1.0f || dir.length() < 0.1f);
+        dir.normalize();
+        voxel.bvalues.push_back(index < 32 ? 1000.0f : 2000.0f);
+        voxel.bvectors.push_back(dir);
+    }
+}
+
+// the per-voxel fit before the pseudo inverse: a fresh signal vector, Kt S
+// and an LU solve for every regularization level tried, and the iterative
+// eigensolver
+class baseline_dti{
+    std::vector<std::vector<double> > iKtK;
+    std::vector<std::vector<unsigned int> > iKtK_pivot;
+    std::vector<double> Kt;
+    unsigned int b_count;
+public:
+    baseline_dti(const Voxel& voxel):iKtK(20),iKtK_pivot(20),b_count(voxel.bvalues.size()-1)
+    {
+        unsigned int qmap[6] = {0,4,8,1,2,5};
+        double qweighting[6] = {1.0,1.0,1.0,2.0,2.0,2.0};
+        Kt.resize(6*b_count);
+        for(unsigned int i = 0;i < b_count;++i)
+        {
+            image::vector<3> q(voxel.bvectors[i+1]);
+            q *= std::sqrt(voxel.bvalues[i+1]);
+            double qq[9];
+            for(unsigned int k = 0;k < 9;++k)
+                qq[k] = q[k/3]*q[k%3];
+            for(unsigned int col = 0;col < 6;++col)
+                Kt[col*b_count+i] = qq[qmap[col]]*qweighting[col];
+        }
+        for(unsigned int i = 0;i < iKtK.size();++i)
+        {
+            iKtK[i].resize(6*6);
+            iKtK_pivot[i].resize(6);
+            image::mat::product_transpose(Kt.begin(),Kt.begin(),iKtK[i].begin(),
+                                           image::dyndim(6,b_count),image::dyndim(6,b_count));
+            if(i)
+            {
+                double w = 0.005*std::pow(2.0,(double)i)*(*std::max_element(iKtK[i].begin(),iKtK[i].end()));
+                for(unsigned int j = 0;j < 36;j += 7)
+                    iKtK[i][j] += w;
+            }
+            image::mat::lu_decomposition(iKtK[i].begin(),iKtK_pivot[i].begin(),image::dyndim(6,6));
+        }
+    }
+    float run(const std::vector<float>& space,float* dir) const
+    {
+        std::vector<float> signal(space.size());
+        if(space.front() != 0.0)
+        {
+            float logs0 = std::log(std::max<float>(1.0,space.front()));
+            for(unsigned int i = 1;i < space.size();++i)
+                signal[i-1] = std::max<float>(0.0,logs0-std::log(std::max<float>(1.0,space[i])));
+        }
+        double KtS[6],tensor_param[6],tensor[9],V[9],d[3];
+        unsigned int tensor_index[9] = {0,3,4,3,1,5,4,5,2};
+        image::mat::product(Kt.begin(),signal.begin(),KtS,image::dyndim(6,b_count),image::dyndim(b_count,1));
+        for(unsigned int i = 0;i < iKtK.size();++i)
+        {
+            image::mat::lu_solve(iKtK[i].begin(),iKtK_pivot[i].begin(),KtS,tensor_param,image::dyndim(6,6));
+            for(unsigned int index = 0;index < 9;++index)
+                tensor[index] = tensor_param[tensor_index[index]];
+            image::mat::eigen_decomposition_sym(tensor,V,d,image::dim<3,3>());
+            if(d[0] > 0.0 && d[1] > 0.0 && d[2] > 0.0)
+                break;
+        }
+        if(d[1] < 0.0)
+            d[1] = d[2] = 0.0;
+        if(d[2] < 0.0)
+            d[2] = 0.0;
+        if(d[0] < 0.0)
+            d[0] = d[1] = d[2] = 0.0;
+        std::copy(V,V+3,dir);
+        double m = (d[0]+d[1]+d[2])/3.0,l2 = d[0]*d[0]+d[1]*d[1]+d[2]*d[2];
+        if(l2 == 0.0)
+            return 0.0f;
+        return std::min(1.0,std::sqrt(1.5*((d[0]-m)*(d[0]-m)+(d[1]-m)*(d[1]-m)+(d[2]-m)*(d[2]-m))/l2));
+    }
+};
+
+struct fit_error{
+    double fa,angle;// mean FA error and mean angle (degrees)
+};
+
+// Fits voxels of a single-fiber tensor with random directions and Rician noise.
+// Every other voxel has four volumes dropped to a third of their signal, as
+// from motion during their acquisition. Returns the errors of the clean voxels
+// and of the corrupted voxels. A given baseline fits the same signals, and
+// the largest difference of its FA and direction from the fit is returned.
+struct fit_timing{
+    double fit,baseline;
+    double fa_difference,dir_difference;// maximum against the baseline
+};
+void fit_voxels(std::mt19937 gen,Voxel& voxel,float noise,unsigned int voxel_count,
+                fit_error& clean,fit_error& corrupted,fit_timing& timing,
+                const baseline_dti* baseline = 0)
+{
+    std::uniform_real_distribution<float> unit(-1.0f,1.0f);
+    std::normal_distribution<float> normal(0.0f,1.0f);
+    voxel.dim = image::geometry<3>(voxel_count,1,1);
+    voxel.output_diffusivity = false;
+    voxel.output_tensor = false;
+    Dwi2Tensor process;
+    process.init(voxel);
+    VoxelData data;
+    data.space.resize(voxel.bvalues.size());
+    data.fa.resize(1);
+    std::vector<image::vector<3,float> > truth(voxel_count);
+    timing.fit = timing.baseline = timing.fa_difference = timing.dir_difference = 0.0;
+    for(unsigned int index = 0;index < voxel_count;++index)
+    {
+        image::vector<3,float> v;
+        do{
+            v = image::vector<3,float>(unit(gen),unit(gen),unit(gen));
+        }while(v.length() > 1.0f || v.length() < 0.1f);
+        v.normalize();
+        truth[index] = v;
+        data.space[0] = 1000.0f;
+        for(unsigned int i = 1;i < data.space.size();++i)
+        {
+            float cos = voxel.bvectors[i]*v;
+            float s = 1000.0f*std::exp(-voxel.bvalues[i]*(0.3e-3f+1.4e-3f*cos*cos));
+            float re = s+noise*normal(gen),im = noise*normal(gen);
+            data.space[i] = std::sqrt(re*re+im*im);
+            if(index % 2 && i % 16 == 3)
+                data.space[i] *= 0.3f;
+        }
+        data.init();
+        data.voxel_index = index;
+        auto begin = std::chrono::steady_clock::now();
+        process.run(voxel,data);
+        timing.fit += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        if(baseline)
+        {
+            float dir[3];
+            begin = std::chrono::steady_clock::now();
+            float fa = baseline->run(data.space,dir);
+            timing.baseline += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+            const float* fib_dir = &voxel.fib_dir[index*3];
+            double cos = std::fabs(dir[0]*fib_dir[0]+dir[1]*fib_dir[1]+dir[2]*fib_dir[2]);
+            timing.fa_difference = std::max<double>(timing.fa_difference,std::fabs(fa-voxel.fib_fa[index]));
+            timing.dir_difference = std::max<double>(timing.dir_difference,1.0-std::min<double>(1.0,cos));
+        }
+    }
+    clean.fa = clean.angle = corrupted.fa = corrupted.angle = 0.0;
+    for(unsigned int index = 0;index < voxel_count;++index)
+    {
+        const float* dir = &voxel.fib_dir[index*3];
+        double cos = std::fabs(dir[0]*truth[index][0]+dir[1]*truth[index][1]+dir[2]*truth[index][2]);
+        fit_error& error = (index % 2 ? corrupted : clean);
+        error.fa += std::fabs(voxel.fib_fa[index]-fa_truth);
+        error.angle += std::acos(std::min<double>(1.0,cos))*180.0/3.14159265358979;
+    }
+    unsigned int half = voxel_count/2;
+    clean.fa /= voxel_count-half;
+    clean.angle /= voxel_count-half;
+    corrupted.fa /= half;
+    corrupted.angle /= half;
+}
+
+}
+
+// Least squares, weighted least squares and the robust fit of the tensor on
+// synthetic signals: all of them recover the tensor of clean signals, and the
+// robust fit is the least affected by corrupted volumes. The least squares
+// fit also matches the per-voxel fit it replaced.
+bool test_dti(bool benchmark)
+{
+    std::mt19937 gen(0);
+    Voxel voxel;
+    make_btable(gen,voxel);
+    const char* fit_name[3] = {"least squares","weighted least squares","robust"};
+    fit_error clean[3],corrupted[3];
+    fit_timing timing[3];
+    for(unsigned char fit = 0;fit < 3;++fit)
+    {
+        voxel.dti_fit = fit;
+        fit_error exact_clean,exact_corrupted;
+        fit_timing exact_timing;
+        // the noise-free signals of the clean voxels are fitted exactly
+        fit_voxels(gen,voxel,0.0f,20,exact_clean,exact_corrupted,exact_timing);
+        TEST_CHECK(exact_clean.fa < 1.0e-3 && exact_clean.angle < 0.1);
+        baseline_dti baseline(voxel);
+        fit_voxels(gen,voxel,20.0f,benchmark ? 200000 : 2000,clean[fit],corrupted[fit],timing[fit],
+                   fit == 0 ? &baseline : 0);
+        TEST_CHECK(clean[fit].fa < 0.05 && clean[fit].angle < 5.0);
+    }
+    TEST_CHECK(corrupted[2].fa < corrupted[0].fa && corrupted[2].fa < corrupted[1].fa);
+    TEST_CHECK(corrupted[2].angle < corrupted[0].angle);
+    TEST_CHECK(timing[0].fa_difference < 1.0e-3 && timing[0].dir_difference < 1.0e-4);
+    if(benchmark)
+    {
+        for(unsigned char fit = 0;fit < 3;++fit)
+            std::cout << "dti: " << fit_name[fit] << " " << timing[fit].fit << " s, FA error "
+                      << clean[fit].fa << " (" << corrupted[fit].fa << " corrupted), angle "
+                      << clean[fit].angle << " (" << corrupted[fit].angle << " corrupted)" << std::endl;
+        std::cout << "dti: per-voxel least squares before the pseudo inverse " << timing[0].baseline
+                  << " s, max FA difference " << timing[0].fa_difference << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,81 @@
+#include <QCoreApplication>
+#include <QStringList>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "image/image.hpp"
+#include "mapping/fa_template.hpp"
+#include "fib_data.hpp"
+#include "program_option.hpp"
+
+// defined by the main.cpp of the application, which is not built here
+track_recognition track_network;
+fa_template fa_template_imp;
+program_option po;
+QStringList search_files(QString,QString)
+{
+    return QStringList();
+}
+
+bool test_tract_edit(bool benchmark);
+bool test_tract_geometry(bool benchmark);
+bool test_tract_file(bool benchmark);
+bool test_tract_stat(bool benchmark);
+bool test_tract_select(bool benchmark);
+bool test_prog(bool benchmark);
+bool test_profile(bool benchmark);
+bool test_dicom(bool benchmark);
+bool test_motion(bool benchmark);
+bool test_dti(bool benchmark);
+bool test_btable(bool benchmark);
+bool test_dsi(bool benchmark);
+bool test_transform(bool benchmark);
+
+struct test_case{
+    const char* name;
+    bool (*run)(bool benchmark);
+};
+
+// dsi_studio_test [--benchmark] [test ...] runs the named tests, or all of them
+int main(int ac, char *av[])
+{
+    QCoreApplication app(ac,av);
+    const test_case tests[] = {
+        {"tract_edit",test_tract_edit},
+        {"tract_geometry",test_tract_geometry},
+        {"tract_file",test_tract_file},
+        {"tract_stat",test_tract_stat},
+        {"tract_select",test_tract_select},
+        {"prog",test_prog},
+        {"profile",test_profile},
+        {"dicom",test_dicom},
+        {"motion",test_motion},
+        {"dti",test_dti},
+        {"btable",test_btable},
+        {"dsi",test_dsi},
+        {"transform",test_transform}
+    };
+    bool benchmark = false;
+    std::vector<std::string> names;
+    for (int i = 1; i < ac; ++i)
+        if (std::string(av[i]) == std::string("--benchmark"))
+            benchmark = true;
+        else
+            names.push_back(av[i]);
+    unsigned int failed = 0;
+    for(unsigned int index = 0;index < sizeof(tests)/sizeof(tests[0]);++index)
+    {
+        const test_case& test = tests[index];
+        if(!names.empty() && std::find(names.begin(),names.end(),std::string(test.name)) == names.end())
+            continue;
+        auto begin = std::chrono::steady_clock::now();
+        bool passed = test.run(benchmark);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        std::cout << (passed ? "PASS " : "FAIL ") << test.name << " (" << seconds << " s)" << std::endl;
+        if(!passed)
+            ++failed;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <vector>
+#include "image/image.hpp"
+#include "image_model.hpp"
+#include "motion_correction.hpp"
+#include "test.hpp"
+
+namespace {
+
+// smooth blobs of different sizes and intensities inside an ellipsoid
+void make_phantom(std::mt19937& gen,image::basic_image<float,3>& I)
+{
+    std::uniform_real_distribution<float> unit(0.0f,1.0f);
+    image::geometry<3> dim = I.geometry();
+    std::vector<float> blob;
+    for(unsigned int i = 0;i < 12;++i)
+    {
+        blob.push_back((0.25f+unit(gen)*0.5f)*dim[0]);
+        blob.push_back((0.25f+unit(gen)*0.5f)*dim[1]);
+        blob.push_back((0.25f+unit(gen)*0.5f)*dim[2]);
+        blob.push_back(2.0f+unit(gen)*5.0f);
+        blob.push_back(200.0f+unit(gen)*800.0f);
+    }
+    for(image::pixel_index<3> index(dim);index < dim.size();++index)
+    {
+        float dx = (index[0]-dim[0]*0.5f)/(dim[0]*0.4f);
+        float dy = (index[1]-dim[1]*0.5f)/(dim[1]*0.4f);
+        float dz = (index[2]-dim[2]*0.5f)/(dim[2]*0.4f);
+        float value = 500.0f/(1.0f+std::exp((dx*dx+dy*dy+dz*dz-1.0f)*10.0f));
+        for(unsigned int i = 0;i < blob.size();i += 5)
+        {
+            float x = index[0]-blob[i],y = index[1]-blob[i+1],z = index[2]-blob[i+2];
+            value += blob[i+4]*std::exp(-(x*x+y*y+z*z)/(2.0f*blob[i+3]*blob[i+3]));
+        }
+        I[index.index()] = value;
+    }
+}
+
+double mean_difference(const unsigned short* I,const image::basic_image<float,3>& ref)
+{
+    double sum = 0.0;
+    for(unsigned int index = 0;index < ref.size();++index)
+        sum += std::fabs(I[index]-ref[index]);
+    return sum/ref.size();
+}
+
+}
+
+// Volumes moved by known rigid transforms must line up with the b0 after
+// correction, and their b-vectors must turn by a small angle only.
+bool test_motion(bool benchmark)
+{
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> unit(-1.0f,1.0f);
+    ImageModel model;
+    model.voxel.dim = benchmark ? image::geometry<3>(96,96,60) : image::geometry<3>(64,64,40);
+    model.voxel.vs = image::vector<3>(2.0f,2.0f,2.0f);
+    unsigned int dwi_count = benchmark ? 32 : 8;
+    image::basic_image<float,3> phantom(model.voxel.dim);
+    make_phantom(gen,phantom);
+
+    std::vector<image::basic_image<unsigned short,3> > dwi(dwi_count);
+    std::vector<double> before(dwi_count);
+    for(unsigned int i = 0;i < dwi_count;++i)
+    {
+        image::basic_image<float,3> moved(model.voxel.dim);
+        if(i == 0)
+            moved = phantom;
+        else
+        {
+            image::affine_transform<double> arg;
+            for(unsigned int d = 0;d < 3;++d)
+            {
+                arg.translocation[d] = unit(gen)*1.5;
+                arg.rotation[d] = unit(gen)*2.0*3.1415926/180.0;
+                arg.scaling[d] = 1.0;
+                arg.affine[d] = 0.0;
+            }
+            image::resample(phantom,moved,image::transformation_matrix<double>(arg,model.voxel.dim,model.voxel.vs,
+                                                                               model.voxel.dim,model.voxel.vs),image::cubic);
+        }
+        dwi[i].resize(model.voxel.dim);
+        for(unsigned int index = 0;index < moved.size();++index)
+            dwi[i][index] = std::max<float>(0.0f,moved[index]+0.5f);
+        model.dwi_data.push_back(&dwi[i][0]);
+        model.voxel.bvalues.push_back(i ? 1000.0f : 0.0f);
+        image::vector<3,float> bvec(unit(gen),unit(gen),unit(gen));
+        bvec.normalize();
+        model.voxel.bvectors.push_back(bvec);
+        before[i] = mean_difference(model.dwi_data[i],phantom);
+    }
+    std::vector<image::vector<3,float> > bvectors(model.voxel.bvectors);
+
+    std::vector<image::affine_transform<double> > args;
+    unsigned int progress = 0;
+    bool terminated = false;
+    auto begin = std::chrono::steady_clock::now();
+    rec_motion_correction(&model,std::max<unsigned int>(1,std::thread::hardware_concurrency()),args,progress,terminated);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+    TEST_CHECK(progress == 100);
+    TEST_CHECK(mean_difference(model.dwi_data[0],phantom) == before[0]);
+    for(unsigned int i = 1;i < dwi_count;++i)
+    {
+        double after = mean_difference(model.dwi_data[i],phantom);
+        TEST_CHECK(after < before[i]*0.3);
+        TEST_CHECK(std::fabs(model.voxel.bvectors[i]*bvectors[i]) > std::cos(5.0*3.1415926/180.0));
+    }
+    if(benchmark)
+        std::cout << "motion: " << dwi_count << " volumes of " << model.voxel.dim[0] << "x" << model.voxel.dim[1]
+                  << "x" << model.voxel.dim[2] << " corrected in " << seconds << " s" << std::endl;
+    return true;
+}
@@ -0,0 +1,111 @@
+#include <QDir>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "profile.hpp"
+#include "test.hpp"
+
+namespace {
+
+std::string read_file(const std::string& file_name)
+{
+    std::ifstream in(file_name.c_str());
+    std::ostringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+}
+
+// Counts from several threads summed in the JSON report, the runs of a table
+// created again summed in one record, nothing recorded while profiling is
+// off, and the cost of a call while off.
+bool test_profile(bool benchmark)
+{
+    std::string file_name = QDir::temp().filePath("dsi_studio_test_profile.json").toStdString();
+    const unsigned int thread_count = 4,call_count = 100000;
+    std::vector<std::string> items;
+    items.push_back("first \"item\"");
+    items.push_back("second");
+    profile_enable(false);
+    {
+        profile_table table("profile_test_off",thread_count,items);
+        TEST_CHECK(!table.is_on());
+        table.count(0,0);
+    }
+    profile_enable(true);
+    {
+        profile_table table("profile_test_on",thread_count,items);
+#ifndef NO_PROFILE
+        TEST_CHECK(table.is_on());
+#endif
+        std::vector<std::thread> threads;
+        for(unsigned int id = 0;id < thread_count;++id)
+            threads.push_back(std::thread([&,id](void)
+            {
+                for(unsigned int i = 0;i < call_count;++i)
+                {
+                    long long t = table.tic();
+                    table.count(id,0,2);
+                    table.toc(id,1,t);
+                }
+            }));
+        for(unsigned int id = 0;id < threads.size();++id)
+            threads[id].join();
+    }
+    // a table made for each run, as by a reused tracking thread
+    for(unsigned int run = 0;run < 3;++run)
+    {
+        profile_table table("profile_test_runs",run+1,items);
+        for(unsigned int id = 0;id <= run;++id)
+            table.count(id,1,10);
+    }
+    profile_enable(false);
+    TEST_CHECK(profile_write(file_name.c_str()));
+    std::string json = read_file(file_name);
+    std::remove(file_name.c_str());
+#ifdef NO_PROFILE
+    TEST_CHECK(json.find("profile_test_on") == std::string::npos);
+#else
+    TEST_CHECK(json.find("profile_test_off") == std::string::npos);
+    TEST_CHECK(json.find("{\"name\":\"profile_test_on\"") != std::string::npos);
+    std::ostringstream first,second,per_thread;
+    first << "{\"name\":\"first \\\"item\\\"\",\"count\":" << call_count*thread_count*2 << ",";
+    second << "{\"name\":\"second\",\"count\":" << call_count*thread_count << ",";
+    per_thread << "\"thread_count\":[" << call_count << "," << call_count << "," << call_count << "," << call_count << "]";
+    TEST_CHECK(json.find(first.str()) != std::string::npos);
+    TEST_CHECK(json.find(second.str()) != std::string::npos);
+    TEST_CHECK(json.find(per_thread.str()) != std::string::npos);
+    std::string runs_record("{\"name\":\"profile_test_runs\",\"run_count\":3,");
+    std::string::size_type runs = json.find(runs_record);
+    TEST_CHECK(runs != std::string::npos);
+    TEST_CHECK(json.find("profile_test_runs",runs+runs_record.size()) == std::string::npos);
+    TEST_CHECK(json.find("{\"name\":\"second\",\"count\":60,",runs) != std::string::npos);
+    TEST_CHECK(json.find("\"thread_count\":[30,20,10]",runs) != std::string::npos);
+#endif
+    if(benchmark)
+    {
+        const unsigned int loop_count = 100000000;
+        profile_table table("profile_test_overhead",1,items);
+        volatile unsigned int sink = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for(unsigned int i = 0;i < loop_count;++i)
+            sink = sink + i;
+        double base_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        begin = std::chrono::steady_clock::now();
+        for(unsigned int i = 0;i < loop_count;++i)
+        {
+            long long t = table.tic();
+            sink = sink + i;
+            table.toc(0,1,t);
+        }
+        double off_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        std::cout << "profile: disabled tic/toc " << (off_time-base_time)*1.0e9/loop_count
+                  << " ns per iteration" << std::endl;
+    }
+    return true;
+}
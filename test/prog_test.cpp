@@ -0,0 +1,109 @@
+#include <QDir>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "prog_interface_static_link.h"
+#include "test.hpp"
+
+namespace {
+
+unsigned int count_lines(const std::string& file_name,const std::string& text)
+{
+    std::ifstream in(file_name.c_str());
+    std::string line;
+    unsigned int count = 0;
+    while(std::getline(in,line))
+        if(line.find(text) != std::string::npos)
+            ++count;
+    return count;
+}
+
+}
+
+// The progress reported and cancelled from worker threads, nested stages, and
+// the cost of a call while the operation runs.
+bool test_prog(bool benchmark)
+{
+    unsigned int thread_count = std::max<unsigned int>(2,std::thread::hardware_concurrency());
+    // a cancel from one worker stops all of them and the owner
+    {
+        begin_prog("cancel");
+        TEST_CHECK(check_prog(0,1000) && !prog_aborted());
+        std::vector<std::thread> threads;
+        for(unsigned int id = 0;id < thread_count;++id)
+            threads.push_back(std::thread([&,id](void)
+            {
+                for(unsigned int i = 0;add_prog(1);++i)
+                    if(id == 0 && i == 1000)
+                        cancel_prog();
+            }));
+        for(unsigned int id = 0;id < threads.size();++id)
+            threads[id].join();
+        TEST_CHECK(prog_aborted() && !check_prog(1,1000));
+        check_prog(1000,1000);
+        // the next operation starts without the cancel
+        begin_prog("after cancel");
+        TEST_CHECK(!prog_aborted() && check_prog(0,10) && add_prog(1));
+        check_prog(10,10);
+    }
+    // a worker cannot take over the progress, and its loops end normally
+    {
+        begin_prog("owner");
+        TEST_CHECK(check_prog(0,10));
+        bool worker_ok = true;
+        std::thread worker([&](void)
+        {
+            begin_prog("worker");
+            unsigned int i = 0;
+            while(check_prog(i,5))
+                ++i;
+            worker_ok = (i == 5);
+        });
+        worker.join();
+        TEST_CHECK(worker_ok && check_prog(1,10) && !prog_aborted());
+        check_prog(10,10);
+    }
+    // a nested stage does not end the operation
+    {
+        std::string file_name = QDir::temp().filePath("dsi_studio_test_prog.json").toStdString();
+        std::remove(file_name.c_str());
+        set_prog_log(file_name.c_str());
+        begin_prog("outer");
+        for(unsigned int i = 0;check_prog(i,2);++i)
+        {
+            prog_stage stage("inner");
+            begin_prog("inner loop");
+            for(unsigned int j = 0;check_prog(j,4);++j)
+                ;
+            TEST_CHECK(count_lines(file_name,"\"event\":\"end\"") == 0);
+        }
+        set_prog_log("");
+        TEST_CHECK(count_lines(file_name,"\"event\":\"begin\"") == 1);
+        TEST_CHECK(count_lines(file_name,"\"event\":\"end\"") == 1);
+        std::remove(file_name.c_str());
+    }
+    if(benchmark)
+    {
+        const unsigned int call_count = 10000000;
+        begin_prog("benchmark");
+        check_prog(0,call_count*thread_count);
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for(unsigned int id = 0;id < thread_count;++id)
+            threads.push_back(std::thread([&](void)
+            {
+                for(unsigned int i = 0;i < call_count && add_prog(1);++i)
+                    ;
+            }));
+        for(unsigned int id = 0;id < threads.size();++id)
+            threads[id].join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        check_prog(call_count*thread_count,call_count*thread_count);
+        std::cout << "prog: add_prog from " << thread_count << " threads, "
+                  << seconds*1.0e9/call_count << " ns per call" << std::endl;
+    }
+    return true;
+}
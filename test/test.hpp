@@ -0,0 +1,23 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+#include <iostream>
+#include <random>
+#include <vector>
+#include "image/image.hpp"
+
+// A test returns false on the first failed check. With benchmark set, it also
+// runs at a larger size and reports its timing.
+#define TEST_CHECK(condition) \
+    if(!(condition)) \
+    { \
+        std::cout << __FILE__ << ":" << __LINE__ << ": " << #condition << " failed" << std::endl; \
+        return false; \
+    }
+
+// random walks of one-voxel steps starting inside the volume, each with
+// min_length to max_length points. Some of them leave the volume.
+void make_tracts(std::mt19937& gen,const image::geometry<3>& dim,unsigned int count,
+                 unsigned int min_length,unsigned int max_length,
+                 std::vector<std::vector<float> >& tracts);
+
+#endif//TEST_HPP
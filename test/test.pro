@@ -0,0 +1,63 @@
+# -------------------------------------------------
+# Tests and benchmarks. The library sources of dsi_studio.pro are built with
+# the test programs in place of main.cpp:
+#   qmake test/test.pro && make && ./dsi_studio_test [--benchmark] [test ...]
+# -------------------------------------------------
+QT += core \
+    gui \
+    opengl \
+    printsupport
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+CONFIG += c++11 console
+CONFIG -= app_bundle
+TARGET = dsi_studio_test
+TEMPLATE = app
+APP_DIR = $$PWD/..
+win32* {
+INCLUDEPATH += $$APP_DIR/../include
+}
+
+linux* {
+QMAKE_CXXFLAGS += -fpermissive
+LIBS += -lGLU \
+        -lz
+}
+
+mac{
+
+INCLUDEPATH += /Users/frankyeh/include
+LIBS += -lz
+}
+
+INCLUDEPATH += $$APP_DIR \
+    $$APP_DIR/libs \
+    $$APP_DIR/libs/dsi \
+    $$APP_DIR/libs/tracking \
+    $$APP_DIR/libs/mapping
+
+APP_HEADERS = $$fromfile($$APP_DIR/dsi_studio.pro, HEADERS)
+APP_FORMS = $$fromfile($$APP_DIR/dsi_studio.pro, FORMS)
+APP_SOURCES = $$fromfile($$APP_DIR/dsi_studio.pro, SOURCES)
+for(file, APP_HEADERS): HEADERS += $$APP_DIR/$$file
+for(file, APP_FORMS): FORMS += $$APP_DIR/$$file
+for(file, APP_SOURCES) {
+    !equals(file, main.cpp): SOURCES += $$APP_DIR/$$file
+}
+RESOURCES += $$APP_DIR/icons.qrc
+
+HEADERS += test.hpp
+SOURCES += main.cpp \
+    test_util.cpp \
+    tract_edit_test.cpp \
+    tract_geometry_test.cpp \
+    tract_file_test.cpp \
+    tract_stat_test.cpp \
+    tract_select_test.cpp \
+    prog_test.cpp \
+    profile_test.cpp \
+    dicom_test.cpp \
+    motion_test.cpp \
+    dti_test.cpp \
+    btable_test.cpp \
+    dsi_test.cpp \
+    transform_test.cpp
@@ -0,0 +1,32 @@
+#include <cmath>
+#include "test.hpp"
+
+void make_tracts(std::mt19937& gen,const image::geometry<3>& dim,unsigned int count,
+                 unsigned int min_length,unsigned int max_length,
+                 std::vector<std::vector<float> >& tracts)
+{
+    std::uniform_real_distribution<float> unit(-1.0f,1.0f);
+    std::uniform_int_distribution<unsigned int> length(min_length,max_length);
+    tracts.clear();
+    tracts.resize(count);
+    for(unsigned int index = 0;index < count;++index)
+    {
+        float pos[3],dir[3];
+        for(unsigned int d = 0;d < 3;++d)
+        {
+            pos[d] = (unit(gen)*0.5f+0.5f)*(dim[d]-1);
+            dir[d] = unit(gen);
+        }
+        unsigned int point_count = length(gen);
+        for(unsigned int i = 0;i < point_count;++i)
+        {
+            float l = std::sqrt(dir[0]*dir[0]+dir[1]*dir[1]+dir[2]*dir[2])+1.0e-6f;
+            for(unsigned int d = 0;d < 3;++d)
+            {
+                pos[d] += dir[d]/l;
+                dir[d] += unit(gen)*0.3f;
+                tracts[index].push_back(pos[d]);
+            }
+        }
+    }
+}
@@ -0,0 +1,167 @@
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <random>
+#include "tract_model.hpp"
+#include "test.hpp"
+
+namespace {
+
+// the tracts and colors are compared by their count and a 64-bit hash
+struct tract_state{
+    size_t count;
+    unsigned long long hash;
+    bool operator==(const tract_state& rhs) const{return count == rhs.count && hash == rhs.hash;}
+    bool operator!=(const tract_state& rhs) const{return !(*this == rhs);}
+};
+
+tract_state get_state(const TractModel& model)
+{
+    tract_state state;
+    state.count = model.get_visible_track_count();
+    state.hash = 14695981039346656037ull;
+    auto add = [&state](unsigned int value){state.hash = (state.hash ^ value)*1099511628211ull;};
+    for(unsigned int index = 0;index < state.count;++index)
+    {
+        const std::vector<float>& tract = model.get_tract(index);
+        add(tract.size());
+        for(unsigned int i = 0;i < tract.size();++i)
+        {
+            unsigned int value;
+            std::memcpy(&value,&tract[i],sizeof(value));
+            add(value);
+        }
+        add(model.get_tract_color(index));
+    }
+    return state;
+}
+
+}
+
+// Long random sequences of edits, undos and redos. After each step the tracts
+// and their colors must equal the state the journal should be at. An edit is
+// only recorded when it changes the tracts, so the expected history grows
+// with the state, and an empty entry would show up as a missed undo.
+bool test_tract_edit(bool benchmark)
+{
+    std::mt19937 gen(0);
+    std::shared_ptr<fib_data> handle(new fib_data);
+    handle->dim = image::geometry<3>(40,40,30);
+    TractModel model(handle);
+    {
+        std::vector<std::vector<float> > tracts;
+        make_tracts(gen,handle->dim,benchmark ? 200000 : 3000,1,60,tracts);
+        model.add_tracts(tracts);
+        std::uniform_int_distribution<unsigned int> color(0,0xFFFFFF);
+        for(unsigned int index = 0;index < model.get_visible_track_count();++index)
+            model.set_tract_color(index,color(gen));
+    }
+    unsigned int initial_count = model.get_visible_track_count();
+    std::vector<tract_state> done(1,get_state(model)),undone;
+    std::uniform_int_distribution<unsigned int> operation(0,9);
+    std::uniform_real_distribution<float> unit(0.0f,1.0f);
+    unsigned int step_count = benchmark ? 500 : 2000;
+    double edit_time = 0.0,undo_time = 0.0;
+    for(unsigned int step = 0;step < step_count;++step)
+    {
+        unsigned int op = operation(gen);
+        auto begin = std::chrono::steady_clock::now();
+        if(op <= 2)// undo several steps
+        {
+            unsigned int count = 1+(op == 2 ? (unsigned int)(unit(gen)*5) : 0);
+            for(unsigned int i = 0;i < count;++i)
+            {
+                model.undo();
+                if(done.size() > 1)
+                {
+                    undone.push_back(done.back());
+                    done.pop_back();
+                }
+            }
+            undo_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+            TEST_CHECK(get_state(model) == done.back());
+            continue;
+        }
+        if(op <= 4)
+        {
+            unsigned int count = 1+(unsigned int)(unit(gen)*3);
+            for(unsigned int i = 0;i < count;++i)
+            {
+                model.redo();
+                if(!undone.empty())
+                {
+                    done.push_back(undone.back());
+                    undone.pop_back();
+                }
+            }
+            undo_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+            TEST_CHECK(get_state(model) == done.back());
+            continue;
+        }
+        unsigned int tract_count = model.get_visible_track_count();
+        switch(op)
+        {
+        case 5:
+            {
+                std::vector<unsigned int> tracts;
+                for(unsigned int index = 0;index < tract_count;++index)
+                    if(unit(gen) < 0.05f)
+                        tracts.push_back(index);
+                model.delete_tracts(tracts);
+            }
+            break;
+        case 6:
+            {
+                std::vector<unsigned int> tracts;
+                for(unsigned int index = 0;index < tract_count;++index)
+                    if(unit(gen) < 0.9f)
+                        tracts.push_back(index);
+                model.select_tracts(tracts);
+            }
+            break;
+        case 7:
+            {
+                unsigned int dim = gen() % 3;
+                model.cut_by_slice(dim,(unsigned int)(unit(gen)*handle->dim[dim]),gen() % 2);
+            }
+            break;
+        case 8:
+            model.trim();
+            break;
+        case 9:
+            if(unit(gen) < 0.1f)
+            {
+                model.clear_deleted();
+                tract_state state = done.back();
+                done.assign(1,state);
+                undone.clear();
+                continue;
+            }
+            model.delete_by_length(unit(gen)*20.0f);
+            break;
+        }
+        edit_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        tract_state state = get_state(model);
+        if(state == done.back())
+            continue;
+        done.push_back(state);
+        undone.clear();
+        // undo and redo of the edit just made
+        model.undo();
+        TEST_CHECK(get_state(model) == done[done.size()-2]);
+        model.redo();
+        TEST_CHECK(get_state(model) == done.back());
+    }
+    // everything undone gives back the initial tracts
+    while(done.size() > 1)
+    {
+        model.undo();
+        done.pop_back();
+    }
+    TEST_CHECK(get_state(model) == done.back());
+    if(benchmark)
+        std::cout << "tract_edit: " << initial_count << " tracts, edits "
+                  << edit_time << " s, undo/redo " << undo_time << " s" << std::endl;
+    return true;
+}
@@ -0,0 +1,205 @@
+#include <QDir>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include "gzip_interface.hpp"
+#include "tract_model.hpp"
+#include "test.hpp"
+
+namespace {
+
+bool same_tracts(const TractModel& model,const std::vector<std::vector<float> >& tracts)
+{
+    if(model.get_visible_track_count() != tracts.size())
+        return false;
+    for(unsigned int index = 0;index < tracts.size();++index)
+    {
+        const std::vector<float>& tract = model.get_tract(index);
+        if(tract.size() != tracts[index].size())
+            return false;
+        // the files store millimeters, one rounding away from the voxel coordinates
+        for(unsigned int i = 0;i < tract.size();++i)
+            if(std::fabs(tract[i]-tracts[index][i]) > 1.0e-5f*(1.0f+std::fabs(tracts[index][i])))
+                return false;
+    }
+    return true;
+}
+
+// the tracts in the cluster (any if negative) whose points are not all on one
+// side of the box
+void select_tracts(const std::vector<std::vector<float> >& tracts,const std::vector<unsigned int>& cluster,
+                   int selected_cluster,const float* from,const float* to,
+                   std::vector<std::vector<float> >& selected)
+{
+    selected.clear();
+    for(unsigned int index = 0;index < tracts.size();++index)
+    {
+        if(selected_cluster >= 0 && cluster[index] != (unsigned int)selected_cluster)
+            continue;
+        bool inside = !tracts[index].empty();
+        for(unsigned int d = 0;d < 3 && inside;++d)
+        {
+            bool below = true,above = true;
+            for(unsigned int i = d;i < tracts[index].size();i += 3)
+            {
+                below = below && tracts[index][i] < from[d];
+                above = above && tracts[index][i] > to[d];
+            }
+            inside = !below && !above;
+        }
+        if(inside)
+            selected.push_back(tracts[index]);
+    }
+}
+
+}
+
+// Tracts saved to trk, tck, txt and tti files and loaded back, in a volume with
+// a different voxel size along each axis. The tti file keeps the colors and
+// clusters, and loads a cluster or a box of its tracts alone.
+bool test_tract_file(bool benchmark)
+{
+    std::mt19937 gen(0);
+    std::shared_ptr<fib_data> handle(new fib_data);
+    handle->dim = image::geometry<3>(60,70,50);
+    handle->vs = image::vector<3>(1.5f,2.0f,2.5f);
+    std::vector<std::vector<float> > tracts;
+    make_tracts(gen,handle->dim,benchmark ? 500000 : 5000,2,100,tracts);
+    TractModel model(handle);
+    model.add_tracts(tracts);
+
+    const char* ext[] = {".trk.gz",".tck",".txt"};
+    for(unsigned int index = 0;index < sizeof(ext)/sizeof(ext[0]);++index)
+    {
+        std::string file_name = QDir::temp().filePath(QString("dsi_studio_test") + ext[index]).toStdString();
+        auto begin = std::chrono::steady_clock::now();
+        TEST_CHECK(model.save_tracts_to_file(file_name.c_str()));
+        double save_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        TractModel loaded(handle);
+        begin = std::chrono::steady_clock::now();
+        TEST_CHECK(loaded.load_from_file(file_name.c_str(),false));
+        double load_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        std::remove(file_name.c_str());
+        TEST_CHECK(same_tracts(loaded,tracts));
+        if(benchmark)
+            std::cout << "tract_file: " << tracts.size() << " tracts " << ext[index] << " save "
+                      << save_time << " s, load " << load_time << " s" << std::endl;
+    }
+    {
+        std::vector<unsigned int>& cluster = model.get_cluster_info();
+        cluster.resize(tracts.size());
+        std::uniform_int_distribution<unsigned int> color(0,0xFFFFFF);
+        for(unsigned int index = 0;index < tracts.size();++index)
+        {
+            cluster[index] = index % 5;
+            model.set_tract_color(index,color(gen));
+        }
+        std::string file_name = QDir::temp().filePath("dsi_studio_test.tti").toStdString();
+        auto begin = std::chrono::steady_clock::now();
+        TEST_CHECK(model.save_tracts_to_file(file_name.c_str()));
+        double save_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        TractModel loaded(handle);
+        begin = std::chrono::steady_clock::now();
+        TEST_CHECK(loaded.load_from_file(file_name.c_str(),false));
+        double load_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        TEST_CHECK(same_tracts(loaded,tracts));
+        TEST_CHECK(loaded.get_cluster_info() == cluster);
+        for(unsigned int index = 0;index < tracts.size();++index)
+            TEST_CHECK(loaded.get_tract_color(index) == model.get_tract_color(index));
+        // a cluster in a box, a box, and a cluster
+        float from[3] = {10.0f,20.0f,15.0f},to[3] = {30.0f,35.0f,25.0f};
+        float all_from[3] = {-1.0e6f,-1.0e6f,-1.0e6f},all_to[3] = {1.0e6f,1.0e6f,1.0e6f};
+        const float* box[3][2] = {{from,to},{from,to},{all_from,all_to}};
+        int selected_cluster[3] = {2,-1,3};
+        double query_time = 0.0;
+        for(unsigned int i = 0;i < 3;++i)
+        {
+            std::vector<std::vector<float> > expected;
+            select_tracts(tracts,cluster,selected_cluster[i],box[i][0],box[i][1],expected);
+            TractModel part(handle);
+            begin = std::chrono::steady_clock::now();
+            TEST_CHECK(part.load_from_tract_file(file_name.c_str(),selected_cluster[i],
+                       image::vector<3,float>(box[i][0]),image::vector<3,float>(box[i][1])));
+            query_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+            TEST_CHECK(!expected.empty() && expected.size() < tracts.size());
+            TEST_CHECK(same_tracts(part,expected));
+            for(unsigned int index = 0;index < part.get_visible_track_count();++index)
+                TEST_CHECK(selected_cluster[i] < 0 || part.get_cluster_info()[index] == (unsigned int)selected_cluster[i]);
+        }
+        std::remove(file_name.c_str());
+        if(benchmark)
+            std::cout << "tract_file: " << tracts.size() << " tracts .tti save " << save_time << " s, load "
+                      << load_time << " s, three partial loads " << query_time << " s" << std::endl;
+    }
+    // files cut short, or with a corrupt record size, are rejected when their
+    // header counts more tracts than they hold
+    {
+        std::string file_name = QDir::temp().filePath("dsi_studio_test.tck").toStdString();
+        TEST_CHECK(model.save_tracts_to_file(file_name.c_str()));
+        std::vector<char> buf;
+        {
+            std::ifstream in(file_name.c_str(),std::ios::binary);
+            buf.assign(std::istreambuf_iterator<char>(in),std::istreambuf_iterator<char>());
+        }
+        {
+            std::ofstream out(file_name.c_str(),std::ios::binary);
+            out.write(&buf[0],buf.size()/2);
+        }
+        TractModel loaded(handle);
+        TEST_CHECK(!loaded.load_from_file(file_name.c_str(),false));
+        std::remove(file_name.c_str());
+    }
+    {
+        std::string gz_file_name = QDir::temp().filePath("dsi_studio_test.trk.gz").toStdString();
+        std::string file_name = QDir::temp().filePath("dsi_studio_test.trk").toStdString();
+        TEST_CHECK(model.save_tracts_to_file(gz_file_name.c_str()));
+        // the uncompressed file, which the loader also reads
+        std::vector<char> buf;
+        {
+            gzFile in = gzopen(gz_file_name.c_str(),"rb");
+            TEST_CHECK(in);
+            char block[65536];
+            int count;
+            while((count = gzread(in,block,sizeof(block))) > 0)
+                buf.insert(buf.end(),block,block+count);
+            gzclose(in);
+        }
+        std::remove(gz_file_name.c_str());
+        TEST_CHECK(buf.size() > 1000);
+        {
+            std::ofstream out(file_name.c_str(),std::ios::binary);
+            out.write(&buf[0],buf.size());
+        }
+        {
+            TractModel loaded(handle);
+            TEST_CHECK(loaded.load_from_file(file_name.c_str(),false));
+            TEST_CHECK(same_tracts(loaded,tracts));
+        }
+        {
+            std::ofstream out(file_name.c_str(),std::ios::binary);
+            out.write(&buf[0],1000+(buf.size()-1000)/2);
+        }
+        {
+            TractModel loaded(handle);
+            TEST_CHECK(!loaded.load_from_file(file_name.c_str(),false));
+        }
+        // the point count of the first record
+        int n_point = 0x7FFFFFFF;
+        std::memcpy(&buf[1000],&n_point,sizeof(int));
+        {
+            std::ofstream out(file_name.c_str(),std::ios::binary);
+            out.write(&buf[0],buf.size());
+        }
+        {
+            TractModel loaded(handle);
+            TEST_CHECK(!loaded.load_from_file(file_name.c_str(),false));
+        }
+        std::remove(file_name.c_str());
+    }
+    return true;
+}
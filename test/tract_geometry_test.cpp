@@ -0,0 +1,123 @@
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <set>
+#include "tract_geometry.hpp"
+#include "test.hpp"
+
+namespace {
+
+void make_helix_tracts(std::mt19937& gen,unsigned int count,std::vector<std::vector<float> >& tracts)
+{
+    std::uniform_real_distribution<float> unit(0.0f,1.0f);
+    tracts.resize(count);
+    for(unsigned int index = 0;index < count;++index)
+    {
+        float x = unit(gen)*80.0f,y = unit(gen)*80.0f,phase = unit(gen)*6.28f;
+        unsigned int point_count = 10+gen()%90;
+        for(unsigned int i = 0;i < point_count;++i)
+        {
+            tracts[index].push_back(x+2.0f*std::cos(phase+i*0.2f));
+            tracts[index].push_back(y+2.0f*std::sin(phase+i*0.2f));
+            tracts[index].push_back(i*0.5f);
+        }
+    }
+}
+
+}
+
+// The geometry of a tract, and which blocks the cache compiles and releases as
+// tracts, colors and rendering parameters change.
+bool test_tract_geometry(bool benchmark)
+{
+    std::mt19937 gen(0);
+    std::vector<std::vector<float> > tracts;
+    make_helix_tracts(gen,benchmark ? 200000 : 5000,tracts);
+
+    TractRenderParam param;
+    param.tube = true;
+    param.show_end_points = false;
+    param.tube_diameter = 0.2f;
+    param.tube_detail = 0.0f;
+    param.end_point_shift = 0.0f;
+    param.simplify_error = 0.0f;
+    param.alpha = 1.0f;
+    {
+        TractGeometry geo;
+        std::vector<image::vector<3,float> > color;
+        make_tract_geometry(&tracts[0][0],tracts[0].size()/3,color,param,geo);
+        TEST_CHECK(geo.size() > tracts[0].size()/3);
+        TEST_CHECK(geo.normal.size() == geo.vertex.size() && geo.color.size() == geo.vertex.size());
+        TEST_CHECK(geo.strip_begin.size() == geo.strip_count.size() && !geo.strip_count.empty());
+        TEST_CHECK(geo.strip_begin.back()+geo.strip_count.back() <= geo.size());
+        param.tube = false;
+        make_tract_geometry(&tracts[0][0],tracts[0].size()/3,color,param,geo);
+        TEST_CHECK(geo.strip_count.size() == 1 && geo.size() == tracts[0].size()/3);
+        param.tube = true;
+    }
+
+    TractGeometryCache cache;
+    std::set<unsigned int> live;
+    unsigned int next_handle = 1,compiled_tracts = 0,compiled_blocks = 0;
+    auto compile = [&](const std::vector<TractGeometry>& block)
+    {
+        compiled_tracts += block.size();
+        ++compiled_blocks;
+        live.insert(next_handle);
+        return next_handle++;
+    };
+    bool released_twice = false;
+    auto release = [&](unsigned int handle)
+    {
+        if(!live.erase(handle))
+            released_twice = true;
+    };
+    std::vector<const float*> data;
+    std::vector<unsigned int> vertex_count;
+    std::vector<std::vector<image::vector<3,float> > > color;
+    auto update = [&](void)
+    {
+        data.clear();
+        vertex_count.clear();
+        for(unsigned int index = 0;index < tracts.size();++index)
+        {
+            data.push_back(&tracts[index][0]);
+            vertex_count.push_back(tracts[index].size()/3);
+        }
+        color.resize(tracts.size());
+        compiled_tracts = compiled_blocks = 0;
+        return cache.update(data,vertex_count,color,param,compile,release);
+    };
+    auto begin = std::chrono::steady_clock::now();
+    TEST_CHECK(update() == tracts.size());
+    double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+    TEST_CHECK(compiled_tracts == tracts.size() && live.size() == cache.size());
+    unsigned int block_count = cache.size();
+    TEST_CHECK(block_count > 1);
+
+    // nothing changed
+    TEST_CHECK(update() == 0 && compiled_tracts == 0);
+    // a removed tract and an edited tract only rebuild the blocks around them,
+    // two each at most when a block boundary moves
+    tracts.erase(tracts.begin()+tracts.size()/2);
+    tracts[10][0] += 1.0f;
+    begin = std::chrono::steady_clock::now();
+    unsigned int rebuilt = update();
+    double edit_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+    TEST_CHECK(rebuilt == compiled_tracts && compiled_blocks >= 1 && compiled_blocks <= 4);
+    TEST_CHECK(live.size() == cache.size() && !released_twice);
+    // a new color of one tract
+    color[20].assign(1,image::vector<3,float>(1.0f,0.0f,0.0f));
+    rebuilt = update();
+    TEST_CHECK(rebuilt == compiled_tracts && compiled_blocks >= 1 && compiled_blocks <= 2);
+    // a new alpha changes every block
+    param.alpha = 0.5f;
+    TEST_CHECK(update() == tracts.size());
+    TEST_CHECK(live.size() == cache.size() && !released_twice);
+    cache.clear(release);
+    TEST_CHECK(live.empty() && !released_twice);
+    if(benchmark)
+        std::cout << "tract_geometry: " << tracts.size() << " tracts in " << block_count << " blocks, build "
+                  << build_time << " s, rebuild after an edit " << edit_time << " s" << std::endl;
+    return true;
+}
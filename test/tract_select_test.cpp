@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include "tract_model.hpp"
+#include "test.hpp"
+
+namespace {
+
+typedef std::vector<std::vector<float> > tract_list;
+
+void get_tracts(const TractModel& model,tract_list& tracts)
+{
+    tracts.resize(model.get_visible_track_count());
+    for(unsigned int index = 0;index < tracts.size();++index)
+        tracts[index] = model.get_tract(index);
+}
+
+// the point where each tract crosses the view plane, checking every point
+void select_all(const tract_list& tracts,float select_angle,
+                const image::vector<3,float>& from_dir,const image::vector<3,float>& to_dir,
+                const image::vector<3,float>& from_pos,std::vector<unsigned int>& selected)
+{
+    image::vector<3,float> z_axis = from_dir.cross_product(to_dir);
+    z_axis.normalize();
+    float view_angle = from_dir*to_dir;
+    float select_angle_cos = std::cos(select_angle*3.141592654/180);
+    selected.assign(tracts.size(),0);
+    for(unsigned int index = 0;index < tracts.size();++index)
+    {
+        float angle = 0.0;
+        const float* ptr = &*tracts[index].begin();
+        const float* end = ptr + tracts[index].size();
+        for (;ptr < end;ptr += 3)
+        {
+            image::vector<3,float> p(ptr);
+            p -= from_pos;
+            float next_angle = z_axis*p;
+            if ((angle < 0.0 && next_angle >= 0.0) ||
+                    (angle > 0.0 && next_angle <= 0.0))
+            {
+                p.normalize();
+                if (p*from_dir > view_angle && p*to_dir > view_angle)
+                {
+                    if(select_angle != 0.0)
+                    {
+                        image::vector<3,float> p1(ptr),p2(ptr-3);
+                        p1 -= p2;
+                        p1.normalize();
+                        if(std::abs(p1*z_axis) < select_angle_cos)
+                            continue;
+                    }
+                    selected[index] = ptr - &*tracts[index].begin();
+                    break;
+                }
+            }
+            angle = next_angle;
+        }
+    }
+}
+
+// the tracts left by trim, labeling a full volume
+void trim_all(const tract_list& tracts,const image::geometry<3>& geo,tract_list& result)
+{
+    unsigned int no_fiber_label = tracts.size(),have_multiple_fiber_label = tracts.size()+1;
+    std::vector<unsigned int> label(geo.size(),no_fiber_label);
+    for(unsigned int index = 0;index < tracts.size();++index)
+        for(unsigned int j = 0;j < tracts[index].size();j += 3)
+        {
+            int x = tracts[index][j],y = tracts[index][j+1],z = tracts[index][j+2];
+            if(x <= 0 || x >= geo[0] || y <= 0 || y >= geo[1] || z <= 0 || z >= geo[2])
+                continue;
+            for(unsigned int i = 0;i < 8;++i)
+            {
+                int tx = x+(i & 1),ty = y+((i >> 1) & 1),tz = z+(i >> 2);
+                if(tx >= geo[0] || ty >= geo[1] || tz >= geo[2])
+                    continue;
+                unsigned int& cur_label = label[tx + (ty + tz*geo[1])*geo[0]];
+                if (cur_label == have_multiple_fiber_label || cur_label == index)
+                    continue;
+                cur_label = (cur_label == no_fiber_label) ? index : have_multiple_fiber_label;
+            }
+        }
+    std::vector<unsigned char> deleted(tracts.size());
+    for(unsigned int index = 0;index < label.size();++index)
+        if(label[index] < tracts.size())
+            deleted[label[index]] = 1;
+    result.clear();
+    for(unsigned int index = 0;index < tracts.size();++index)
+        if(!deleted[index])
+            result.push_back(tracts[index]);
+}
+
+// the tracts not cut stay in order, followed by the pieces of the cut ones.
+// Each piece after the first starts at the last removed point before it.
+void cut_by_slice_all(const tract_list& tracts,unsigned int dim,unsigned int pos,bool greater,tract_list& result)
+{
+    tract_list pieces;
+    result.clear();
+    for(unsigned int i = 0;i < tracts.size();++i)
+    {
+        if(tracts[i].size() < 6)
+            continue;
+        bool cut = false,adding = false;
+        tract_list tract_pieces;
+        for(unsigned int j = 0;j < tracts[i].size();j += 3)
+        {
+            if(tracts[i][j+dim] < pos ^ greater)
+            {
+                cut = true;
+                if(!adding)
+                    continue;
+                adding = false;
+            }
+            if(!adding)
+            {
+                tract_pieces.push_back(std::vector<float>());
+                adding = true;
+            }
+            tract_pieces.back().insert(tract_pieces.back().end(),tracts[i].begin()+j,tracts[i].begin()+j+3);
+        }
+        if(!cut)
+        {
+            result.push_back(tracts[i]);
+            continue;
+        }
+        for(unsigned int k = 0;k < tract_pieces.size();++k)
+            if(tract_pieces[k].size() >= 6)
+                pieces.push_back(tract_pieces[k]);
+    }
+    result.insert(result.end(),pieces.begin(),pieces.end());
+}
+
+}
+
+// select, trim and cut_by_slice, which use the grid of the model, against the
+// same operations checking every point, with edits, undos and redos between
+// them so that the grid is updated rather than rebuilt.
+bool test_tract_select(bool benchmark)
+{
+    std::mt19937 gen(0);
+    std::shared_ptr<fib_data> handle(new fib_data);
+    handle->dim = image::geometry<3>(100,100,80);
+    TractModel model(handle);
+    {
+        tract_list tracts;
+        make_tracts(gen,handle->dim,benchmark ? 500000 : 20000,1,40,tracts);
+        model.add_tracts(tracts);
+    }
+    std::uniform_real_distribution<float> unit(0.0f,1.0f);
+    auto random_dir = [&](void)
+    {
+        image::vector<3,float> dir(unit(gen)-0.5f,unit(gen)-0.5f,unit(gen)-0.5f);
+        dir.normalize();
+        return dir;
+    };
+    double select_time = 0.0,trim_time = 0.0,cut_time = 0.0;
+    unsigned int round_count = benchmark ? 5 : 20;
+    tract_list tracts,expected,result;
+    for(unsigned int round = 0;round < round_count;++round)
+    {
+        get_tracts(model,tracts);
+        // a view plane through a random point
+        {
+            image::vector<3,float> from_pos(unit(gen)*handle->dim[0],unit(gen)*handle->dim[1],unit(gen)*handle->dim[2]);
+            // the view between two directions
+            image::vector<3,float> from_dir = random_dir(),to_dir = random_dir();
+            for(unsigned int d = 0;d < 3;++d)
+                to_dir[d] = from_dir[d]+to_dir[d]*1.5f;
+            to_dir.normalize();
+            float select_angle = (round % 2) ? 30.0f : 0.0f;
+            std::vector<unsigned int> selected,expected_selected;
+            auto begin = std::chrono::steady_clock::now();
+            model.select(select_angle,from_dir,to_dir,from_pos,selected);
+            select_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+            select_all(tracts,select_angle,from_dir,to_dir,from_pos,expected_selected);
+            TEST_CHECK(selected == expected_selected);
+        }
+        // trim, then undo
+        {
+            trim_all(tracts,handle->dim,expected);
+            auto begin = std::chrono::steady_clock::now();
+            bool trimmed = model.trim();
+            trim_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+            TEST_CHECK(trimmed == (expected.size() != tracts.size()));
+            get_tracts(model,result);
+            TEST_CHECK(result == expected);
+            if(trimmed)
+                model.undo();
+        }
+        // a slice cut, kept every other round
+        {
+            unsigned int dim = gen() % 3;
+            unsigned int pos = unit(gen)*0.2f*handle->dim[dim];
+            bool greater = gen() % 2;
+            if(greater)
+                pos = handle->dim[dim]-1-pos;
+            cut_by_slice_all(tracts,dim,pos,greater,expected);
+            auto begin = std::chrono::steady_clock::now();
+            model.cut_by_slice(dim,pos,greater);
+            cut_time += std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+            get_tracts(model,result);
+            TEST_CHECK(result == expected);
+            if(round % 2)
+            {
+                model.undo();
+                model.redo();
+                model.undo();
+            }
+        }
+        // some tracts deleted
+        {
+            std::vector<unsigned int> to_delete;
+            for(unsigned int index = 0;index < model.get_visible_track_count();++index)
+                if(unit(gen) < 0.02f)
+                    to_delete.push_back(index);
+            model.delete_tracts(to_delete);
+        }
+    }
+    if(benchmark)
+    {
+        std::cout << "tract_select: " << model.get_visible_track_count() << " tracts, select "
+                  << select_time/round_count << " s, trim " << trim_time/round_count
+                  << " s, cut_by_slice " << cut_time/round_count << " s" << std::endl;
+        // small edits of a million tracts, each updating the grid of every tract
+        TractModel large_model(handle);
+        {
+            tract_list tracts;
+            make_tracts(gen,handle->dim,1000000,1,40,tracts);
+            large_model.add_tracts(tracts);
+        }
+        std::vector<unsigned int> selected;
+        auto begin = std::chrono::steady_clock::now();
+        large_model.select(0.0f,random_dir(),random_dir(),image::vector<3,float>(50.0f,50.0f,40.0f),selected);
+        double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        const unsigned int edit_count = 10;
+        begin = std::chrono::steady_clock::now();
+        for(unsigned int i = 0;i < edit_count;++i)
+        {
+            std::vector<unsigned int> to_delete;
+            for(unsigned int j = 0;j < 10;++j)
+                to_delete.push_back((i*100003+j*7919) % large_model.get_visible_track_count());
+            std::sort(to_delete.begin(),to_delete.end());
+            to_delete.erase(std::unique(to_delete.begin(),to_delete.end()),to_delete.end());
+            large_model.delete_tracts(to_delete);
+            large_model.undo();
+        }
+        double edit_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        std::cout << "tract_select: 1000000 tracts, grid built in " << build_time
+                  << " s, deletion of 10 tracts and its undo " << edit_time/edit_count << " s" << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,153 @@
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <set>
+#include "tract_model.hpp"
+#include "test.hpp"
+
+namespace {
+
+// a linear index, which trilinear interpolation reproduces exactly
+float index_value(const float* pos)
+{
+    return 1.0f+0.1f*pos[0]+0.2f*pos[1]+0.3f*pos[2];
+}
+
+bool close(double value,double expected)
+{
+    return std::fabs(value-expected) <= 1.0e-3*(1.0+std::fabs(expected));
+}
+
+}
+
+// The statistics and profiles of an index along the tracts, against the same
+// quantities computed point by point.
+bool test_tract_stat(bool benchmark)
+{
+    std::mt19937 gen(0);
+    std::shared_ptr<fib_data> handle(new fib_data);
+    handle->dim = image::geometry<3>(40,40,30);
+    handle->vs = image::vector<3>(1.0f,1.5f,2.0f);
+    image::basic_image<float,3> volume(handle->dim);
+    for(image::pixel_index<3> index(handle->dim);index < handle->dim.size();++index)
+    {
+        float pos[3] = {(float)index[0],(float)index[1],(float)index[2]};
+        volume[index.index()] = index_value(pos);
+    }
+    handle->view_item.push_back(item());
+    handle->view_item.back().name = "color";
+    handle->view_item.push_back(item());
+    handle->view_item.back().name = "test";
+    handle->view_item.back().image_data = image::make_image(&volume[0],handle->dim);
+    handle->view_item.back().set_scale(volume.begin(),volume.end());
+
+    std::vector<std::vector<float> > tracts(benchmark ? 200000 : 5000);
+    {
+        std::uniform_real_distribution<float> unit(0.0f,1.0f);
+        for(unsigned int index = 0;index < tracts.size();++index)
+        {
+            unsigned int point_count = 2+gen()%60;
+            for(unsigned int i = 0;i < point_count*3;++i)
+                tracts[index].push_back(1.0f+unit(gen)*(handle->dim[i%3]-3));
+        }
+    }
+    TractModel model(handle);
+    model.add_tracts(tracts);
+
+    // direct computation
+    double n = 0.0,sum_length = 0.0,sum_length2 = 0.0,sum = 0.0,sum2 = 0.0;
+    std::set<std::vector<int> > voxels;
+    std::vector<float> tract_mean(tracts.size());
+    for(unsigned int index = 0;index < tracts.size();++index)
+    {
+        const std::vector<float>& tract = tracts[index];
+        double length = 0.0,tract_sum = 0.0;
+        for(unsigned int j = 0;j < tract.size();j += 3)
+        {
+            if(j)
+            {
+                double dx = handle->vs[0]*(tract[j]-tract[j-3]);
+                double dy = handle->vs[1]*(tract[j+1]-tract[j-2]);
+                double dz = handle->vs[2]*(tract[j+2]-tract[j-1]);
+                length += std::sqrt(dx*dx+dy*dy+dz*dz);
+            }
+            std::vector<int> voxel(3);
+            for(unsigned int d = 0;d < 3;++d)
+                voxel[d] = std::round(tract[j+d]);
+            voxels.insert(voxel);
+            double value = index_value(&tract[j]);
+            sum += value;
+            sum2 += value*value;
+            tract_sum += value;
+            n += 1.0;
+        }
+        sum_length += length;
+        sum_length2 += length*length;
+        tract_mean[index] = tract_sum/(tract.size()/3);
+    }
+    double count = tracts.size();
+
+    std::vector<float> data;
+    auto begin = std::chrono::steady_clock::now();
+    model.get_quantitative_data(data);
+    double stat_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+    TEST_CHECK(data.size() == 6);
+    TEST_CHECK(data[0] == tracts.size());
+    TEST_CHECK(close(data[1],sum_length/count));
+    TEST_CHECK(close(data[2],std::sqrt(sum_length2/count-sum_length*sum_length/count/count)));
+    TEST_CHECK(close(data[3],voxels.size()*handle->vs[0]*handle->vs[1]*handle->vs[2]));
+    TEST_CHECK(close(data[4],sum/n));
+    TEST_CHECK(close(data[5],std::sqrt(sum2/n-sum*sum/n/n)));
+
+    // the mean of each tract
+    std::vector<float> values,profile;
+    model.get_report(4,1.0f,"test",values,profile);
+    TEST_CHECK(profile.size() == tracts.size());
+    for(unsigned int index = 0;index < tracts.size();++index)
+        TEST_CHECK(close(profile[index],tract_mean[index]));
+
+    // the profile along x, each point spread by the Gaussian kernel
+    float band_width = 2.0f;
+    begin = std::chrono::steady_clock::now();
+    model.get_report(0,band_width,"test",values,profile);
+    double profile_time = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+    unsigned int width = (handle->dim[0]+1)*2;
+    TEST_CHECK(profile.size() == width && values.size() == width);
+    {
+        std::vector<double> weighting((int)(1.0+band_width*3.0));
+        for(unsigned int k = 0;k < weighting.size();++k)
+            weighting[k] = std::exp(-(double)k*k/2.0/band_width/band_width);
+        std::vector<double> v(width),w(width);
+        for(unsigned int index = 0;index < tracts.size();++index)
+            for(unsigned int j = 0;j < tracts[index].size();j += 3)
+            {
+                int pos = std::round(tracts[index][j]*2.0f);
+                double value = index_value(&tracts[index][j]);
+                v[pos] += value*weighting[0];
+                w[pos] += weighting[0];
+                for(int k = 1;k < (int)weighting.size();++k)
+                {
+                    if(pos > k)
+                    {
+                        v[pos-k] += value*weighting[k];
+                        w[pos-k] += weighting[k];
+                    }
+                    if(pos+k < (int)width)
+                    {
+                        v[pos+k] += value*weighting[k];
+                        w[pos+k] += weighting[k];
+                    }
+                }
+            }
+        for(unsigned int q = 0;q < width;++q)
+        {
+            TEST_CHECK(values[q] == q/2.0f);
+            TEST_CHECK(close(profile[q],w[q] + 1.0 != 1.0 ? v[q]/w[q] : 0.0));
+        }
+    }
+    if(benchmark)
+        std::cout << "tract_stat: " << tracts.size() << " tracts, statistics " << stat_time
+                  << " s, profile " << profile_time << " s" << std::endl;
+    return true;
+}
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include "image/image.hpp"
+#include "image_model.hpp"
+#include "test.hpp"
+
+namespace {
+
+// the volumes of a model, owned here as they are by the file reader
+struct model_data{
+    std::vector<image::basic_image<unsigned short,3> > dwi;
+    std::vector<image::basic_image<float,3> > grad_dev;
+};
+
+// a tilted blob that falls to zero well inside the volume, so that the
+// volume edges never take part in the interpolation, with a b-table and a
+// grad_dev of different values along each axis
+void make_model(const image::geometry<3>& dim,unsigned int dwi_count,ImageModel& model,model_data& data)
+{
+    model.voxel.dim = dim;
+    model.voxel.vs = image::vector<3>(1.5f,2.0f,2.5f);
+    float center[3] = {dim[0]*0.45f,dim[1]*0.55f,dim[2]*0.5f};
+    float radius = 5.0f;
+    image::basic_image<float,3> blob(dim);
+    for(image::pixel_index<3> index(dim);index < dim.size();++index)
+    {
+        float d[3];
+        for(unsigned int k = 0;k < 3;++k)
+            d[k] = index[k]-center[k];
+        float r = std::sqrt(d[0]*d[0]+d[1]*d[1]+d[2]*d[2]);
+        if(r < radius)
+        {
+            float c = std::cos(r*3.1415926f*0.5f/radius);
+            blob[index.index()] = c*c*(1.0f+0.06f*d[0]-0.04f*d[1]+0.02f*d[2]);
+        }
+    }
+    data.dwi.resize(dwi_count);
+    for(unsigned int i = 0;i < dwi_count;++i)
+    {
+        data.dwi[i].resize(dim);
+        for(unsigned int index = 0;index < dim.size();++index)
+            data.dwi[i][index] = std::round(blob[index]*(1000.0f+100.0f*i));
+        model.dwi_data.push_back(&data.dwi[i][0]);
+        model.voxel.bvalues.push_back(i ? 1000.0f : 0.0f);
+        image::vector<3,float> bvec(std::cos(i*0.7f),std::sin(i*0.7f),std::cos(i*1.3f));
+        bvec.normalize();
+        model.voxel.bvectors.push_back(i ? bvec : image::vector<3,float>());
+    }
+    data.grad_dev.resize(9);
+    for(unsigned int i = 0;i < 9;++i)
+    {
+        data.grad_dev[i] = blob;
+        image::multiply_constant(data.grad_dev[i],(i % 4 == 0) ? 1.0f : 0.02f*(i+1));
+        model.voxel.grad_dev.push_back(image::make_image(&data.grad_dev[i][0],dim));
+    }
+    model.calculate_dwi_sum();
+    model.calculate_mask();
+}
+
+// a small rotation and shift between the current volume and one of new_dim
+image::transformation_matrix<double> make_affine(const ImageModel& model,const image::geometry<3>& new_dim)
+{
+    image::affine_transform<double> arg;
+    for(unsigned int d = 0;d < 3;++d)
+    {
+        arg.translocation[d] = 0.3*(d+1);
+        arg.rotation[d] = (4.0+3.0*d)*3.1415926/180.0;
+        arg.scaling[d] = 1.0;
+        arg.affine[d] = 0.0;
+    }
+    return image::transformation_matrix<double>(arg,new_dim,model.voxel.vs,model.transformed_dim(),model.voxel.vs);
+}
+
+bool same_model(const ImageModel& lhs,const ImageModel& rhs,unsigned int dwi_tolerance,float grad_dev_tolerance)
+{
+    for(unsigned int k = 0;k < 3;++k)
+        if(lhs.voxel.dim[k] != rhs.voxel.dim[k] || lhs.voxel.vs[k] != rhs.voxel.vs[k])
+            return false;
+    for(unsigned int i = 0;i < lhs.voxel.bvectors.size();++i)
+        for(unsigned int k = 0;k < 3;++k)
+            if(lhs.voxel.bvectors[i][k] != rhs.voxel.bvectors[i][k])
+                return false;
+    for(unsigned int i = 0;i < lhs.dwi_data.size();++i)
+        for(unsigned int index = 0;index < lhs.voxel.dim.size();++index)
+            if(std::abs((int)lhs.dwi_data[i][index]-(int)rhs.dwi_data[i][index]) > (int)dwi_tolerance)
+                return false;
+    for(unsigned int i = 0;i < lhs.voxel.grad_dev.size();++i)
+        for(unsigned int index = 0;index < lhs.voxel.dim.size();++index)
+            if(std::fabs(lhs.voxel.grad_dev[i][index]-rhs.voxel.grad_dev[i][index]) > grad_dev_tolerance)
+                return false;
+    return true;
+}
+
+// the steps of a chain: a flip type, or rotate_step for a rotation to a
+// volume that grows by one voxel along x and shrinks by one along z
+const unsigned char rotate_step = 255;
+
+void run_chain(ImageModel& model,const std::vector<unsigned char>& steps,bool chained)
+{
+    for(unsigned int i = 0;i < steps.size();++i)
+    {
+        if(steps[i] == rotate_step)
+        {
+            image::geometry<3> new_dim(model.transformed_dim());
+            ++new_dim[0];
+            --new_dim[2];
+            image::transformation_matrix<double> affine(make_affine(model,new_dim));
+            if(chained)
+                model.add_rotation(new_dim,affine);
+            else
+                model.rotate(new_dim,affine);
+        }
+        else
+        {
+            if(chained)
+                model.add_flip(steps[i]);
+            else
+                model.flip(steps[i]);
+        }
+    }
+    if(chained)
+        model.apply_transform();
+}
+
+}
+
+// Flips and rotations queued and applied in one pass against the same steps
+// applied one at a time. The axis swaps change the dimension the later flips
+// and rotations see. Chains of flips must give the very same volumes;
+// chains with rotations the same volumes within the rounding of the
+// interpolated values.
+bool test_transform(bool benchmark)
+{
+    image::geometry<3> dim(22,24,20);
+    std::vector<std::vector<unsigned char> > chains;
+    chains.push_back({0,3,2,4,1,5});
+    chains.push_back({rotate_step,4});
+    chains.push_back({3,rotate_step});
+    chains.push_back({0,rotate_step,5,2});
+    for(unsigned int c = 0;c < chains.size();++c)
+    {
+        bool flip_only = std::find(chains[c].begin(),chains[c].end(),rotate_step) == chains[c].end();
+        ImageModel chained,sequential;
+        model_data chained_data,sequential_data;
+        make_model(dim,6,chained,chained_data);
+        make_model(dim,6,sequential,sequential_data);
+        run_chain(chained,chains[c],true);
+        run_chain(sequential,chains[c],false);
+        TEST_CHECK(!chained.has_pending_transform());
+        if(flip_only)
+        {
+            TEST_CHECK(same_model(chained,sequential,0,0.0f));
+        }
+        else
+        {
+            TEST_CHECK(same_model(chained,sequential,1,1.0e-4f));
+        }
+    }
+    if(benchmark)
+    {
+        std::vector<unsigned char> chain = {rotate_step,4,1};
+        double seconds[2];
+        for(unsigned int i = 0;i < 2;++i)
+        {
+            ImageModel model;
+            model_data data;
+            make_model(image::geometry<3>(128,128,72),64,model,data);
+            auto begin = std::chrono::steady_clock::now();
+            run_chain(model,chain,i == 0);
+            seconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now()-begin).count();
+        }
+        std::cout << "transform: 64 volumes of 128x128x72 rotated and flipped twice, in one pass "
+                  << seconds[0] << " s, one step at a time " << seconds[1] << " s" << std::endl;
+    }
+    return true;
+}
@@ -14,6 +14,7 @@
 #include "ui_tracking_window.h"
 #include "opengl/renderingtablewidget.h"
 #include "libs/gzip_interface.hpp"
+#include "libs/utility/text_io.hpp"
 #include "tract_cluster.hpp"
 #include "atlas.hpp"
 #include "../color_bar_dialog.hpp"
@@ -189,15 +190,21 @@ void TractTableWidget::load_tracts(QStringList filenames)
         label.remove(".trk");
         label.remove(".gz");
         label.remove(".txt");
+        label.remove(".tti");
         std::string sfilename = filename.toLocal8Bit().begin();
         addNewTracts(label);
         tract_models.back()->load_from_file(&*sfilename.begin(),false);
         if(tract_models.back()->get_cluster_info().empty()) // not multiple cluster file
         {
             item(tract_models.size()-1,1)->setText(QString::number(tract_models.back()->get_visible_track_count()));
-            image::rgb_color c;
-            c.from_hsl(((color_gen++)*1.1-std::floor((color_gen++)*1.1/6)*6)*3.14159265358979323846/3.0,0.85,0.7);
-            tract_models.back()->set_color(c.color);
+            // keep the colors stored in the file
+            if(!tract_models.back()->get_visible_track_count() ||
+                tract_models.back()->get_tract_color(0) == 0)
+            {
+                image::rgb_color c;
+                c.from_hsl(((color_gen++)*1.1-std::floor((color_gen++)*1.1/6)*6)*3.14159265358979323846/3.0,0.85,0.7);
+                tract_models.back()->set_color(c.color);
+            }
         }
         else
         {
@@ -213,7 +220,7 @@ void TractTableWidget::load_tracts(void)
 {
     load_tracts(QFileDialog::getOpenFileNames(
             this,"Load tracts as",QFileInfo(cur_tracking_window.windowTitle()).absolutePath(),
-            "Tract files (*.txt *.trk *trk.gz *.tck);;All files (*)"));
+            "Tract files (*.txt *.trk *trk.gz *.tck *.tti);;All files (*)"));
 
 }
 void TractTableWidget::load_tract_label(void)
@@ -286,7 +293,7 @@ void TractTableWidget::save_all_tracts_as(void)
     QString filename;
     filename = QFileDialog::getSaveFileName(
                 this,"Save tracts as",item(currentRow(),0)->text().replace(':','_') + output_format(),
-                "Tract files (*.trk *trk.gz);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
+                "Tract files (*.trk *trk.gz);;Indexed tract files (*.tti);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
     if(filename.isEmpty())
         return;
     std::string sfilename = filename.toLocal8Bit().begin();
@@ -423,7 +430,7 @@ void TractTableWidget::save_tracts_as(void)
     QString filename;
     filename = QFileDialog::getSaveFileName(
                 this,"Save tracts as",item(currentRow(),0)->text().replace(':','_') + output_format(),
-                 "Tract files (*.trk *trk.gz);;Text File (*.txt);;MAT files (*.mat);;ROI files (*.nii *nii.gz);;All files (*)");
+                 "Tract files (*.trk *trk.gz);;Indexed tract files (*.tti);;Text File (*.txt);;MAT files (*.mat);;ROI files (*.nii *nii.gz);;All files (*)");
     if(filename.isEmpty())
         return;
     std::string sfilename = filename.toLocal8Bit().begin();
@@ -490,10 +497,12 @@ void TractTableWidget::save_end_point_in_mni(void)
 
     if (QFileInfo(filename).suffix().toLower() == "txt")
     {
-        std::ofstream out(filename.toLocal8Bit().begin(),std::ios::out);
+        std::ofstream out(filename.toLocal8Bit().begin(),std::ios::binary);
         if (!out)
             return;
-        std::copy(buffer.begin(),buffer.end(),std::ostream_iterator<float>(out," "));
+        std::string text;
+        append_floats(text,buffer.begin(),buffer.end(),' ');
+        out << text;
     }
     if (QFileInfo(filename).suffix().toLower() == "mat")
     {
@@ -653,7 +662,7 @@ void TractTableWidget::saveTransformedTracts(const float* transform)
     filename = QFileDialog::getSaveFileName(
                 this,
                 "Save tracts as",item(currentRow(),0)->text() + output_format(),
-                 "Tract files (*.trk *trk.gz);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
+                 "Tract files (*.trk *trk.gz);;Indexed tract files (*.tti);;Text File (*.txt);;MAT files (*.mat);;All files (*)");
     if(filename.isEmpty())
         return;
     std::string sfilename = filename.toLocal8Bit().begin();
@@ -919,7 +928,8 @@ void TractTableWidget::separate_deleted_track(void)
 {
     unsigned int cur_row = currentRow();
     addNewTracts(item(cur_row,0)->text(),false);
-    std::vector<std::vector<float> > new_tracks = tract_models[cur_row]->get_deleted_tracts();
+    std::vector<std::vector<float> > new_tracks;
+    tract_models[cur_row]->get_deleted_tracts(new_tracks);
     if(new_tracks.empty())
         return;
     tract_models.back()->add_tracts(new_tracks);
@@ -702,51 +702,47 @@ void vbc_dialog::on_open_mr_files_clicked()
 
 bool vbc_dialog::load_demographic_file(QString filename)
 {
-    model.reset(new stat_model);
-    model->init(vbc->handle->db.num_subjects);
     file_names.clear();
     file_names.push_back(filename.toLocal8Bit().begin());
-
-    std::vector<std::string> items;
-    std::ifstream in(filename.toLocal8Bit().begin());
-    if(!in)
+    unsigned int num_subjects = vbc->handle->db.num_subjects;
+    unsigned int model_type = 0;
+    if(ui->rb_group_difference->isChecked())
+        model_type = 1;
+    if(ui->rb_paired_difference->isChecked())
+        model_type = 2;
+    std::vector<std::string> feature_names;
+    bool loaded = vbc->load_demographic_file(filename.toLocal8Bit().begin(),model_type,feature_names,
+                                             [&](unsigned int item_count)
+    {
+        return gui && QMessageBox::information(this,"Warning",QString("Subject number mismatch. text file has %1 elements while database has %2 subjects. Try to match the data?").
+                                               arg(item_count).arg(num_subjects),QMessageBox::Yes|QMessageBox::No) == QMessageBox::Yes;
+    });
+    model.reset(vbc->model.release());
+    if(!model.get())
+    {
+        model.reset(new stat_model);
+        model->init(num_subjects);
+    }
+    if(!loaded)
     {
         if(gui)
-            QMessageBox::information(this,"Error",QString("Cannot find the demographic file."));
+            QMessageBox::information(this,"Error",vbc->error_msg.c_str(),0);
         else
-            std::cout << "cannot find the demographic file at" << filename.toLocal8Bit().begin() << std::endl;
+            std::cout << vbc->error_msg << std::endl;
+        ui->run->setEnabled(false);
         return false;
     }
-    std::copy(std::istream_iterator<std::string>(in),
-              std::istream_iterator<std::string>(),std::back_inserter(items));
 
-    if(ui->rb_multiple_regression->isChecked())
+    if(model_type == 0)
     {
-        unsigned int feature_count = items.size()/(vbc->handle->db.num_subjects+1);
-        if(feature_count*(vbc->handle->db.num_subjects+1) != items.size())
-        {
-            if(gui)
-            {
-                int result = QMessageBox::information(this,"Warning",QString("Subject number mismatch. text file has %1 elements while database has %2 subjects. Try to match the data?").
-                                                                arg(items.size()).arg(vbc->handle->db.num_subjects),QMessageBox::Yes|QMessageBox::No);
-                if(result == QMessageBox::No)
-                    return false;
-                items.resize(feature_count*(vbc->handle->db.num_subjects+1));
-            }
-            else
-            {
-                std::cout << "subject number mismatch in the demographic file" <<std::endl;
-                return false;
-            }
-        }
         bool add_age_and_sex = false;
-        std::vector<unsigned int> age(vbc->handle->db.num_subjects),sex(vbc->handle->db.num_subjects);
+        std::vector<unsigned int> age(num_subjects),sex(num_subjects);
         if((QString(vbc->handle->db.subject_names[0].c_str()).contains("_M0") || QString(vbc->handle->db.subject_names[0].c_str()).contains("_F0")) &&
             QString(vbc->handle->db.subject_names[0].c_str()).contains("Y_") && gui &&
             QMessageBox::information(this,"Connectomtetry aanalysis","Pull age and sex (1 = male, 0 = female) information from connectometry db?",QMessageBox::Yes|QMessageBox::No) == QMessageBox::Yes)
             {
                 add_age_and_sex = true;
-                for(unsigned int index = 0;index < vbc->handle->db.num_subjects;++index)
+                for(unsigned int index = 0;index < num_subjects;++index)
                 {
                     QString name = vbc->handle->db.subject_names[index].c_str();
                     if(name.contains("_M0"))
@@ -771,49 +767,36 @@ bool vbc_dialog::load_demographic_file(QString filename)
                     }
                 }
             }
-
-        std::vector<double> X;
-        for(unsigned int i = 0,index = 0;i < vbc->handle->db.num_subjects;++i)
+        if(add_age_and_sex)
         {
-            bool ok = false;
-            X.push_back(1); // for the intercep
-            if(add_age_and_sex)
+            // insert age and sex after the intercept
+            std::vector<double> X;
+            unsigned int feature_count = model->feature_count;
+            for(unsigned int i = 0;i < num_subjects;++i)
             {
+                X.push_back(model->X[i*feature_count]);
                 X.push_back(age[i]);
                 X.push_back(sex[i]);
+                X.insert(X.end(),model->X.begin()+i*feature_count+1,model->X.begin()+(i+1)*feature_count);
             }
-            for(unsigned int j = 0;j < feature_count;++j,++index)
+            model->X.swap(X);
+            model->feature_count += 2;
+            feature_names.insert(feature_names.begin(),"Sex");
+            feature_names.insert(feature_names.begin(),"Age");
+            if(!model->pre_process())
             {
-                X.push_back(QString(items[index+feature_count].c_str()).toDouble(&ok));
-                if(!ok)
-                {
-                    if(gui)
-                    QMessageBox::information(this,"Error",QString("Cannot parse '") +
-                                             QString(items[index+feature_count].c_str()) +
-                                             QString("' at subject%1 feature%2.").arg(i+1).arg(j+1),0);
-                    else
-                        std::cout << "invalid demographic file: cannot parse " << items[index+feature_count] << std::endl;
-                    return false;
-                }
+                if(gui)
+                    QMessageBox::information(this,"Error","Invalid subjet information for statistical analysis",0);
+                else
+                    std::cout << "invalid subjet information for statistical analysis" << std::endl;
+                ui->run->setEnabled(false);
+                return false;
             }
         }
-        model->type = 1;
-        model->X = X;
-        model->feature_count = feature_count+1; // additional one for intercept
         QStringList t;
         t << "Subject ID";
-        if(add_age_and_sex)
-        {
-            model->feature_count += 2;
-            t << "Age";
-            t << "Sex";
-        }
-        for(unsigned int index = 0;index < feature_count;++index)
-        {
-            std::replace(items[index].begin(),items[index].end(),'/','_');
-            std::replace(items[index].begin(),items[index].end(),'\\','_');
-            t << items[index].c_str();
-        }
+        for(unsigned int index = 0;index < feature_names.size();++index)
+            t << feature_names[index].c_str();
         ui->foi->clear();
         ui->foi->addItems(t);
         ui->foi->removeItem(0);
@@ -822,7 +805,7 @@ bool vbc_dialog::load_demographic_file(QString filename)
         ui->subject_demo->clear();
         ui->subject_demo->setColumnCount(t.size());
         ui->subject_demo->setHorizontalHeaderLabels(t);
-        ui->subject_demo->setRowCount(vbc->handle->db.num_subjects);
+        ui->subject_demo->setRowCount(num_subjects);
         for(unsigned int row = 0,index = 0;row < ui->subject_demo->rowCount();++row)
         {
             ui->subject_demo->setItem(row,0,new QTableWidgetItem(QString(vbc->handle->db.subject_names[row].c_str())));
@@ -830,99 +813,22 @@ bool vbc_dialog::load_demographic_file(QString filename)
             for(unsigned int col = 1;col < ui->subject_demo->columnCount();++col,++index)
                 ui->subject_demo->setItem(row,col,new QTableWidgetItem(QString::number(model->X[index])));
         }
-        ui->missing_data_checked->setChecked(std::find(X.begin(),X.end(),ui->missing_value->value()) != X.end());
+        ui->missing_data_checked->setChecked(std::find(model->X.begin(),model->X.end(),ui->missing_value->value()) != model->X.end());
     }
-    if(ui->rb_group_difference->isChecked())
+    if(model_type == 1)
     {
-        if(vbc->handle->db.num_subjects != items.size() &&
-           vbc->handle->db.num_subjects+1 != items.size())
-        {
-            if(gui)
-                QMessageBox::information(this,"Warning",
-                                     QString("Subject number mismatch. text file=%1 database=%2").
-                                     arg(items.size()).arg(vbc->handle->db.num_subjects));
-            else
-                std::cout << "invalid demographic file: subject number mismatch." << std::endl;
-            return false;
-        }
-        if(vbc->handle->db.num_subjects+1 == items.size())
-            items.erase(items.begin());
-
-        std::vector<int> label;
-        for(unsigned int i = 0;i < vbc->handle->db.num_subjects;++i)
-        {
-            bool ok = false;
-            label.push_back(QString(items[i].c_str()).toInt(&ok));
-            if(!ok)
-            {
-                if(gui)
-                    QMessageBox::information(this,"Error",QString("Cannot parse ") +
-                                             QString(items[i].c_str()) +
-                                             QString(" at subject%1").arg(i+1),0);
-                else
-                    std::cout << "invalid demographic file: cannot parse " << items[i] << std::endl;
-                return false;
-            }
-        }
-
-        model->type = 0;
-        model->label = label;
         ui->subject_demo->clear();
         ui->subject_demo->setColumnCount(2);
         ui->subject_demo->setHorizontalHeaderLabels(QStringList() << "Subject ID" << "Group ID");
-        ui->subject_demo->setRowCount(vbc->handle->db.num_subjects);
+        ui->subject_demo->setRowCount(num_subjects);
         for(unsigned int row = 0;row < ui->subject_demo->rowCount();++row)
         {
             ui->subject_demo->setItem(row,0,new QTableWidgetItem(QString(vbc->handle->db.subject_names[row].c_str())));
             ui->subject_demo->setItem(row,1,new QTableWidgetItem(QString::number(model->label[row])));
         }
     }
-    if(ui->rb_paired_difference->isChecked())
+    if(model_type == 2)
     {
-        if(vbc->handle->db.num_subjects != items.size() &&
-           vbc->handle->db.num_subjects+1 != items.size())
-        {
-            if(gui)
-                QMessageBox::information(this,"Warning",
-                                     QString("Subject number mismatch. text file=%1 database=%2").
-                                     arg(items.size()).arg(vbc->handle->db.num_subjects));
-            else
-                std::cout << "invalid demographic file: subject number mismatch." << std::endl;
-            return false;
-        }
-        if(vbc->handle->db.num_subjects+1 == items.size())
-            items.erase(items.begin());
-
-        std::vector<int> label;
-        for(unsigned int i = 0;i < vbc->handle->db.num_subjects;++i)
-        {
-            bool ok = false;
-            label.push_back(QString(items[i].c_str()).toInt(&ok));
-            if(!ok)
-            {
-                if(gui)
-                    QMessageBox::information(this,"Error",QString("Cannot parse ") +
-                                             QString(items[i].c_str()) +
-                                             QString(" at subject%1").arg(i+1),0);
-                else
-                    std::cout << "invalid demographic file: cannot parse " << items[i] << std::endl;
-                return false;
-            }
-        }
-
-        model->type = 3;
-        model->subject_index.clear();
-        model->paired.clear();
-        for(unsigned int i = 0;i < label.size() && i < vbc->handle->db.num_subjects;++i)
-            if(label[i] > 0)
-            {
-                for(unsigned int j = 0;j < label.size() && j < vbc->handle->db.num_subjects;++j)
-                    if(label[j] == -label[i])
-                    {
-                        model->subject_index.push_back(i);
-                        model->paired.push_back(j);
-                    } 
-            }
         ui->subject_demo->clear();
         ui->subject_demo->setColumnCount(2);
         ui->subject_demo->setHorizontalHeaderLabels(QStringList() << "Subject ID" << "Matched ID");
@@ -933,19 +839,6 @@ bool vbc_dialog::load_demographic_file(QString filename)
             ui->subject_demo->setItem(row,1,new QTableWidgetItem(QString(vbc->handle->db.subject_names[model->paired[row]].c_str())));
         }
     }
-
-
-
-    if(!model->pre_process())
-    {
-        if(gui)
-            QMessageBox::information(this,"Error","Invalid subjet information for statistical analysis",0);
-        else
-            std::cout << "invalid subjet information for statistical analysis" << std::endl;
-        ui->run->setEnabled(false);
-        return false;
-    }
-
     ui->run->setEnabled(true);
     on_suggest_threshold_clicked();
     return true;
@@ -1328,7 +1221,7 @@ void vbc_dialog::on_show_result_clicked()
         result_fib.reset(new connectometry_result);
         stat_model info;
         info.resample(*cur_model,false,false);
-        vbc->calculate_spm(*result_fib.get(),info,vbc->normalize_qa);
+        vbc->calculate_spm(*result_fib.get(),info,vbc->normalize_qa,std::thread::hardware_concurrency());
         new_data->view_item.push_back(item());
         new_data->view_item.back().name = threshold_type[vbc->model->threshold_type];
         new_data->view_item.back().name += "-";